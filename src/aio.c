@@ -0,0 +1,492 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Reads that overlap with each other and with whatever the CPU is doing. Where the firmware
+ * supports it, each request is handed to it with a completion event (File ReadEx, or Disk
+ * I/O 2 for raw devices) and up to the queue's depth of them are in flight at once. Where it
+ * doesn't, requests are queued and carried out one at a time with ordinary synchronous
+ * reads, either by a scheduler task while we wait for the user or by whoever waits on them.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "aio.h"
+#include "config.h"
+
+// Unless the drive has been measured: large enough to keep the transfer rate up, small
+// enough that several are in flight.
+#define AIO_READ_CHUNK_SIZE (64 * 1024)
+// Reads straight from the device skip the file system, so they can afford to be larger.
+#define AIO_DIRECT_CHUNK_SIZE (512 * 1024)
+
+static EFI_GUID DiskIo2Protocol = EFI_DISK_IO2_PROTOCOL_GUID;
+
+static AioQueue* CreateQueue(UINTN depth) {
+	AioQueue *queue = AllocateZeroPool(sizeof(AioQueue));
+	if (!queue) {
+		return NULL;
+	}
+
+	if (depth < 1) {
+		depth = 1;
+	}
+	if (depth > AIO_MAX_DEPTH) {
+		depth = AIO_MAX_DEPTH;
+	}
+	queue->depth = depth;
+	queue->chunk_size = ioChunkSize ? ioChunkSize : AIO_READ_CHUNK_SIZE;
+	queue->position = AIO_POSITION_UNKNOWN;
+	return queue;
+}
+
+/*
+ * Reads through an open file. The queue doesn't take ownership of the handle, but nothing
+ * else should move its position while the queue is open.
+ */
+AioQueue* AioOpenFile(EFI_FILE_HANDLE file, UINTN depth) {
+	AioQueue *queue = CreateQueue(depth);
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->file = file;
+	queue->asynchronous = file->Revision >= EFI_FILE_PROTOCOL_REVISION2 && file->ReadEx != NULL;
+	return queue;
+}
+
+/*
+ * Reads straight from the device on the given handle, by byte offset.
+ */
+AioQueue* AioOpenDisk(EFI_HANDLE device, UINTN depth) {
+	EFI_BLOCK_IO *block_io;
+	EFI_STATUS err;
+
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &BlockIoProtocol, (VOID **)&block_io);
+	if (EFI_ERROR(err)) {
+		return NULL;
+	}
+
+	AioQueue *queue = CreateQueue(depth);
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->media_id = block_io->Media->MediaId;
+	if (!ioChunkSize) {
+		queue->chunk_size = AIO_DIRECT_CHUNK_SIZE;
+	}
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &DiskIoProtocol, (VOID **)&queue->disk_io);
+	if (EFI_ERROR(err)) {
+		FreePool(queue);
+		return NULL;
+	}
+
+	// Disk I/O is kept as well, for when Disk I/O 2 turns out not to work.
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &DiskIo2Protocol, (VOID **)&queue->disk_io2);
+	if (!EFI_ERROR(err)) {
+		queue->asynchronous = TRUE;
+	} else {
+		queue->disk_io2 = NULL;
+	}
+
+	return queue;
+}
+
+/*
+ * Reads a file of the given size straight from the device it is on, bypassing the file
+ * system driver. The extents say where each part of the file is, in file order, and are
+ * copied.
+ */
+AioQueue* AioOpenMapped(EFI_HANDLE device, const AioExtent *extents, UINTN count, UINT64 size, UINTN depth) {
+	AioQueue *queue = AioOpenDisk(device, depth);
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->extents = AllocatePool(sizeof(AioExtent) * (count ? count : 1));
+	if (!queue->extents) {
+		FreePool(queue);
+		return NULL;
+	}
+
+	CopyMem(queue->extents, extents, sizeof(AioExtent) * count);
+	queue->extent_count = count;
+	queue->size = size;
+	return queue;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Carrying out requests
+#endif
+/*
+ * Finds where a file offset is on the device, and how much of the file from there on is
+ * in one piece.
+ */
+static BOOLEAN MapOffset(AioQueue *queue, UINT64 offset, UINT64 *disk_offset, UINT64 *contiguous) {
+	UINTN low = 0, high = queue->extent_count;
+
+	while (low < high) {
+		UINTN middle = (low + high) / 2;
+		AioExtent *extent = &queue->extents[middle];
+		if (offset < extent->offset) {
+			high = middle;
+		} else if (offset >= extent->offset + extent->length) {
+			low = middle + 1;
+		} else {
+			*disk_offset = extent->disk_offset + (offset - extent->offset);
+			*contiguous = extent->length - (offset - extent->offset);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+// Like a file, a mapped queue comes up short at the end rather than failing.
+static UINTN ClipToSize(AioQueue *queue, AioRequest *request) {
+	if (!queue->extents || request->offset >= queue->size) {
+		return queue->extents ? 0 : request->length;
+	}
+
+	UINT64 remaining = queue->size - request->offset;
+	return remaining < request->length ? (UINTN)remaining : request->length;
+}
+
+static EFI_STATUS ReadMapped(AioQueue *queue, AioRequest *request) {
+	UINTN length = ClipToSize(queue, request);
+	UINTN done = 0;
+
+	while (done < length) {
+		UINT64 disk_offset, contiguous;
+		if (!MapOffset(queue, request->offset + done, &disk_offset, &contiguous)) {
+			return EFI_VOLUME_CORRUPTED;
+		}
+
+		UINTN piece = length - done < contiguous ? length - done : (UINTN)contiguous;
+		EFI_STATUS err = uefi_call_wrapper(queue->disk_io->ReadDisk, 5, queue->disk_io, queue->media_id,
+			disk_offset, piece, (UINT8 *)request->buffer + done);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+		done += piece;
+	}
+
+	request->transferred = length;
+	return EFI_SUCCESS;
+}
+
+static VOID Append(AioRequest **list, AioRequest *request) {
+	request->next = NULL;
+	while (*list) {
+		list = &(*list)->next;
+	}
+	*list = request;
+}
+
+static VOID Remove(AioRequest **list, AioRequest *request) {
+	while (*list && *list != request) {
+		list = &(*list)->next;
+	}
+	if (*list) {
+		*list = request->next;
+	}
+	request->next = NULL;
+}
+
+/*
+ * Moves the file to where a read starts, unless the last read already left it there; on
+ * some file system drivers, setting the position throws away their read-ahead.
+ */
+static EFI_STATUS Seek(AioQueue *queue, UINT64 offset) {
+	if (queue->position == offset) {
+		return EFI_SUCCESS;
+	}
+
+	EFI_STATUS err = uefi_call_wrapper(queue->file->SetPosition, 2, queue->file, offset);
+	queue->position = EFI_ERROR(err) ? AIO_POSITION_UNKNOWN : offset;
+	return err;
+}
+
+static VOID ReadSynchronously(AioQueue *queue, AioRequest *request) {
+	EFI_STATUS err;
+
+	if (queue->file) {
+		err = Seek(queue, request->offset);
+		request->transferred = request->length;
+		if (!EFI_ERROR(err)) {
+			err = uefi_call_wrapper(queue->file->Read, 3, queue->file, &request->transferred, request->buffer);
+		}
+		queue->position = EFI_ERROR(err) ? AIO_POSITION_UNKNOWN : request->offset + request->transferred;
+	} else if (queue->extents) {
+		request->transferred = 0;
+		err = ReadMapped(queue, request);
+	} else {
+		err = uefi_call_wrapper(queue->disk_io->ReadDisk, 5, queue->disk_io, queue->media_id,
+			request->offset, request->length, request->buffer);
+		request->transferred = EFI_ERROR(err) ? 0 : request->length;
+	}
+
+	request->status = err;
+}
+
+static VOID Complete(AioQueue *queue, AioRequest *request) {
+	if (queue->file) {
+		request->status = request->file_token.Status;
+		request->transferred = request->file_token.BufferSize;
+	} else {
+		request->status = request->disk_token.TransactionStatus;
+		request->transferred = EFI_ERROR(request->status) ? 0 : ClipToSize(queue, request);
+	}
+
+	uefi_call_wrapper(BS->CloseEvent, 1, request->event);
+	request->event = NULL;
+	Remove(&queue->active, request);
+	queue->in_flight--;
+}
+
+/*
+ * Hands a request to the firmware. If it turns out not to do asynchronous reads after all,
+ * the queue falls back to doing them itself.
+ */
+static VOID Issue(AioQueue *queue, AioRequest *request) {
+	UINT64 disk_offset = request->offset, contiguous;
+	UINTN length = request->length;
+	EFI_STATUS err;
+
+	// Disk I/O 2 takes one stretch of the device per request. The odd request that spans two
+	// extents of a fragmented file is read in pieces instead.
+	if (queue->extents) {
+		length = ClipToSize(queue, request);
+		if (length == 0 || !MapOffset(queue, request->offset, &disk_offset, &contiguous) || contiguous < length) {
+			ReadSynchronously(queue, request);
+			return;
+		}
+	}
+
+	err = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &request->event);
+	if (EFI_ERROR(err)) {
+		request->event = NULL;
+		ReadSynchronously(queue, request);
+		return;
+	}
+
+	if (queue->file) {
+		request->file_token.Event = request->event;
+		request->file_token.Status = EFI_SUCCESS;
+		request->file_token.BufferSize = request->length;
+		request->file_token.Buffer = request->buffer;
+		err = Seek(queue, request->offset);
+		if (!EFI_ERROR(err)) {
+			err = uefi_call_wrapper(queue->file->ReadEx, 2, queue->file, &request->file_token);
+		}
+		// The position moves on when the read is queued. At the end of the file it stops short,
+		// but a read that starts past the end gets nothing either way.
+		queue->position = EFI_ERROR(err) ? AIO_POSITION_UNKNOWN : request->offset + request->length;
+	} else {
+		request->disk_token.Event = request->event;
+		request->disk_token.TransactionStatus = EFI_SUCCESS;
+		err = uefi_call_wrapper(queue->disk_io2->ReadDiskEx, 6, queue->disk_io2, queue->media_id,
+			disk_offset, &request->disk_token, length, request->buffer);
+	}
+
+	if (EFI_ERROR(err)) {
+		uefi_call_wrapper(BS->CloseEvent, 1, request->event);
+		request->event = NULL;
+		if (err == EFI_UNSUPPORTED) {
+			queue->asynchronous = FALSE;
+			ReadSynchronously(queue, request);
+		} else {
+			request->status = err;
+		}
+		return;
+	}
+
+	Append(&queue->active, request);
+	queue->in_flight++;
+}
+
+static BOOLEAN QueueTaskStep(VOID *context) {
+	AioQueue *queue = context;
+	if (AioPoll(queue)) {
+		return FALSE;
+	}
+
+	queue->task = NULL;
+	return TRUE;
+}
+
+static VOID QueueTaskCancel(VOID *context) {
+	AioQueue *queue = context;
+	queue->task = NULL;
+}
+
+/*
+ * Collects finished requests and starts pending ones. When the firmware can't read in the
+ * background, this carries out one pending request itself. Returns TRUE while there are
+ * still requests that haven't finished.
+ */
+BOOLEAN AioPoll(AioQueue *queue) {
+	AioRequest *request = queue->active;
+	while (request) {
+		AioRequest *next = request->next;
+		if (uefi_call_wrapper(BS->CheckEvent, 1, request->event) == EFI_SUCCESS) {
+			Complete(queue, request);
+		}
+		request = next;
+	}
+
+	while (queue->pending && (!queue->asynchronous || queue->in_flight < queue->depth)) {
+		request = queue->pending;
+		Remove(&queue->pending, request);
+		if (queue->asynchronous) {
+			Issue(queue, request);
+		} else {
+			ReadSynchronously(queue, request);
+			break;
+		}
+	}
+
+	return queue->pending || queue->active;
+}
+
+EFI_STATUS AioSubmit(AioQueue *queue, AioRequest *request, UINT64 offset, UINTN length, VOID *buffer) {
+	request->offset = offset;
+	request->length = length;
+	request->buffer = buffer;
+	request->transferred = 0;
+	request->status = EFI_NOT_READY;
+	request->event = NULL;
+	Append(&queue->pending, request);
+
+	if (queue->asynchronous) {
+		AioPoll(queue);
+	} else if (!queue->task) {
+		// Make progress while the menu waits for the user.
+		queue->task = SchedulerAddTask(QueueTaskStep, QueueTaskCancel, queue, FALSE);
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Waits until the given request has finished and returns its status.
+ */
+EFI_STATUS AioWait(AioQueue *queue, AioRequest *request) {
+	UINTN index;
+
+	while (request->status == EFI_NOT_READY) {
+		// Above TPL_APPLICATION the firmware won't wait, and says so; polling checks each
+		// event instead, and only completes the ones that have been signalled.
+		if (request->event &&
+			uefi_call_wrapper(BS->WaitForEvent, 3, 1, &request->event, &index) == EFI_SUCCESS) {
+			Complete(queue, request);
+		}
+		AioPoll(queue);
+	}
+
+	return request->status;
+}
+
+/*
+ * Reads a range in chunks, keeping as many of them in flight as the queue allows, and
+ * waits for all of it. Reads past the end of a file come up short rather than failing.
+ */
+EFI_STATUS AioRead(AioQueue *queue, UINT64 offset, UINTN length, VOID *buffer, UINTN *transferred) {
+	AioRequest requests[AIO_MAX_DEPTH];
+	EFI_STATUS result = EFI_SUCCESS;
+	UINTN submitted = 0, completed = 0, total = 0;
+	UINTN chunks = (length + queue->chunk_size - 1) / queue->chunk_size;
+
+	while (completed < chunks) {
+		while (submitted < chunks && submitted - completed < queue->depth && !EFI_ERROR(result)) {
+			UINTN start = submitted * queue->chunk_size;
+			UINTN size = length - start < queue->chunk_size ? length - start : queue->chunk_size;
+			AioSubmit(queue, &requests[submitted % AIO_MAX_DEPTH], offset + start, size, (UINT8 *)buffer + start);
+			submitted++;
+		}
+
+		if (completed == submitted) {
+			break;
+		}
+
+		AioRequest *request = &requests[completed % AIO_MAX_DEPTH];
+		EFI_STATUS err = AioWait(queue, request);
+		if (EFI_ERROR(err) && !EFI_ERROR(result)) {
+			result = err;
+		}
+		total += request->transferred;
+		completed++;
+	}
+
+	if (transferred) {
+		*transferred = total;
+	}
+
+	return result;
+}
+
+/*
+ * AioRead for readers that work in whole sectors (such as a block cache): the context is the
+ * queue, and anything past the end of the file reads as zeroes.
+ */
+EFI_STATUS AioReadPadded(VOID *context, UINT64 offset, UINTN length, VOID *buffer) {
+	UINTN read;
+
+	EFI_STATUS err = AioRead(context, offset, length, buffer, &read);
+	if (!EFI_ERROR(err) && read != length) {
+		SetMem((UINT8 *)buffer + read, length - read, 0);
+	}
+
+	return err;
+}
+
+/*
+ * Waits for anything still in flight, since the firmware may still write into those
+ * buffers, and frees the queue.
+ */
+VOID AioClose(AioQueue *queue) {
+	UINTN index;
+
+	if (queue->task) {
+		SchedulerCancelTask(queue->task);
+		queue->task = NULL;
+	}
+
+	// Nothing pending gets issued now, so polling below only looks at what's in flight.
+	while (queue->pending) {
+		AioRequest *request = queue->pending;
+		Remove(&queue->pending, request);
+		request->status = EFI_ABORTED;
+	}
+
+	// As in AioWait, a request is only done once its event has been signalled.
+	while (queue->active) {
+		AioRequest *request = queue->active;
+		if (uefi_call_wrapper(BS->WaitForEvent, 3, 1, &request->event, &index) == EFI_SUCCESS) {
+			Complete(queue, request);
+		} else {
+			AioPoll(queue);
+		}
+	}
+
+	if (queue->extents) {
+		FreePool(queue->extents);
+	}
+	FreePool(queue);
+}
@@ -0,0 +1,88 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _aio_h
+#define _aio_h
+#include <efi.h>
+#include "protocols.h"
+#include "sched.h"
+
+#define AIO_MAX_DEPTH 32
+
+/*
+ * One read. The caller owns the request and its buffer, and must not touch either until
+ * AioWait has returned for it (or the queue has been closed).
+ */
+typedef struct AioRequest {
+	UINT64 offset;
+	UINTN length;
+	VOID *buffer;
+	UINTN transferred;
+	EFI_STATUS status; // EFI_NOT_READY until the read has finished.
+
+	// Private to aio.c.
+	EFI_EVENT event;
+	EFI_FILE_IO_TOKEN file_token;
+	EFI_DISK_IO2_TOKEN disk_token;
+	struct AioRequest *next;
+} AioRequest;
+
+/*
+ * Where a stretch of a file lies on its device: length bytes from offset in the file are at
+ * disk_offset on the device.
+ */
+typedef struct {
+	UINT64 offset;
+	UINT64 disk_offset;
+	UINT64 length;
+} AioExtent;
+
+#define AIO_POSITION_UNKNOWN ((UINT64)-1)
+
+typedef struct AioQueue {
+	EFI_FILE_HANDLE file;
+	EFI_DISK_IO *disk_io;
+	EFI_DISK_IO2_PROTOCOL *disk_io2;
+	UINT32 media_id;
+	BOOLEAN asynchronous;
+	UINTN depth;
+	UINTN in_flight;
+	AioRequest *pending;
+	AioRequest *active;
+	BackgroundTask *task;
+	UINTN chunk_size;
+	// Where the file's position was left by the last read, or AIO_POSITION_UNKNOWN.
+	UINT64 position;
+
+	// Set for a file read straight from its device, by file offset.
+	AioExtent *extents;
+	UINTN extent_count;
+	UINT64 size;
+} AioQueue;
+
+AioQueue* AioOpenFile(EFI_FILE_HANDLE, UINTN);
+AioQueue* AioOpenDisk(EFI_HANDLE, UINTN);
+AioQueue* AioOpenMapped(EFI_HANDLE, const AioExtent *, UINTN, UINT64, UINTN);
+EFI_STATUS AioSubmit(AioQueue *, AioRequest *, UINT64, UINTN, VOID *);
+BOOLEAN AioPoll(AioQueue *);
+EFI_STATUS AioWait(AioQueue *, AioRequest *);
+EFI_STATUS AioRead(AioQueue *, UINT64, UINTN, VOID *, UINTN *);
+EFI_STATUS AioReadPadded(VOID *, UINT64, UINTN, VOID *);
+VOID AioClose(AioQueue *);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * An LRU cache of fixed-size lines in front of a slow device. Misses are fetched a whole
+ * line at a time, so lots of small, scattered reads turn into a few large transfers, and
+ * when reads look sequential the cache fetches further and further ahead in one go.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "blockcache.h"
+
+static CacheLine* LookupLine(BlockCache *cache, UINT64 index) {
+	CacheLine *line = cache->buckets[index % cache->bucket_count];
+	while (line && line->index != index) {
+		line = line->hash_next;
+	}
+
+	return line;
+}
+
+static VOID UnlinkLru(BlockCache *cache, CacheLine *line) {
+	if (line->lru_prev) {
+		line->lru_prev->lru_next = line->lru_next;
+	} else {
+		cache->lru_head = line->lru_next;
+	}
+	if (line->lru_next) {
+		line->lru_next->lru_prev = line->lru_prev;
+	} else {
+		cache->lru_tail = line->lru_prev;
+	}
+	line->lru_prev = line->lru_next = NULL;
+}
+
+static VOID PushLru(BlockCache *cache, CacheLine *line) {
+	line->lru_prev = NULL;
+	line->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = line;
+	}
+	cache->lru_head = line;
+	if (!cache->lru_tail) {
+		cache->lru_tail = line;
+	}
+}
+
+static VOID UnlinkHash(BlockCache *cache, CacheLine *line) {
+	CacheLine **link = &cache->buckets[line->index % cache->bucket_count];
+	while (*link && *link != line) {
+		link = &(*link)->hash_next;
+	}
+
+	if (*link) {
+		*link = line->hash_next;
+	}
+	line->hash_next = NULL;
+}
+
+/*
+ * Takes the least recently used line, forgets what it held, and files it under a new index.
+ */
+static CacheLine* ReuseLine(BlockCache *cache, UINT64 index) {
+	CacheLine *line = cache->lru_tail;
+
+	UnlinkLru(cache, line);
+	if (line->index != (UINT64)-1) {
+		UnlinkHash(cache, line);
+	}
+
+	line->index = index;
+	line->hash_next = cache->buckets[index % cache->bucket_count];
+	cache->buckets[index % cache->bucket_count] = line;
+	PushLru(cache, line);
+	return line;
+}
+
+/*
+ * Creates a cache of line_count lines of line_size bytes over a device of the given size.
+ * At most max_window lines are fetched in a single transfer.
+ */
+BlockCache* BlockCacheCreate(UINT64 size, UINTN line_size, UINTN line_count, UINTN max_window,
+	BLOCK_CACHE_FILL fill, VOID *context) {
+	BlockCache *cache = AllocateZeroPool(sizeof(BlockCache));
+	if (!cache) {
+		return NULL;
+	}
+
+	if (max_window > line_count / 2) {
+		max_window = line_count / 2;
+	}
+	if (max_window < 1) {
+		max_window = 1;
+	}
+
+	cache->fill = fill;
+	cache->context = context;
+	cache->size = size;
+	cache->line_size = line_size;
+	cache->line_count = line_count;
+	cache->bucket_count = line_count * 2 + 1;
+	cache->max_window = max_window;
+	cache->window = 1;
+	cache->lines = AllocateZeroPool(sizeof(CacheLine) * line_count);
+	cache->buckets = AllocateZeroPool(sizeof(CacheLine *) * cache->bucket_count);
+	cache->memory = AllocatePool(line_size * (line_count + max_window));
+	if (!cache->lines || !cache->buckets || !cache->memory) {
+		BlockCacheFree(cache);
+		return NULL;
+	}
+
+	// The line buffers and the staging area for multi-line fetches share one allocation.
+	for (UINTN i = 0; i < line_count; i++) {
+		cache->lines[i].index = (UINT64)-1;
+		cache->lines[i].data = cache->memory + i * line_size;
+		PushLru(cache, &cache->lines[i]);
+	}
+	cache->staging = cache->memory + line_count * line_size;
+
+	return cache;
+}
+
+VOID BlockCacheFree(BlockCache *cache) {
+	if (cache->memory) {
+		FreePool(cache->memory);
+	}
+	if (cache->lines) {
+		FreePool(cache->lines);
+	}
+	if (cache->buckets) {
+		FreePool(cache->buckets);
+	}
+	FreePool(cache);
+}
+
+/*
+ * Forgets everything cached, for when the device underneath has been written to.
+ */
+VOID BlockCacheInvalidate(BlockCache *cache) {
+	UINTN i;
+
+	for (i = 0; i < cache->bucket_count; i++) {
+		cache->buckets[i] = NULL;
+	}
+	for (i = 0; i < cache->line_count; i++) {
+		cache->lines[i].index = (UINT64)-1;
+		cache->lines[i].hash_next = NULL;
+	}
+	cache->window = 1;
+	cache->next_sequential = 0;
+}
+
+/*
+ * Fetches the line at index, along with as many following lines as the read-ahead window
+ * allows that aren't cached already, in a single transfer.
+ */
+static EFI_STATUS FetchLines(BlockCache *cache, UINT64 index) {
+	UINT64 last_line = (cache->size - 1) / cache->line_size;
+	UINTN count = 1;
+	EFI_STATUS err;
+
+	// Grow the window while reads keep following on from each other, and start over
+	// as soon as they jump around.
+	if (index == cache->next_sequential) {
+		cache->window = cache->window * 2 > cache->max_window ? cache->max_window : cache->window * 2;
+	} else {
+		cache->window = 1;
+	}
+
+	while (count < cache->window && index + count <= last_line && !LookupLine(cache, index + count)) {
+		count++;
+	}
+
+	UINT64 offset = index * cache->line_size;
+	UINTN length = count * cache->line_size;
+	if (offset + length > cache->size) {
+		length = cache->size - offset;
+	}
+
+	err = cache->fill(cache->context, offset, length, cache->staging);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	cache->transfers++;
+	cache->bytes_transferred += length;
+	cache->next_sequential = index + count;
+
+	for (UINTN i = 0; i < count; i++) {
+		CacheLine *line = ReuseLine(cache, index + i);
+		UINTN line_length = length - i * cache->line_size;
+		if (line_length > cache->line_size) {
+			line_length = cache->line_size;
+		}
+		CopyMem(line->data, cache->staging + i * cache->line_size, line_length);
+	}
+
+	// The line that was actually asked for should be the most recently used, not the
+	// read-ahead ones after it.
+	CacheLine *wanted = LookupLine(cache, index);
+	UnlinkLru(cache, wanted);
+	PushLru(cache, wanted);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS BlockCacheRead(BlockCache *cache, UINT64 offset, UINTN length, VOID *buffer) {
+	UINT8 *dest = buffer;
+	EFI_STATUS err;
+
+	if (offset > cache->size || length > cache->size - offset) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	// Big reads don't benefit from the cache, so they go straight to the device rather
+	// than pushing everything else out.
+	if (length >= cache->max_window * cache->line_size) {
+		cache->misses++;
+		cache->transfers++;
+		cache->bytes_transferred += length;
+		return cache->fill(cache->context, offset, length, buffer);
+	}
+
+	while (length > 0) {
+		UINT64 index = offset / cache->line_size;
+		UINTN within = offset % cache->line_size;
+		UINTN chunk = cache->line_size - within;
+		if (chunk > length) {
+			chunk = length;
+		}
+
+		CacheLine *line = LookupLine(cache, index);
+		if (line) {
+			cache->hits++;
+			UnlinkLru(cache, line);
+			PushLru(cache, line);
+		} else {
+			cache->misses++;
+			err = FetchLines(cache, index);
+			if (EFI_ERROR(err)) {
+				return err;
+			}
+			line = LookupLine(cache, index);
+		}
+
+		CopyMem(dest, line->data + within, chunk);
+		dest += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,57 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _blockcache_h
+#define _blockcache_h
+
+/*
+ * Reads length bytes at offset from whatever sits underneath the cache.
+ */
+typedef EFI_STATUS (*BLOCK_CACHE_FILL)(VOID *context, UINT64 offset, UINTN length, VOID *buffer);
+
+typedef struct CacheLine {
+	UINT64 index;
+	UINT8 *data;
+	struct CacheLine *lru_prev, *lru_next;
+	struct CacheLine *hash_next;
+} CacheLine;
+
+typedef struct {
+	BLOCK_CACHE_FILL fill;
+	VOID *context;
+	UINT64 size;
+	UINTN line_size;
+	UINTN line_count;
+	UINTN bucket_count;
+	CacheLine *lines;
+	CacheLine **buckets;
+	UINT8 *memory;
+	CacheLine *lru_head, *lru_tail;
+	UINT8 *staging;
+	UINTN max_window;
+	UINTN window;
+	UINT64 next_sequential;
+	UINT64 hits, misses, transfers, bytes_transferred;
+} BlockCache;
+
+BlockCache* BlockCacheCreate(UINT64, UINTN, UINTN, UINTN, BLOCK_CACHE_FILL, VOID *);
+EFI_STATUS BlockCacheRead(BlockCache *, UINT64, UINTN, VOID *);
+VOID BlockCacheInvalidate(BlockCache *);
+VOID BlockCacheFree(BlockCache *);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Boot counting, after systemd-boot's boot assessment. Each entry has a number of tries,
+ * kept in an NV variable, and one is used up every time we start GRUB for it. A hook on
+ * the Linux side (see tools/) gives them back by deleting the variables once the system
+ * has come up. When an entry has no tries left, it is tried again with safe kernel
+ * options; when those run out too, unattended boots move on to the next entry.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "bootcount.h"
+#include "config.h"
+#include "utils.h"
+#include "uki.h"
+
+#define ATTEMPT_VARIABLE L"Enterprise_BootAttempt"
+
+typedef struct {
+	UINT8 tries_left;
+	UINT8 safe_tries_left;
+} BootCounter;
+
+// Entries are told apart by name and ISO (or by image), so that reordering the file doesn't mix them up.
+static CHAR16* CounterName(LinuxBootOption *option) {
+	CHAR16 *identity;
+	if (option->uki_path) {
+		identity = PoolPrint(L"%a", option->uki_path);
+	} else {
+		identity = PoolPrint(L"%a|%a", option->name ? option->name : (CHAR8 *)"",
+			option->iso_path ? option->iso_path : (CHAR8 *)"");
+	}
+	if (!identity) {
+		return NULL;
+	}
+
+	CHAR16 *name = PoolPrint(L"Enterprise_BootTries_%08x", Fnv1aHash(identity, StrLen(identity) * sizeof(CHAR16)));
+	FreePool(identity);
+	return name;
+}
+
+static BOOLEAN ReadCounter(LinuxBootOption *option, CHAR16 **name, BootCounter *counter) {
+	CHAR8 *buffer;
+	UINTN size;
+
+	*name = CounterName(option);
+	if (!*name) {
+		return FALSE;
+	}
+
+	// An entry that has never been tried, or that last came up fine, has all of its tries.
+	counter->tries_left = counter->safe_tries_left = bootTries > 255 ? 255 : bootTries;
+	if (!EFI_ERROR(efi_get_variable(&enterprise_variable_guid, *name, &buffer, &size))) {
+		if (size == sizeof(BootCounter)) {
+			CopyMem(counter, buffer, sizeof(BootCounter));
+		}
+		FreePool(buffer);
+	}
+
+	return TRUE;
+}
+
+BootStage BootCountStage(LinuxBootOption *option) {
+	BootCounter counter;
+	CHAR16 *name;
+
+	if (!bootTries || !ReadCounter(option, &name, &counter)) {
+		return BOOT_STAGE_NORMAL;
+	}
+	FreePool(name);
+
+	if (counter.tries_left > 0) {
+		return BOOT_STAGE_NORMAL;
+	}
+
+	return counter.safe_tries_left > 0 ? BOOT_STAGE_SAFE : BOOT_STAGE_EXHAUSTED;
+}
+
+/*
+ * Uses up one try of the entry, in safe mode if safe is set. This must be called just
+ * before GRUB is started, while the variable store can still be written.
+ */
+VOID BootCountAttempt(LinuxBootOption *option, BOOLEAN safe) {
+	BootCounter counter;
+	CHAR16 *name;
+
+	if (!bootTries || !ReadCounter(option, &name, &counter)) {
+		return;
+	}
+
+	if (safe && counter.safe_tries_left > 0) {
+		counter.safe_tries_left--;
+	} else if (!safe && counter.tries_left > 0) {
+		counter.tries_left--;
+	}
+	efi_set_variable(&enterprise_variable_guid, name, (CHAR8 *)&counter, sizeof(counter), TRUE);
+
+	// Tells the hook which counter to reset.
+	CHAR8 *ascii = UTF16toASCII(name, StrLen(name) + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, ATTEMPT_VARIABLE, ascii, strlena(ascii) + 1, TRUE);
+		FreePool(ascii);
+	}
+	FreePool(name);
+}
+
+/*
+ * Picks what to boot when nobody is there to pick: the preferred entry if it has tries
+ * left (in safe mode if only those are left), otherwise the next entry after it that
+ * does. Returns -1 if every entry has run out.
+ */
+INTN BootCountChooseEntry(UINTN preferred, BOOLEAN *safe) {
+	UINTN count = distroCount + 1, i;
+
+	*safe = FALSE;
+	if (!bootTries || count == 0) {
+		return preferred;
+	}
+
+	for (i = 0; i < count; i++) {
+		UINTN index = (preferred + i) % count;
+		BootableLinuxDistro *conductor = distributionListRoot->next;
+		UINTN j;
+		for (j = 0; j < index && conductor; j++) {
+			conductor = conductor->next;
+		}
+		if (!conductor || !conductor->bootOption) {
+			continue;
+		}
+
+		UkiResolveName(conductor->bootOption);
+		BootStage stage = BootCountStage(conductor->bootOption);
+		if (stage == BOOT_STAGE_EXHAUSTED) {
+			Print(L"%a has failed to boot too many times, skipping it.\n", conductor->bootOption->name);
+			continue;
+		}
+
+		*safe = stage == BOOT_STAGE_SAFE;
+		if (*safe) {
+			Print(L"%a has failed to boot, trying it with safe options.\n", conductor->bootOption->name);
+		}
+		return index;
+	}
+
+	return -1;
+}
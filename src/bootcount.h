@@ -0,0 +1,34 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _bootcount_h
+#define _bootcount_h
+#include "main.h"
+
+// How many more times an entry may be tried, first as configured and then in safe mode.
+typedef enum {
+	BOOT_STAGE_NORMAL,
+	BOOT_STAGE_SAFE,
+	BOOT_STAGE_EXHAUSTED
+} BootStage;
+
+BootStage BootCountStage(LinuxBootOption *);
+VOID BootCountAttempt(LinuxBootOption *, BOOLEAN);
+INTN BootCountChooseEntry(UINTN, BOOLEAN *);
+
+#endif
@@ -20,12 +20,213 @@
 #include "config.h"
 #include "distribution.h"
 #include "utils.h"
+#include "smbios.h"
+#include "iotune.h"
+#include "multipart.h"
+#include "listview.h"
 
 BOOLEAN shouldAutoboot;
 UINTN autobootIndex = 0;
+UINTN autobootTimeout = 0;
+CHAR8 *machineKernelOptions = NULL;
 INTN distroCount = -1; // start at -1 due to an error on my part.
+BOOLEAN verifyBeforeBoot = FALSE;
+BOOLEAN useGraphicalMenu = FALSE;
+BOOLEAN useVirtualCD = FALSE;
+BOOLEAN useDirectIO = TRUE;
+BOOLEAN useDiskCache = TRUE;
+UINTN ioQueueDepth = 0;
+UINTN ioChunkSize = 0;
+UINTN bootTries = 0;
+CHAR8 *safeKernelOptions = NULL;
+
+// The size and modification time of the configuration file when we last read it.
+static UINT64 config_size = 0;
+static EFI_TIME config_time;
+// Whether the last read got to the end of the file.
+static BOOLEAN config_complete = FALSE;
+
+static BOOLEAN ParseBoolean(CHAR8 *value) {
+	return !(strcmpa((CHAR8 *)"false", value) == 0 || strcmpa((CHAR8 *)"0", value) == 0 ||
+		strcmpa((CHAR8 *)"no", value) == 0);
+}
+
+static UINTN ParseNumber(CHAR8 *value) {
+	UINTN number = 0;
+	while (*value >= '0' && *value <= '9') {
+		number = number * 10 + (*value++ - '0');
+	}
+
+	return number;
+}
+
+static CHAR8 ToLower(CHAR8 c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// The user can currently only autoboot the first ten entries.
+static VOID ParseAutoboot(CHAR8 *value, BOOLEAN *enabled, UINTN *index) {
+	*enabled = TRUE;
+	if (strlena(value) == 1 && (*value >= 48 && *value <= 57)) {
+		*index = *value - '0';
+	}
+}
+
+#ifdef __APPLE__
+	#pragma mark - Machine sections
+#endif
+/*
+ * A "machine" line starts a section that only applies to machines whose SMBIOS system UUID,
+ * product name or board ID is the given value, compared without case. A golden image carries
+ * one section per model, so rather than comparing strings for every section we compare
+ * hashes and only confirm the string when a hash matches.
+ */
+typedef enum {
+	MACHINE_MATCH_NONE = 0,
+	MACHINE_MATCH_PRODUCT,
+	MACHINE_MATCH_BOARD,
+	MACHINE_MATCH_UUID
+} MachineMatch;
+
+#define MACHINE_KEY_LENGTH (SMBIOS_STRING_LENGTH + 1)
+
+static UINT32 MachineKeyHash(const CHAR8 *value, CHAR8 *key) {
+	UINTN length = 0;
+	while (value[length] && length < MACHINE_KEY_LENGTH - 1) {
+		key[length] = ToLower(value[length]);
+		length++;
+	}
+	key[length] = '\0';
+
+	return Fnv1aHash(key, length);
+}
+
+static MachineMatch MatchMachine(CHAR8 *selector) {
+	static BOOLEAN hashed = FALSE;
+	static CHAR8 keys[3][MACHINE_KEY_LENGTH];
+	static UINT32 hashes[3];
+	// In order of how specific they are, which is also the order of MachineMatch.
+	static const MachineMatch matches[3] = {MACHINE_MATCH_PRODUCT, MACHINE_MATCH_BOARD, MACHINE_MATCH_UUID};
+
+	if (!hashed) {
+		const SmbiosIdentity *identity = GetSmbiosIdentity();
+		hashes[0] = MachineKeyHash(identity->product, keys[0]);
+		hashes[1] = MachineKeyHash(identity->board, keys[1]);
+		hashes[2] = MachineKeyHash(identity->uuid, keys[2]);
+		hashed = TRUE;
+	}
+
+	CHAR8 key[MACHINE_KEY_LENGTH];
+	UINT32 hash = MachineKeyHash(selector, key);
+	MachineMatch best = MACHINE_MATCH_NONE;
+	UINTN i;
+	for (i = 0; i < 3; i++) {
+		if (hashes[i] == hash && keys[i][0] && strcmpa(keys[i], key) == 0) {
+			best = matches[i];
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Warns about the ISO of a boot option, or any of its parts, not being there.
+ */
+static VOID WarnIfIsoMissing(LinuxBootOption *option) {
+	UINTN count = 0, i;
+
+	EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+	CHAR16 **paths = volume ? IsoPartPathsForBootOption(option, volume, &count) : NULL;
+	if (!paths) {
+		Print(L"Warning: ISO file %a not found.\n", option->iso_path);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (FileExists(volume, paths[i])) {
+			continue;
+		}
+		if (count == 1 && !option->iso_parts) {
+			Print(L"Warning: ISO file %a not found.\n", option->iso_path);
+		} else {
+			Print(L"Warning: part %s of ISO file %a not found.\n", paths[i], option->iso_path);
+		}
+	}
+
+	if (paths) {
+		FreeIsoPartPaths(paths, count);
+	}
+	if (volume) {
+		CloseVolume(volume);
+	}
+}
+
+static BOOLEAN GetFileStamp(const CHAR16 * const name, UINT64 *size, EFI_TIME *time) {
+	EFI_FILE_HANDLE handle;
+	EFI_STATUS err;
+
+	err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &handle, (CHAR16 *)name, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(err)) {
+		return FALSE;
+	}
+
+	EFI_FILE_INFO *info = LibFileInfo(handle);
+	uefi_call_wrapper(handle->Close, 1, handle);
+	if (!info) {
+		return FALSE;
+	}
+
+	*size = info->FileSize;
+	CopyMem(time, &info->ModificationTime, sizeof(EFI_TIME));
+	FreePool(info);
+	return TRUE;
+}
+
+/*
+ * Tells whether the configuration file differs from the one we last read, going by its size
+ * and modification time.
+ */
+BOOLEAN ConfigurationFileChanged(const CHAR16 * const name) {
+	UINT64 size;
+	EFI_TIME time;
+
+	if (!GetFileStamp(name, &size, &time)) {
+		return TRUE;
+	}
+
+	return size != config_size || CompareMem(&time, &config_time, sizeof(EFI_TIME)) != 0;
+}
+
+// Options that aren't in the file take their defaults, also when it is read again.
+static VOID ResetOptions(VOID) {
+	shouldAutoboot = FALSE;
+	autobootIndex = 0;
+	verifyBeforeBoot = FALSE;
+	useGraphicalMenu = FALSE;
+	useVirtualCD = FALSE;
+	useDirectIO = TRUE;
+	useDiskCache = TRUE;
+	ioQueueDepth = 0;
+	ioChunkSize = 0;
+	autobootTimeout = 0;
+	if (machineKernelOptions) {
+		FreePool(machineKernelOptions);
+	}
+	machineKernelOptions = NULL;
+	bootTries = 0;
+	if (safeKernelOptions) {
+		FreePool(safeKernelOptions);
+	}
+	safeKernelOptions = NULL;
+	AllocateMemoryAndCopyChar8String(safeKernelOptions, (CHAR8 *)"nomodeset");
+}
 
 void ReadConfigurationFile(const CHAR16 * const name) {
+	config_complete = FALSE;
+	ResetOptions();
+	if (!GetFileStamp(name, &config_size, &config_time)) {
+		config_size = 0;
+	}
+
 	/* This will always stay consistent, otherwise we'll lose the list in memory.*/
 	distributionListRoot = AllocateZeroPool(sizeof(BootableLinuxDistro));
 	if (!distributionListRoot) {
@@ -43,25 +244,78 @@ void ReadConfigurationFile(const CHAR16 * const name) {
 	}
 	
 	UINTN position = 0;
-	CHAR8 *key, *value, *distribution, *boot_folder;
+	CHAR8 *key, *value, *distribution = NULL, *boot_folder;
+
+	// The machine section we're in, and the best matching one so far. Settings from the most
+	// specific matching section win over the rest of the file, wherever they appear.
+	BOOLEAN in_machine_section = FALSE;
+	MachineMatch section_match = MACHINE_MATCH_NONE, best_match = MACHINE_MATCH_NONE;
+	BOOLEAN machine_autoboot = FALSE, machine_timeout_set = FALSE;
+	UINTN machine_autoboot_index = 0, machine_timeout = 0;
+
+	// An entry's ISO is looked for once all of its lines have been read, since the list of
+	// parts may come after it.
+	LinuxBootOption *unchecked_iso = NULL;
+
 	while ((GetConfigurationKeyAndValue(contents, &position, &key, &value))) {
+		if (strcmpa((CHAR8 *)"machine", key) == 0) {
+			in_machine_section = TRUE;
+			section_match = MatchMachine(value);
+			if (section_match > best_match) {
+				best_match = section_match;
+				machine_autoboot = machine_timeout_set = FALSE;
+				if (machineKernelOptions) {
+					FreePool(machineKernelOptions);
+				}
+				machineKernelOptions = NULL;
+			} else {
+				// A section no more specific than one we've already taken.
+				section_match = MACHINE_MATCH_NONE;
+			}
+			continue;
+		} else if (strcmpa((CHAR8 *)"entry", key) == 0 || strcmpa((CHAR8 *)"uki", key) == 0) {
+			// Both start an entry, which ends the section.
+			in_machine_section = FALSE;
+		}
+
+		if (in_machine_section) {
+			if (section_match == MACHINE_MATCH_NONE) {
+				continue;
+			}
+
+			if (strcmpa((CHAR8 *)"autoboot", key) == 0) {
+				ParseAutoboot(value, &machine_autoboot, &machine_autoboot_index);
+			} else if (strcmpa((CHAR8 *)"timeout", key) == 0) {
+				machine_timeout = ParseNumber(value);
+				machine_timeout_set = TRUE;
+			} else if (strcmpa((CHAR8 *)"options", key) == 0) {
+				AllocateMemoryAndCopyChar8String(machineKernelOptions, value);
+			} else {
+				Print(L"Option %a can't be set per machine.\n", key);
+			}
+			continue;
+		}
+
 		/* 
 		 * We require the user to specify an entry, followed by the file name and
 		 * any information required to boot the Linux distribution.
 		 */
 		// The autoboot entry was enabled.
 		if (strcmpa((CHAR8 *)"autoboot", key) == 0) {
-			shouldAutoboot = TRUE;
-
 			// Check if they've given us a parameter; if they have, check if it's a valid
 			// integer and then parse it.
-			// The user can currently only autoboot the first ten entries.
-			if (strlena(value) == 1 && (*value >= 48 && *value <= 57)) {
-				autobootIndex = *value - '0';
-			}
+			ParseAutoboot(value, &shouldAutoboot, &autobootIndex);
+		// How many seconds to show the menu for before autobooting.
+		} else if (strcmpa((CHAR8 *)"timeout", key) == 0) {
+			autobootTimeout = ParseNumber(value);
 		}
 		// The user has put a given a distribution entry.
 		else if (strcmpa((CHAR8 *)"entry", key) == 0) {
+			if (unchecked_iso) {
+				WarnIfIsoMissing(unchecked_iso);
+				unchecked_iso = NULL;
+			}
+
 			BootableLinuxDistro *new = AllocateZeroPool(sizeof(BootableLinuxDistro));
 			if (!new) {
 				DisplayErrorText(L"Failed to allocate memory for distribution entry.");
@@ -76,6 +330,34 @@ void ReadConfigurationFile(const CHAR16 * const name) {
 			conductor = conductor->next; // subsequent operations affect the new link in the chain
 			distroCount++;
 		}
+		// A unified kernel image, given by its path and any kernel parameters after it. It is
+		// an entry by itself, named after the distribution inside it when it is first shown.
+		else if (strcmpa((CHAR8 *)"uki", key) == 0) {
+			if (unchecked_iso) {
+				WarnIfIsoMissing(unchecked_iso);
+				unchecked_iso = NULL;
+			}
+
+			BootableLinuxDistro *new = AllocateZeroPool(sizeof(BootableLinuxDistro));
+			if (!new || !(new->bootOption = AllocateZeroPool(sizeof(LinuxBootOption)))) {
+				DisplayErrorText(L"Failed to allocate memory for distribution entry.");
+				if (new) {
+					FreePool(new);
+				}
+				continue;
+			}
+
+			INTN space = strposa(value, ' ');
+			if (space > 0) {
+				AllocateMemoryAndCopyChar8String(new->bootOption->kernel_options, value + space + 1);
+				value[space] = '\0';
+			}
+			AllocateMemoryAndCopyChar8String(new->bootOption->uki_path, value);
+
+			conductor->next = new;
+			conductor = new;
+			distroCount++;
+		}
 		// The user has given us a distribution family.
 		else if (strcmpa((CHAR8 *)"family", key) == 0) {
 			AllocateMemoryAndCopyChar8String(distribution, value);
@@ -89,10 +371,10 @@ void ReadConfigurationFile(const CHAR16 * const name) {
 			if (strcmpa((CHAR8 *)"", conductor->bootOption->kernel_path) == 0 ||
 				strcmpa((CHAR8 *)"", conductor->bootOption->initrd_path) == 0) {
 				Print(L"Distribution family %a is not supported.\n", value);
-				
-				FreePool(conductor->bootOption);
-				distributionListRoot = NULL;
-				return;
+
+				unchecked_iso = NULL;
+				FreeConfiguration();
+				break;
 			}
 		// The user is manually specifying information; override any previous values.
 		} else if (strcmpa((CHAR8 *)"kernel", key) == 0) {
@@ -129,20 +411,217 @@ void ReadConfigurationFile(const CHAR16 * const name) {
 		} else if (strcmpa((CHAR8 *)"initrd", key) == 0) {
 			AllocateMemoryAndCopyChar8String(conductor->bootOption->initrd_path, value);
 		} else if (strcmpa((CHAR8 *)"iso", key) == 0) {
-			strcpya(conductor->bootOption->iso_path, value);
-			
-			CHAR16 *temp = ASCIItoUTF16(value, strlena(value));
-			if (!FileExists(root_dir, temp)) {
-				Print(L"Warning: ISO file %a not found.\n", value);
-			}
-			FreePool(temp);
+			AllocateMemoryAndCopyChar8String(conductor->bootOption->iso_path, value);
+			unchecked_iso = conductor->bootOption;
+		// The files of a split ISO, in the ISO's directory and in order.
+		} else if (strcmpa((CHAR8 *)"parts", key) == 0) {
+			AllocateMemoryAndCopyChar8String(conductor->bootOption->iso_parts, value);
+			unchecked_iso = conductor->bootOption;
 		} else if (strcmpa((CHAR8 *)"root", key) == 0) {
 			AllocateMemoryAndCopyChar8String(conductor->bootOption->boot_folder, value);
+		} else if (strcmpa((CHAR8 *)"checksum", key) == 0) {
+			AllocateMemoryAndCopyChar8String(conductor->bootOption->checksum, value);
+		// Check every ISO against its checksum before booting it.
+		} else if (strcmpa((CHAR8 *)"verify", key) == 0) {
+			verifyBeforeBoot = ParseBoolean(value);
+		// Draw the menus ourselves instead of through the firmware's text console.
+		} else if (strcmpa((CHAR8 *)"graphics", key) == 0) {
+			useGraphicalMenu = ParseBoolean(value);
+		// Give GRUB the ISO as a CD drive instead of having it loopback mount the file.
+		} else if (strcmpa((CHAR8 *)"virtualcd", key) == 0) {
+			useVirtualCD = ParseBoolean(value);
+		// Read ISOs straight from the drive instead of through the firmware's FAT driver.
+		} else if (strcmpa((CHAR8 *)"directio", key) == 0) {
+			useDirectIO = ParseBoolean(value);
+		// Cache the drive's reads for GRUB and the kernel after we hand over to them.
+		} else if (strcmpa((CHAR8 *)"diskcache", key) == 0) {
+			useDiskCache = ParseBoolean(value);
+		// How many reads we keep in flight at once where the firmware allows it.
+		} else if (strcmpa((CHAR8 *)"queuedepth", key) == 0) {
+			UINTN depth = ParseNumber(value);
+			if (depth > 0) {
+				ioQueueDepth = depth;
+			}
+		// How much each of those reads asks for, in KB.
+		} else if (strcmpa((CHAR8 *)"chunksize", key) == 0) {
+			UINTN size = ParseNumber(value);
+			if (size >= 4 && size <= 4096) {
+				ioChunkSize = size * 1024;
+			}
+		// How often an entry may fail to boot before it's tried in safe mode, and then passed over.
+		} else if (strcmpa((CHAR8 *)"boottries", key) == 0) {
+			bootTries = ParseNumber(value);
+		} else if (strcmpa((CHAR8 *)"safeoptions", key) == 0) {
+			AllocateMemoryAndCopyChar8String(safeKernelOptions, value);
 		} else {
 			Print(L"Unrecognized configuration option: %a.\n", key);
 		}
 	}
+	if (unchecked_iso) {
+		WarnIfIsoMissing(unchecked_iso);
+	}
 	
+	if (machine_autoboot) {
+		shouldAutoboot = TRUE;
+		autobootIndex = machine_autoboot_index;
+	}
+	if (machine_timeout_set) {
+		autobootTimeout = machine_timeout;
+	}
+
+	if (distribution) {
+		FreePool(distribution);
+	}
 	FreePool(contents);
+
+	// Whatever I/O settings the file left out depend on the drive.
+	IoTuneApply();
+
+	// Work out the boot selector's filter masks now rather than each time it opens.
+	BootableLinuxDistro *entry;
+	for (entry = distributionListRoot ? distributionListRoot->next : NULL; entry; entry = entry->next) {
+		if (entry->bootOption) {
+			ListViewNameMasks(entry->bootOption->name, &entry->bootOption->name_chars,
+				&entry->bootOption->name_pairs);
+		}
+	}
 	//Print(L"Done reading configuration file.\n");
+	config_complete = TRUE;
+}
+
+static VOID FreeBootOption(LinuxBootOption *option) {
+	if (option->name) {
+		FreePool(option->name);
+	}
+	if (option->file_name) {
+		FreePool(option->file_name);
+	}
+	if (option->distro_family) {
+		FreePool(option->distro_family);
+	}
+	if (option->kernel_path) {
+		FreePool(option->kernel_path);
+	}
+	if (option->kernel_options) {
+		FreePool(option->kernel_options);
+	}
+	if (option->initrd_path) {
+		FreePool(option->initrd_path);
+	}
+	if (option->boot_folder) {
+		FreePool(option->boot_folder);
+	}
+	if (option->iso_path) {
+		FreePool(option->iso_path);
+	}
+	if (option->iso_parts) {
+		FreePool(option->iso_parts);
+	}
+	if (option->checksum) {
+		FreePool(option->checksum);
+	}
+	if (option->uki_path) {
+		FreePool(option->uki_path);
+	}
+	FreePool(option);
+}
+
+static VOID FreeDistributionList(BootableLinuxDistro *conductor) {
+	while (conductor) {
+		BootableLinuxDistro *next = conductor->next;
+		if (conductor->bootOption) {
+			FreeBootOption(conductor->bootOption);
+		}
+		FreePool(conductor);
+		conductor = next;
+	}
+}
+
+/*
+ * Releases the distribution list built by ReadConfigurationFile. Nothing may refer to the
+ * boot options afterwards.
+ */
+VOID FreeConfiguration(VOID) {
+	FreeDistributionList(distributionListRoot);
+	distributionListRoot = NULL;
+	distroCount = -1;
+}
+
+// Everything ReadConfigurationFile sets, so that it can be put back.
+typedef struct {
+	BootableLinuxDistro *list;
+	INTN count;
+	BOOLEAN autoboot;
+	UINTN autoboot_index;
+	UINTN autoboot_timeout;
+	CHAR8 *machine_options;
+	BOOLEAN verify;
+	BOOLEAN graphics;
+	BOOLEAN virtual_cd;
+	BOOLEAN direct_io;
+	BOOLEAN disk_cache;
+	UINTN queue_depth;
+	UINTN chunk_size;
+	UINTN boot_tries;
+	CHAR8 *safe_options;
+	UINT64 size;
+	EFI_TIME time;
+} SavedConfiguration;
+
+static VOID SwapConfiguration(SavedConfiguration *saved) {
+	SavedConfiguration current = {
+		distributionListRoot, distroCount, shouldAutoboot, autobootIndex, autobootTimeout,
+		machineKernelOptions, verifyBeforeBoot, useGraphicalMenu, useVirtualCD, useDirectIO,
+		useDiskCache, ioQueueDepth, ioChunkSize, bootTries, safeKernelOptions, config_size, config_time
+	};
+
+	distributionListRoot = saved->list;
+	distroCount = saved->count;
+	shouldAutoboot = saved->autoboot;
+	autobootIndex = saved->autoboot_index;
+	autobootTimeout = saved->autoboot_timeout;
+	machineKernelOptions = saved->machine_options;
+	verifyBeforeBoot = saved->verify;
+	useGraphicalMenu = saved->graphics;
+	useVirtualCD = saved->virtual_cd;
+	useDirectIO = saved->direct_io;
+	useDiskCache = saved->disk_cache;
+	ioQueueDepth = saved->queue_depth;
+	ioChunkSize = saved->chunk_size;
+	bootTries = saved->boot_tries;
+	safeKernelOptions = saved->safe_options;
+	config_size = saved->size;
+	CopyMem(&config_time, &saved->time, sizeof(EFI_TIME));
+
+	*saved = current;
+}
+
+/*
+ * Reads the configuration file again. The configuration in use is only replaced once the new
+ * one has been read in full; if it can't be, the old one stays and FALSE is returned.
+ */
+BOOLEAN ReloadConfigurationFile(const CHAR16 * const name) {
+	// Start from nothing, as at startup, with the old configuration set aside.
+	SavedConfiguration old;
+	SetMem(&old, sizeof(old), 0);
+	old.count = -1;
+	old.direct_io = old.disk_cache = TRUE;
+	SwapConfiguration(&old);
+
+	ReadConfigurationFile(name);
+	BOOLEAN read = config_complete && distributionListRoot;
+	if (!read) {
+		FreeConfiguration();
+		SwapConfiguration(&old);
+	}
+
+	// Whichever configuration isn't kept is now the one set aside.
+	FreeDistributionList(old.list);
+	if (old.machine_options) {
+		FreePool(old.machine_options);
+	}
+	if (old.safe_options) {
+		FreePool(old.safe_options);
+	}
+	return read;
 }
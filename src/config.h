@@ -22,8 +22,24 @@
 extern EFI_FILE *root_dir;
 extern BOOLEAN shouldAutoboot;
 extern UINTN autobootIndex;
+extern UINTN autobootTimeout;
+extern CHAR8 *machineKernelOptions;
 extern INTN distroCount;
+extern BOOLEAN verifyBeforeBoot;
+extern BOOLEAN useGraphicalMenu;
+extern BOOLEAN useVirtualCD;
+extern BOOLEAN useDirectIO;
+extern BOOLEAN useDiskCache;
+extern UINTN ioQueueDepth;
+extern UINTN ioChunkSize;
+extern UINTN bootTries;
+extern CHAR8 *safeKernelOptions;
+
+#define CONFIGURATION_FILE_PATH L"\\efi\\boot\\enterprise.cfg"
 
 void ReadConfigurationFile(const CHAR16 const *);
+BOOLEAN ReloadConfigurationFile(const CHAR16 const *);
+BOOLEAN ConfigurationFileChanged(const CHAR16 const *);
+VOID FreeConfiguration(VOID);
 
 #endif
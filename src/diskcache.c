@@ -0,0 +1,306 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A read cache in front of the drive we were started from, for GRUB and the kernel's EFI
+ * stub, which read the ISO, kernel and initrd through Block I/O in many small pieces. It is
+ * put in place just before GRUB starts and stays until ExitBootServices (or until GRUB
+ * comes back to us): the drive's own ReadBlocks goes through a block cache, so small reads
+ * are served a line at a time and sequential ones are read further and further ahead.
+ * Anything written to the drive empties the cache. How well it did is left in the volatile
+ * Enterprise_DiskCache variable.
+ *
+ * The functions are replaced in the drive's own protocol structure, since the partition and
+ * file system drivers already have it open and would never see a new one.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "diskcache.h"
+#include "config.h"
+#include "timing.h"
+#include "utils.h"
+
+#define DISK_CACHE_LINE_SIZE (64 * 1024)
+#define DISK_CACHE_READ_AHEAD_LINES 32
+#define DISK_CACHE_MIN_SIZE (4 * 1024 * 1024)
+#define DISK_CACHE_MAX_SIZE (128 * 1024 * 1024)
+#define DISK_CACHE_MEMORY_SHARE 32 // of the free memory, as GRUB and the kernel need the rest
+
+static EFI_GUID BlockIo2Protocol = EFI_BLOCK_IO2_PROTOCOL_GUID;
+static DiskCache *disk_cache = NULL;
+
+#ifdef __APPLE__
+	#pragma mark - The filter
+#endif
+static EFI_STATUS FillFromDevice(VOID *context, UINT64 offset, UINTN length, VOID *buffer) {
+	DiskCache *cache = context;
+	UINT64 start = TimestampNow();
+
+	EFI_STATUS err = uefi_call_wrapper(cache->read_blocks, 5, cache->block_io, cache->media_id,
+		offset / cache->block_io->Media->BlockSize, length, buffer);
+	cache->device_time += TimestampNow() - start;
+	return err;
+}
+
+/*
+ * Serves reads of the whole drive from the cache. Anything odd, such as a read of another
+ * medium or one that doesn't fit the drive, goes to the firmware as it is, so that the
+ * caller gets the firmware's answer.
+ */
+static EFI_CALLBACK EFI_STATUS FilterReadBlocks(EFI_BLOCK_IO *this, UINT32 media_id, EFI_LBA lba, UINTN size,
+	VOID *buffer) {
+	DiskCache *cache = disk_cache;
+	EFI_BLOCK_IO_MEDIA *media = this->Media;
+	EFI_STATUS err;
+
+	if (!cache->busy && media_id == cache->media_id && media->MediaId == cache->media_id &&
+		media->MediaPresent && size > 0 && size % media->BlockSize == 0 && buffer &&
+		lba <= media->LastBlock && size / media->BlockSize <= media->LastBlock - lba + 1) {
+		// Reads can come from event notifications in the middle of another one.
+		cache->busy = TRUE;
+		err = BlockCacheRead(cache->cache, lba * media->BlockSize, size, buffer);
+		cache->busy = FALSE;
+		if (cache->stale) {
+			BlockCacheInvalidate(cache->cache);
+			cache->stale = FALSE;
+		}
+
+		if (!EFI_ERROR(err)) {
+			cache->reads++;
+			cache->bytes_read += size;
+			return err;
+		}
+	}
+
+	cache->passed_through++;
+	return uefi_call_wrapper(cache->read_blocks, 5, this, media_id, lba, size, buffer);
+}
+
+static VOID Invalidate(DiskCache *cache) {
+	BlockCacheInvalidate(cache->cache);
+	if (cache->busy) {
+		cache->stale = TRUE;
+	}
+}
+
+static EFI_CALLBACK EFI_STATUS FilterWriteBlocks(EFI_BLOCK_IO *this, UINT32 media_id, EFI_LBA lba, UINTN size,
+	VOID *buffer) {
+	Invalidate(disk_cache);
+	return uefi_call_wrapper(disk_cache->write_blocks, 5, this, media_id, lba, size, buffer);
+}
+
+static EFI_CALLBACK EFI_STATUS FilterWriteBlocksEx(EFI_BLOCK_IO2_PROTOCOL *this, UINT32 media_id, EFI_LBA lba,
+	EFI_BLOCK_IO2_TOKEN *token, UINTN size, VOID *buffer) {
+	Invalidate(disk_cache);
+	return uefi_call_wrapper(disk_cache->write_blocks_ex, 6, this, media_id, lba, token, size, buffer);
+}
+
+static EFI_CALLBACK EFI_STATUS FilterReset(EFI_BLOCK_IO *this, BOOLEAN extended) {
+	Invalidate(disk_cache);
+	return uefi_call_wrapper(disk_cache->reset, 2, this, extended);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Statistics
+#endif
+/*
+ * Leaves the statistics in Enterprise_DiskCache as one line of "name=value" pairs. This may
+ * run as boot services exit, so it neither allocates nor goes through the variable store.
+ */
+static VOID StoreStatistics(DiskCache *cache) {
+	static CHAR16 line[256];
+	static CHAR8 ascii[256];
+	UINTN i;
+
+	SPrint(line, sizeof(line), L"size=%ld reads=%ld read_bytes=%ld hits=%ld misses=%ld transfers=%ld "
+		L"transfer_bytes=%ld device_us=%ld passed_through=%ld\n", cache->cache->line_count * cache->cache->line_size,
+		cache->reads, cache->bytes_read, cache->cache->hits, cache->cache->misses, cache->cache->transfers,
+		cache->cache->bytes_transferred, TimestampToMicroseconds(cache->device_time), cache->passed_through);
+	for (i = 0; line[i] != '\0' && i < sizeof(ascii) - 1; i++) {
+		ascii[i] = (CHAR8)line[i];
+	}
+	ascii[i] = '\0';
+
+	uefi_call_wrapper(RT->SetVariable, 5, L"Enterprise_DiskCache", (EFI_GUID *)&enterprise_variable_guid,
+		EFI_VARIABLE_BOOTSERVICE_ACCESS|EFI_VARIABLE_RUNTIME_ACCESS, i + 1, ascii);
+}
+
+static EFI_CALLBACK VOID ExitBootServicesNotify(EFI_EVENT event, VOID *context) {
+	(VOID)event;
+	StoreStatistics(context);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Installation
+#endif
+/*
+ * Finds the whole drive that the given partition is on, whose Block I/O is what GRUB reads
+ * and what the partition's own reads end up at.
+ */
+static EFI_HANDLE FindDrive(EFI_HANDLE partition) {
+	EFI_DEVICE_PATH *path = DevicePathFromHandle(partition);
+	EFI_DEVICE_PATH *copy, *node, *remaining;
+	EFI_BLOCK_IO *block_io;
+	EFI_HANDLE drive = NULL;
+
+	if (!path || !(copy = DuplicateDevicePath(path))) {
+		return NULL;
+	}
+
+	// Cut the path off at the partition, and see what's left.
+	for (node = copy; !IsDevicePathEnd(node); node = NextDevicePathNode(node)) {
+		if (DevicePathType(node) == MEDIA_DEVICE_PATH && DevicePathSubType(node) == MEDIA_HARDDRIVE_DP) {
+			SetDevicePathEndNode(node);
+			break;
+		}
+	}
+
+	remaining = copy;
+	if (EFI_ERROR(uefi_call_wrapper(BS->LocateDevicePath, 3, &BlockIoProtocol, &remaining, &drive)) ||
+		!IsDevicePathEnd(remaining) ||
+		EFI_ERROR(uefi_call_wrapper(BS->HandleProtocol, 3, drive, &BlockIoProtocol, (VOID **)&block_io)) ||
+		block_io->Media->LogicalPartition) {
+		drive = NULL;
+	}
+
+	FreePool(copy);
+	return drive;
+}
+
+/*
+ * Takes a share of the free memory, within limits, in whole lines.
+ */
+static UINTN CacheLineCount(VOID) {
+	UINTN count, key, descriptor_size, i;
+	UINT32 version;
+	UINT64 free_pages = 0;
+
+	EFI_MEMORY_DESCRIPTOR *map = LibMemoryMap(&count, &key, &descriptor_size, &version);
+	if (map) {
+		EFI_MEMORY_DESCRIPTOR *descriptor = map;
+		for (i = 0; i < count; i++) {
+			if (descriptor->Type == EfiConventionalMemory) {
+				free_pages += descriptor->NumberOfPages;
+			}
+			descriptor = NextMemoryDescriptor(descriptor, descriptor_size);
+		}
+		FreePool(map);
+	}
+
+	UINT64 size = free_pages * EFI_PAGE_SIZE / DISK_CACHE_MEMORY_SHARE;
+	if (size < DISK_CACHE_MIN_SIZE) {
+		size = DISK_CACHE_MIN_SIZE;
+	}
+	if (size > DISK_CACHE_MAX_SIZE) {
+		size = DISK_CACHE_MAX_SIZE;
+	}
+	return size / DISK_CACHE_LINE_SIZE;
+}
+
+/*
+ * Puts the cache in front of the drive the given partition is on. Drives whose blocks
+ * don't divide a cache line, or which need their buffers aligned more than pool memory is,
+ * are left alone.
+ */
+EFI_STATUS DiskCacheInstall(EFI_HANDLE partition) {
+	EFI_BLOCK_IO_MEDIA *media;
+	EFI_STATUS err;
+
+	if (disk_cache) {
+		return EFI_ALREADY_STARTED;
+	}
+
+	EFI_HANDLE drive = FindDrive(partition);
+	if (!drive) {
+		return EFI_NOT_FOUND;
+	}
+
+	DiskCache *cache = AllocateZeroPool(sizeof(DiskCache));
+	if (!cache) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	uefi_call_wrapper(BS->HandleProtocol, 3, drive, &BlockIoProtocol, (VOID **)&cache->block_io);
+	media = cache->block_io->Media;
+	if (!media->MediaPresent || media->BlockSize == 0 || DISK_CACHE_LINE_SIZE % media->BlockSize != 0 ||
+		media->IoAlign > 8) {
+		FreePool(cache);
+		return EFI_UNSUPPORTED;
+	}
+
+	cache->media_id = media->MediaId;
+	cache->cache = BlockCacheCreate((media->LastBlock + 1) * media->BlockSize, DISK_CACHE_LINE_SIZE,
+		CacheLineCount(), DISK_CACHE_READ_AHEAD_LINES, FillFromDevice, cache);
+	if (!cache->cache) {
+		FreePool(cache);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_SIGNAL_EXIT_BOOT_SERVICES, TPL_CALLBACK,
+		(EFI_EVENT_NOTIFY)ExitBootServicesNotify, cache, &cache->exit_event);
+	if (EFI_ERROR(err)) {
+		BlockCacheFree(cache->cache);
+		FreePool(cache);
+		return err;
+	}
+
+	cache->reset = cache->block_io->Reset;
+	cache->read_blocks = cache->block_io->ReadBlocks;
+	cache->write_blocks = cache->block_io->WriteBlocks;
+	cache->block_io->Reset = (EFI_BLOCK_RESET)FilterReset;
+	cache->block_io->ReadBlocks = (EFI_BLOCK_READ)FilterReadBlocks;
+	cache->block_io->WriteBlocks = (EFI_BLOCK_WRITE)FilterWriteBlocks;
+
+	// Writes through Block I/O 2 mustn't leave stale data behind either. Its reads are
+	// left alone, as they can't be wrong.
+	if (!EFI_ERROR(uefi_call_wrapper(BS->HandleProtocol, 3, drive, &BlockIo2Protocol, (VOID **)&cache->block_io2))) {
+		cache->write_blocks_ex = cache->block_io2->WriteBlocksEx;
+		cache->block_io2->WriteBlocksEx = (EFI_BLOCK_WRITE_EX)FilterWriteBlocksEx;
+	} else {
+		cache->block_io2 = NULL;
+	}
+
+	disk_cache = cache;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Gives the drive its own functions back, if GRUB returns to us, since nothing of ours may
+ * be left in them once we exit.
+ */
+VOID DiskCacheRemove(VOID) {
+	DiskCache *cache = disk_cache;
+
+	if (!cache) {
+		return;
+	}
+
+	cache->block_io->Reset = cache->reset;
+	cache->block_io->ReadBlocks = cache->read_blocks;
+	cache->block_io->WriteBlocks = cache->write_blocks;
+	if (cache->block_io2) {
+		cache->block_io2->WriteBlocksEx = cache->write_blocks_ex;
+	}
+
+	uefi_call_wrapper(BS->CloseEvent, 1, cache->exit_event);
+	StoreStatistics(cache);
+	BlockCacheFree(cache->cache);
+	FreePool(cache);
+	disk_cache = NULL;
+}
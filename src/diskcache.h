@@ -0,0 +1,46 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _diskcache_h
+#define _diskcache_h
+#include <efi.h>
+#include "blockcache.h"
+#include "protocols.h"
+
+typedef struct {
+	EFI_BLOCK_IO *block_io;
+	EFI_BLOCK_IO2_PROTOCOL *block_io2;
+	UINT32 media_id;
+	BlockCache *cache;
+	EFI_EVENT exit_event;
+	BOOLEAN busy;
+	BOOLEAN stale; // written to during a read from the cache
+
+	// The firmware's own functions, which ours sit in front of.
+	EFI_BLOCK_RESET reset;
+	EFI_BLOCK_READ read_blocks;
+	EFI_BLOCK_WRITE write_blocks;
+	EFI_BLOCK_WRITE_EX write_blocks_ex;
+
+	UINT64 reads, bytes_read, passed_through, device_time;
+} DiskCache;
+
+EFI_STATUS DiskCacheInstall(EFI_HANDLE);
+VOID DiskCacheRemove(VOID);
+
+#endif
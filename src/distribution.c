@@ -19,25 +19,170 @@
 #include <efilib.h>
 
 #include "distribution.h"
+#include "utils.h"
+
+/*
+ * Everything we know about booting each family from an ISO. The script is handed to GRUB,
+ * which runs it once it has found the ISO and made it its root device. Before that, these
+ * placeholders are filled in:
+ *   @KERNEL@, @INITRD@  the kernel and initial RAM disk inside the ISO
+ *   @FOLDER@            the family's live system folder (the "root" option)
+ *   @ISO@               the ISO's path on its volume, as Linux will see it
+ *   @OPTIONS@           kernel parameters from the configuration file and the menu
+ * GRUB variables such as ${root} are left for GRUB to expand. grub.cfg sets ${overlay} to
+ * the entry's overlay archive (see overlay.c), if it has one.
+ */
+static const DistributionFamily families[] = {
+	{
+		"Ubuntu", "/casper/vmlinuz.efi", "/casper/initrd.lz", "casper",
+		"linux @KERNEL@ file=/preseed/ubuntu.seed boot=@FOLDER@ iso-scan/filename=@ISO@ quiet splash @OPTIONS@ --\n"
+		"initrd @INITRD@ ${overlay}\n"
+		"boot\n"
+	},
+	{
+		"Debian", "/live/vmlinuz", "/live/initrd.img", "live",
+		"linux @KERNEL@ boot=@FOLDER@ findiso=@ISO@ components quiet splash @OPTIONS@\n"
+		"initrd @INITRD@ ${overlay}\n"
+		"boot\n"
+	},
+	{
+		"Fedora", "/images/pxeboot/vmlinuz", "/images/pxeboot/initrd.img", "LiveOS",
+		"probe --label --set=iso_label ${root}\n"
+		"linux @KERNEL@ root=live:CDLABEL=${iso_label} rd.live.image rd.live.dir=@FOLDER@ iso-scan/filename=@ISO@ quiet @OPTIONS@\n"
+		"initrd @INITRD@ ${overlay}\n"
+		"boot\n"
+	},
+	{
+		"Arch", "/arch/boot/x86_64/vmlinuz-linux", "/arch/boot/x86_64/initramfs-linux.img", "arch",
+		"probe --fs-uuid --set=esp_uuid ${real_root}\n"
+		"probe --label --set=iso_label ${root}\n"
+		"linux @KERNEL@ img_dev=/dev/disk/by-uuid/${esp_uuid} img_loop=@ISO@ archisobasedir=@FOLDER@ archisolabel=${iso_label} @OPTIONS@\n"
+		"initrd @INITRD@ ${overlay}\n"
+		"boot\n"
+	},
+};
+
+#define FAMILY_COUNT (sizeof(families) / sizeof(families[0]))
+
+/*
+ * Boots an entry whose kernel parameters we read from the ISO's own configuration; those
+ * already say everything the distribution needs.
+ */
+static const CHAR8 derived_script[] =
+	"linux @KERNEL@ @OPTIONS@\n"
+	"initrd @INITRD@ ${overlay}\n"
+	"boot\n";
+
+const DistributionFamily* DistributionFamilyForName(CHAR8 *name) {
+	UINTN i;
+	for (i = 0; i < FAMILY_COUNT; i++) {
+		if (strcmpa((CHAR8 *)families[i].name, name) == 0) {
+			return &families[i];
+		}
+	}
+
+	return NULL;
+}
 
 CHAR8* KernelLocationForDistributionName(CHAR8 *name, OUT CHAR8 **boot_folder) {
-	if (strcmpa((CHAR8 *)"Debian", name) == 0) {
-		*boot_folder = (CHAR8 *)"live";
-		return (CHAR8 *)"/live/vmlinuz";
-	} else if (strcmpa((CHAR8 *)"Ubuntu", name) == 0) {
-		*boot_folder = (CHAR8 *)"casper";
-		return (CHAR8 *)"/casper/vmlinuz.efi";
-	} else {
+	const DistributionFamily *family = DistributionFamilyForName(name);
+	if (!family) {
 		return (CHAR8 *)"";
 	}
+
+	*boot_folder = (CHAR8 *)family->boot_folder;
+	return (CHAR8 *)family->kernel_path;
 }
 
 CHAR8* InitRDLocationForDistributionName(CHAR8 *name) {
-	if (strcmpa((CHAR8 *)"Debian", name) == 0) {
-		return (CHAR8 *)"/live/initrd.img";
-	} else if (strcmpa((CHAR8 *)"Ubuntu", name) == 0) {
-		return (CHAR8 *)"/casper/initrd.lz";
-	} else {
-		return (CHAR8 *)"";
+	const DistributionFamily *family = DistributionFamilyForName(name);
+	return family ? (CHAR8 *)family->initrd_path : (CHAR8 *)"";
+}
+
+#ifdef __APPLE__
+	#pragma mark - Boot scripts
+#endif
+static const CHAR8* ValueForPlaceholder(const CHAR8 *placeholder, UINTN length, const CHAR8 **values) {
+	static const CHAR8 *names[] = {
+		(const CHAR8 *)"KERNEL", (const CHAR8 *)"INITRD", (const CHAR8 *)"FOLDER",
+		(const CHAR8 *)"ISO", (const CHAR8 *)"OPTIONS"
+	};
+
+	UINTN i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strlena((CHAR8 *)names[i]) == length && strncmpa((CHAR8 *)names[i], (CHAR8 *)placeholder, length) == 0) {
+			return values[i] ? values[i] : (const CHAR8 *)"";
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Fills in a template's placeholders. Called twice: once with output set to NULL to measure
+ * the result, then again to write it.
+ */
+static UINTN ExpandTemplate(const CHAR8 *template, const CHAR8 **values, CHAR8 *output) {
+	UINTN length = 0;
+	const CHAR8 *p = template;
+
+	while (*p) {
+		if (*p == '@') {
+			const CHAR8 *end = p + 1;
+			while (*end && *end != '@' && *end != '\n') {
+				end++;
+			}
+
+			const CHAR8 *value = *end == '@' ? ValueForPlaceholder(p + 1, end - p - 1, values) : NULL;
+			if (value) {
+				UINTN value_length = strlena((CHAR8 *)value);
+				if (output) {
+					CopyMem(output + length, value, value_length);
+				}
+				length += value_length;
+				p = end + 1;
+				continue;
+			}
+		}
+
+		if (output) {
+			output[length] = *p;
+		}
+		length++;
+		p++;
+	}
+
+	if (output) {
+		output[length] = '\0';
 	}
+	return length;
+}
+
+/*
+ * Writes the GRUB script that boots the given entry with the given kernel parameters. The
+ * caller frees the result.
+ */
+CHAR8* BootScriptForBootOption(LinuxBootOption *option, CHAR8 *kernel_parameters) {
+	const DistributionFamily *family = DistributionFamilyForName(option->distro_family);
+	if (!family && !option->derived) {
+		return NULL;
+	}
+
+	CHAR8 *iso = IsoPathForLinux(option);
+	if (!iso) {
+		return NULL;
+	}
+
+	const CHAR8 *values[] = {
+		option->kernel_path, option->initrd_path, option->boot_folder, iso, kernel_parameters
+	};
+
+	const CHAR8 *template = family ? (const CHAR8 *)family->script : derived_script;
+	CHAR8 *script = AllocatePool(ExpandTemplate(template, values, NULL) + 1);
+	if (script) {
+		ExpandTemplate(template, values, script);
+	}
+
+	FreePool(iso);
+	return script;
 }
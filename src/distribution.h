@@ -21,7 +21,19 @@
 #ifndef _distribution_h
 #define _distribution_h
 
+#include "main.h"
+
+typedef struct {
+	const char *name;
+	const char *kernel_path;
+	const char *initrd_path;
+	const char *boot_folder;
+	const char *script;
+} DistributionFamily;
+
+const DistributionFamily* DistributionFamilyForName(CHAR8 *);
 CHAR8* KernelLocationForDistributionName(CHAR8 *, OUT CHAR8 **);
 CHAR8* InitRDLocationForDistributionName(CHAR8 *);
+CHAR8* BootScriptForBootOption(LinuxBootOption *, CHAR8 *);
 
 #endif
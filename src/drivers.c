@@ -0,0 +1,192 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Loads the EFI drivers in \efi\boot\drivers\, such as file system drivers for exFAT, NTFS
+ * or ext4, so that ISOs can be kept on a volume without FAT32's 4 GB limit and with larger
+ * clusters. The configuration names such an ISO by the volume's label, as in
+ * "iso BIGDATA:\isos\fedora.iso".
+ *
+ * Drivers are loaded in the order of their file names, so prefixing them with numbers
+ * orders them. Loading stops once DRIVER_TIME_BUDGET has been used up, as a misbehaving
+ * driver mustn't keep the menu from ever coming up; what's left is reported.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "drivers.h"
+#include "timing.h"
+#include "utils.h"
+
+#define MAX_DRIVERS 32
+#define DRIVER_TIME_BUDGET (3 * 1000 * 1000) // microseconds
+
+static BOOLEAN OutOfTime(UINT64 start) {
+	return TimestampToMicroseconds(TimestampNow() - start) > DRIVER_TIME_BUDGET;
+}
+
+static BOOLEAN IsDriverFile(EFI_FILE_INFO *info) {
+	UINTN length = StrLen(info->FileName);
+	return !(info->Attribute & EFI_FILE_DIRECTORY) && length > 4 &&
+		StriCmp(info->FileName + length - 4, L".efi") == 0;
+}
+
+/*
+ * Lists the drivers in the directory, sorted by name. Returns how many there are.
+ */
+static UINTN ListDrivers(EFI_FILE_HANDLE directory, CHAR16 **names) {
+	UINTN buffer_size = SIZE_OF_EFI_FILE_INFO + 256 * sizeof(CHAR16);
+	EFI_FILE_INFO *info = AllocatePool(buffer_size);
+	UINTN count = 0, i;
+
+	if (!info) {
+		return 0;
+	}
+
+	while (count < MAX_DRIVERS) {
+		UINTN size = buffer_size;
+		EFI_STATUS err = uefi_call_wrapper(directory->Read, 3, directory, &size, info);
+		if (EFI_ERROR(err) || size == 0) {
+			break;
+		}
+		if (!IsDriverFile(info)) {
+			continue;
+		}
+
+		CHAR16 *name = StrDuplicate(info->FileName);
+		if (!name) {
+			break;
+		}
+
+		for (i = count; i > 0 && StriCmp(names[i - 1], name) > 0; i--) {
+			names[i] = names[i - 1];
+		}
+		names[i] = name;
+		count++;
+	}
+
+	FreePool(info);
+	return count;
+}
+
+/*
+ * Loads and starts one driver. Anything that turns out not to be a driver is unloaded
+ * again without being started.
+ */
+static EFI_STATUS StartDriver(EFI_HANDLE parent, EFI_HANDLE device, CHAR16 *name) {
+	EFI_LOADED_IMAGE *loaded;
+	EFI_HANDLE image;
+	EFI_STATUS err;
+
+	CHAR16 *path = PoolPrint(L"%s\\%s", DRIVER_DIRECTORY, name);
+	EFI_DEVICE_PATH *device_path = path ? FileDevicePath(device, path) : NULL;
+	if (path) {
+		FreePool(path);
+	}
+	if (!device_path) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent, device_path, NULL, 0, &image);
+	FreePool(device_path);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, image, &LoadedImageProtocol, (VOID **)&loaded);
+	if (EFI_ERROR(err) || (loaded->ImageCodeType != EfiBootServicesCode &&
+		loaded->ImageCodeType != EfiRuntimeServicesCode)) {
+		uefi_call_wrapper(BS->UnloadImage, 1, image);
+		return EFI_ERROR(err) ? err : EFI_UNSUPPORTED;
+	}
+
+	err = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
+	if (EFI_ERROR(err)) {
+		uefi_call_wrapper(BS->UnloadImage, 1, image);
+	}
+	return err;
+}
+
+/*
+ * Has the new drivers look at every partition that no file system driver took yet. The
+ * rest are left alone, which is much quicker than connecting everything again.
+ */
+static VOID ConnectUnclaimedVolumes(UINT64 start) {
+	EFI_HANDLE *handles;
+	UINTN count, i;
+	VOID *file_system;
+
+	if (EFI_ERROR(LibLocateHandle(ByProtocol, &BlockIoProtocol, NULL, &count, &handles))) {
+		return;
+	}
+
+	for (i = 0; i < count && !OutOfTime(start); i++) {
+		if (!EFI_ERROR(uefi_call_wrapper(BS->HandleProtocol, 3, handles[i], &FileSystemProtocol, &file_system))) {
+			continue;
+		}
+		uefi_call_wrapper(BS->ConnectController, 4, handles[i], NULL, NULL, TRUE);
+	}
+
+	FreePool(handles);
+}
+
+/*
+ * Loads the drivers on the given device, which is the one we were started from, and
+ * connects them. parent is our own image.
+ */
+VOID LoadDrivers(EFI_HANDLE parent, EFI_HANDLE device) {
+	CHAR16 *names[MAX_DRIVERS];
+	EFI_FILE_HANDLE root, directory;
+	UINTN count, loaded = 0, i;
+
+	root = LibOpenRoot(device);
+	if (!root) {
+		return;
+	}
+	EFI_STATUS err = uefi_call_wrapper(root->Open, 5, root, &directory, DRIVER_DIRECTORY, EFI_FILE_MODE_READ, 0);
+	uefi_call_wrapper(root->Close, 1, root);
+	if (EFI_ERROR(err)) {
+		return;
+	}
+
+	count = ListDrivers(directory, names);
+	uefi_call_wrapper(directory->Close, 1, directory);
+
+	UINT64 start = TimestampNow();
+	for (i = 0; i < count; i++) {
+		if (OutOfTime(start)) {
+			Print(L"Warning: ran out of time loading drivers; %s and after were skipped.\n", names[i]);
+			break;
+		}
+
+		err = StartDriver(parent, device, names[i]);
+		if (EFI_ERROR(err)) {
+			Print(L"Warning: couldn't load the driver %s: %r\n", names[i], err);
+		} else {
+			loaded++;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		FreePool(names[i]);
+	}
+
+	if (loaded > 0) {
+		ConnectUnclaimedVolumes(start);
+	}
+}
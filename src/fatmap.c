@@ -0,0 +1,695 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Finds out where an ISO is on our FAT drive, so that it can be read straight from the
+ * device rather than through the firmware's FAT driver, which follows the cluster chain
+ * again on every read. The file's directory entry and cluster chain are read once and
+ * turned into a list of extents (usually just one, as ISOs are copied onto the drive in one
+ * go). The list is saved next to the ISO, and used for as long as the ISO keeps its size
+ * and modification time.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "fatmap.h"
+#include "main.h"
+#include "config.h"
+#include "utils.h"
+
+#define EXTENT_CACHE_MAGIC 0x3250414d // "MAP2"
+#define EXTENT_CACHE_SUFFIX L".map"
+#define FAT_WINDOW_SIZE (64 * 1024)
+#define MAX_DIRECTORY_SIZE (4 * 1024 * 1024)
+#define MAX_EXTENTS 4096
+#define MAX_SPOT_CHECKS 16
+#define DIRECTORY_ENTRY_SIZE 32
+#define LFN_CHARS_PER_ENTRY 13
+#define MAX_NAME_LENGTH 255
+
+#define ATTRIBUTE_VOLUME_LABEL 0x08
+#define ATTRIBUTE_DIRECTORY 0x10
+#define ATTRIBUTE_LONG_NAME 0x0F
+
+typedef struct {
+	UINT32 magic;
+	UINT32 count;
+	UINT64 size;
+	EFI_TIME modification_time;
+	UINT32 first_cluster; // tells the file apart from an older copy with the same size and time
+	UINT32 reserved;
+} ExtentCacheHeader;
+
+typedef struct {
+	EFI_DISK_IO *disk_io;
+	UINT32 media_id;
+	BOOLEAN fat32;
+	UINT32 cluster_size;
+	UINT32 cluster_count;
+	UINT64 fat_offset;
+	UINT64 root_offset;   // FAT12/16 only: the fixed root directory
+	UINT32 root_size;
+	UINT32 root_cluster;  // FAT32 only
+	UINT64 data_offset;
+
+	UINT8 *window;        // the part of the FAT we last read
+	UINT64 window_start;
+	UINTN window_length;
+} FatVolume;
+
+typedef struct {
+	UINT32 first_cluster;
+	UINT32 size;
+	BOOLEAN directory;
+} FatEntry;
+
+static UINT16 ReadLittleEndian16(const UINT8 *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static UINT32 ReadLittleEndian32(const UINT8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static CHAR16 FoldCase(CHAR16 c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Volume
+#endif
+static EFI_STATUS ReadVolume(FatVolume *volume, UINT64 offset, UINTN length, VOID *buffer) {
+	return uefi_call_wrapper(volume->disk_io->ReadDisk, 5, volume->disk_io, volume->media_id, offset, length,
+		buffer);
+}
+
+static EFI_STATUS MountVolume(EFI_HANDLE device, FatVolume *volume) {
+	EFI_BLOCK_IO *block_io;
+	UINT8 boot_sector[512];
+	EFI_STATUS err;
+
+	SetMem(volume, sizeof(FatVolume), 0);
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &BlockIoProtocol, (VOID **)&block_io);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &DiskIoProtocol, (VOID **)&volume->disk_io);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	volume->media_id = block_io->Media->MediaId;
+	err = ReadVolume(volume, 0, sizeof(boot_sector), boot_sector);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	UINT16 bytes_per_sector = ReadLittleEndian16(boot_sector + 0x0B);
+	UINT8 sectors_per_cluster = boot_sector[0x0D];
+	UINT16 reserved_sectors = ReadLittleEndian16(boot_sector + 0x0E);
+	UINT8 fat_count = boot_sector[0x10];
+	UINT16 root_entries = ReadLittleEndian16(boot_sector + 0x11);
+	UINT32 total_sectors = ReadLittleEndian16(boot_sector + 0x13);
+	UINT32 fat_sectors = ReadLittleEndian16(boot_sector + 0x16);
+	if (total_sectors == 0) {
+		total_sectors = ReadLittleEndian32(boot_sector + 0x20);
+	}
+	if (fat_sectors == 0) {
+		fat_sectors = ReadLittleEndian32(boot_sector + 0x24);
+	}
+
+	if (boot_sector[510] != 0x55 || boot_sector[511] != 0xAA || bytes_per_sector < 512 ||
+		(bytes_per_sector & (bytes_per_sector - 1)) || sectors_per_cluster == 0 ||
+		(sectors_per_cluster & (sectors_per_cluster - 1)) || fat_count == 0 || fat_sectors == 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	UINT32 root_sectors = (root_entries * DIRECTORY_ENTRY_SIZE + bytes_per_sector - 1) / bytes_per_sector;
+	UINT64 data_sector = reserved_sectors + (UINT64)fat_count * fat_sectors + root_sectors;
+	if (data_sector >= total_sectors) {
+		return EFI_VOLUME_CORRUPTED;
+	}
+
+	volume->cluster_size = (UINT32)bytes_per_sector * sectors_per_cluster;
+	volume->cluster_count = (UINT32)((total_sectors - data_sector) / sectors_per_cluster);
+	volume->fat_offset = (UINT64)reserved_sectors * bytes_per_sector;
+	volume->root_offset = (reserved_sectors + (UINT64)fat_count * fat_sectors) * bytes_per_sector;
+	volume->root_size = root_sectors * bytes_per_sector;
+	volume->data_offset = data_sector * bytes_per_sector;
+
+	// The number of clusters is what decides the FAT type. FAT12 is only used on volumes far
+	// too small to hold an ISO.
+	if (volume->cluster_count < 4085) {
+		return EFI_UNSUPPORTED;
+	}
+	volume->fat32 = volume->cluster_count >= 65525;
+	if (volume->fat32) {
+		volume->root_cluster = ReadLittleEndian32(boot_sector + 0x2C);
+	}
+
+	volume->window = AllocatePool(FAT_WINDOW_SIZE);
+	return volume->window ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static VOID UnmountVolume(FatVolume *volume) {
+	if (volume->window) {
+		FreePool(volume->window);
+	}
+	volume->window = NULL;
+}
+
+/*
+ * Looks up the cluster after the given one. Returns FALSE at the end of the chain, and
+ * sets status if the chain is broken.
+ */
+static BOOLEAN NextCluster(FatVolume *volume, UINT32 cluster, UINT32 *next, EFI_STATUS *status) {
+	UINTN entry_size = volume->fat32 ? 4 : 2;
+	UINT64 offset = volume->fat_offset + (UINT64)cluster * entry_size;
+
+	if (!volume->window_length || offset < volume->window_start ||
+		offset + entry_size > volume->window_start + volume->window_length) {
+		volume->window_start = offset & ~(UINT64)(FAT_WINDOW_SIZE - 1);
+		volume->window_length = FAT_WINDOW_SIZE;
+		*status = ReadVolume(volume, volume->window_start, FAT_WINDOW_SIZE, volume->window);
+		if (EFI_ERROR(*status)) {
+			volume->window_length = 0;
+			return FALSE;
+		}
+	}
+
+	const UINT8 *entry = volume->window + (offset - volume->window_start);
+	UINT32 value = volume->fat32 ? ReadLittleEndian32(entry) & 0x0FFFFFFF : ReadLittleEndian16(entry);
+	UINT32 end_of_chain = volume->fat32 ? 0x0FFFFFF8 : 0xFFF8;
+
+	if (value >= end_of_chain) {
+		return FALSE;
+	}
+
+	if (value < 2 || value >= volume->cluster_count + 2) {
+		*status = EFI_VOLUME_CORRUPTED;
+		return FALSE;
+	}
+
+	*next = value;
+	return TRUE;
+}
+
+/*
+ * Follows a cluster chain, merging runs of consecutive clusters into extents. Stops once
+ * limit bytes are covered, or at the end of the chain if limit is zero; a chain that ends
+ * before limit is an error. The caller frees the extents.
+ */
+static EFI_STATUS ChainExtents(FatVolume *volume, UINT32 cluster, UINT64 limit, AioExtent **extents,
+	UINTN *count, UINT64 *length) {
+	UINTN capacity = 16, used = 0;
+	UINT64 covered = 0;
+	UINT32 steps = 0;
+	EFI_STATUS status = EFI_SUCCESS;
+
+	*extents = NULL;
+	*count = 0;
+	if (cluster < 2 || cluster >= volume->cluster_count + 2) {
+		return limit ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+	}
+
+	AioExtent *list = AllocatePool(sizeof(AioExtent) * capacity);
+	if (!list) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (;;) {
+		UINT64 disk_offset = volume->data_offset + (UINT64)(cluster - 2) * volume->cluster_size;
+		if (used > 0 && list[used - 1].disk_offset + list[used - 1].length == disk_offset) {
+			list[used - 1].length += volume->cluster_size;
+		} else {
+			if (used == capacity) {
+				// Past this point, the file is too scattered to be worth reading this way.
+				if (capacity * 2 > MAX_EXTENTS) {
+					status = EFI_UNSUPPORTED;
+					break;
+				}
+				AioExtent *bigger = AllocatePool(sizeof(AioExtent) * capacity * 2);
+				if (!bigger) {
+					status = EFI_OUT_OF_RESOURCES;
+					break;
+				}
+				CopyMem(bigger, list, sizeof(AioExtent) * used);
+				FreePool(list);
+				list = bigger;
+				capacity *= 2;
+			}
+			list[used].offset = covered;
+			list[used].disk_offset = disk_offset;
+			list[used].length = volume->cluster_size;
+			used++;
+		}
+		covered += volume->cluster_size;
+
+		if ((limit && covered >= limit) || ++steps > volume->cluster_count) {
+			break;
+		}
+
+		if (!NextCluster(volume, cluster, &cluster, &status)) {
+			if (!EFI_ERROR(status) && limit) {
+				status = EFI_VOLUME_CORRUPTED;
+			}
+			break;
+		}
+	}
+
+	if (!EFI_ERROR(status) && steps > volume->cluster_count) {
+		// The chain loops.
+		status = EFI_VOLUME_CORRUPTED;
+	}
+
+	if (EFI_ERROR(status)) {
+		FreePool(list);
+		return status;
+	}
+
+	// The last cluster is usually only partly used.
+	if (limit && covered > limit) {
+		list[used - 1].length -= covered - limit;
+		covered = limit;
+	}
+
+	*extents = list;
+	*count = used;
+	*length = covered;
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Directories
+#endif
+static EFI_STATUS ReadDirectory(FatVolume *volume, UINT32 cluster, UINT8 **contents, UINTN *size) {
+	AioExtent *extents;
+	UINTN count, i;
+	UINT64 length;
+	EFI_STATUS err;
+
+	// FAT12 and FAT16 keep the root directory in a fixed place.
+	if (cluster == 0 && !volume->fat32) {
+		*contents = AllocatePool(volume->root_size);
+		if (!*contents) {
+			return EFI_OUT_OF_RESOURCES;
+		}
+		*size = volume->root_size;
+		err = ReadVolume(volume, volume->root_offset, volume->root_size, *contents);
+		if (EFI_ERROR(err)) {
+			FreePool(*contents);
+		}
+		return err;
+	}
+
+	err = ChainExtents(volume, cluster ? cluster : volume->root_cluster, 0, &extents, &count, &length);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+	if (count == 0 || length > MAX_DIRECTORY_SIZE) {
+		if (extents) {
+			FreePool(extents);
+		}
+		return EFI_VOLUME_CORRUPTED;
+	}
+
+	*contents = AllocatePool(length);
+	if (!*contents) {
+		FreePool(extents);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (i = 0; i < count && !EFI_ERROR(err); i++) {
+		err = ReadVolume(volume, extents[i].disk_offset, extents[i].length, *contents + extents[i].offset);
+	}
+
+	FreePool(extents);
+	if (EFI_ERROR(err)) {
+		FreePool(*contents);
+		return err;
+	}
+
+	*size = length;
+	return EFI_SUCCESS;
+}
+
+static UINT8 ShortNameChecksum(const UINT8 *name) {
+	UINT8 sum = 0;
+	UINTN i;
+	for (i = 0; i < 11; i++) {
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	}
+	return sum;
+}
+
+static BOOLEAN NameMatches(const CHAR16 *name, UINTN name_length, const CHAR16 *wanted, UINTN wanted_length) {
+	UINTN i;
+
+	if (name_length != wanted_length) {
+		return FALSE;
+	}
+
+	for (i = 0; i < name_length; i++) {
+		if (FoldCase(name[i]) != FoldCase(wanted[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Looks for a name in a directory, by its long name or its 8.3 name, ignoring case as the
+ * FAT driver does.
+ */
+static EFI_STATUS FindInDirectory(FatVolume *volume, UINT32 cluster, const CHAR16 *wanted, UINTN wanted_length,
+	FatEntry *found) {
+	CHAR16 long_name[MAX_NAME_LENGTH + LFN_CHARS_PER_ENTRY + 1];
+	UINT8 long_name_checksum = 0, long_name_parts = 0, long_name_expected = 0;
+	UINT8 *contents;
+	UINTN size, position;
+	EFI_STATUS err;
+
+	err = ReadDirectory(volume, cluster, &contents, &size);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	err = EFI_NOT_FOUND;
+	for (position = 0; position + DIRECTORY_ENTRY_SIZE <= size; position += DIRECTORY_ENTRY_SIZE) {
+		const UINT8 *entry = contents + position;
+		UINT8 attributes = entry[11];
+
+		if (entry[0] == 0x00) {
+			break;
+		}
+		if (entry[0] == 0xE5) {
+			long_name_expected = 0;
+			continue;
+		}
+
+		if (attributes == ATTRIBUTE_LONG_NAME) {
+			// Long names are stored backwards, up to 13 characters per entry.
+			UINT8 sequence = entry[0] & 0x1F;
+			if (entry[0] & 0x40) {
+				long_name_expected = sequence;
+				long_name_parts = 0;
+				long_name_checksum = entry[13];
+				SetMem(long_name, sizeof(long_name), 0);
+			}
+			if (sequence == 0 || sequence > long_name_expected || entry[13] != long_name_checksum ||
+				sequence * LFN_CHARS_PER_ENTRY > MAX_NAME_LENGTH + LFN_CHARS_PER_ENTRY) {
+				long_name_expected = 0;
+				continue;
+			}
+
+			static const UINT8 offsets[LFN_CHARS_PER_ENTRY] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+			UINTN i;
+			for (i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+				long_name[(sequence - 1) * LFN_CHARS_PER_ENTRY + i] = ReadLittleEndian16(entry + offsets[i]);
+			}
+			long_name_parts++;
+			continue;
+		}
+
+		BOOLEAN has_long_name = long_name_expected && long_name_parts == long_name_expected &&
+			long_name_checksum == ShortNameChecksum(entry);
+		long_name_expected = 0;
+		if (attributes & ATTRIBUTE_VOLUME_LABEL) {
+			continue;
+		}
+
+		CHAR16 name[13];
+		UINTN length = 0, long_length = 0, i;
+		for (i = 0; i < 8 && entry[i] != ' '; i++) {
+			name[length++] = (i == 0 && entry[0] == 0x05) ? 0xE5 : entry[i];
+		}
+		if (entry[8] != ' ') {
+			name[length++] = '.';
+			for (i = 8; i < 11 && entry[i] != ' '; i++) {
+				name[length++] = entry[i];
+			}
+		}
+		if (has_long_name) {
+			while (long_length < MAX_NAME_LENGTH && long_name[long_length] && long_name[long_length] != 0xFFFF) {
+				long_length++;
+			}
+		}
+
+		if ((has_long_name && NameMatches(long_name, long_length, wanted, wanted_length)) ||
+			NameMatches(name, length, wanted, wanted_length)) {
+			found->first_cluster = ((UINT32)ReadLittleEndian16(entry + 20) << 16) | ReadLittleEndian16(entry + 26);
+			if (!volume->fat32) {
+				found->first_cluster &= 0xFFFF;
+			}
+			found->size = ReadLittleEndian32(entry + 28);
+			found->directory = (attributes & ATTRIBUTE_DIRECTORY) != 0;
+			err = EFI_SUCCESS;
+			break;
+		}
+	}
+
+	FreePool(contents);
+	return err;
+}
+
+/*
+ * Finds the directory entry of the file at path, which is relative to the volume's root.
+ */
+static EFI_STATUS FindFile(FatVolume *volume, const CHAR16 *path, FatEntry *found) {
+	FatEntry entry = {0, 0, TRUE};
+	EFI_STATUS err;
+
+	while (*path) {
+		while (*path == '\\' || *path == '/') {
+			path++;
+		}
+		const CHAR16 *end = path;
+		while (*end && *end != '\\' && *end != '/') {
+			end++;
+		}
+		if (end == path) {
+			break;
+		}
+
+		if (!entry.directory) {
+			return EFI_NOT_FOUND;
+		}
+
+		err = FindInDirectory(volume, entry.first_cluster, path, end - path, &entry);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+		path = end;
+	}
+
+	if (entry.directory || entry.size == 0) {
+		return EFI_NOT_FOUND;
+	}
+
+	*found = entry;
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Extent cache
+#endif
+static BOOLEAN LoadCachedExtents(CHAR16 *cache_path, EFI_FILE_INFO *info, UINT32 first_cluster, AioExtent **extents,
+	UINTN *count) {
+	CHAR8 *contents = NULL;
+
+	UINTN size = FileExists(root_dir, cache_path) ? FileRead(root_dir, cache_path, &contents) : 0;
+	if (size < sizeof(ExtentCacheHeader)) {
+		if (contents) {
+			FreePool(contents);
+		}
+		return FALSE;
+	}
+
+	ExtentCacheHeader *header = (ExtentCacheHeader *)contents;
+	BOOLEAN valid = header->magic == EXTENT_CACHE_MAGIC && header->count > 0 && header->count <= MAX_EXTENTS &&
+		size == sizeof(ExtentCacheHeader) + header->count * sizeof(AioExtent) && header->size == info->FileSize &&
+		CompareMem(&header->modification_time, &info->ModificationTime, sizeof(EFI_TIME)) == 0 &&
+		header->first_cluster == first_cluster;
+
+	if (valid) {
+		*count = header->count;
+		*extents = AllocatePool(sizeof(AioExtent) * header->count);
+		valid = *extents != NULL;
+		if (valid) {
+			CopyMem(*extents, contents + sizeof(ExtentCacheHeader), sizeof(AioExtent) * header->count);
+		}
+	}
+
+	FreePool(contents);
+	return valid;
+}
+
+static VOID StoreCachedExtents(CHAR16 *cache_path, EFI_FILE_INFO *info, UINT32 first_cluster, AioExtent *extents,
+	UINTN count) {
+	EFI_FILE_HANDLE file;
+	EFI_STATUS err;
+
+	// Start from an empty file, so a shorter list doesn't leave the end of an older one.
+	err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &file, cache_path,
+		EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0);
+	if (!EFI_ERROR(err)) {
+		uefi_call_wrapper(file->Delete, 1, file);
+	}
+
+	err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &file, cache_path,
+		EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE|EFI_FILE_MODE_CREATE, 0);
+	if (EFI_ERROR(err)) {
+		return;
+	}
+
+	ExtentCacheHeader header;
+	SetMem(&header, sizeof(header), 0);
+	header.magic = EXTENT_CACHE_MAGIC;
+	header.count = count;
+	header.size = info->FileSize;
+	CopyMem(&header.modification_time, &info->ModificationTime, sizeof(EFI_TIME));
+	header.first_cluster = first_cluster;
+
+	UINTN length = sizeof(header);
+	err = uefi_call_wrapper(file->Write, 3, file, &length, &header);
+	if (!EFI_ERROR(err)) {
+		length = sizeof(AioExtent) * count;
+		err = uefi_call_wrapper(file->Write, 3, file, &length, extents);
+	}
+
+	if (EFI_ERROR(err)) {
+		uefi_call_wrapper(file->Delete, 1, file);
+	} else {
+		uefi_call_wrapper(file->Close, 1, file);
+	}
+}
+
+#ifdef __APPLE__
+	#pragma mark - Opening files
+#endif
+static BOOLEAN SectorMatches(AioQueue *queue, EFI_FILE_HANDLE file, UINT64 offset, UINT64 size) {
+	UINT8 expected[512], actual[512];
+	UINTN length = size - offset < sizeof(expected) ? (UINTN)(size - offset) : sizeof(expected);
+	UINTN read = length, transferred;
+
+	if (EFI_ERROR(uefi_call_wrapper(file->SetPosition, 2, file, offset)) ||
+		EFI_ERROR(uefi_call_wrapper(file->Read, 3, file, &read, expected)) || read != length) {
+		return FALSE;
+	}
+
+	return !EFI_ERROR(AioRead(queue, offset, length, actual, &transferred)) && transferred == length &&
+		CompareMem(expected, actual, length) == 0;
+}
+
+/*
+ * Checks a map against the file system by reading the start of the file both ways, and a
+ * sector from the middle of each extent (or of a spread of them, for a badly fragmented
+ * file). The start of an ISO is often zeroes, which on its own proves little.
+ */
+static BOOLEAN MapLooksRight(AioQueue *queue, EFI_FILE_HANDLE file, AioExtent *extents, UINTN count, UINT64 size) {
+	UINTN checks = count < MAX_SPOT_CHECKS ? count : MAX_SPOT_CHECKS;
+	UINTN i;
+
+	if (!SectorMatches(queue, file, 0, size)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < checks; i++) {
+		AioExtent *extent = &extents[i * count / checks];
+		UINT64 offset = (extent->offset + extent->length / 2) & ~(UINT64)511;
+		if (offset < size && !SectorMatches(queue, file, offset, size)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Opens a queue for reading the file at path, which must be open as file. If the file can
+ * be found on our FAT drive, the queue reads it straight from the device; otherwise it goes
+ * through the file system as usual. Unless quiet is set, a fragmented file is pointed out,
+ * as it can't be read as quickly.
+ */
+AioQueue* FatOpenDirect(EFI_FILE_HANDLE file, CHAR16 *path, UINTN depth, BOOLEAN quiet) {
+	AioExtent *extents = NULL;
+	UINTN count = 0, attempt;
+	UINT64 size = 0;
+	AioQueue *queue = NULL;
+	FatVolume volume;
+	FatEntry entry;
+
+	if (!useDirectIO) {
+		return AioOpenFile(file, depth);
+	}
+
+	EFI_FILE_INFO *info = LibFileInfo(file);
+	CHAR16 *cache_path = PoolPrint(L"%s%s", path, EXTENT_CACHE_SUFFIX);
+	EFI_STATUS err = MountVolume(this_image->DeviceHandle, &volume);
+	if (!info || !cache_path || EFI_ERROR(err)) {
+		goto out;
+	}
+
+	// The directory entry is always read, so that a saved map of an older copy of the file
+	// isn't taken for this one.
+	err = FindFile(&volume, path, &entry);
+	if (EFI_ERROR(err) || entry.size != info->FileSize) {
+		goto out;
+	}
+
+	// A saved map is checked before it's trusted; if it's wrong, it's worked out again.
+	for (attempt = 0; attempt < 2 && !queue; attempt++) {
+		BOOLEAN cached = attempt == 0 && LoadCachedExtents(cache_path, info, entry.first_cluster, &extents, &count);
+		if (cached) {
+			size = info->FileSize;
+		} else if (EFI_ERROR(ChainExtents(&volume, entry.first_cluster, entry.size, &extents, &count, &size)) ||
+			size != info->FileSize) {
+			break;
+		}
+
+		queue = AioOpenMapped(this_image->DeviceHandle, extents, count, size, depth);
+		if (queue && !MapLooksRight(queue, file, extents, count, size)) {
+			AioClose(queue);
+			queue = NULL;
+		}
+
+		if (queue && !cached) {
+			StoreCachedExtents(cache_path, info, entry.first_cluster, extents, count);
+			if (count > 1 && !quiet) {
+				Print(L"Warning: %s is in %d pieces on the drive, which makes it slower to read.\n", path, count);
+				Print(L"Copying it onto the drive again may help.\n");
+			}
+		}
+
+		if (extents) {
+			FreePool(extents);
+		}
+		extents = NULL;
+	}
+
+out:
+	UnmountVolume(&volume);
+	if (info) {
+		FreePool(info);
+	}
+	if (cache_path) {
+		FreePool(cache_path);
+	}
+	return queue ? queue : AioOpenFile(file, depth);
+}
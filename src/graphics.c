@@ -0,0 +1,698 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A text console drawn with the Graphics Output Protocol. Simple Text Output on a lot of
+ * firmware (Apple's in particular) redraws glyph by glyph straight into video memory, which
+ * makes every menu redraw visibly slow. We install our own Simple Text Output protocol in
+ * its place so the rest of Enterprise keeps using Print() as before; text goes into a cell
+ * grid, and only cells that differ from what is already on screen are rasterized into an
+ * off-screen buffer and pushed to the display with Blt.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "graphics.h"
+#include "hardware.h"
+#include "protocols.h"
+#include "timing.h"
+#include "utils.h"
+
+#define FIRST_GLYPH 0x20
+#define LAST_GLYPH 0x7e
+#define GLYPH_COUNT (LAST_GLYPH - FIRST_GLYPH + 1)
+#define CURSOR_BIT 0x80
+#define INVALID_CELL 0xffff
+
+// Flush at most this long (in 100ns units) after the first change to the screen, so that a
+// whole menu's worth of Print() calls ends up in a single frame.
+#define FLUSH_DELAY (5 * 10000)
+
+typedef struct {
+	CHAR16 character;
+	UINT16 attribute;
+} GraphicsCell;
+
+static struct {
+	SIMPLE_TEXT_OUTPUT_INTERFACE protocol;
+	SIMPLE_TEXT_OUTPUT_MODE mode;
+	SIMPLE_TEXT_OUTPUT_INTERFACE *original;
+	EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;
+	EFI_EVENT flush_timer;
+	BOOLEAN flush_pending;
+	UINTN width, height;
+	UINTN origin_x, origin_y;
+	UINTN glyph_width, glyph_height;
+	UINTN columns, rows;
+	UINT8 *atlas;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *back_buffer;
+	GraphicsCell *cells;
+	GraphicsCell *presented;
+	UINTN pending_scroll;
+} gfx;
+
+UINT64 graphicsLastFrameTime = 0, graphicsWorstFrameTime = 0;
+// For the report StoreFrameTiming leaves behind, which outlives the console.
+static UINT64 frame_count = 0, total_frame_time = 0;
+static UINTN frame_width = 0, frame_height = 0;
+
+// The standard EFI text colors, as the EDK2 graphics console draws them.
+static const EFI_GRAPHICS_OUTPUT_BLT_PIXEL palette[16] = {
+	{0x00, 0x00, 0x00, 0}, {0x98, 0x00, 0x00, 0}, {0x00, 0x98, 0x00, 0}, {0x98, 0x98, 0x00, 0},
+	{0x00, 0x00, 0x98, 0}, {0x98, 0x00, 0x98, 0}, {0x00, 0x98, 0x98, 0}, {0x98, 0x98, 0x98, 0},
+	{0x30, 0x30, 0x30, 0}, {0xff, 0x00, 0x00, 0}, {0x00, 0xff, 0x00, 0}, {0xff, 0xff, 0x00, 0},
+	{0x00, 0x00, 0xff, 0}, {0xff, 0x00, 0xff, 0}, {0x00, 0xff, 0xff, 0}, {0xff, 0xff, 0xff, 0}
+};
+
+BOOLEAN GraphicsConsoleActive(VOID) {
+	return ST->ConOut == &gfx.protocol;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Rendering
+#endif
+static VOID RasterizeCell(UINTN column, UINTN row, GraphicsCell *cell) {
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL fg = palette[cell->attribute & 0x0f];
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL bg = palette[(cell->attribute >> 4) & 0x07];
+	CHAR16 c = cell->character;
+	if (c < FIRST_GLYPH || c > LAST_GLYPH) {
+		c = (c == 0 || c == INVALID_CELL) ? ' ' : '?';
+	}
+
+	UINT8 *glyph = gfx.atlas + (c - FIRST_GLYPH) * gfx.glyph_width * gfx.glyph_height;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *pixel = gfx.back_buffer + (gfx.origin_y + row * gfx.glyph_height) * gfx.width +
+		gfx.origin_x + column * gfx.glyph_width;
+	UINTN underline = gfx.glyph_height - gfx.glyph_height / 8;
+
+	for (UINTN y = 0; y < gfx.glyph_height; y++) {
+		BOOLEAN cursor = (cell->attribute & CURSOR_BIT) && y >= underline;
+		for (UINTN x = 0; x < gfx.glyph_width; x++) {
+			pixel[x] = (*glyph++ || cursor) ? fg : bg;
+		}
+		pixel += gfx.width;
+	}
+}
+
+static VOID BltRows(UINTN first_row, UINTN last_row, UINTN first_column, UINTN last_column) {
+	UINTN x = gfx.origin_x + first_column * gfx.glyph_width;
+	UINTN y = gfx.origin_y + first_row * gfx.glyph_height;
+
+	uefi_call_wrapper(gfx.gop->Blt, 10, gfx.gop, gfx.back_buffer, EfiBltBufferToVideo, x, y, x, y,
+		(last_column - first_column + 1) * gfx.glyph_width, (last_row - first_row + 1) * gfx.glyph_height,
+		gfx.width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+}
+
+/*
+ * Moves what is already on screen up instead of redrawing it, then forgets the rows that
+ * scrolled in so that they get drawn fresh.
+ */
+static VOID ApplyPendingScroll(VOID) {
+	UINTN lines = gfx.pending_scroll;
+	UINTN i;
+
+	gfx.pending_scroll = 0;
+	if (lines < gfx.rows) {
+		UINTN text_width = gfx.columns * gfx.glyph_width;
+		UINTN moved_height = (gfx.rows - lines) * gfx.glyph_height;
+		UINTN offset = lines * gfx.glyph_height;
+
+		uefi_call_wrapper(gfx.gop->Blt, 10, gfx.gop, NULL, EfiBltVideoToVideo, gfx.origin_x, gfx.origin_y + offset,
+			gfx.origin_x, gfx.origin_y, text_width, moved_height, 0);
+		for (i = 0; i < moved_height; i++) {
+			UINTN y = gfx.origin_y + i;
+			CopyMem(gfx.back_buffer + y * gfx.width + gfx.origin_x,
+				gfx.back_buffer + (y + offset) * gfx.width + gfx.origin_x,
+				text_width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+		}
+
+		CopyMem(gfx.presented, gfx.presented + lines * gfx.columns,
+			(gfx.rows - lines) * gfx.columns * sizeof(GraphicsCell));
+	} else {
+		lines = gfx.rows;
+	}
+
+	for (i = (gfx.rows - lines) * gfx.columns; i < gfx.rows * gfx.columns; i++) {
+		gfx.presented[i].character = INVALID_CELL;
+	}
+}
+
+static VOID FlushLocked(VOID) {
+	UINT64 start = TimestampNow();
+	UINTN band_start = 0, band_first = 0, band_last = 0;
+	BOOLEAN in_band = FALSE;
+	UINTN cursor_index = gfx.mode.CursorRow * gfx.columns + gfx.mode.CursorColumn;
+
+	gfx.flush_pending = FALSE;
+	if (gfx.pending_scroll) {
+		ApplyPendingScroll();
+	}
+
+	// Changed rows next to each other are sent as a single rectangle; a menu redraw is
+	// then a handful of Blt calls rather than one per line.
+	for (UINTN row = 0; row < gfx.rows; row++) {
+		UINTN first = gfx.columns, last = 0;
+
+		for (UINTN column = 0; column < gfx.columns; column++) {
+			UINTN i = row * gfx.columns + column;
+			GraphicsCell wanted = gfx.cells[i];
+			if (gfx.mode.CursorVisible && i == cursor_index) {
+				wanted.attribute |= CURSOR_BIT;
+			}
+
+			if (wanted.character != gfx.presented[i].character || wanted.attribute != gfx.presented[i].attribute) {
+				RasterizeCell(column, row, &wanted);
+				gfx.presented[i] = wanted;
+				if (column < first) {
+					first = column;
+				}
+				last = column;
+			}
+		}
+
+		if (first <= last) {
+			if (!in_band) {
+				in_band = TRUE;
+				band_start = row;
+				band_first = first;
+				band_last = last;
+			} else {
+				if (first < band_first) {
+					band_first = first;
+				}
+				if (last > band_last) {
+					band_last = last;
+				}
+			}
+		} else if (in_band) {
+			BltRows(band_start, row - 1, band_first, band_last);
+			in_band = FALSE;
+		}
+	}
+
+	if (in_band) {
+		BltRows(band_start, gfx.rows - 1, band_first, band_last);
+	}
+
+	graphicsLastFrameTime = TimestampToMicroseconds(TimestampNow() - start);
+	if (graphicsLastFrameTime > graphicsWorstFrameTime) {
+		graphicsWorstFrameTime = graphicsLastFrameTime;
+	}
+	if (frame_count == 0) {
+		TimingMark((const CHAR8 *)"frame");
+	}
+	frame_count++;
+	total_frame_time += graphicsLastFrameTime;
+}
+
+VOID GraphicsConsoleFlush(VOID) {
+	if (!GraphicsConsoleActive()) {
+		return;
+	}
+
+	EFI_TPL old = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+	FlushLocked();
+	uefi_call_wrapper(BS->RestoreTPL, 1, old);
+}
+
+static EFI_CALLBACK VOID FlushTimerNotify(EFI_EVENT event, VOID *context) {
+	(VOID)event;
+	(VOID)context;
+	if (gfx.flush_pending) {
+		FlushLocked();
+	}
+}
+
+static VOID ScheduleFlush(VOID) {
+	if (!gfx.flush_pending) {
+		gfx.flush_pending = TRUE;
+		uefi_call_wrapper(BS->SetTimer, 3, gfx.flush_timer, TimerRelative, FLUSH_DELAY);
+	}
+}
+
+#ifdef __APPLE__
+	#pragma mark - Simple Text Output protocol
+#endif
+static VOID ClearCells(UINTN start, UINTN count) {
+	for (UINTN i = start; i < start + count; i++) {
+		gfx.cells[i].character = ' ';
+		gfx.cells[i].attribute = gfx.mode.Attribute & 0x7f;
+	}
+}
+
+static VOID NewLine(VOID) {
+	gfx.mode.CursorRow++;
+	if ((UINTN)gfx.mode.CursorRow >= gfx.rows) {
+		CopyMem(gfx.cells, gfx.cells + gfx.columns, (gfx.rows - 1) * gfx.columns * sizeof(GraphicsCell));
+		ClearCells((gfx.rows - 1) * gfx.columns, gfx.columns);
+		gfx.mode.CursorRow = gfx.rows - 1;
+		gfx.pending_scroll++;
+	}
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsOutputString(SIMPLE_TEXT_OUTPUT_INTERFACE *this, CHAR16 *string) {
+	(VOID)this;
+	EFI_TPL old = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+
+	for (; *string; string++) {
+		switch (*string) {
+			case CHAR_CARRIAGE_RETURN:
+				gfx.mode.CursorColumn = 0;
+				break;
+			case CHAR_LINEFEED:
+				NewLine();
+				break;
+			case CHAR_BACKSPACE:
+				if (gfx.mode.CursorColumn > 0) {
+					gfx.mode.CursorColumn--;
+				}
+				break;
+			default:
+				if ((UINTN)gfx.mode.CursorColumn >= gfx.columns) {
+					gfx.mode.CursorColumn = 0;
+					NewLine();
+				}
+
+				GraphicsCell *cell = &gfx.cells[gfx.mode.CursorRow * gfx.columns + gfx.mode.CursorColumn];
+				cell->character = *string;
+				cell->attribute = gfx.mode.Attribute & 0x7f;
+				gfx.mode.CursorColumn++;
+				break;
+		}
+	}
+
+	ScheduleFlush();
+	uefi_call_wrapper(BS->RestoreTPL, 1, old);
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsTestString(SIMPLE_TEXT_OUTPUT_INTERFACE *this, CHAR16 *string) {
+	(VOID)this;
+	(VOID)string;
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsQueryMode(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN mode,
+	UINTN *columns, UINTN *rows) {
+	(VOID)this;
+	if (mode != 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	*columns = gfx.columns;
+	*rows = gfx.rows;
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsClearScreen(SIMPLE_TEXT_OUTPUT_INTERFACE *this) {
+	(VOID)this;
+	EFI_TPL old = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+	ClearCells(0, gfx.columns * gfx.rows);
+	gfx.mode.CursorColumn = 0;
+	gfx.mode.CursorRow = 0;
+	ScheduleFlush();
+	uefi_call_wrapper(BS->RestoreTPL, 1, old);
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsSetMode(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN mode) {
+	if (mode != 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	return GraphicsClearScreen(this);
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsReset(SIMPLE_TEXT_OUTPUT_INTERFACE *this, BOOLEAN extended) {
+	(VOID)extended;
+	gfx.mode.Attribute = EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK;
+	return GraphicsClearScreen(this);
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsSetAttribute(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN attribute) {
+	(VOID)this;
+	gfx.mode.Attribute = (INT32)(attribute & 0x7f);
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsSetCursorPosition(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN column, UINTN row) {
+	(VOID)this;
+	if (column >= gfx.columns || row >= gfx.rows) {
+		return EFI_UNSUPPORTED;
+	}
+
+	EFI_TPL old = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+	gfx.mode.CursorColumn = (INT32)column;
+	gfx.mode.CursorRow = (INT32)row;
+	if (gfx.mode.CursorVisible) {
+		ScheduleFlush();
+	}
+	uefi_call_wrapper(BS->RestoreTPL, 1, old);
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS GraphicsEnableCursor(SIMPLE_TEXT_OUTPUT_INTERFACE *this, BOOLEAN visible) {
+	(VOID)this;
+	EFI_TPL old = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+	gfx.mode.CursorVisible = visible;
+	ScheduleFlush();
+	uefi_call_wrapper(BS->RestoreTPL, 1, old);
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Setup
+#endif
+static BOOLEAN PixelLit(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *pixel) {
+	return pixel->Red + pixel->Green + pixel->Blue > 3 * 0x80;
+}
+
+/*
+ * Works out where the firmware draws its text and how big each character cell is, by
+ * printing the same character in two neighbouring cells and looking at where it shows up.
+ */
+static BOOLEAN MeasureFirmwareText(UINTN columns, UINTN rows, UINTN *cell_width, UINTN *cell_height,
+	UINTN *origin_x, UINTN *origin_y) {
+	SIMPLE_TEXT_OUTPUT_INTERFACE *out = gfx.original;
+	UINTN min_y = gfx.height, max_y = 0;
+	UINTN x, y;
+
+	uefi_call_wrapper(out->SetAttribute, 2, out, EFI_WHITE|EFI_BACKGROUND_BLACK);
+	uefi_call_wrapper(out->ClearScreen, 1, out);
+	uefi_call_wrapper(out->SetCursorPosition, 3, out, 0, 0);
+	uefi_call_wrapper(out->OutputString, 2, out, L"#");
+	uefi_call_wrapper(out->SetCursorPosition, 3, out, 1, 1);
+	uefi_call_wrapper(out->OutputString, 2, out, L"#");
+
+	if (EFI_ERROR(uefi_call_wrapper(gfx.gop->Blt, 10, gfx.gop, gfx.back_buffer, EfiBltVideoToBltBuffer,
+		0, 0, 0, 0, gfx.width, gfx.height, 0))) {
+		return FALSE;
+	}
+
+	for (y = 0; y < gfx.height; y++) {
+		for (x = 0; x < gfx.width; x++) {
+			if (PixelLit(&gfx.back_buffer[y * gfx.width + x])) {
+				if (y < min_y) {
+					min_y = y;
+				}
+				if (y > max_y) {
+					max_y = y;
+				}
+			}
+		}
+	}
+
+	if (min_y >= max_y) {
+		return FALSE;
+	}
+
+	// The two copies of the glyph do not overlap vertically, so splitting the lit area
+	// halfway down separates them.
+	UINTN split = (min_y + max_y) / 2;
+	UINTN first_x = gfx.width, first_y = gfx.height, second_x = gfx.width, second_y = gfx.height;
+	for (y = min_y; y <= max_y; y++) {
+		for (x = 0; x < gfx.width; x++) {
+			if (PixelLit(&gfx.back_buffer[y * gfx.width + x])) {
+				if (y <= split) {
+					if (x < first_x) {
+						first_x = x;
+					}
+					if (y < first_y) {
+						first_y = y;
+					}
+				} else {
+					if (x < second_x) {
+						second_x = x;
+					}
+					if (y < second_y) {
+						second_y = y;
+					}
+				}
+			}
+		}
+	}
+
+	if (second_x <= first_x || second_y <= first_y) {
+		return FALSE;
+	}
+
+	*cell_width = second_x - first_x;
+	*cell_height = second_y - first_y;
+	if (*cell_width < 4 || *cell_width > 64 || *cell_height < 8 || *cell_height > 64 ||
+		columns * *cell_width > gfx.width || rows * *cell_height > gfx.height) {
+		return FALSE;
+	}
+
+	// Firmware consoles centre the text area on the screen; fall back to the top left
+	// corner if the glyph doesn't fall in the first cell of a centred one.
+	*origin_x = (gfx.width - columns * *cell_width) / 2;
+	*origin_y = (gfx.height - rows * *cell_height) / 2;
+	if (first_x < *origin_x || first_x >= *origin_x + *cell_width ||
+		first_y < *origin_y || first_y >= *origin_y + *cell_height) {
+		*origin_x = 0;
+		*origin_y = 0;
+		if (first_x >= *cell_width || first_y >= *cell_height) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Builds the glyph atlas by having the firmware draw every printable character once and
+ * reading the result back, scaled up so text stays legible on very large screens. No font
+ * has to be shipped, and the menu looks the same as the firmware's own text.
+ */
+static BOOLEAN BuildGlyphAtlas(VOID) {
+	SIMPLE_TEXT_OUTPUT_INTERFACE *out = gfx.original;
+	UINTN columns, rows, cell_width, cell_height, origin_x, origin_y;
+	CHAR16 line[GLYPH_COUNT + 1];
+	UINTN i;
+
+	if (EFI_ERROR(uefi_call_wrapper(out->QueryMode, 4, out, out->Mode->Mode, &columns, &rows)) || columns < 2) {
+		return FALSE;
+	}
+
+	if (!MeasureFirmwareText(columns, rows, &cell_width, &cell_height, &origin_x, &origin_y)) {
+		return FALSE;
+	}
+
+	// Print all of the glyphs, never touching the last column so nothing scrolls.
+	UINTN per_row = columns - 1;
+	UINTN glyph_rows = (GLYPH_COUNT + per_row - 1) / per_row;
+	if (glyph_rows > rows) {
+		return FALSE;
+	}
+
+	uefi_call_wrapper(out->ClearScreen, 1, out);
+	for (i = 0; i < glyph_rows; i++) {
+		UINTN j, count = 0;
+		for (j = i * per_row; j < GLYPH_COUNT && j < (i + 1) * per_row; j++) {
+			line[count++] = (CHAR16)(FIRST_GLYPH + j);
+		}
+		line[count] = '\0';
+
+		uefi_call_wrapper(out->SetCursorPosition, 3, out, 0, i);
+		uefi_call_wrapper(out->OutputString, 2, out, line);
+	}
+
+	EFI_STATUS err = uefi_call_wrapper(gfx.gop->Blt, 10, gfx.gop, gfx.back_buffer, EfiBltVideoToBltBuffer,
+		origin_x, origin_y, origin_x, origin_y, per_row * cell_width, glyph_rows * cell_height,
+		gfx.width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	uefi_call_wrapper(out->SetAttribute, 2, out, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
+	uefi_call_wrapper(out->ClearScreen, 1, out);
+	if (EFI_ERROR(err)) {
+		return FALSE;
+	}
+
+	// Aim for at least 100 x 25 characters on screen.
+	UINTN scale_x = gfx.width / (cell_width * 100);
+	UINTN scale_y = gfx.height / (cell_height * 25);
+	UINTN scale = scale_x < scale_y ? scale_x : scale_y;
+	if (scale < 1) {
+		scale = 1;
+	}
+
+	gfx.glyph_width = cell_width * scale;
+	gfx.glyph_height = cell_height * scale;
+	gfx.atlas = AllocatePool(GLYPH_COUNT * gfx.glyph_width * gfx.glyph_height);
+	if (!gfx.atlas) {
+		return FALSE;
+	}
+
+	UINT8 *dest = gfx.atlas;
+	for (i = 0; i < GLYPH_COUNT; i++) {
+		UINTN cell_x = origin_x + (i % per_row) * cell_width;
+		UINTN cell_y = origin_y + (i / per_row) * cell_height;
+		for (UINTN y = 0; y < gfx.glyph_height; y++) {
+			for (UINTN x = 0; x < gfx.glyph_width; x++) {
+				*dest++ = PixelLit(&gfx.back_buffer[(cell_y + y / scale) * gfx.width + cell_x + x / scale]);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static VOID FreeGraphicsConsole(VOID) {
+	if (gfx.flush_timer) {
+		uefi_call_wrapper(BS->CloseEvent, 1, gfx.flush_timer);
+	}
+	if (gfx.atlas) {
+		FreePool(gfx.atlas);
+	}
+	if (gfx.back_buffer) {
+		FreePool(gfx.back_buffer);
+	}
+	if (gfx.cells) {
+		FreePool(gfx.cells);
+	}
+	if (gfx.presented) {
+		FreePool(gfx.presented);
+	}
+	ZeroMem(&gfx, sizeof(gfx));
+}
+
+static VOID UpdateSystemTableCrc(VOID) {
+	ST->Hdr.CRC32 = 0;
+	uefi_call_wrapper(BS->CalculateCrc32, 3, ST, ST->Hdr.HeaderSize, &ST->Hdr.CRC32);
+}
+
+/*
+ * Switches the console over to the graphical renderer. If the firmware has no Graphics
+ * Output Protocol, or its text console isn't drawn on it, nothing changes and the caller
+ * carries on in text mode.
+ */
+EFI_STATUS GraphicsConsoleInstall(VOID) {
+	EFI_GUID GraphicsOutputProtocolGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+	EFI_STATUS err;
+
+	if (GraphicsConsoleActive()) {
+		return EFI_SUCCESS;
+	}
+
+	ZeroMem(&gfx, sizeof(gfx));
+	gfx.original = ST->ConOut;
+	err = uefi_call_wrapper(BS->HandleProtocol, 3, ST->ConsoleOutHandle, &GraphicsOutputProtocolGuid, (VOID **)&gfx.gop);
+	if (EFI_ERROR(err)) {
+		err = LibLocateProtocol(&GraphicsOutputProtocolGuid, (VOID **)&gfx.gop);
+		if (EFI_ERROR(err)) {
+			return EFI_UNSUPPORTED;
+		}
+	}
+
+	gfx.width = gfx.gop->Mode->Info->HorizontalResolution;
+	gfx.height = gfx.gop->Mode->Info->VerticalResolution;
+	frame_width = gfx.width;
+	frame_height = gfx.height;
+	gfx.back_buffer = AllocateZeroPool(gfx.width * gfx.height * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	if (!gfx.back_buffer) {
+		FreeGraphicsConsole();
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (!BuildGlyphAtlas()) {
+		FreeGraphicsConsole();
+		return EFI_UNSUPPORTED;
+	}
+
+	// Now that we know our own glyph size, lay out the text area over the whole screen.
+	gfx.columns = gfx.width / gfx.glyph_width;
+	gfx.rows = gfx.height / gfx.glyph_height;
+	gfx.origin_x = (gfx.width - gfx.columns * gfx.glyph_width) / 2;
+	gfx.origin_y = (gfx.height - gfx.rows * gfx.glyph_height) / 2;
+	gfx.cells = AllocatePool(gfx.columns * gfx.rows * sizeof(GraphicsCell));
+	gfx.presented = AllocatePool(gfx.columns * gfx.rows * sizeof(GraphicsCell));
+	err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER|EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+		(EFI_EVENT_NOTIFY)FlushTimerNotify, NULL, &gfx.flush_timer);
+	if (!gfx.cells || !gfx.presented || EFI_ERROR(err)) {
+		FreeGraphicsConsole();
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	// The screen is black after building the atlas, so that is what is presented.
+	SetMem(gfx.back_buffer, gfx.width * gfx.height * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL), 0);
+	for (UINTN i = 0; i < gfx.columns * gfx.rows; i++) {
+		gfx.presented[i].character = ' ';
+		gfx.presented[i].attribute = EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK;
+	}
+
+	gfx.mode.MaxMode = 1;
+	gfx.mode.Mode = 0;
+	gfx.mode.Attribute = EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK;
+	gfx.protocol.Reset = (EFI_TEXT_RESET)GraphicsReset;
+	gfx.protocol.OutputString = (EFI_TEXT_OUTPUT_STRING)GraphicsOutputString;
+	gfx.protocol.TestString = (EFI_TEXT_TEST_STRING)GraphicsTestString;
+	gfx.protocol.QueryMode = (EFI_TEXT_QUERY_MODE)GraphicsQueryMode;
+	gfx.protocol.SetMode = (EFI_TEXT_SET_MODE)GraphicsSetMode;
+	gfx.protocol.SetAttribute = (EFI_TEXT_SET_ATTRIBUTE)GraphicsSetAttribute;
+	gfx.protocol.ClearScreen = (EFI_TEXT_CLEAR_SCREEN)GraphicsClearScreen;
+	gfx.protocol.SetCursorPosition = (EFI_TEXT_SET_CURSOR_POSITION)GraphicsSetCursorPosition;
+	gfx.protocol.EnableCursor = (EFI_TEXT_ENABLE_CURSOR)GraphicsEnableCursor;
+	gfx.protocol.Mode = &gfx.mode;
+	ClearCells(0, gfx.columns * gfx.rows);
+
+	ST->ConOut = &gfx.protocol;
+	UpdateSystemTableCrc();
+
+	numberOfDisplayRows = gfx.columns;
+	numberOfDisplayColumns = gfx.rows;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Hands the console back to the firmware. This has to happen before starting another
+ * image, since GRUB and the kernel expect to talk to the firmware's console directly.
+ */
+VOID GraphicsConsoleUninstall(VOID) {
+	if (!GraphicsConsoleActive()) {
+		return;
+	}
+
+	GraphicsConsoleFlush();
+	uefi_call_wrapper(BS->SetTimer, 3, gfx.flush_timer, TimerCancel, 0);
+	ST->ConOut = gfx.original;
+	UpdateSystemTableCrc();
+	FreeGraphicsConsole();
+}
+
+/*
+ * Leaves how long frames took to draw, in microseconds, and the resolution they were drawn
+ * at in the volatile Enterprise_FrameTiming variable, where the running system can read
+ * them. Nothing is left if the graphical renderer never drew a frame.
+ */
+VOID StoreFrameTiming(VOID) {
+	if (frame_count == 0) {
+		return;
+	}
+
+	CHAR16 *report = PoolPrint(L"width=%d height=%d frames=%ld last=%ld worst=%ld mean=%ld",
+		frame_width, frame_height, frame_count, graphicsLastFrameTime, graphicsWorstFrameTime,
+		total_frame_time / frame_count);
+	if (!report) {
+		return;
+	}
+
+	UINTN length = StrLen(report);
+	CHAR8 *ascii = UTF16toASCII(report, length + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, L"Enterprise_FrameTiming", ascii, length + 1, FALSE);
+		FreePool(ascii);
+	}
+	FreePool(report);
+}
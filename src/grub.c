@@ -0,0 +1,91 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "grub.h"
+#include "lz4.h"
+
+#ifdef EMBEDDED_GRUB
+// Defined in payload.S: GRUB, compressed into an LZ4 frame at build time.
+extern const UINT8 grub_payload[];
+extern const UINT8 grub_payload_end[];
+#endif
+
+BOOLEAN GrubIsEmbedded(VOID) {
+#ifdef EMBEDDED_GRUB
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+#ifdef EMBEDDED_GRUB
+static EFI_STATUS DecompressGrub(UINT8 **image, UINTN *size) {
+	UINTN payload_size = grub_payload_end - grub_payload;
+	UINT64 content_size;
+
+	EFI_STATUS err = Lz4FrameContentSize(grub_payload, payload_size, &content_size);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	*image = AllocatePool(content_size);
+	if (!*image) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = Lz4DecompressFrame(grub_payload, payload_size, *image, content_size, size);
+	if (EFI_ERROR(err)) {
+		FreePool(*image);
+		*image = NULL;
+	}
+
+	return err;
+}
+#endif
+
+/*
+ * Loads GRUB as a child of our image, either from the copy built into Enterprise or from
+ * the ESP. Either way GRUB is given the device path of \efi\boot\boot.efi on our device,
+ * which is what it derives $cmdpath (and so the location of the ISOs) from.
+ */
+EFI_STATUS LoadGrubImage(EFI_HANDLE parent, EFI_HANDLE device, EFI_HANDLE *image) {
+	EFI_STATUS err;
+
+	EFI_DEVICE_PATH *path = FileDevicePath(device, GRUB_IMAGE_PATH);
+	if (!path) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+#ifdef EMBEDDED_GRUB
+	UINT8 *buffer;
+	UINTN size;
+	err = DecompressGrub(&buffer, &size);
+	if (!EFI_ERROR(err)) {
+		// The firmware makes its own copy of the image, so ours can go straight away.
+		err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent, path, buffer, size, image);
+		FreePool(buffer);
+	}
+#else
+	err = uefi_call_wrapper(BS->LoadImage, 6, TRUE, parent, path, NULL, 0, image);
+#endif
+
+	FreePool(path);
+	return err;
+}
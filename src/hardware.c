@@ -19,6 +19,9 @@
 #include <efilib.h>
 #include "hardware.h"
 #include "utils.h"
+#include "graphics.h"
+#include "sched.h"
+#include "input.h"
 
 #define KEYPRESS(keys, scan, uni) ((((UINT64)keys) << 32) | ((scan) << 16) | (uni))
 #define EFI_SHIFT_STATE_VALID           0x80000000
@@ -110,10 +113,22 @@ EFI_STATUS key_read(UINT64 *key, BOOLEAN wait) {
 
 	/* wait until key is pressed */
 	if (wait) {
+		// Make sure whatever the user is meant to respond to is actually on screen.
+		GraphicsConsoleFlush();
+		InputTraceDrawn();
+	}
+
+	// A test script stands in for the user while it lasts.
+	if (InputScriptActive()) {
+		return InputScriptRead(key, wait);
+	}
+
+	if (wait) {
+		// Background tasks get to run while we wait.
 		if (TextInputEx) {
-			uefi_call_wrapper(BS->WaitForEvent, 3, 1, &TextInputEx->WaitForKeyEx, &index);
+			SchedulerWaitForEvents(1, &TextInputEx->WaitForKeyEx, 0, &index);
 		} else {
-			uefi_call_wrapper(BS->WaitForEvent, 3, 1, &ST->ConIn->WaitForKey, &index);
+			SchedulerWaitForEvents(1, &ST->ConIn->WaitForKey, 0, &index);
 		}
 	}
 
@@ -139,6 +154,7 @@ EFI_STATUS key_read(UINT64 *key, BOOLEAN wait) {
 			keypress = KEYPRESS(shift, keydata.Key.ScanCode, keydata.Key.UnicodeChar);
 			if (keypress > 0) {
 				*key = keypress;
+				InputTraceKey(keypress);
 				return EFI_SUCCESS;
 			}
 		}
@@ -155,6 +171,7 @@ EFI_STATUS key_read(UINT64 *key, BOOLEAN wait) {
 	}
 
 	*key = KEYPRESS(0, k.ScanCode, k.UnicodeChar);
+	InputTraceKey(*key);
 	return EFI_SUCCESS;
 }
 
@@ -224,3 +241,65 @@ EFI_STATUS console_text_mode(VOID) {
 		return err;
 	return uefi_call_wrapper(ConsoleControl->SetMode, 2, ConsoleControl, EfiConsoleControlScreenText);
 }
+
+/*
+ * Finds the enabled application processors in the system and stores up to max of their
+ * processor numbers in list. Returns the number found, or zero if the firmware does not
+ * provide the MP services protocol (in which case all work stays on the boot processor).
+ */
+UINTN GetApplicationProcessors(EFI_MP_SERVICES_PROTOCOL **mp, UINTN *list, UINTN max) {
+	EFI_GUID MpServicesProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+	EFI_PROCESSOR_INFORMATION info;
+	UINTN total, enabled, bsp, i, count = 0;
+	EFI_STATUS err;
+
+	err = LibLocateProtocol(&MpServicesProtocolGuid, (VOID **)mp);
+	if (EFI_ERROR(err)) {
+		*mp = NULL;
+		return 0;
+	}
+
+	err = uefi_call_wrapper((*mp)->GetNumberOfProcessors, 3, *mp, &total, &enabled);
+	if (EFI_ERROR(err) || enabled < 2) {
+		return 0;
+	}
+
+	err = uefi_call_wrapper((*mp)->WhoAmI, 2, *mp, &bsp);
+	if (EFI_ERROR(err)) {
+		return 0;
+	}
+
+	for (i = 0; i < total && count < max; i++) {
+		if (i == bsp) {
+			continue;
+		}
+
+		err = uefi_call_wrapper((*mp)->GetProcessorInfo, 3, *mp, i, &info);
+		if (!EFI_ERROR(err) && (info.StatusFlag & PROCESSOR_ENABLED_BIT) &&
+			(info.StatusFlag & PROCESSOR_HEALTH_STATUS_BIT)) {
+			list[count++] = i;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Has the firmware bind its drivers to every controller again, so that media plugged in
+ * since we started (a second USB stick, say) shows up with a file system. Controllers that
+ * are already connected are left as they are.
+ */
+VOID ConnectAllControllers(VOID) {
+	EFI_HANDLE *handles;
+	UINTN count, i;
+
+	if (EFI_ERROR(LibLocateHandle(AllHandles, NULL, NULL, &count, &handles))) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		uefi_call_wrapper(BS->ConnectController, 4, handles[i], NULL, NULL, TRUE);
+	}
+
+	FreePool(handles);
+}
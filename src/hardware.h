@@ -18,11 +18,14 @@
 #pragma once
 #ifndef _hardware_h
 #define _hardware_h
+#include "protocols.h"
 
 extern UINTN numberOfDisplayRows, numberOfDisplayColumns, highestModeNumberAvailable;
 
 EFI_STATUS key_read(UINT64 *key, BOOLEAN wait);
 EFI_STATUS SetupDisplay(VOID);
 EFI_STATUS console_text_mode(VOID);
+UINTN GetApplicationProcessors(EFI_MP_SERVICES_PROTOCOL **, UINTN *, UINTN);
+VOID ConnectAllControllers(VOID);
 
 #endif
@@ -0,0 +1,333 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Scripted key presses, so that the menus can be driven and timed without anyone at the
+ * keyboard. A script comes from the Enterprise_InputScript variable or, failing that, from
+ * INPUT_SCRIPT_PATH. Each line gives a time and a key:
+ *
+ *   500 2          press "2" half a second after Enterprise started
+ *   +200 down      press the down arrow 200 ms after the previous key
+ *   +0 "quiet"     type a string, one key after another
+ *
+ * Key names are enter, esc, backspace, space, tab, up, down, left, right, home, end, pgup,
+ * pgdn and f1 to f10. Once the script runs out, the keyboard takes over.
+ *
+ * Every key, scripted or not, is traced along with when the menu had finished reacting to
+ * it (the next time it waited for a key) and when GRUB was started. The trace is left in the
+ * Enterprise_InputTrace variable for the test harness to collect.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "input.h"
+#include "main.h"
+#include "config.h"
+#include "utils.h"
+#include "timing.h"
+#include "sched.h"
+
+#define MAX_SCRIPT_EVENTS 1024
+#define MAX_TRACE_EVENTS 256
+
+typedef struct {
+	UINT64 time;    // microseconds since the script was loaded
+	UINT64 key;
+} ScriptEvent;
+
+typedef struct {
+	UINT64 key;
+	UINT64 pressed; // microseconds since the script was loaded
+	UINT64 drawn;   // zero until the menu was ready for the next key
+} TraceEvent;
+
+static ScriptEvent *script = NULL;
+static UINTN script_length = 0, script_position = 0;
+
+static UINT64 start_time = 0;
+static TraceEvent trace[MAX_TRACE_EVENTS];
+static UINTN trace_length = 0;
+static UINT64 start_image_time = 0;
+
+static UINT64 Now(VOID) {
+	return TimestampToMicroseconds(TimestampNow() - start_time);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Parsing scripts
+#endif
+typedef struct {
+	const char *name;
+	UINT16 scan;
+	CHAR16 unicode;
+} KeyName;
+
+static const KeyName key_names[] = {
+	{"enter", SCAN_NULL, CHAR_CARRIAGE_RETURN}, {"esc", SCAN_ESC, 0}, {"backspace", SCAN_NULL, CHAR_BACKSPACE},
+	{"space", SCAN_NULL, ' '}, {"tab", SCAN_NULL, CHAR_TAB}, {"up", SCAN_UP, 0}, {"down", SCAN_DOWN, 0},
+	{"left", SCAN_LEFT, 0}, {"right", SCAN_RIGHT, 0}, {"home", SCAN_HOME, 0}, {"end", SCAN_END, 0},
+	{"pgup", SCAN_PAGE_UP, 0}, {"pgdn", SCAN_PAGE_DOWN, 0}, {"f1", SCAN_F1, 0}, {"f2", SCAN_F2, 0},
+	{"f3", SCAN_F3, 0}, {"f4", SCAN_F4, 0}, {"f5", SCAN_F5, 0}, {"f6", SCAN_F6, 0}, {"f7", SCAN_F7, 0},
+	{"f8", SCAN_F8, 0}, {"f9", SCAN_F9, 0}, {"f10", SCAN_F10, 0},
+};
+
+// The same encoding key_read uses.
+static UINT64 MakeKey(UINT16 scan, CHAR16 unicode) {
+	return ((UINT64)scan << 16) | unicode;
+}
+
+static BOOLEAN AddEvent(UINT64 time, UINT64 key) {
+	if (script_length >= MAX_SCRIPT_EVENTS) {
+		return FALSE;
+	}
+
+	script[script_length].time = time;
+	script[script_length].key = key;
+	script_length++;
+	return TRUE;
+}
+
+static BOOLEAN ParseLine(CHAR8 *when, CHAR8 *line, UINT64 *time) {
+	BOOLEAN relative = (*when == '+');
+	if (relative) {
+		when++;
+	}
+
+	if (*when < '0' || *when > '9') {
+		return FALSE;
+	}
+
+	UINT64 milliseconds = 0;
+	while (*when >= '0' && *when <= '9') {
+		milliseconds = milliseconds * 10 + (*when++ - '0');
+	}
+	if (*when) {
+		return FALSE;
+	}
+	*time = (relative ? *time : 0) + milliseconds * 1000;
+
+	// A quoted string is typed one character at a time.
+	if (*line == '"') {
+		for (line++; *line && *line != '"'; line++) {
+			if (!AddEvent(*time, MakeKey(SCAN_NULL, *line))) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+
+	UINTN i;
+	for (i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+		if (strcmpa((CHAR8 *)key_names[i].name, line) == 0) {
+			return AddEvent(*time, MakeKey(key_names[i].scan, key_names[i].unicode));
+		}
+	}
+
+	// Anything else is a single character.
+	if (line[0] && !line[1]) {
+		return AddEvent(*time, MakeKey(SCAN_NULL, line[0]));
+	}
+
+	return FALSE;
+}
+
+static VOID ParseScript(CHAR8 *text) {
+	UINT64 time = 0;
+	UINTN position = 0;
+	CHAR8 *key, *value;
+
+	// The lines are split like those of the configuration file, which hands us the time as
+	// the key and the rest of the line as the value.
+	while (GetConfigurationKeyAndValue(text, &position, &key, &value)) {
+		if (!ParseLine(key, value, &time)) {
+			Print(L"Ignoring input script line: %a %a\n", key, value);
+		}
+	}
+}
+
+/*
+ * Looks for an input script and, if there is one, reads it in. Also starts the clock that
+ * script times and the trace are relative to.
+ */
+VOID InputScriptLoad(VOID) {
+	CHAR8 *text = NULL;
+	UINTN size = 0;
+
+	start_time = TimestampNow();
+	trace_length = 0;
+	start_image_time = 0;
+
+	if (EFI_ERROR(efi_get_variable(&enterprise_variable_guid, L"Enterprise_InputScript", &text, &size))) {
+		text = NULL;
+		size = FileExists(root_dir, INPUT_SCRIPT_PATH) ? FileRead(root_dir, INPUT_SCRIPT_PATH, &text) : 0;
+	} else {
+		// A script set for one boot shouldn't be played again on the next.
+		efi_delete_variable(&enterprise_variable_guid, L"Enterprise_InputScript");
+
+		// Variables needn't be NUL-terminated.
+		CHAR8 *terminated = AllocatePool(size + 1);
+		if (terminated) {
+			CopyMem(terminated, text, size);
+			terminated[size] = '\0';
+		}
+		FreePool(text);
+		text = terminated;
+	}
+
+	if (!text || size == 0) {
+		if (text) {
+			FreePool(text);
+		}
+		return;
+	}
+
+	script = AllocatePool(sizeof(ScriptEvent) * MAX_SCRIPT_EVENTS);
+	if (script) {
+		script_length = script_position = 0;
+		ParseScript(text);
+	}
+	FreePool(text);
+}
+
+BOOLEAN InputScriptActive(VOID) {
+	return script && script_position < script_length;
+}
+
+/*
+ * Hands out the next scripted key once its time has come, the way key_read would hand out
+ * a real one.
+ */
+EFI_STATUS InputScriptRead(UINT64 *key, BOOLEAN wait) {
+	if (!InputScriptActive()) {
+		return EFI_NOT_READY;
+	}
+
+	ScriptEvent *event = &script[script_position];
+	while (Now() < event->time) {
+		if (!wait) {
+			return EFI_NOT_READY;
+		}
+
+		// Background tasks get to run while we wait, as they would for a real key.
+		if (!SchedulerRunSlice()) {
+			uefi_call_wrapper(BS->Stall, 1, 1000);
+		}
+	}
+
+	*key = event->key;
+	script_position++;
+	if (script_position == script_length) {
+		FreePool(script);
+		script = NULL;
+	}
+
+	InputTraceKey(*key);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Waits up to timeout microseconds for a key, scripted or real, to become available without
+ * reading it. Returns EFI_TIMEOUT if none did.
+ */
+EFI_STATUS InputWaitForKey(UINT64 timeout) {
+	UINTN index;
+
+	if (!InputScriptActive()) {
+		return SchedulerWaitForEvents(1, &ST->ConIn->WaitForKey, timeout, &index);
+	}
+
+	UINT64 deadline = Now() + timeout;
+	while (Now() < script[script_position].time) {
+		if (Now() >= deadline) {
+			return EFI_TIMEOUT;
+		}
+
+		if (!SchedulerRunSlice()) {
+			uefi_call_wrapper(BS->Stall, 1, 1000);
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Tracing
+#endif
+VOID InputTraceKey(UINT64 key) {
+	if (trace_length < MAX_TRACE_EVENTS) {
+		trace[trace_length].key = key;
+		trace[trace_length].pressed = Now();
+		trace[trace_length].drawn = 0;
+		trace_length++;
+	}
+}
+
+// Called when a menu is done drawing and waits for the next key.
+VOID InputTraceDrawn(VOID) {
+	if (trace_length > 0 && trace[trace_length - 1].drawn == 0) {
+		trace[trace_length - 1].drawn = Now();
+	}
+}
+
+VOID InputTraceStartImage(VOID) {
+	start_image_time = Now();
+}
+
+/*
+ * Leaves the trace in a variable, one line per key: the key as key_read returns it, when it
+ * was pressed, and how long the menu took to react (or to start GRUB, for the last key).
+ * Times are in microseconds.
+ */
+VOID StoreInputTrace(VOID) {
+	CHAR16 *report = NULL;
+	UINTN i;
+
+	if (trace_length == 0) {
+		return;
+	}
+
+	for (i = 0; i < trace_length; i++) {
+		TraceEvent *event = &trace[i];
+		CHAR16 *line;
+		if (i == trace_length - 1 && start_image_time) {
+			line = PoolPrint(L"%skey=%lx at=%ld start_image=%ld\n", report ? report : L"", event->key,
+				event->pressed, start_image_time - event->pressed);
+		} else if (event->drawn) {
+			line = PoolPrint(L"%skey=%lx at=%ld drawn=%ld\n", report ? report : L"", event->key,
+				event->pressed, event->drawn - event->pressed);
+		} else {
+			line = PoolPrint(L"%skey=%lx at=%ld\n", report ? report : L"", event->key, event->pressed);
+		}
+
+		if (report) {
+			FreePool(report);
+		}
+		if (!line) {
+			return;
+		}
+		report = line;
+	}
+
+	UINTN length = StrLen(report);
+	CHAR8 *ascii = UTF16toASCII(report, length + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, L"Enterprise_InputTrace", ascii, length + 1, FALSE);
+		FreePool(ascii);
+	}
+	FreePool(report);
+}
@@ -0,0 +1,33 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _input_h
+#define _input_h
+
+#define INPUT_SCRIPT_PATH L"\\efi\\boot\\enterprise-input.txt"
+
+VOID InputScriptLoad(VOID);
+BOOLEAN InputScriptActive(VOID);
+EFI_STATUS InputScriptRead(UINT64 *, BOOLEAN);
+EFI_STATUS InputWaitForKey(UINT64);
+VOID InputTraceKey(UINT64);
+VOID InputTraceDrawn(VOID);
+VOID InputTraceStartImage(VOID);
+VOID StoreInputTrace(VOID);
+
+#endif
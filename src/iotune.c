@@ -0,0 +1,335 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Works out how large our reads should be and how many should be in flight for the drive
+ * we were started from, which can differ by an order of magnitude between USB 2 and fast
+ * USB 3 sticks. This is done by timing reads of the drive at several sizes and depths the
+ * first time we see it; the result is remembered in an NV variable and used from then on
+ * for every queue, unless the configuration file says otherwise.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "iotune.h"
+#include "aio.h"
+#include "main.h"
+#include "config.h"
+#include "timing.h"
+#include "utils.h"
+
+#define SAMPLE_SIZE (4 * 1024 * 1024)
+#define SAMPLE_SIZE_SLOW (2 * 1024 * 1024)
+#define THOROUGH_FACTOR 4
+#define WAKE_UP_SIZE (64 * 1024)
+#define DEFAULT_DEPTH 4
+// A setting has to be this much faster (in percent) to be picked over a smaller one.
+#define SIGNIFICANT_GAIN 5
+
+static const UINT32 chunk_sizes[] = {32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024};
+static const UINT32 depths[] = {1, 2, 4, 8, 16};
+
+typedef struct {
+	EFI_HANDLE device;
+	UINT64 media_size;
+	UINTN sample_size;
+	UINT64 next_offset;
+	VOID *buffer;
+	IoMeasurement *measurements; // optional
+	UINTN count;
+} Calibration;
+
+static IoTuning tuning;
+static BOOLEAN tuned = FALSE;
+static BOOLEAN depth_automatic = FALSE, chunk_size_automatic = FALSE;
+
+#ifdef __APPLE__
+	#pragma mark - The drive
+#endif
+static UINT64 MediaSize(EFI_HANDLE device) {
+	EFI_BLOCK_IO *block_io;
+
+	if (EFI_ERROR(uefi_call_wrapper(BS->HandleProtocol, 3, device, &BlockIoProtocol, (VOID **)&block_io)) ||
+		!block_io->Media->MediaPresent) {
+		return 0;
+	}
+
+	return (block_io->Media->LastBlock + 1) * block_io->Media->BlockSize;
+}
+
+/*
+ * Asks the USB device the drive is on which version of USB it is using. A USB 3 drive in a
+ * USB 2 port says 2.1, so this is a fair guide to the link speed.
+ */
+static UINT16 UsbVersion(EFI_HANDLE device) {
+	EFI_DEVICE_PATH *path = DevicePathFromHandle(device);
+	EFI_USB_IO_PROTOCOL *usb_io;
+	EFI_USB_DEVICE_DESCRIPTOR descriptor;
+	EFI_HANDLE usb_device;
+
+	if (!path || EFI_ERROR(uefi_call_wrapper(BS->LocateDevicePath, 3, &UsbIoProtocol, &path, &usb_device)) ||
+		EFI_ERROR(uefi_call_wrapper(BS->HandleProtocol, 3, usb_device, &UsbIoProtocol, (VOID **)&usb_io)) ||
+		EFI_ERROR(uefi_call_wrapper(usb_io->UsbGetDeviceDescriptor, 2, usb_io, &descriptor))) {
+		return 0;
+	}
+
+	return descriptor.BcdUSB;
+}
+
+// The same port with a different stick in it is a different drive, so the size counts too.
+static CHAR16* TuningVariableName(EFI_HANDLE device, UINT64 media_size) {
+	EFI_DEVICE_PATH *path = DevicePathFromHandle(device);
+	CHAR16 *path_text = path ? DevicePathToStr(path) : NULL;
+	CHAR16 *identity = PoolPrint(L"%s|%lx", path_text ? path_text : L"", media_size);
+	if (path_text) {
+		FreePool(path_text);
+	}
+	if (!identity) {
+		return NULL;
+	}
+
+	CHAR16 *name = PoolPrint(L"Enterprise_IoTune_%08x", Fnv1aHash(identity, StrLen(identity) * sizeof(CHAR16)));
+	FreePool(identity);
+	return name;
+}
+
+static BOOLEAN LoadTuning(CHAR16 *name) {
+	CHAR8 *buffer;
+	UINTN size;
+
+	if (!name || EFI_ERROR(efi_get_variable(&enterprise_variable_guid, name, &buffer, &size))) {
+		return FALSE;
+	}
+
+	BOOLEAN valid = size == sizeof(IoTuning);
+	if (valid) {
+		CopyMem(&tuning, buffer, sizeof(IoTuning));
+		valid = tuning.chunk_size > 0 && tuning.depth > 0 && tuning.depth <= AIO_MAX_DEPTH;
+	}
+
+	FreePool(buffer);
+	return valid;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Measuring
+#endif
+/*
+ * Times one read of the sample size and returns the rate in KB per second. Each read is of
+ * a part of the drive not read before, so that nothing comes out of a cache.
+ */
+static UINT32 Measure(Calibration *calibration, UINT32 chunk_size, UINT32 depth, UINT32 misalignment) {
+	UINTN transferred = 0;
+	UINT32 rate = 0;
+
+	UINT64 offset = calibration->next_offset + misalignment;
+	if (offset + calibration->sample_size > calibration->media_size) {
+		offset = misalignment;
+	}
+	calibration->next_offset = (offset + calibration->sample_size + 4095) & ~(UINT64)4095;
+
+	AioQueue *queue = AioOpenDisk(calibration->device, depth);
+	if (queue) {
+		queue->chunk_size = chunk_size;
+		UINT64 start = TimestampNow();
+		EFI_STATUS err = AioRead(queue, offset, calibration->sample_size, calibration->buffer, &transferred);
+		UINT64 elapsed = TimestampToMicroseconds(TimestampNow() - start);
+		AioClose(queue);
+
+		if (!EFI_ERROR(err) && transferred == calibration->sample_size && elapsed > 0) {
+			rate = (UINT32)((UINT64)transferred * 1000000 / 1024 / elapsed);
+		}
+	}
+
+	if (calibration->measurements && calibration->count < IO_TUNE_MAX_MEASUREMENTS) {
+		IoMeasurement *measurement = &calibration->measurements[calibration->count++];
+		measurement->chunk_size = chunk_size;
+		measurement->depth = depth;
+		measurement->misalignment = misalignment;
+		measurement->rate = rate;
+	}
+
+	return rate;
+}
+
+static BOOLEAN SignificantlyFaster(UINT32 rate, UINT32 best) {
+	return (UINT64)rate * 100 > (UINT64)best * (100 + SIGNIFICANT_GAIN);
+}
+
+/*
+ * Tries each chunk size, then each queue depth with the best chunk size. Where two settings
+ * are about as fast, the smaller one wins, as it ties up less memory. A thorough run reads
+ * more each time, and also tries reads that don't start on a 4 KB boundary.
+ */
+static EFI_STATUS Calibrate(EFI_HANDLE device, BOOLEAN thorough, IoTuning *result, IoMeasurement *measurements,
+	UINTN *count) {
+	Calibration calibration;
+	UINTN i;
+
+	SetMem(&calibration, sizeof(calibration), 0);
+	SetMem(result, sizeof(IoTuning), 0);
+	calibration.device = device;
+	calibration.measurements = measurements;
+	calibration.media_size = MediaSize(device);
+	result->usb_version = UsbVersion(device);
+
+	// Slow drives get smaller samples, so that this doesn't hold up the menu for long.
+	calibration.sample_size = result->usb_version && result->usb_version < 0x0300 ? SAMPLE_SIZE_SLOW : SAMPLE_SIZE;
+	if (thorough) {
+		calibration.sample_size *= THOROUGH_FACTOR;
+	}
+
+	if (calibration.media_size < calibration.sample_size * 2 || !TimestampToMicroseconds(TimestampNow())) {
+		return EFI_UNSUPPORTED;
+	}
+
+	calibration.buffer = AllocatePool(calibration.sample_size);
+	if (!calibration.buffer) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	// Start away from the file system structures, and give a sleeping drive a chance to wake up.
+	calibration.next_offset = (calibration.media_size / 8) & ~(UINT64)4095;
+	AioQueue *queue = AioOpenDisk(device, 1);
+	if (queue) {
+		UINTN transferred;
+		AioRead(queue, calibration.next_offset, WAKE_UP_SIZE, calibration.buffer, &transferred);
+		calibration.next_offset += WAKE_UP_SIZE;
+		AioClose(queue);
+	}
+
+	// Depth only matters where reads can overlap.
+	queue = AioOpenDisk(device, 1);
+	BOOLEAN asynchronous = queue && queue->asynchronous;
+	if (queue) {
+		AioClose(queue);
+	}
+	UINT32 depth = asynchronous ? DEFAULT_DEPTH : 1;
+
+	for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+		UINT32 rate = Measure(&calibration, chunk_sizes[i], depth, 0);
+		if (SignificantlyFaster(rate, result->rate)) {
+			result->chunk_size = chunk_sizes[i];
+			result->rate = rate;
+		}
+	}
+	result->depth = depth;
+
+	if (asynchronous && result->rate) {
+		for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+			if (depths[i] == depth) {
+				continue;
+			}
+			UINT32 rate = Measure(&calibration, result->chunk_size, depths[i], 0);
+			if (depths[i] < result->depth ? rate * (UINT64)100 >= (UINT64)result->rate * (100 - SIGNIFICANT_GAIN) :
+				SignificantlyFaster(rate, result->rate)) {
+				result->depth = depths[i];
+				result->rate = rate > result->rate ? rate : result->rate;
+			}
+		}
+	}
+
+	if (thorough && result->rate) {
+		Measure(&calibration, result->chunk_size, result->depth, 0);
+		Measure(&calibration, result->chunk_size, result->depth, 512);
+	}
+
+	FreePool(calibration.buffer);
+	if (count) {
+		*count = calibration.count;
+	}
+
+	return result->rate ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Settings
+#endif
+static VOID UseTuning(VOID) {
+	if (depth_automatic) {
+		ioQueueDepth = tuning.depth;
+	}
+	if (chunk_size_automatic) {
+		ioChunkSize = tuning.chunk_size;
+	}
+}
+
+/*
+ * Fills in the queue depth and chunk size, where the configuration file left them out,
+ * with what suits the drive we were started from. The drive is measured the first time
+ * it is seen.
+ */
+VOID IoTuneApply(VOID) {
+	depth_automatic = ioQueueDepth == 0;
+	chunk_size_automatic = ioChunkSize == 0;
+	if (!depth_automatic && !chunk_size_automatic) {
+		return;
+	}
+
+	if (!tuned) {
+		EFI_HANDLE device = this_image->DeviceHandle;
+		CHAR16 *name = TuningVariableName(device, MediaSize(device));
+
+		tuned = LoadTuning(name);
+		if (!tuned) {
+			Print(L"Measuring how fast this drive is. This is only done once.\n");
+			tuned = !EFI_ERROR(Calibrate(device, FALSE, &tuning, NULL, NULL));
+			if (tuned && name) {
+				efi_set_variable(&enterprise_variable_guid, name, (CHAR8 *)&tuning, sizeof(IoTuning), TRUE);
+			}
+		}
+		if (name) {
+			FreePool(name);
+		}
+
+		// If the drive can't be measured, the queues use their own defaults.
+		if (!tuned) {
+			SetMem(&tuning, sizeof(IoTuning), 0);
+			tuning.depth = DEFAULT_DEPTH;
+			tuned = TRUE;
+		}
+	}
+
+	UseTuning();
+}
+
+/*
+ * Measures the drive we were started from again, more thoroughly, and keeps the result.
+ * Every read that was timed is returned in measurements, which has room for
+ * IO_TUNE_MAX_MEASUREMENTS of them.
+ */
+EFI_STATUS IoTuneBenchmark(IoMeasurement *measurements, UINTN *count, IoTuning *result) {
+	EFI_HANDLE device = this_image->DeviceHandle;
+
+	*count = 0;
+	EFI_STATUS err = Calibrate(device, TRUE, result, measurements, count);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	CHAR16 *name = TuningVariableName(device, MediaSize(device));
+	if (name) {
+		efi_set_variable(&enterprise_variable_guid, name, (CHAR8 *)result, sizeof(IoTuning), TRUE);
+		FreePool(name);
+	}
+
+	CopyMem(&tuning, result, sizeof(IoTuning));
+	tuned = TRUE;
+	UseTuning();
+	return EFI_SUCCESS;
+}
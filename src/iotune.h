@@ -0,0 +1,44 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _iotune_h
+#define _iotune_h
+
+#define IO_TUNE_MAX_MEASUREMENTS 16
+
+// One timed read of the drive. The rate is in KB per second, or 0 if the read failed.
+typedef struct {
+	UINT32 chunk_size;
+	UINT32 depth;
+	UINT32 misalignment;
+	UINT32 rate;
+} IoMeasurement;
+
+// The best settings found for a drive. This is stored as is in an NV variable.
+typedef struct {
+	UINT32 chunk_size;
+	UINT32 depth;
+	UINT32 rate;
+	UINT16 usb_version; // bcdUSB as the drive reports it, or 0 if it isn't a USB drive
+	UINT16 reserved;
+} IoTuning;
+
+VOID IoTuneApply(VOID);
+EFI_STATUS IoTuneBenchmark(IoMeasurement *, UINTN *, IoTuning *);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Just enough of an ISO 9660 reader to pull small text files out of an ISO: path lookup
+ * through the directory tree, with Rock Ridge names where the ISO has them and plain
+ * ISO 9660 names (compared without case or version suffix) otherwise.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "iso9660.h"
+
+#define PRIMARY_DESCRIPTOR_SECTOR 16
+#define MAX_DESCRIPTORS 32
+#define DESCRIPTOR_PRIMARY 1
+#define DESCRIPTOR_TERMINATOR 255
+#define RECORD_FLAG_DIRECTORY 0x02
+#define MAX_NAME_LENGTH 255
+#define MAX_DIRECTORY_SIZE (4 * 1024 * 1024)
+
+static UINT32 ReadLittleEndian32(const UINT8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static CHAR8 ToLower(CHAR8 c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static EFI_STATUS ReadSectors(Iso9660Volume *volume, UINT32 sector, UINTN length, VOID *buffer) {
+	return volume->read(volume->context, (UINT64)sector * ISO9660_SECTOR_SIZE, length, buffer);
+}
+
+/*
+ * Finds the primary volume descriptor and, through it, the root directory.
+ */
+EFI_STATUS Iso9660Mount(Iso9660Volume *volume, BLOCK_CACHE_FILL read, VOID *context) {
+	UINT8 descriptor[ISO9660_SECTOR_SIZE];
+	UINTN i;
+
+	volume->read = read;
+	volume->context = context;
+
+	for (i = 0; i < MAX_DESCRIPTORS; i++) {
+		EFI_STATUS err = ReadSectors(volume, PRIMARY_DESCRIPTOR_SECTOR + i, sizeof(descriptor), descriptor);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+
+		if (CompareMem(descriptor + 1, "CD001", 5) != 0 || descriptor[0] == DESCRIPTOR_TERMINATOR) {
+			break;
+		}
+
+		if (descriptor[0] == DESCRIPTOR_PRIMARY) {
+			// The root directory's record is embedded in the descriptor at offset 156.
+			volume->root_extent = ReadLittleEndian32(descriptor + 156 + 2);
+			volume->root_size = ReadLittleEndian32(descriptor + 156 + 10);
+			return EFI_SUCCESS;
+		}
+	}
+
+	return EFI_UNSUPPORTED;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Directory lookup
+#endif
+/*
+ * Gets a directory record's name: the Rock Ridge NM entry if there is one, otherwise the
+ * ISO 9660 name without its ";1" version and any trailing dot.
+ */
+static UINTN RecordName(const UINT8 *record, CHAR8 *name) {
+	UINTN record_length = record[0];
+	UINTN identifier_length = record[32];
+
+	// The system use area follows the identifier, padded to an even offset.
+	UINTN offset = 33 + identifier_length + ((identifier_length & 1) ? 0 : 1);
+	UINTN rock_ridge_length = 0;
+	BOOLEAN found = FALSE;
+	while (offset + 4 <= record_length) {
+		const UINT8 *entry = record + offset;
+		UINTN entry_length = entry[2];
+		if (entry_length < 4 || offset + entry_length > record_length) {
+			break;
+		}
+
+		// NM entries may be split; the pieces are concatenated in order.
+		if (entry[0] == 'N' && entry[1] == 'M' && entry_length > 5) {
+			UINTN piece = entry_length - 5;
+			if (rock_ridge_length + piece > MAX_NAME_LENGTH) {
+				break;
+			}
+			CopyMem(name + rock_ridge_length, entry + 5, piece);
+			rock_ridge_length += piece;
+			found = TRUE;
+		}
+
+		offset += entry_length;
+	}
+
+	if (found) {
+		name[rock_ridge_length] = '\0';
+		return rock_ridge_length;
+	}
+
+	UINTN length = 0;
+	while (length < identifier_length && record[33 + length] != ';') {
+		name[length] = record[33 + length];
+		length++;
+	}
+	if (length > 0 && name[length - 1] == '.') {
+		length--;
+	}
+
+	name[length] = '\0';
+	return length;
+}
+
+static BOOLEAN NamesMatch(const CHAR8 *a, UINTN a_length, const CHAR8 *b, UINTN b_length) {
+	UINTN i;
+
+	if (a_length != b_length) {
+		return FALSE;
+	}
+
+	for (i = 0; i < a_length; i++) {
+		if (ToLower(a[i]) != ToLower(b[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static EFI_STATUS FindInDirectory(Iso9660Volume *volume, UINT32 extent, UINT32 size, const CHAR8 *component,
+	UINTN component_length, UINT32 *found_extent, UINT32 *found_size, BOOLEAN *is_directory) {
+	CHAR8 name[MAX_NAME_LENGTH + 1];
+	EFI_STATUS err;
+
+	if (size > MAX_DIRECTORY_SIZE) {
+		return EFI_UNSUPPORTED;
+	}
+
+	UINT8 *directory = AllocatePool(size);
+	if (!directory) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = ReadSectors(volume, extent, size, directory);
+	if (EFI_ERROR(err)) {
+		FreePool(directory);
+		return err;
+	}
+
+	err = EFI_NOT_FOUND;
+	UINTN offset = 0;
+	while (offset < size) {
+		UINT8 *record = directory + offset;
+		UINTN record_length = record[0];
+
+		// Records never straddle a sector, so a zero length means the rest is padding.
+		if (record_length == 0) {
+			offset = (offset / ISO9660_SECTOR_SIZE + 1) * ISO9660_SECTOR_SIZE;
+			continue;
+		}
+		if (record_length < 34 || offset + record_length > size || (UINTN)33 + record[32] > record_length) {
+			break;
+		}
+
+		// Skip the "." and ".." entries.
+		if (!(record[32] == 1 && record[33] <= 1)) {
+			UINTN name_length = RecordName(record, name);
+			if (NamesMatch(name, name_length, component, component_length)) {
+				*found_extent = ReadLittleEndian32(record + 2);
+				*found_size = ReadLittleEndian32(record + 10);
+				*is_directory = (record[25] & RECORD_FLAG_DIRECTORY) != 0;
+				err = EFI_SUCCESS;
+				break;
+			}
+		}
+
+		offset += record_length;
+	}
+
+	FreePool(directory);
+	return err;
+}
+
+/*
+ * Reads a whole file, given by its absolute path, into a NUL-terminated buffer that the
+ * caller frees. Files larger than max_size are refused.
+ */
+EFI_STATUS Iso9660ReadFile(Iso9660Volume *volume, const CHAR8 *path, UINTN max_size, CHAR8 **contents,
+	UINTN *size) {
+	UINT32 extent = volume->root_extent;
+	UINT32 length = volume->root_size;
+	BOOLEAN is_directory = TRUE;
+	EFI_STATUS err;
+
+	while (*path) {
+		while (*path == '/') {
+			path++;
+		}
+		if (!*path) {
+			break;
+		}
+
+		const CHAR8 *end = path;
+		while (*end && *end != '/') {
+			end++;
+		}
+
+		if (!is_directory) {
+			return EFI_NOT_FOUND;
+		}
+
+		err = FindInDirectory(volume, extent, length, path, end - path, &extent, &length, &is_directory);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+
+		path = end;
+	}
+
+	if (is_directory) {
+		return EFI_NOT_FOUND;
+	}
+	if (length > max_size) {
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	// Reads are done in whole sectors.
+	UINTN sectors_length = (length + ISO9660_SECTOR_SIZE - 1) & ~(ISO9660_SECTOR_SIZE - 1);
+	CHAR8 *buffer = AllocatePool(sectors_length + 1);
+	if (!buffer) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = ReadSectors(volume, extent, sectors_length, buffer);
+	if (EFI_ERROR(err)) {
+		FreePool(buffer);
+		return err;
+	}
+
+	buffer[length] = '\0';
+	*contents = buffer;
+	*size = length;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,36 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _iso9660_h
+#define _iso9660_h
+#include <efi.h>
+#include "blockcache.h"
+
+#define ISO9660_SECTOR_SIZE 2048
+
+typedef struct {
+	BLOCK_CACHE_FILL read;
+	VOID *context;
+	UINT32 root_extent;
+	UINT32 root_size;
+} Iso9660Volume;
+
+EFI_STATUS Iso9660Mount(Iso9660Volume *, BLOCK_CACHE_FILL, VOID *);
+EFI_STATUS Iso9660ReadFile(Iso9660Volume *, const CHAR8 *, UINTN, CHAR8 **, UINTN *);
+
+#endif
@@ -0,0 +1,594 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Works out how to boot an ISO from the boot loader configuration inside it, for entries
+ * that don't name a distribution family. GRUB's loopback.cfg is written for exactly this
+ * and is tried first, then the ISO's grub.cfg, then its isolinux or syslinux configuration.
+ * What we find is remembered per ISO, so an unchanged ISO is only ever looked inside once.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "isoconfig.h"
+#include "iso9660.h"
+#include "aio.h"
+#include "packediso.h"
+#include "multipart.h"
+#include "config.h"
+#include "utils.h"
+
+#define MAX_CONFIG_FILE_SIZE (256 * 1024)
+
+typedef struct {
+	const char *path;
+	BOOLEAN isolinux;
+} IsoConfigFile;
+
+static const IsoConfigFile config_files[] = {
+	{"/boot/grub/loopback.cfg", FALSE},
+	{"/boot/grub/grub.cfg", FALSE},
+	{"/EFI/BOOT/grub.cfg", FALSE},
+	{"/isolinux/txt.cfg", TRUE},
+	{"/isolinux/isolinux.cfg", TRUE},
+	{"/boot/isolinux/isolinux.cfg", TRUE},
+	{"/syslinux/syslinux.cfg", TRUE},
+	{"/boot/syslinux/syslinux.cfg", TRUE},
+};
+
+/*
+ * What we remember about an ISO: a hash of its path, and the size and modification time it
+ * had, followed by the kernel, initrd and kernel parameters as consecutive NUL-terminated
+ * strings.
+ */
+typedef struct {
+	UINT64 size;
+	EFI_TIME modification_time;
+	UINT32 path_hash;
+	UINT32 reserved;
+} IsoConfigRecord;
+
+// How many ISOs are remembered, in non-volatile variables. Each ISO has a slot picked by its
+// path, and pushes out whichever ISO had the slot before.
+#define ISO_CONFIG_CACHE_SLOTS 16
+
+#ifdef __APPLE__
+	#pragma mark - String helpers
+#endif
+static BOOLEAN IsSpace(CHAR8 c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static CHAR8 ToLower(CHAR8 c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static BOOLEAN WordIs(const CHAR8 *word, UINTN length, const char *keyword) {
+	UINTN i;
+	for (i = 0; i < length; i++) {
+		if (!keyword[i] || ToLower(word[i]) != keyword[i]) {
+			return FALSE;
+		}
+	}
+
+	return keyword[length] == '\0';
+}
+
+/*
+ * Appends length bytes of text to a pool-allocated string, separated by a space if it
+ * wasn't empty.
+ */
+static BOOLEAN AppendText(CHAR8 **string, const CHAR8 *text, UINTN length) {
+	UINTN old_length = *string ? strlena(*string) : 0;
+	UINTN separator = old_length > 0 ? 1 : 0;
+
+	CHAR8 *joined = AllocatePool(old_length + separator + length + 1);
+	if (!joined) {
+		return FALSE;
+	}
+
+	if (old_length) {
+		CopyMem(joined, *string, old_length);
+	}
+	if (separator) {
+		joined[old_length] = ' ';
+	}
+	CopyMem(joined + old_length + separator, text, length);
+	joined[old_length + separator + length] = '\0';
+
+	if (*string) {
+		FreePool(*string);
+	}
+	*string = joined;
+	return TRUE;
+}
+
+/*
+ * Appends a path from the configuration, dropping a GRUB device prefix such as "($root)"
+ * and resolving isolinux-style relative paths against the configuration's directory.
+ */
+static BOOLEAN AppendPath(CHAR8 **string, const CHAR8 *path, UINTN length, const CHAR8 *directory) {
+	if (length > 0 && path[0] == '(') {
+		while (length > 0 && *path != ')') {
+			path++;
+			length--;
+		}
+		if (length > 0) {
+			path++;
+			length--;
+		}
+	}
+
+	if (length == 0 || path[0] == '/') {
+		return AppendText(string, path, length);
+	}
+
+	UINTN directory_length = strlena((CHAR8 *)directory);
+	CHAR8 *full = AllocatePool(directory_length + 1 + length + 1);
+	if (!full) {
+		return FALSE;
+	}
+
+	CopyMem(full, directory, directory_length);
+	full[directory_length] = '/';
+	CopyMem(full + directory_length + 1, path, length);
+	BOOLEAN result = AppendText(string, full, directory_length + 1 + length);
+	FreePool(full);
+	return result;
+}
+
+static VOID FreeString(CHAR8 **string) {
+	if (*string) {
+		FreePool(*string);
+	}
+	*string = NULL;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Parsing
+#endif
+/*
+ * Finds the first entry in a GRUB or isolinux configuration that has both a Linux kernel
+ * and an initial RAM disk. Returns pool-allocated copies of the kernel path, the initrd
+ * path(s) separated by spaces, and the kernel parameters.
+ */
+BOOLEAN ParseBootConfig(CHAR8 *text, const CHAR8 *directory, BOOLEAN isolinux, CHAR8 **kernel,
+	CHAR8 **initrd, CHAR8 **options) {
+	CHAR8 *line = text;
+	*kernel = *initrd = *options = NULL;
+
+	while (*line) {
+		CHAR8 *end = line;
+		while (*end && *end != '\n') {
+			end++;
+		}
+
+		CHAR8 *word = line;
+		while (word < end && IsSpace(*word)) {
+			word++;
+		}
+		CHAR8 *word_end = word;
+		while (word_end < end && !IsSpace(*word_end)) {
+			word_end++;
+		}
+		UINTN word_length = word_end - word;
+
+		CHAR8 *rest = word_end;
+		while (rest < end && IsSpace(*rest)) {
+			rest++;
+		}
+		CHAR8 *rest_end = end;
+		while (rest_end > rest && IsSpace(rest_end[-1])) {
+			rest_end--;
+		}
+
+		CHAR8 *argument_end = rest;
+		while (argument_end < rest_end && !IsSpace(*argument_end)) {
+			argument_end++;
+		}
+
+		// A new entry starts; forget a half-finished one.
+		if (WordIs(word, word_length, isolinux ? "label" : "menuentry")) {
+			FreeString(kernel);
+			FreeString(initrd);
+			FreeString(options);
+		} else if (!*kernel && (WordIs(word, word_length, "linux") || WordIs(word, word_length, "linuxefi") ||
+			WordIs(word, word_length, "linux16") || (isolinux && WordIs(word, word_length, "kernel")))) {
+			// Skip isolinux modules and anything that needs GRUB variables to find.
+			BOOLEAN usable = argument_end > rest &&
+				(argument_end - rest < 4 || strncmpa(argument_end - 4, (CHAR8 *)".c32", 4) != 0);
+			CHAR8 *p = rest;
+			if (*p == '(') {
+				while (p < argument_end && *p != ')') {
+					p++;
+				}
+			}
+			for (; p < argument_end; p++) {
+				if (*p == '$') {
+					usable = FALSE;
+				}
+			}
+
+			if (usable) {
+				if (!AppendPath(kernel, rest, argument_end - rest, directory)) {
+					break;
+				}
+				CHAR8 *arguments = argument_end;
+				while (arguments < rest_end && IsSpace(*arguments)) {
+					arguments++;
+				}
+				if (!isolinux && arguments < rest_end && !AppendText(options, arguments, rest_end - arguments)) {
+					break;
+				}
+			}
+		} else if (*kernel && (WordIs(word, word_length, "initrd") || WordIs(word, word_length, "initrdefi") ||
+			WordIs(word, word_length, "initrd16"))) {
+			// GRUB lists several initrds separated by spaces, syslinux by commas.
+			CHAR8 *p = rest;
+			while (p < rest_end) {
+				CHAR8 *q = p;
+				while (q < rest_end && !IsSpace(*q) && *q != ',') {
+					q++;
+				}
+				if (q > p && !AppendPath(initrd, p, q - p, directory)) {
+					break;
+				}
+				p = q + 1;
+			}
+		} else if (*kernel && isolinux && WordIs(word, word_length, "append")) {
+			// isolinux passes the initrd as a kernel parameter.
+			CHAR8 *p = rest;
+			while (p < rest_end) {
+				CHAR8 *q = p;
+				while (q < rest_end && !IsSpace(*q)) {
+					q++;
+				}
+				if (q - p > 7 && strncmpa(p, (CHAR8 *)"initrd=", 7) == 0) {
+					CHAR8 *r = p + 7;
+					while (r < q) {
+						CHAR8 *s = r;
+						while (s < q && *s != ',') {
+							s++;
+						}
+						if (s > r) {
+							AppendPath(initrd, r, s - r, directory);
+						}
+						r = s + 1;
+					}
+				} else if (q > p) {
+					AppendText(options, p, q - p);
+				}
+				p = q;
+				while (p < rest_end && IsSpace(*p)) {
+					p++;
+				}
+			}
+		}
+
+		if (*kernel && *initrd) {
+			if (!*options) {
+				AppendText(options, (CHAR8 *)"", 0);
+			}
+			return *options != NULL;
+		}
+
+		line = *end ? end + 1 : end;
+	}
+
+	FreeString(kernel);
+	FreeString(initrd);
+	FreeString(options);
+	return FALSE;
+}
+
+/*
+ * loopback.cfg expects GRUB to have set iso_path to where the ISO is; we know that already,
+ * so it is filled in here.
+ */
+static CHAR8* SubstituteIsoPath(CHAR8 *options, const CHAR8 *iso_path) {
+	static const char *forms[] = {"${iso_path}", "$iso_path"};
+	CHAR8 *result = NULL;
+	CHAR8 *p = options;
+	CHAR8 *copied = options;
+
+	while (*p) {
+		UINTN i, matched = 0;
+		for (i = 0; i < 2 && !matched; i++) {
+			UINTN length = strlena((CHAR8 *)forms[i]);
+			if (strncmpa(p, (CHAR8 *)forms[i], length) == 0) {
+				matched = length;
+			}
+		}
+
+		if (matched) {
+			// Glue the pieces together without the spaces AppendText would add.
+			UINTN before = p - copied;
+			UINTN result_length = result ? strlena(result) : 0;
+			UINTN iso_length = strlena((CHAR8 *)iso_path);
+			CHAR8 *joined = AllocatePool(result_length + before + iso_length + 1);
+			if (!joined) {
+				FreeString(&result);
+				return NULL;
+			}
+			if (result_length) {
+				CopyMem(joined, result, result_length);
+			}
+			CopyMem(joined + result_length, copied, before);
+			CopyMem(joined + result_length + before, iso_path, iso_length);
+			joined[result_length + before + iso_length] = '\0';
+			FreeString(&result);
+			result = joined;
+			p += matched;
+			copied = p;
+		} else {
+			p++;
+		}
+	}
+
+	if (!result) {
+		return options;
+	}
+
+	UINTN result_length = strlena(result);
+	UINTN tail = strlena(copied);
+	CHAR8 *joined = AllocatePool(result_length + tail + 1);
+	if (joined) {
+		CopyMem(joined, result, result_length);
+		CopyMem(joined + result_length, copied, tail + 1);
+	}
+	FreePool(result);
+	if (joined) {
+		FreePool(options);
+	}
+	return joined ? joined : options;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Looking inside the ISO
+#endif
+/*
+ * Reads the boot configuration from an ISO, which is either the given file or, for a split
+ * ISO, multipart.
+ */
+static BOOLEAN ReadConfigFromIso(EFI_FILE_HANDLE file, UINT64 file_size, MultipartIso *multipart, CHAR8 **kernel,
+	CHAR8 **initrd, CHAR8 **options) {
+	Iso9660Volume volume;
+	AioQueue *queue = NULL;
+	PackedIso *packed = NULL;
+	BOOLEAN found = FALSE;
+	EFI_STATUS err;
+	UINTN i;
+
+	if (multipart) {
+		err = Iso9660Mount(&volume, MultipartIsoRead, multipart);
+	} else {
+		queue = AioOpenFile(file, ioQueueDepth);
+		if (!queue) {
+			return FALSE;
+		}
+
+		packed = PackedIsoOpen(queue, file_size);
+		if (packed) {
+			err = Iso9660Mount(&volume, PackedIsoRead, packed);
+		} else {
+			err = Iso9660Mount(&volume, AioReadPadded, queue);
+		}
+	}
+
+	if (!EFI_ERROR(err)) {
+		for (i = 0; i < sizeof(config_files) / sizeof(config_files[0]) && !found; i++) {
+			CHAR8 *contents;
+			UINTN size;
+			if (EFI_ERROR(Iso9660ReadFile(&volume, (const CHAR8 *)config_files[i].path, MAX_CONFIG_FILE_SIZE,
+				&contents, &size))) {
+				continue;
+			}
+
+			// isolinux resolves relative paths against the directory its configuration is in.
+			CHAR8 directory[64];
+			UINTN directory_length = strlena((CHAR8 *)config_files[i].path);
+			CopyMem(directory, config_files[i].path, directory_length + 1);
+			while (directory_length > 0 && directory[directory_length] != '/') {
+				directory_length--;
+			}
+			directory[directory_length] = '\0';
+
+			found = ParseBootConfig(contents, directory, config_files[i].isolinux, kernel, initrd, options);
+			FreePool(contents);
+		}
+	}
+
+	if (packed) {
+		PackedIsoClose(packed);
+	}
+	if (queue) {
+		AioClose(queue);
+	}
+	return found;
+}
+
+static CHAR16* CacheVariableName(UINT32 path_hash) {
+	return PoolPrint(L"Enterprise_IsoConfig_%d", path_hash % ISO_CONFIG_CACHE_SLOTS);
+}
+
+static BOOLEAN LoadCachedConfig(CHAR16 *name, UINT32 path_hash, EFI_FILE_INFO *info, CHAR8 **kernel,
+	CHAR8 **initrd, CHAR8 **options) {
+	CHAR8 *buffer;
+	UINTN size;
+
+	if (EFI_ERROR(efi_get_variable(&enterprise_variable_guid, name, &buffer, &size))) {
+		return FALSE;
+	}
+
+	IsoConfigRecord *record = (IsoConfigRecord *)buffer;
+	BOOLEAN valid = size > sizeof(IsoConfigRecord) && buffer[size - 1] == '\0' &&
+		record->path_hash == path_hash && record->size == info->FileSize &&
+		CompareMem(&record->modification_time, &info->ModificationTime, sizeof(EFI_TIME)) == 0;
+
+	*kernel = *initrd = *options = NULL;
+	if (valid) {
+		CHAR8 *strings[3];
+		CHAR8 *p = buffer + sizeof(IsoConfigRecord);
+		UINTN i;
+		for (i = 0; i < 3; i++) {
+			if (p >= buffer + size) {
+				valid = FALSE;
+				break;
+			}
+			strings[i] = p;
+			p += strlena(p) + 1;
+		}
+
+		valid = valid && AppendText(kernel, strings[0], strlena(strings[0])) &&
+			AppendText(initrd, strings[1], strlena(strings[1])) &&
+			AppendText(options, strings[2], strlena(strings[2]));
+	}
+
+	if (!valid) {
+		FreeString(kernel);
+		FreeString(initrd);
+		FreeString(options);
+	}
+
+	FreePool(buffer);
+	return valid;
+}
+
+static VOID StoreCachedConfig(CHAR16 *name, UINT32 path_hash, EFI_FILE_INFO *info, CHAR8 *kernel, CHAR8 *initrd,
+	CHAR8 *options) {
+	UINTN lengths[3] = {strlena(kernel) + 1, strlena(initrd) + 1, strlena(options) + 1};
+	UINTN size = sizeof(IsoConfigRecord) + lengths[0] + lengths[1] + lengths[2];
+
+	CHAR8 *buffer = AllocatePool(size);
+	if (!buffer) {
+		return;
+	}
+
+	IsoConfigRecord *record = (IsoConfigRecord *)buffer;
+	SetMem(record, sizeof(IsoConfigRecord), 0);
+	record->path_hash = path_hash;
+	record->size = info->FileSize;
+	CopyMem(&record->modification_time, &info->ModificationTime, sizeof(EFI_TIME));
+
+	CHAR8 *p = buffer + sizeof(IsoConfigRecord);
+	CopyMem(p, kernel, lengths[0]);
+	CopyMem(p + lengths[0], initrd, lengths[1]);
+	CopyMem(p + lengths[0] + lengths[1], options, lengths[2]);
+
+	efi_set_variable(&enterprise_variable_guid, name, buffer, size, TRUE);
+	FreePool(buffer);
+}
+
+/*
+ * Fills in the kernel, initrd and kernel parameters of a boot option from the ISO's own
+ * configuration. Kernel parameters from our configuration file come after the ISO's.
+ */
+EFI_STATUS DeriveBootOptionFromIso(LinuxBootOption *option) {
+	CHAR8 *kernel, *initrd, *options;
+	MultipartIso *multipart = NULL;
+	EFI_FILE_HANDLE file;
+	EFI_STATUS err;
+	UINTN count;
+
+	EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+	if (!volume) {
+		return EFI_NOT_FOUND;
+	}
+
+	CHAR16 **paths = IsoPartPathsForBootOption(option, volume, &count);
+	if (!paths) {
+		CloseVolume(volume);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	// A split ISO is remembered by its first part, but with the size of the whole.
+	err = uefi_call_wrapper(volume->Open, 5, volume, &file, paths[0], EFI_FILE_MODE_READ, 0);
+	if (!EFI_ERROR(err) && count > 1) {
+		multipart = MultipartIsoOpen(volume, paths, count, FALSE);
+		if (!multipart) {
+			uefi_call_wrapper(file->Close, 1, file);
+			err = EFI_NOT_FOUND;
+		}
+	}
+	CloseVolume(volume);
+	if (EFI_ERROR(err)) {
+		FreeIsoPartPaths(paths, count);
+		return err;
+	}
+
+	EFI_FILE_INFO *info = LibFileInfo(file);
+	UINT32 path_hash = Fnv1aHash(paths[0], StrLen(paths[0]) * sizeof(CHAR16));
+	CHAR16 *name = CacheVariableName(path_hash);
+	FreeIsoPartPaths(paths, count);
+	if (!info || !name) {
+		err = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	if (multipart) {
+		info->FileSize = multipart->size;
+	}
+
+	if (!LoadCachedConfig(name, path_hash, info, &kernel, &initrd, &options)) {
+		if (!ReadConfigFromIso(file, info->FileSize, multipart, &kernel, &initrd, &options)) {
+			err = EFI_NOT_FOUND;
+			goto out;
+		}
+
+		CHAR8 *iso_path = IsoPathForLinux(option);
+		if (iso_path) {
+			options = SubstituteIsoPath(options, iso_path);
+			FreePool(iso_path);
+		}
+
+		StoreCachedConfig(name, path_hash, info, kernel, initrd, options);
+	}
+
+	if (option->kernel_options) {
+		if (strlena(option->kernel_options) > 0) {
+			AppendText(&options, option->kernel_options, strlena(option->kernel_options));
+		}
+		FreePool(option->kernel_options);
+	}
+	if (option->kernel_path) {
+		FreePool(option->kernel_path);
+	}
+	if (option->initrd_path) {
+		FreePool(option->initrd_path);
+	}
+	option->kernel_path = kernel;
+	option->initrd_path = initrd;
+	option->kernel_options = options;
+	option->derived = TRUE;
+	if (!option->boot_folder) {
+		AppendText(&option->boot_folder, (CHAR8 *)"", 0);
+	}
+	err = EFI_SUCCESS;
+
+out:
+	if (name) {
+		FreePool(name);
+	}
+	if (info) {
+		FreePool(info);
+	}
+	if (multipart) {
+		MultipartIsoClose(multipart);
+	}
+	uefi_call_wrapper(file->Close, 1, file);
+	return err;
+}
@@ -0,0 +1,522 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Presents an ISO file as a read-only optical disc with 2048-byte sectors, so that GRUB and
+ * the firmware's own drivers can read it directly instead of GRUB having to loopback mount
+ * it through its FAT driver. All reads go through a block cache. A packed ISO (see
+ * packediso.c) appears as the ISO it was made from, and a split one (see multipart.c) as the
+ * whole ISO.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "isodev.h"
+#include "config.h"
+#include "protocols.h"
+#include "utils.h"
+#include "fatmap.h"
+#include "timing.h"
+#include "multipart.h"
+
+#define ISO_CACHE_LINE_SIZE (64 * 1024)
+#define ISO_CACHE_LINES 256
+#define ISO_READ_AHEAD_LINES 32
+
+#define ISO_DEVICE_FROM_DISK_IO(p) ((IsoDevice *)((UINT8 *)(p) - (UINTN)&((IsoDevice *)0)->disk_io))
+
+// Vendor GUID for the device paths of our virtual discs.
+static EFI_GUID iso_device_guid = {0x8c9e2a1b, 0x5d47, 0x4f2e, {0xa6, 0x31, 0x0e, 0x7b, 0x94, 0xd2, 0x53, 0xc8}};
+static UINT32 iso_device_count = 0;
+// The discs that are installed, most recent first.
+static IsoDevice *iso_devices = NULL;
+
+#ifdef __APPLE__
+	#pragma mark - Block I/O and Disk I/O protocols
+#endif
+static EFI_STATUS ReadDevice(IsoDevice *device, UINT64 offset, UINTN size, VOID *buffer) {
+	if (!device->memory) {
+		return BlockCacheRead(device->cache, offset, size, buffer);
+	}
+
+	UINT64 end = (device->media.LastBlock + 1) * ISO_SECTOR_SIZE;
+	if (offset > end || size > end - offset) {
+		return EFI_INVALID_PARAMETER;
+	}
+	CopyMem(buffer, device->memory + offset, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceReset(EFI_BLOCK_IO *this, BOOLEAN extended) {
+	(VOID)this;
+	(VOID)extended;
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceReadBlocks(EFI_BLOCK_IO *this, UINT32 media_id, EFI_LBA lba,
+	UINTN size, VOID *buffer) {
+	IsoDevice *device = (IsoDevice *)this;
+
+	if (media_id != device->media.MediaId) {
+		return EFI_MEDIA_CHANGED;
+	}
+
+	if (size % ISO_SECTOR_SIZE != 0) {
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	if (lba > device->media.LastBlock || size / ISO_SECTOR_SIZE > device->media.LastBlock - lba + 1) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (size == 0) {
+		return EFI_SUCCESS;
+	}
+
+	return ReadDevice(device, lba * ISO_SECTOR_SIZE, size, buffer);
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceWriteBlocks(EFI_BLOCK_IO *this, UINT32 media_id, EFI_LBA lba,
+	UINTN size, VOID *buffer) {
+	(VOID)this;
+	(VOID)media_id;
+	(VOID)lba;
+	(VOID)size;
+	(VOID)buffer;
+	return EFI_WRITE_PROTECTED;
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceFlushBlocks(EFI_BLOCK_IO *this) {
+	(VOID)this;
+	return EFI_SUCCESS;
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceReadDisk(EFI_DISK_IO *this, UINT32 media_id, UINT64 offset,
+	UINTN size, VOID *buffer) {
+	IsoDevice *device = ISO_DEVICE_FROM_DISK_IO(this);
+
+	if (media_id != device->media.MediaId) {
+		return EFI_MEDIA_CHANGED;
+	}
+
+	if (size == 0) {
+		return EFI_SUCCESS;
+	}
+
+	return ReadDevice(device, offset, size, buffer);
+}
+
+static EFI_CALLBACK EFI_STATUS IsoDeviceWriteDisk(EFI_DISK_IO *this, UINT32 media_id, UINT64 offset,
+	UINTN size, VOID *buffer) {
+	(VOID)this;
+	(VOID)media_id;
+	(VOID)offset;
+	(VOID)size;
+	(VOID)buffer;
+	return EFI_WRITE_PROTECTED;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Device creation
+#endif
+/*
+ * Builds a device path of our own vendor node plus a controller node numbering the disc,
+ * so that each virtual disc has a unique path that doesn't look like a child of any real
+ * device.
+ */
+static EFI_DEVICE_PATH* CreateDevicePath(UINT32 number) {
+	UINTN size = sizeof(VENDOR_DEVICE_PATH) + sizeof(CONTROLLER_DEVICE_PATH) + END_DEVICE_PATH_LENGTH;
+	UINT8 *path = AllocateZeroPool(size);
+	if (!path) {
+		return NULL;
+	}
+
+	VENDOR_DEVICE_PATH *vendor = (VENDOR_DEVICE_PATH *)path;
+	vendor->Header.Type = HARDWARE_DEVICE_PATH;
+	vendor->Header.SubType = HW_VENDOR_DP;
+	SetDevicePathNodeLength(&vendor->Header, sizeof(VENDOR_DEVICE_PATH));
+	CopyMem(&vendor->Guid, &iso_device_guid, sizeof(EFI_GUID));
+
+	CONTROLLER_DEVICE_PATH *controller = (CONTROLLER_DEVICE_PATH *)(path + sizeof(VENDOR_DEVICE_PATH));
+	controller->Header.Type = HARDWARE_DEVICE_PATH;
+	controller->Header.SubType = HW_CONTROLLER_DP;
+	SetDevicePathNodeLength(&controller->Header, sizeof(CONTROLLER_DEVICE_PATH));
+	controller->Controller = number;
+
+	EFI_DEVICE_PATH *end = (EFI_DEVICE_PATH *)(path + sizeof(VENDOR_DEVICE_PATH) + sizeof(CONTROLLER_DEVICE_PATH));
+	SetDevicePathEndNode(end);
+	return (EFI_DEVICE_PATH *)path;
+}
+
+/*
+ * Installs a virtual disc of the given size, whose contents come from its cache or memory.
+ * The disc is read-only, removable and has 2048-byte sectors, which is what GRUB looks for
+ * when deciding that a device is a CD.
+ */
+static IsoDevice* InstallDevice(IsoDevice *device, UINT64 size) {
+	EFI_STATUS err;
+
+	device->device_path = CreateDevicePath(iso_device_count++);
+	if (!device->device_path) {
+		goto fail;
+	}
+
+	device->media.MediaId = 1;
+	device->media.RemovableMedia = TRUE;
+	device->media.MediaPresent = TRUE;
+	device->media.LogicalPartition = FALSE;
+	device->media.ReadOnly = TRUE;
+	device->media.WriteCaching = FALSE;
+	device->media.BlockSize = ISO_SECTOR_SIZE;
+	device->media.IoAlign = 0;
+	device->media.LastBlock = (size + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE - 1;
+
+	device->block_io.Revision = EFI_BLOCK_IO_INTERFACE_REVISION;
+	device->block_io.Media = &device->media;
+	device->block_io.Reset = (EFI_BLOCK_RESET)IsoDeviceReset;
+	device->block_io.ReadBlocks = (EFI_BLOCK_READ)IsoDeviceReadBlocks;
+	device->block_io.WriteBlocks = (EFI_BLOCK_WRITE)IsoDeviceWriteBlocks;
+	device->block_io.FlushBlocks = (EFI_BLOCK_FLUSH)IsoDeviceFlushBlocks;
+
+	device->disk_io.Revision = EFI_DISK_IO_INTERFACE_REVISION;
+	device->disk_io.ReadDisk = (EFI_DISK_READ)IsoDeviceReadDisk;
+	device->disk_io.WriteDisk = (EFI_DISK_WRITE)IsoDeviceWriteDisk;
+
+	err = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &device->handle, &DevicePathProtocol,
+		EFI_NATIVE_INTERFACE, device->device_path);
+	if (EFI_ERROR(err)) {
+		goto fail;
+	}
+
+	err = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &device->handle, &BlockIoProtocol,
+		EFI_NATIVE_INTERFACE, &device->block_io);
+	if (EFI_ERROR(err)) {
+		uefi_call_wrapper(BS->UninstallProtocolInterface, 3, device->handle, &DevicePathProtocol,
+			device->device_path);
+		goto fail;
+	}
+
+	err = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &device->handle, &DiskIoProtocol,
+		EFI_NATIVE_INTERFACE, &device->disk_io);
+	if (EFI_ERROR(err)) {
+		uefi_call_wrapper(BS->UninstallProtocolInterface, 3, device->handle, &BlockIoProtocol,
+			&device->block_io);
+		uefi_call_wrapper(BS->UninstallProtocolInterface, 3, device->handle, &DevicePathProtocol,
+			device->device_path);
+		goto fail;
+	}
+
+	device->next = iso_devices;
+	iso_devices = device;
+
+	// Let the firmware's partition and file system drivers have a look at it.
+	uefi_call_wrapper(BS->ConnectController, 4, device->handle, NULL, NULL, TRUE);
+	return device;
+
+fail:
+	if (device->cache) {
+		BlockCacheFree(device->cache);
+	}
+	if (device->device_path) {
+		FreePool(device->device_path);
+	}
+	FreePool(device);
+	return NULL;
+}
+
+/*
+ * Creates and installs a virtual disc of the given size whose contents come from read.
+ */
+IsoDevice* IsoDeviceCreate(UINT64 size, BLOCK_CACHE_FILL read, VOID *context) {
+	IsoDevice *device = AllocateZeroPool(sizeof(IsoDevice));
+	if (!device) {
+		return NULL;
+	}
+
+	device->cache = BlockCacheCreate(size, ISO_CACHE_LINE_SIZE, ISO_CACHE_LINES, ISO_READ_AHEAD_LINES, read, context);
+	if (!device->cache) {
+		FreePool(device);
+		return NULL;
+	}
+
+	return InstallDevice(device, size);
+}
+
+/*
+ * Creates and installs a virtual disc of the given size, a whole number of sectors, whose
+ * contents are in memory. The disc keeps the memory.
+ */
+IsoDevice* IsoDeviceCreateInMemory(UINT8 *memory, UINT64 size) {
+	IsoDevice *device = AllocateZeroPool(sizeof(IsoDevice));
+	if (!device) {
+		return NULL;
+	}
+
+	device->memory = memory;
+	return InstallDevice(device, size);
+}
+
+/*
+ * Takes away every virtual disc and whatever it reads from, for when the boot loader we
+ * started has come back. A disc that something still holds on to is left alone.
+ */
+VOID IsoDeviceRemoveAll(VOID) {
+	IsoDevice **link = &iso_devices;
+	EFI_STATUS err;
+
+	while (*link) {
+		IsoDevice *device = *link;
+		uefi_call_wrapper(BS->DisconnectController, 3, device->handle, NULL, NULL);
+		err = uefi_call_wrapper(BS->UninstallMultipleProtocolInterfaces, 8, device->handle,
+			&DiskIoProtocol, &device->disk_io, &BlockIoProtocol, &device->block_io,
+			&DevicePathProtocol, device->device_path, NULL);
+		if (EFI_ERROR(err)) {
+			link = &device->next;
+			continue;
+		}
+
+		*link = device->next;
+		if (device->multipart) {
+			MultipartIsoClose(device->multipart);
+		}
+		if (device->packed) {
+			PackedIsoClose(device->packed);
+		}
+		if (device->queue) {
+			AioClose(device->queue);
+		}
+		if (device->file) {
+			uefi_call_wrapper(device->file->Close, 1, device->file);
+		}
+		if (device->cache) {
+			BlockCacheFree(device->cache);
+		}
+		if (device->memory) {
+			FreePool(device->memory);
+		}
+		FreePool(device->device_path);
+		FreePool(device);
+	}
+}
+
+/*
+ * Where the contents of a virtual disc come from: read and context fill a cache with them,
+ * and they are size bytes long.
+ */
+typedef struct {
+	EFI_FILE_HANDLE file;
+	AioQueue *queue;
+	PackedIso *packed;
+	MultipartIso *multipart;
+	UINT64 size;
+	BLOCK_CACHE_FILL read;
+	VOID *context;
+} IsoSource;
+
+/*
+ * Opens an ISO on the given volume from the files it is in, reading them straight from the
+ * drive if they're on ours, and unpacking it if it's packed.
+ */
+static EFI_STATUS OpenIso(EFI_FILE_HANDLE volume, CHAR16 **paths, UINTN count, IsoSource *source) {
+	EFI_FILE_INFO *info;
+	EFI_STATUS err;
+
+	SetMem(source, sizeof(IsoSource), 0);
+	if (count > 1) {
+		source->multipart = MultipartIsoOpen(volume, paths, count, volume == root_dir);
+		if (!source->multipart) {
+			return EFI_NOT_FOUND;
+		}
+
+		source->size = source->multipart->size;
+		source->read = MultipartIsoRead;
+		source->context = source->multipart;
+		goto out;
+	}
+
+	err = uefi_call_wrapper(volume->Open, 5, volume, &source->file, paths[0], EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	info = LibFileInfo(source->file);
+	if (!info || info->FileSize == 0) {
+		if (info) {
+			FreePool(info);
+		}
+		uefi_call_wrapper(source->file->Close, 1, source->file);
+		return EFI_NOT_FOUND;
+	}
+
+	UINT64 file_size = info->FileSize;
+	FreePool(info);
+
+	// Other volumes are read through whichever driver serves them.
+	source->queue = volume == root_dir ? FatOpenDirect(source->file, paths[0], ioQueueDepth, FALSE) :
+		AioOpenFile(source->file, ioQueueDepth);
+	if (!source->queue) {
+		uefi_call_wrapper(source->file->Close, 1, source->file);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	source->packed = PackedIsoOpen(source->queue, file_size);
+	if (source->packed) {
+		source->size = source->packed->image_size;
+		source->read = PackedIsoRead;
+		source->context = source->packed;
+	} else {
+		source->size = file_size;
+		source->read = AioReadPadded;
+		source->context = source->queue;
+	}
+
+out:
+	source->size = (source->size + ISO_SECTOR_SIZE - 1) & ~(UINT64)(ISO_SECTOR_SIZE - 1);
+	return EFI_SUCCESS;
+}
+
+static VOID CloseIso(IsoSource *source) {
+	if (source->multipart) {
+		MultipartIsoClose(source->multipart);
+	}
+	if (source->packed) {
+		PackedIsoClose(source->packed);
+	}
+	if (source->queue) {
+		AioClose(source->queue);
+	}
+	if (source->file) {
+		uefi_call_wrapper(source->file->Close, 1, source->file);
+	}
+}
+
+/*
+ * Works out the UUID GRUB gives the disc's file system, which it makes from the volume's
+ * modification date in the primary volume descriptor. Leaves uuid empty if there isn't one.
+ */
+static VOID ReadFsUuid(IsoDevice *device, CHAR8 *uuid) {
+	// The separators go after these many digits of the 16 in the date.
+	static const UINTN breaks[] = {4, 6, 8, 10, 12, 14};
+	UINT8 descriptor[ISO_SECTOR_SIZE];
+	UINTN i, j = 0, k = 0;
+
+	uuid[0] = '\0';
+	if (EFI_ERROR(ReadDevice(device, 16 * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE, descriptor)) ||
+		descriptor[0] != 1 || CompareMem(descriptor + 1, "CD001", 5) != 0) {
+		return;
+	}
+
+	CHAR8 *date = (CHAR8 *)descriptor + 830;
+	for (i = 0; i < 16; i++) {
+		if (date[i] < '0' || date[i] > '9') {
+			uuid[0] = '\0';
+			return;
+		}
+		if (k < 6 && i == breaks[k]) {
+			uuid[j++] = '-';
+			k++;
+		}
+		uuid[j++] = date[i];
+	}
+	uuid[j] = '\0';
+}
+
+/*
+ * Exposes the ISO file of the given boot option as a virtual disc, and sets uuid (of
+ * ISO_UUID_SIZE bytes) to what GRUB will know its file system by, or to an empty string.
+ */
+EFI_STATUS IsoDeviceInstallForBootOption(LinuxBootOption *option, CHAR8 *uuid) {
+	IsoSource source;
+	UINTN count;
+
+	EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+	if (!volume) {
+		return EFI_NOT_FOUND;
+	}
+
+	CHAR16 **paths = IsoPartPathsForBootOption(option, volume, &count);
+	if (!paths) {
+		CloseVolume(volume);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	EFI_STATUS err = OpenIso(volume, paths, count, &source);
+	CloseVolume(volume);
+	FreeIsoPartPaths(paths, count);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	IsoDevice *device = IsoDeviceCreate(source.size, source.read, source.context);
+	if (!device) {
+		CloseIso(&source);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	device->file = source.file;
+	device->queue = source.queue;
+	device->packed = source.packed;
+	device->multipart = source.multipart;
+	ReadFsUuid(device, uuid);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Reads up to limit bytes from the start of an ISO on the given volume the way a virtual
+ * disc would, in order through the same cache, and sets rate to how fast that went in KB/s
+ * of the ISO.
+ */
+EFI_STATUS IsoDeviceBenchmark(EFI_FILE_HANDLE volume, CHAR16 *path, UINT64 limit, UINTN *rate) {
+	IsoSource source;
+	UINT64 offset;
+
+	EFI_STATUS err = OpenIso(volume, &path, 1, &source);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	BlockCache *cache = BlockCacheCreate(source.size, ISO_CACHE_LINE_SIZE, ISO_CACHE_LINES, ISO_READ_AHEAD_LINES,
+		source.read, source.context);
+	UINT8 *buffer = AllocatePool(ISO_CACHE_LINE_SIZE);
+	if (!cache || !buffer) {
+		err = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	if (limit > source.size) {
+		limit = source.size;
+	}
+
+	UINT64 start = TimestampNow();
+	for (offset = 0; offset < limit && !EFI_ERROR(err); offset += ISO_CACHE_LINE_SIZE) {
+		UINTN length = limit - offset < ISO_CACHE_LINE_SIZE ? limit - offset : ISO_CACHE_LINE_SIZE;
+		err = BlockCacheRead(cache, offset, length, buffer);
+	}
+	UINT64 elapsed = TimestampToMicroseconds(TimestampNow() - start);
+	*rate = elapsed ? (limit * 1000000 / 1024) / elapsed : 0;
+
+out:
+	if (buffer) {
+		FreePool(buffer);
+	}
+	if (cache) {
+		BlockCacheFree(cache);
+	}
+	CloseIso(&source);
+	return err;
+}
@@ -0,0 +1,52 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _isodev_h
+#define _isodev_h
+#include "main.h"
+#include "blockcache.h"
+#include "aio.h"
+#include "packediso.h"
+#include "multipart.h"
+
+#define ISO_SECTOR_SIZE 2048
+// GRUB's file system UUID for an ISO: "YYYY-MM-DD-HH-MM-SS-hh" and a NUL.
+#define ISO_UUID_SIZE 23
+
+typedef struct IsoDevice {
+	EFI_BLOCK_IO block_io;
+	EFI_BLOCK_IO_MEDIA media;
+	EFI_DISK_IO disk_io;
+	EFI_DEVICE_PATH *device_path;
+	EFI_HANDLE handle;
+	BlockCache *cache;
+	EFI_FILE_HANDLE file;
+	AioQueue *queue;
+	PackedIso *packed;
+	MultipartIso *multipart;
+	UINT8 *memory; // set instead of cache for a disc held in memory
+	struct IsoDevice *next;
+} IsoDevice;
+
+IsoDevice* IsoDeviceCreate(UINT64, BLOCK_CACHE_FILL, VOID *);
+IsoDevice* IsoDeviceCreateInMemory(UINT8 *, UINT64);
+EFI_STATUS IsoDeviceInstallForBootOption(LinuxBootOption *, CHAR8 *);
+VOID IsoDeviceRemoveAll(VOID);
+EFI_STATUS IsoDeviceBenchmark(EFI_FILE_HANDLE, CHAR16 *, UINT64, UINTN *);
+
+#endif
@@ -0,0 +1,397 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A scrolling list of names that can be narrowed by typing. Only the rows that fit on the
+ * screen are ever drawn, so it doesn't matter how many entries there are.
+ *
+ * Matching ignores case. Names that start with the filter are listed before names that
+ * merely contain it. Every name has two 64-bit masks (of the characters and of the pairs of
+ * adjacent characters in it), worked out when the configuration is read; a filter can only
+ * match names whose masks cover its own, which rules out most names without looking at
+ * their text.
+ * Typing narrows the current matches rather than searching every name again.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "listview.h"
+#include "hardware.h"
+#include "graphics.h"
+
+#define MAX_FILTER_LENGTH 63
+#define FOOTER_ROWS 3
+
+#define KEY_SCAN(k) (((k) >> 16) & 0xffff)
+#define KEY_CHAR(k) ((k) & 0xffff)
+
+struct ListView {
+	CHAR8 **names;        // as given, which may include NULLs
+	CHAR8 **folded;       // lowercase copies for matching
+	UINT64 *char_masks;
+	UINT64 *pair_masks;
+	UINTN count;
+
+	UINTN *candidates;    // entries matching the filter, in the order shown
+	UINTN *scratch;
+	UINTN candidate_count;
+	UINTN prefix_count;   // how many of the candidates start with the filter
+
+	CHAR8 filter[MAX_FILTER_LENGTH + 1];
+	UINTN filter_length;
+	UINTN selected;       // position in candidates
+	UINTN top;            // first candidate on screen
+};
+
+static CHAR8 ToLower(CHAR8 c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static UINT64 CharBit(CHAR8 c) {
+	return 1ULL << (c & 63);
+}
+
+static UINT64 PairBit(CHAR8 a, CHAR8 b) {
+	return 1ULL << ((a * 31 + b) & 63);
+}
+
+static VOID ComputeMasks(const CHAR8 *text, UINT64 *chars, UINT64 *pairs) {
+	*chars = *pairs = 0;
+	for (; *text; text++) {
+		*chars |= CharBit(ToLower(text[0]));
+		if (text[1]) {
+			*pairs |= PairBit(ToLower(text[0]), ToLower(text[1]));
+		}
+	}
+}
+
+/*
+ * Works out the masks of a name (which may be NULL) for ListViewCreate, ignoring case.
+ */
+VOID ListViewNameMasks(const CHAR8 *name, UINT64 *chars, UINT64 *pairs) {
+	ComputeMasks(name ? name : (const CHAR8 *)"", chars, pairs);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Filtering
+#endif
+/*
+ * Creates a list of the given names, whose masks come from ListViewNameMasks.
+ */
+ListView* ListViewCreate(CHAR8 **names, const UINT64 *char_masks, const UINT64 *pair_masks, UINTN count) {
+	ListView *view = AllocateZeroPool(sizeof(ListView));
+	if (!view) {
+		return NULL;
+	}
+
+	view->names = names;
+	view->count = count;
+	view->folded = AllocateZeroPool(sizeof(CHAR8 *) * (count + 1));
+	view->char_masks = AllocatePool(sizeof(UINT64) * (count + 1));
+	view->pair_masks = AllocatePool(sizeof(UINT64) * (count + 1));
+	view->candidates = AllocatePool(sizeof(UINTN) * (count + 1));
+	view->scratch = AllocatePool(sizeof(UINTN) * (count + 1));
+	if (!view->folded || !view->char_masks || !view->pair_masks || !view->candidates || !view->scratch) {
+		ListViewFree(view);
+		return NULL;
+	}
+
+	UINTN i;
+	for (i = 0; i < count; i++) {
+		const CHAR8 *name = names[i] ? names[i] : (CHAR8 *)"";
+		UINTN length = strlena((CHAR8 *)name), j;
+
+		view->folded[i] = AllocatePool(length + 1);
+		if (!view->folded[i]) {
+			ListViewFree(view);
+			return NULL;
+		}
+		for (j = 0; j <= length; j++) {
+			view->folded[i][j] = ToLower(name[j]);
+		}
+
+		view->char_masks[i] = char_masks[i];
+		view->pair_masks[i] = pair_masks[i];
+		view->candidates[i] = i;
+	}
+	view->candidate_count = view->prefix_count = count;
+
+	return view;
+}
+
+VOID ListViewFree(ListView *view) {
+	UINTN i;
+
+	if (view->folded) {
+		for (i = 0; i < view->count; i++) {
+			if (view->folded[i]) {
+				FreePool(view->folded[i]);
+			}
+		}
+		FreePool(view->folded);
+	}
+	if (view->char_masks) {
+		FreePool(view->char_masks);
+	}
+	if (view->pair_masks) {
+		FreePool(view->pair_masks);
+	}
+	if (view->candidates) {
+		FreePool(view->candidates);
+	}
+	if (view->scratch) {
+		FreePool(view->scratch);
+	}
+	FreePool(view);
+}
+
+// Tells whether the filter starts the name (2), is elsewhere in it (1) or isn't in it (0).
+static UINTN MatchName(const CHAR8 *name, const CHAR8 *filter, UINTN filter_length) {
+	const CHAR8 *p;
+
+	for (p = name; *p; p++) {
+		if (*p == filter[0] && strncmpa((CHAR8 *)p, (CHAR8 *)filter, filter_length) == 0) {
+			return p == name ? 2 : 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Keeps the entries in from that match the filter: those it starts first, then those that
+ * merely contain it, each in their original order. from is either every entry or the
+ * current candidates, of which the first from_prefix_count started the shorter filter.
+ */
+static VOID Filter(ListView *view, const UINTN *from, UINTN from_count, UINTN from_prefix_count) {
+	UINT64 chars, pairs;
+	UINTN i, prefix_count = 0, other_count = 0, early_others = 0;
+
+	if (view->filter_length == 0) {
+		for (i = 0; i < view->count; i++) {
+			view->candidates[i] = i;
+		}
+		view->candidate_count = view->prefix_count = view->count;
+		return;
+	}
+
+	ComputeMasks(view->filter, &chars, &pairs);
+
+	// Prefix matches go straight into place; the rest wait in scratch. from may be
+	// candidates itself, which is fine as we never write ahead of where we read.
+	for (i = 0; i < from_count; i++) {
+		if (i == from_prefix_count) {
+			early_others = other_count;
+		}
+
+		UINTN entry = from[i];
+		if ((view->char_masks[entry] & chars) != chars || (view->pair_masks[entry] & pairs) != pairs) {
+			continue;
+		}
+
+		UINTN match = MatchName(view->folded[entry], view->filter, view->filter_length);
+		if (match == 2) {
+			view->candidates[prefix_count++] = entry;
+		} else if (match == 1) {
+			view->scratch[other_count++] = entry;
+		}
+	}
+
+	if (from_prefix_count >= from_count) {
+		early_others = other_count;
+	}
+
+	// Names that used to start the filter but now only contain it came out ahead of the
+	// others; merge the two runs back into their original order.
+	UINTN a = 0, b = early_others, out = prefix_count;
+	while (a < early_others || b < other_count) {
+		if (b >= other_count || (a < early_others && view->scratch[a] < view->scratch[b])) {
+			view->candidates[out++] = view->scratch[a++];
+		} else {
+			view->candidates[out++] = view->scratch[b++];
+		}
+	}
+
+	view->candidate_count = out;
+	view->prefix_count = prefix_count;
+}
+
+static VOID AppendToFilter(ListView *view, CHAR8 c) {
+	if (view->filter_length >= MAX_FILTER_LENGTH) {
+		return;
+	}
+
+	view->filter[view->filter_length++] = ToLower(c);
+	view->filter[view->filter_length] = '\0';
+
+	// Anything matching the longer filter also matched the shorter one.
+	Filter(view, view->candidates, view->candidate_count, view->prefix_count);
+	view->selected = view->top = 0;
+}
+
+static VOID SetFilterLength(ListView *view, UINTN length) {
+	view->filter_length = length;
+	view->filter[length] = '\0';
+
+	// Shortening the filter brings back entries we dropped, so start from all of them.
+	UINTN i;
+	for (i = 0; i < view->count; i++) {
+		view->candidates[i] = i;
+	}
+	Filter(view, view->candidates, view->count, view->count);
+	view->selected = view->top = 0;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Drawing
+#endif
+// Writes text at the start of a screen row, padded with spaces to width.
+static VOID DrawRow(UINTN row, UINTN width, CHAR16 *text) {
+	CHAR16 line[256];
+	UINTN i = 0;
+
+	if (width >= sizeof(line) / sizeof(line[0])) {
+		width = sizeof(line) / sizeof(line[0]) - 1;
+	}
+
+	for (; text && text[i] && i < width; i++) {
+		line[i] = text[i];
+	}
+	for (; i < width; i++) {
+		line[i] = ' ';
+	}
+	line[width] = '\0';
+
+	uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, row);
+	uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, line);
+}
+
+static VOID Draw(ListView *view, UINTN first_row, UINTN rows, UINTN columns) {
+	UINTN i;
+	// The last column is left alone, as writing there makes some consoles scroll.
+	UINTN width = columns - 1;
+
+	CHAR16 *line = PoolPrint(L"    Find: %a_", view->filter);
+	DrawRow(first_row, width, line);
+	if (line) {
+		FreePool(line);
+	}
+
+	for (i = 0; i < rows; i++) {
+		UINTN position = view->top + i;
+		line = NULL;
+		if (position < view->candidate_count) {
+			UINTN entry = view->candidates[position];
+			line = PoolPrint(L"    %2d) %a", entry, view->names[entry] ? view->names[entry] : (CHAR8 *)"");
+		}
+
+		if (position == view->selected && position < view->candidate_count) {
+			uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_BLACK|EFI_BACKGROUND_LIGHTGRAY);
+		}
+		DrawRow(first_row + 2 + i, width, line);
+		uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
+		if (line) {
+			FreePool(line);
+		}
+	}
+
+	if (view->candidate_count > 0) {
+		UINTN last = view->top + rows < view->candidate_count ? view->top + rows : view->candidate_count;
+		line = PoolPrint(L"    Showing %d-%d of %d.", view->top + 1, last, view->candidate_count);
+	} else {
+		line = PoolPrint(L"    Nothing matches.");
+	}
+	DrawRow(first_row + 3 + rows, width, line);
+	if (line) {
+		FreePool(line);
+	}
+
+	DrawRow(first_row + 4 + rows, width,
+		L"    Arrow keys and Page Up/Down move, Enter boots, typing narrows the list.");
+	DrawRow(first_row + 5 + rows, width,
+		view->filter_length ? L"    Press Esc to clear the search." : L"    Press Esc to reboot the system.");
+	GraphicsConsoleFlush();
+}
+
+#ifdef __APPLE__
+	#pragma mark - Input
+#endif
+/*
+ * Shows the list from the given screen row down and lets the user pick an entry. Returns
+ * the entry's index, or -1 if the user pressed Escape with nothing typed.
+ */
+INTN ListViewRun(ListView *view, UINTN first_row) {
+	UINTN columns = 80, screen_rows = 25;
+	uefi_call_wrapper(ST->ConOut->QueryMode, 4, ST->ConOut, ST->ConOut->Mode->Mode, &columns, &screen_rows);
+
+	// The search line, a gap, the entries, a gap and the footer.
+	UINTN rows = screen_rows > first_row + 3 + FOOTER_ROWS + 1 ? screen_rows - first_row - 3 - FOOTER_ROWS : 1;
+
+	for (;;) {
+		// Keep the selection on screen.
+		if (view->selected < view->top) {
+			view->top = view->selected;
+		} else if (view->selected >= view->top + rows) {
+			view->top = view->selected - rows + 1;
+		}
+
+		Draw(view, first_row, rows, columns);
+
+		UINT64 key;
+		if (EFI_ERROR(key_read(&key, TRUE))) {
+			continue;
+		}
+
+		UINTN scan = KEY_SCAN(key);
+		CHAR16 c = KEY_CHAR(key);
+		UINTN last = view->candidate_count ? view->candidate_count - 1 : 0;
+
+		if (scan == SCAN_UP) {
+			if (view->selected > 0) {
+				view->selected--;
+			}
+		} else if (scan == SCAN_DOWN) {
+			if (view->selected < last) {
+				view->selected++;
+			}
+		} else if (scan == SCAN_PAGE_UP) {
+			view->selected = view->selected > rows ? view->selected - rows : 0;
+		} else if (scan == SCAN_PAGE_DOWN) {
+			view->selected = view->selected + rows < last ? view->selected + rows : last;
+		} else if (scan == SCAN_HOME) {
+			view->selected = 0;
+		} else if (scan == SCAN_END) {
+			view->selected = last;
+		} else if (scan == SCAN_ESC || c == 27) {
+			if (view->filter_length == 0) {
+				return -1;
+			}
+			SetFilterLength(view, 0);
+		} else if (c == CHAR_CARRIAGE_RETURN || c == CHAR_LINEFEED) {
+			if (view->candidate_count > 0) {
+				return view->candidates[view->selected];
+			}
+		} else if (c == CHAR_BACKSPACE) {
+			if (view->filter_length > 0) {
+				SetFilterLength(view, view->filter_length - 1);
+			}
+		} else if (c >= ' ' && c < 127) {
+			AppendToFilter(view, (CHAR8)c);
+		}
+	}
+}
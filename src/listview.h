@@ -0,0 +1,29 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _listview_h
+#define _listview_h
+
+typedef struct ListView ListView;
+
+VOID ListViewNameMasks(const CHAR8 *, UINT64 *, UINT64 *);
+ListView* ListViewCreate(CHAR8 **, const UINT64 *, const UINT64 *, UINTN);
+VOID ListViewFree(ListView *);
+INTN ListViewRun(ListView *, UINTN);
+
+#endif
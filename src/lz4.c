@@ -0,0 +1,229 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A decompressor for the LZ4 frame format, as written by the lz4 command line tool. Only
+ * what we need is here: the whole frame is decompressed into one buffer, and checksums are
+ * skipped rather than checked. Every copy is bounds checked against both buffers.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_FLAG_VERSION_MASK 0xC0
+#define LZ4_FLAG_VERSION 0x40
+#define LZ4_FLAG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLAG_CONTENT_SIZE 0x08
+#define LZ4_FLAG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLAG_DICTIONARY_ID 0x01
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+
+static UINT32 ReadLittleEndian32(const UINT8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT64 ReadLittleEndian64(const UINT8 *p) {
+	return ReadLittleEndian32(p) | ((UINT64)ReadLittleEndian32(p + 4) << 32);
+}
+
+/*
+ * Reads the 255-continued length extension that follows a 15 in a token nibble.
+ */
+static BOOLEAN ReadLength(const UINT8 **in, const UINT8 *end, UINTN *length) {
+	UINT8 byte;
+	do {
+		if (*in >= end) {
+			return FALSE;
+		}
+		byte = *(*in)++;
+		*length += byte;
+	} while (byte == 255);
+
+	return TRUE;
+}
+
+/*
+ * Decompresses one LZ4 block into output + position. Matches may reach back into anything
+ * already in output, so blocks that depend on the ones before them (the lz4 tool's
+ * default) work as long as they are decompressed into the same buffer in order.
+ */
+EFI_STATUS Lz4DecompressBlock(const UINT8 *input, UINTN input_size, UINT8 *output, UINTN position,
+	UINTN capacity, UINTN *written) {
+	const UINT8 *in = input;
+	const UINT8 *in_end = input + input_size;
+	UINTN out = position;
+
+	while (in < in_end) {
+		UINT8 token = *in++;
+
+		UINTN literals = token >> 4;
+		if (literals == 15 && !ReadLength(&in, in_end, &literals)) {
+			return EFI_COMPROMISED_DATA;
+		}
+		if (literals > (UINTN)(in_end - in) || literals > capacity - out) {
+			return EFI_COMPROMISED_DATA;
+		}
+		CopyMem(output + out, in, literals);
+		in += literals;
+		out += literals;
+
+		// The last sequence of a block has literals only.
+		if (in == in_end) {
+			break;
+		}
+
+		if (in_end - in < 2) {
+			return EFI_COMPROMISED_DATA;
+		}
+		UINTN offset = in[0] | (in[1] << 8);
+		in += 2;
+		if (offset == 0 || offset > out) {
+			return EFI_COMPROMISED_DATA;
+		}
+
+		UINTN match = (token & 0x0F);
+		if (match == 15 && !ReadLength(&in, in_end, &match)) {
+			return EFI_COMPROMISED_DATA;
+		}
+		match += LZ4_MIN_MATCH;
+		if (match > capacity - out) {
+			return EFI_COMPROMISED_DATA;
+		}
+
+		// Matches may overlap their own output, so this has to go a byte at a time.
+		UINT8 *from = output + out - offset;
+		UINT8 *to = output + out;
+		UINTN i;
+		for (i = 0; i < match; i++) {
+			to[i] = from[i];
+		}
+		out += match;
+	}
+
+	*written = out - position;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ParseFrameHeader(const UINT8 *input, UINTN input_size, UINT8 *flags, UINT64 *content_size,
+	UINTN *header_size) {
+	if (input_size < 7 || ReadLittleEndian32(input) != LZ4_FRAME_MAGIC) {
+		return EFI_UNSUPPORTED;
+	}
+
+	*flags = input[4];
+	if ((*flags & LZ4_FLAG_VERSION_MASK) != LZ4_FLAG_VERSION) {
+		return EFI_UNSUPPORTED;
+	}
+
+	UINTN size = 4 + 2 + 1;
+	*content_size = 0;
+	if (*flags & LZ4_FLAG_CONTENT_SIZE) {
+		if (input_size < size + 8) {
+			return EFI_COMPROMISED_DATA;
+		}
+		*content_size = ReadLittleEndian64(input + 6);
+		size += 8;
+	}
+	if (*flags & LZ4_FLAG_DICTIONARY_ID) {
+		size += 4;
+	}
+	if (input_size < size) {
+		return EFI_COMPROMISED_DATA;
+	}
+
+	*header_size = size;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Returns the uncompressed size recorded in a frame's header. Frames written without
+ * --content-size don't have one and give EFI_UNSUPPORTED.
+ */
+EFI_STATUS Lz4FrameContentSize(const UINT8 *input, UINTN input_size, UINT64 *content_size) {
+	UINT8 flags;
+	UINTN header_size;
+
+	EFI_STATUS err = ParseFrameHeader(input, input_size, &flags, content_size, &header_size);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	return (flags & LZ4_FLAG_CONTENT_SIZE) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+EFI_STATUS Lz4DecompressFrame(const UINT8 *input, UINTN input_size, UINT8 *output, UINTN capacity,
+	UINTN *written) {
+	UINT8 flags;
+	UINT64 content_size;
+	UINTN position;
+
+	EFI_STATUS err = ParseFrameHeader(input, input_size, &flags, &content_size, &position);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	UINTN out = 0;
+	for (;;) {
+		if (input_size - position < 4) {
+			return EFI_COMPROMISED_DATA;
+		}
+		UINT32 block_size = ReadLittleEndian32(input + position);
+		position += 4;
+		if (block_size == 0) {
+			break;
+		}
+
+		BOOLEAN uncompressed = (block_size & LZ4_BLOCK_UNCOMPRESSED) != 0;
+		block_size &= ~LZ4_BLOCK_UNCOMPRESSED;
+		if (block_size > input_size - position) {
+			return EFI_COMPROMISED_DATA;
+		}
+
+		if (uncompressed) {
+			if (block_size > capacity - out) {
+				return EFI_BUFFER_TOO_SMALL;
+			}
+			CopyMem(output + out, input + position, block_size);
+			out += block_size;
+		} else {
+			UINTN block_written;
+			err = Lz4DecompressBlock(input + position, block_size, output, out, capacity, &block_written);
+			if (EFI_ERROR(err)) {
+				return err;
+			}
+			out += block_written;
+		}
+
+		position += block_size;
+		if (flags & LZ4_FLAG_BLOCK_CHECKSUM) {
+			position += 4;
+		}
+		if (position > input_size) {
+			return EFI_COMPROMISED_DATA;
+		}
+	}
+
+	if ((flags & LZ4_FLAG_CONTENT_SIZE) && content_size != out) {
+		return EFI_COMPROMISED_DATA;
+	}
+
+	*written = out;
+	return EFI_SUCCESS;
+}
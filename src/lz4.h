@@ -0,0 +1,29 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _lz4_h
+#define _lz4_h
+#include <efi.h>
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+
+EFI_STATUS Lz4DecompressBlock(const UINT8 *, UINTN, UINT8 *, UINTN, UINTN, UINTN *);
+EFI_STATUS Lz4FrameContentSize(const UINT8 *, UINTN, UINT64 *);
+EFI_STATUS Lz4DecompressFrame(const UINT8 *, UINTN, UINT8 *, UINTN, UINTN *);
+
+#endif
@@ -24,6 +24,25 @@
 #include "utils.h"
 #include "hardware.h"
 #include "config.h"
+#include "verify.h"
+#include "isoconfig.h"
+#include "graphics.h"
+#include "timing.h"
+#include "sched.h"
+#include "isodev.h"
+#include "memtrack.h"
+#include "varstore.h"
+#include "grub.h"
+#include "distribution.h"
+#include "input.h"
+#include "bootcount.h"
+#include "uki.h"
+#include "nextboot.h"
+#include "overlay.h"
+#include "drivers.h"
+#include "multipart.h"
+#include "profile.h"
+#include "diskcache.h"
 
 const EFI_GUID enterprise_variable_guid = {0xd92996a6, 0x9f56, 0x48fc, {0xc4, 0x45, 0xb9, 0x0f, 0x23, 0x98, 0x6d, 0x4a}};
 const EFI_GUID grub_variable_guid = {0x8BE4DF61, 0x93CA, 0x11d2, {0xAA, 0x0D, 0x00, 0xE0, 0x98, 0x03, 0x2B,0x8C}};
@@ -36,12 +55,42 @@ EFI_FILE *root_dir;
 EFI_HANDLE global_image = NULL; // EFI_HANDLE is a typedef to a VOID pointer.
 BootableLinuxDistro *distributionListRoot;
 
+// Set when an unattended boot falls back to safe kernel options.
+static BOOLEAN safe_mode_boot = FALSE;
+
+// What picked the entry being booted: "menu", "autoboot" or "next".
+static const CHAR8 *boot_chosen_by = (const CHAR8 *)"menu";
+
+/*
+ * Counts down before autobooting. Returns FALSE if the user pressed a key to get the menu
+ * instead.
+ */
+static BOOLEAN WaitToAutoboot(UINTN seconds) {
+	UINT64 key;
+	
+	for (; seconds > 0; seconds--) {
+		Print(L"\rBooting automatically in %d seconds. Press any key for the menu. ", seconds);
+		GraphicsConsoleFlush();
+		// A test script can press the key as well.
+		if (InputWaitForKey(1000 * 1000) != EFI_TIMEOUT) {
+			key_read(&key, FALSE);
+			Print(L"\n");
+			return FALSE;
+		}
+	}
+	
+	Print(L"\n");
+	return TRUE;
+}
+
 /* entry function for EFI */
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 	/* Setup key GNU-EFI library and its functions first. */
 	EFI_STATUS err; // Define an error variable.
 	
 	InitializeLib(image_handle, systab); // Initialize EFI.
+	TimingInit();
+	VarStoreLoad();
 	console_text_mode(); // Put the console into text mode. If we don't do that, the image of the Apple
 	                     // boot manager will remain on the screen and the user won't see any output
 	                     // from the program.
@@ -55,6 +104,10 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 		return err;
 	}
 	
+	// File system drivers on the stick may open up volumes with ISOs on them, which the
+	// configuration can refer to.
+	LoadDrivers(image_handle, this_image->DeviceHandle);
+	
 	root_dir = LibOpenRoot(this_image->DeviceHandle);
 	if (!root_dir) {
 		DisplayErrorText(L"Unable to open root directory.\n");
@@ -62,6 +115,9 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 		return EFI_LOAD_ERROR;
 	}
 	
+	// Automated test runs drive the menus from a script.
+	InputScriptLoad();
+	
 	/* Setup global variables. */
 	// Set all present options to be false (i.e off).
 	SetMem(preset_options_array, PRESET_OPTIONS_SIZE * sizeof(BOOLEAN), 0);
@@ -76,10 +132,18 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 	BOOLEAN can_continue = TRUE;
 	
 	/* Check to make sure that we have our configuration file and GRUB bootloader. */
-	if (!FileExists(root_dir, L"\\efi\\boot\\enterprise.cfg")) {
+	if (!FileExists(root_dir, CONFIGURATION_FILE_PATH)) {
 		can_continue = FALSE;
 	} else {
-		ReadConfigurationFile(L"\\efi\\boot\\enterprise.cfg");
+		ReadConfigurationFile(CONFIGURATION_FILE_PATH);
+	}
+	TimingMark((const CHAR8 *)"config");
+	
+	// Switch to the faster graphical renderer if the user asked for it. If this doesn't
+	// work on this machine, we just stay in text mode.
+	if (useGraphicalMenu && !EFI_ERROR(GraphicsConsoleInstall())) {
+		uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+		Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 	}
 	
 	// Verify if the configuration file is valid.
@@ -88,8 +152,8 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 		can_continue = FALSE;
 	}
 	
-	// Check for GRUB.
-	if (!FileExists(root_dir, L"\\efi\\boot\\boot.efi")) {
+	// Check for GRUB, unless we carry our own.
+	if (!GrubIsEmbedded() && !FileExists(root_dir, GRUB_IMAGE_PATH)) {
 		DisplayErrorText(L"Error: can't find GRUB bootloader!\n");
 		can_continue = FALSE;
 	}
@@ -105,7 +169,32 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 	
 	// Display the menu where the user can select what they want to do.
 	if (can_continue) {
+		// The running system may have asked for an entry to be booted this once, in which
+		// case nobody is waiting at the keyboard.
+		CHAR16 *next_params;
+		INTN next = NextBootTake(&next_params);
+		if (next >= 0) {
+			boot_chosen_by = (const CHAR8 *)"next";
+			BootLinuxWithOptions(next_params ? next_params : L"", next);
+			if (next_params) {
+				FreePool(next_params);
+			}
+			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+			boot_chosen_by = (const CHAR8 *)"menu";
+			shouldAutoboot = FALSE;
+		}
+		
+		if (shouldAutoboot && autobootTimeout > 0 && !WaitToAutoboot(autobootTimeout)) {
+			shouldAutoboot = FALSE;
+		}
+		
 		if (!shouldAutoboot) {
+			// Check the ISOs while the user reads the menu.
+			if (verifyBeforeBoot) {
+				VerifyInBackground();
+			}
+			
+			TimingMark((const CHAR8 *)"menu");
 			DisplayMenu();
 		} else {
 			// Don't allow the user to overflow.
@@ -115,7 +204,24 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 				return EFI_LOAD_ERROR;
 			}
 
-			BootLinuxWithOptions(L"", autobootIndex);
+			// Entries that keep failing to boot are passed over, so that nobody has to.
+			INTN index = BootCountChooseEntry(autobootIndex, &safe_mode_boot);
+			if (index < 0) {
+				DisplayErrorText(L"Every distribution has failed to boot too many times.\n");
+				uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+				DisplayMenu();
+				return EFI_SUCCESS;
+			}
+			
+			boot_chosen_by = (const CHAR8 *)"autoboot";
+			CHAR16 *params = NULL;
+			if (safe_mode_boot && safeKernelOptions) {
+				params = ASCIItoUTF16(safeKernelOptions, strlena(safeKernelOptions) + 1);
+			}
+			BootLinuxWithOptions(params ? params : L"", index);
+			if (params) {
+				FreePool(params);
+			}
 			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
 		}
 	} else {
@@ -127,10 +233,93 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *systab) {
 	return EFI_SUCCESS;
 }
 
+/*
+ * Brings back what BootLinuxWithOptions stopped before starting GRUB, once we are back at
+ * the menu.
+ */
+static VOID ResumeMenu(VOID) {
+	if (useGraphicalMenu) {
+		GraphicsConsoleInstall();
+	}
+	if (verifyBeforeBoot) {
+		VerifyInBackground();
+	}
+}
+
+/*
+ * Passes everything GRUB needs to boot an entry to it in variables. Fails if the entry can
+ * only be booted from a virtual CD and that couldn't be made.
+ */
+static EFI_STATUS PassBootOptionToGrub(LinuxBootOption *boot_params, CHAR8 *kernel_parameters) {
+	EFI_STATUS err;
+	CHAR8 *kernel_path = boot_params->kernel_path;
+	CHAR8 *initrd_path = boot_params->initrd_path;
+	CHAR8 *boot_folder = boot_params->boot_folder;
+	CHAR8 *iso_path = boot_params->iso_path;
+	
+	efi_set_variable(&grub_variable_guid, L"Enterprise_LinuxBootOptions", kernel_parameters,
+		sizeof(kernel_parameters[0]) * (strlena(kernel_parameters) + 1), FALSE);
+	efi_set_variable(&grub_variable_guid, L"Enterprise_LinuxKernelPath", kernel_path,
+		sizeof(kernel_path[0]) * (strlena(kernel_path) + 1), FALSE);
+	efi_set_variable(&grub_variable_guid, L"Enterprise_InitRDPath", initrd_path,
+		sizeof(initrd_path[0]) * (strlena(initrd_path) + 1), FALSE);
+	efi_set_variable(&grub_variable_guid, L"Enterprise_ISOPath", iso_path,
+		sizeof(iso_path[0]) * (strlena(iso_path) + 1), FALSE);
+	efi_set_variable(&grub_variable_guid, L"Enterprise_BootFolder", boot_folder,
+		sizeof(boot_folder[0]) * (strlena(boot_folder) + 1), FALSE);
+	
+	// Hand GRUB the commands that boot this family, so it gets it right the first time
+	// rather than trying Ubuntu's way and falling back to the ISO's own menu.
+	CHAR8 *boot_script = BootScriptForBootOption(boot_params, kernel_parameters);
+	if (boot_script) {
+		efi_set_variable(&grub_variable_guid, L"Enterprise_BootScript", boot_script,
+			sizeof(boot_script[0]) * (strlena(boot_script) + 1), FALSE);
+		FreePool(boot_script);
+	} else {
+		efi_delete_variable(&grub_variable_guid, L"Enterprise_BootScript");
+	}
+	
+	// Expose the ISO as a CD drive so that GRUB reads it through our cache rather than
+	// through its own FAT driver. GRUB falls back to loopback if this isn't set, which it
+	// can't do for a packed or split ISO or one on another volume, so those always get one.
+	CHAR8 *virtual_cd = (CHAR8 *)"0";
+	CHAR8 virtual_cd_uuid[ISO_UUID_SIZE] = "";
+	BOOLEAN needs_virtual_cd = IsPackedIsoPath(iso_path) || !IsoIsOnBootVolume(boot_params) ||
+		IsSplitIso(boot_params);
+	if (useVirtualCD || needs_virtual_cd) {
+		err = IsoDeviceInstallForBootOption(boot_params, virtual_cd_uuid);
+		if (!EFI_ERROR(err)) {
+			virtual_cd = (CHAR8 *)"1";
+		} else if (needs_virtual_cd) {
+			DisplayErrorText(L"Error: couldn't create a virtual CD drive for the ISO: ");
+			Print(L"%r\n", err);
+			return err;
+		} else {
+			Print(L"Couldn't create a virtual CD drive for the ISO: %r\n", err);
+		}
+	}
+	efi_set_variable(&grub_variable_guid, L"Enterprise_VirtualCD", virtual_cd,
+		sizeof(virtual_cd[0]) * (strlena(virtual_cd) + 1), FALSE);
+	// GRUB picks the disc out by this, since other drives may well have the same kernel path.
+	efi_set_variable(&grub_variable_guid, L"Enterprise_VirtualCDUUID", virtual_cd_uuid,
+		sizeof(virtual_cd_uuid[0]) * (strlena(virtual_cd_uuid) + 1), FALSE);
+	
+	// Files for this entry in the overlay directory go in after its own initrd.
+	CHAR8 *overlay = (CHAR8 *)"0";
+	err = OverlayInstallForBootOption(boot_params);
+	if (!EFI_ERROR(err)) {
+		overlay = (CHAR8 *)"1";
+	} else if (err != EFI_NOT_FOUND) {
+		Print(L"Couldn't add the files in the overlay directory: %r\n", err);
+	}
+	efi_set_variable(&grub_variable_guid, L"Enterprise_Overlay", overlay,
+		sizeof(overlay[0]) * (strlena(overlay) + 1), FALSE);
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS BootLinuxWithOptions(CHAR16 *params, UINT16 distribution) {
 	EFI_STATUS err;
 	EFI_HANDLE image;
-	EFI_DEVICE_PATH *path = NULL;
 	
 	uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
 	
@@ -143,63 +332,145 @@ EFI_STATUS BootLinuxWithOptions(CHAR16 *params, UINT16 distribution) {
 		DisplayErrorText(L"Error: couldn't get Linux distribution boot settings.\n");
 		return EFI_LOAD_ERROR;
 	}
+	TimingMark((const CHAR8 *)"selected");
+	
+	// Refuse to boot a damaged ISO if the user asked us to check first, or one we couldn't
+	// check because it couldn't be read. Files we have already checked are not read again
+	// unless they have changed since. An entry with no checksum, or an ISO we don't know
+	// how to check, boots as it is.
+	if (verifyBeforeBoot && !boot_params->uki_path) {
+		Print(L"Verifying %a...\n", boot_params->iso_path);
+		err = VerifyIsoFile(boot_params, FALSE);
+		if (err == EFI_CRC_ERROR) {
+			DisplayErrorText(L"Error: the ISO file is damaged and cannot be booted.\n");
+			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+			return EFI_LOAD_ERROR;
+		} else if (EFI_ERROR(err) && err != EFI_NOT_FOUND && err != EFI_UNSUPPORTED) {
+			DisplayErrorText(L"Error: couldn't verify the ISO file: ");
+			Print(L"%r\n", err);
+			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+			return EFI_LOAD_ERROR;
+		}
+	}
+	
+	// Entries that name neither a family nor a kernel boot the way the ISO itself would.
+	if (!boot_params->kernel_path && !boot_params->uki_path) {
+		Print(L"Reading the boot configuration of %a...\n", boot_params->iso_path);
+		err = DeriveBootOptionFromIso(boot_params);
+		if (EFI_ERROR(err)) {
+			DisplayErrorText(L"Error: couldn't work out how to boot this ISO. Give its family or kernel in the configuration file.\n");
+			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+			return EFI_LOAD_ERROR;
+		}
+	}
 	
-	CHAR8 *kernel_path = boot_params->kernel_path;
-	CHAR8 *initrd_path = boot_params->initrd_path;
-	CHAR8 *boot_folder = boot_params->boot_folder;
-	CHAR8 *iso_path = boot_params->iso_path;
-
 	// Convert the kernel options string from a UTF16 string into an ASCII C string.
 	// We need to do this because GNU-EFI uses Unicode internally but we can only pass ASCII
 	// C strings to GRUB.
 	//
 	// We also concatenate the kernel options given as part of the Enterprise configuration
 	// file with the user selected kernel options from the Advanced menu. The user selected
-	// options should override those given in the configuration file.
+	// options should override those given in the configuration file, and those given for
+	// this machine in particular come in between.
 	CHAR8 *sized_str = UTF16toASCII(params, StrLen(params) + 1);
 	CHAR8 *kernel_parameters = NULL;
-	kernel_parameters = AllocatePool(sizeof(CHAR8) * (strlena(sized_str) + strlena(boot_params->kernel_options)));
-	if (boot_params->kernel_options && strlena(boot_params->kernel_options) > 0) {
-		strcpya(kernel_parameters, boot_params->kernel_options);
-		strcata(kernel_parameters, sized_str);
-	} else {
-		strcpya(kernel_parameters, sized_str);
+	UINTN config_options_length = boot_params->kernel_options ? strlena(boot_params->kernel_options) : 0;
+	UINTN machine_options_length = machineKernelOptions ? strlena(machineKernelOptions) : 0;
+	kernel_parameters = AllocatePool(sizeof(CHAR8) * ((sized_str ? strlena(sized_str) : 0) + config_options_length +
+		machine_options_length + 3));
+	if (!sized_str || !kernel_parameters) {
+		DisplayErrorText(L"Error: couldn't allocate memory for the kernel parameters.\n");
+		if (sized_str) {
+			FreePool(sized_str);
+		}
+		if (kernel_parameters) {
+			FreePool(kernel_parameters);
+		}
+		return EFI_OUT_OF_RESOURCES;
+	}
+	kernel_parameters[0] = '\0';
+	if (config_options_length > 0) {
+		strcata(kernel_parameters, boot_params->kernel_options);
+		strcata(kernel_parameters, (CHAR8 *)" ");
 	}
+	if (machine_options_length > 0) {
+		strcata(kernel_parameters, machineKernelOptions);
+		strcata(kernel_parameters, (CHAR8 *)" ");
+	}
+	strcata(kernel_parameters, sized_str);
+	FreePool(sized_str);
 	
-	efi_set_variable(&grub_variable_guid, L"Enterprise_LinuxBootOptions", kernel_parameters,
-		sizeof(kernel_parameters[0]) * (strlena(kernel_parameters) + 1), FALSE);
-	efi_set_variable(&grub_variable_guid, L"Enterprise_LinuxKernelPath", kernel_path,
-		sizeof(kernel_path[0]) * (strlena(kernel_path) + 1), FALSE);
-	efi_set_variable(&grub_variable_guid, L"Enterprise_InitRDPath", initrd_path,
-		sizeof(initrd_path[0]) * (strlena(initrd_path) + 1), FALSE);
-	efi_set_variable(&grub_variable_guid, L"Enterprise_ISOPath", iso_path,
-		sizeof(iso_path[0]) * (strlena(iso_path) + 1), FALSE);
-	efi_set_variable(&grub_variable_guid, L"Enterprise_BootFolder", boot_folder,
-		sizeof(boot_folder[0]) * (strlena(boot_folder) + 1), FALSE);
+	if (!boot_params->uki_path && EFI_ERROR(PassBootOptionToGrub(boot_params, kernel_parameters))) {
+		FreePool(kernel_parameters);
+		uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+		return EFI_LOAD_ERROR;
+	}
 	
-	// Load the EFI boot loader image into memory.
-	path = FileDevicePath(this_image->DeviceHandle, L"\\efi\\boot\\boot.efi");
-	err = uefi_call_wrapper(BS->LoadImage, 6, TRUE, global_image, path, NULL, 0, &image);
+	// Nothing of ours may still be running once GRUB starts, and GRUB needs the
+	// firmware's own console back.
+	SchedulerShutdown();
+	GraphicsConsoleUninstall();
+	
+	// Load the EFI boot loader image into memory. A unified kernel image has its kernel,
+	// initrd and command line built in, so it is started in GRUB's place.
+	if (boot_params->uki_path) {
+		err = LoadUkiImage(global_image, boot_params, kernel_parameters, &image);
+	} else {
+		err = LoadGrubImage(global_image, this_image->DeviceHandle, &image);
+	}
+	FreePool(kernel_parameters);
 	if (EFI_ERROR(err)) {
+		IsoDeviceRemoveAll();
 		DisplayErrorText(L"Error loading image: ");
 		Print(L"%r\n", err);
 		uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
-		FreePool(path);
+		ResumeMenu();
 		
 		return EFI_LOAD_ERROR;
 	}
 	
+	TimingMark((const CHAR8 *)"loaded");
+	
+	// This try counts against the entry unless Linux says it came up.
+	BootCountAttempt(boot_params, safe_mode_boot);
+	StoreBootEntry(boot_params, boot_chosen_by, safe_mode_boot);
+	
+	// Everything GRUB needs has been passed to it in variables, so give it (and the kernel
+	// after it) all of our memory back. Only the virtual CD drive stays behind.
+	FreeConfiguration();
+	StoreMemoryStatistics();
+	InputTraceStartImage();
+	StoreInputTrace();
+	TimingMark((const CHAR8 *)"start");
+	StoreBootTiming();
+	StoreFrameTiming();
+	StoreFunctionProfile();
+	VarStoreShutdown();
+	
+	// GRUB and the kernel read the drive in small pieces, so give them a cache.
+	if (useDiskCache) {
+		DiskCacheInstall(this_image->DeviceHandle);
+	}
+	
 	// Start the EFI boot loader.
 	uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut); // Clear the screen.
 	err = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
+	DiskCacheRemove();
+	// The discs we made for it would otherwise show up again next time, twice over.
+	IsoDeviceRemoveAll();
+	
+	// If GRUB comes back, the menu needs the configuration again.
+	VarStoreLoad();
+	ReadConfigurationFile(CONFIGURATION_FILE_PATH);
 	if (EFI_ERROR(err)) {
 		DisplayErrorText(L"Error starting image: ");
 		Print(L"%r\n", err);
 		uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
-		FreePool(path);
+		ResumeMenu();
 		
 		return EFI_LOAD_ERROR;
 	}
+	ResumeMenu();
 
 	// Should never return.
 	return EFI_SUCCESS;
@@ -51,6 +51,11 @@ typedef struct LinuxBootOption {
 	CHAR8 *initrd_path;
 	CHAR8 *boot_folder;
 	CHAR8 *iso_path;
+	CHAR8 *iso_parts; // the files a split ISO is in, if not iso_path.000 and so on
+	CHAR8 *checksum;
+	CHAR8 *uki_path; // set for a unified kernel image, which is booted without GRUB
+	BOOLEAN derived; // the kernel and initrd came from the ISO's own configuration
+	UINT64 name_chars, name_pairs; // for filtering the boot selector, see listview.c
 } LinuxBootOption;
 
 typedef struct BootableLinuxDistro {
@@ -67,5 +72,6 @@ extern UINTN numberOfDisplayRows, numberOfDisplayColumns, highestModeNumberAvail
 extern BOOLEAN preset_options_array[PRESET_OPTIONS_SIZE];
 
 extern BootableLinuxDistro *distributionListRoot;
+extern EFI_LOADED_IMAGE *this_image;
 
 #endif
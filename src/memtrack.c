@@ -0,0 +1,175 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "main.h"
+#include "memtrack.h"
+#include "utils.h"
+
+#ifdef TRACK_ALLOCATIONS
+// We are the one place that needs the real allocator.
+#undef AllocatePool
+#undef AllocateZeroPool
+#undef FreePool
+#endif
+
+#define ALLOCATION_MAGIC 0x45504f4f4c545243ULL
+#define MAX_REPORTED_SITES 32
+
+static MemoryStatistics statistics;
+
+#ifdef TRACK_ALLOCATIONS
+/*
+ * Sits in front of every tracked allocation, taking up HEADER_SIZE bytes. That is rounded up
+ * to 16 (the structure is 48 bytes on x64 but 28 on ia32), so that the caller's buffer is
+ * aligned at least as well as the pool allocation it is in.
+ */
+typedef struct AllocationHeader {
+	UINT64 magic;
+	UINTN size;
+	const CHAR8 *file;
+	UINTN line;
+	struct AllocationHeader *prev;
+	struct AllocationHeader *next;
+} AllocationHeader;
+
+#define HEADER_SIZE ((sizeof(AllocationHeader) + 15) & ~(UINTN)15)
+
+static AllocationHeader *live_list = NULL;
+
+#ifdef __APPLE__
+	#pragma mark - Allocator wrappers
+#endif
+VOID* TrackedAllocatePool(UINTN size, const CHAR8 *file, UINTN line) {
+	AllocationHeader *header = AllocatePool(HEADER_SIZE + size);
+	if (!header) {
+		return NULL;
+	}
+
+	header->magic = ALLOCATION_MAGIC;
+	header->size = size;
+	header->file = file;
+	header->line = line;
+	header->prev = NULL;
+	header->next = live_list;
+	if (live_list) {
+		live_list->prev = header;
+	}
+	live_list = header;
+
+	statistics.allocations++;
+	statistics.live_allocations++;
+	statistics.live_bytes += size;
+	if (statistics.live_bytes > statistics.peak_bytes) {
+		statistics.peak_bytes = statistics.live_bytes;
+	}
+
+	return (UINT8 *)header + HEADER_SIZE;
+}
+
+VOID* TrackedAllocateZeroPool(UINTN size, const CHAR8 *file, UINTN line) {
+	VOID *buffer = TrackedAllocatePool(size, file, line);
+	if (buffer) {
+		ZeroMem(buffer, size);
+	}
+
+	return buffer;
+}
+
+VOID TrackedFreePool(VOID *buffer) {
+	if (!buffer) {
+		return;
+	}
+
+	// Memory handed to us by GNU-EFI (LibFileInfo, PoolPrint and so on) was never tracked
+	// and is freed as it is.
+	AllocationHeader *header = (AllocationHeader *)((UINT8 *)buffer - HEADER_SIZE);
+	if (header->magic != ALLOCATION_MAGIC) {
+		FreePool(buffer);
+		return;
+	}
+
+	if (header->prev) {
+		header->prev->next = header->next;
+	} else {
+		live_list = header->next;
+	}
+	if (header->next) {
+		header->next->prev = header->prev;
+	}
+
+	statistics.frees++;
+	statistics.live_allocations--;
+	statistics.live_bytes -= header->size;
+
+	header->magic = 0;
+	FreePool(header);
+}
+#endif
+
+#ifdef __APPLE__
+	#pragma mark - Reporting
+#endif
+BOOLEAN MemoryTrackingEnabled(VOID) {
+#ifdef TRACK_ALLOCATIONS
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+VOID GetMemoryStatistics(MemoryStatistics *out) {
+	CopyMem(out, &statistics, sizeof(MemoryStatistics));
+}
+
+/*
+ * Writes the totals and the call sites of everything that is still allocated to the
+ * Enterprise_MemoryStats variable, one line each, so they can be read from Linux once it
+ * has booted. Called just before GRUB starts, when anything still live is either needed by
+ * GRUB or a leak.
+ */
+VOID StoreMemoryStatistics(VOID) {
+#ifdef TRACK_ALLOCATIONS
+	CHAR16 *report = PoolPrint(L"live=%d peak=%d count=%d allocations=%d frees=%d\n",
+		statistics.live_bytes, statistics.peak_bytes, statistics.live_allocations,
+		statistics.allocations, statistics.frees);
+	if (!report) {
+		return;
+	}
+
+	UINTN sites = 0;
+	AllocationHeader *header;
+	for (header = live_list; header && sites < MAX_REPORTED_SITES; header = header->next, sites++) {
+		CHAR16 *line = PoolPrint(L"%s%a:%d %d\n", report, header->file, header->line, header->size);
+		FreePool(report);
+		if (!line) {
+			return;
+		}
+		report = line;
+	}
+
+	UINTN length = StrLen(report);
+	CHAR8 *ascii = UTF16toASCII(report, length + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, L"Enterprise_MemoryStats", ascii, length + 1, FALSE);
+		TrackedFreePool(ascii);
+	}
+	FreePool(report);
+#endif
+}
@@ -0,0 +1,52 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _memtrack_h
+#define _memtrack_h
+#include <efi.h>
+#include <efilib.h>
+
+/*
+ * Allocation tracking for debug builds. Build with "make TRACK_ALLOCATIONS=1" and every
+ * AllocatePool, AllocateZeroPool and FreePool in Enterprise goes through the functions
+ * below, which remember where each live allocation came from.
+ */
+
+typedef struct {
+	UINTN live_bytes;
+	UINTN peak_bytes;
+	UINTN live_allocations;
+	UINTN allocations;
+	UINTN frees;
+} MemoryStatistics;
+
+#ifdef TRACK_ALLOCATIONS
+VOID* TrackedAllocatePool(UINTN, const CHAR8 *, UINTN);
+VOID* TrackedAllocateZeroPool(UINTN, const CHAR8 *, UINTN);
+VOID TrackedFreePool(VOID *);
+
+#define AllocatePool(size) TrackedAllocatePool(size, (const CHAR8 *)__FILE__, __LINE__)
+#define AllocateZeroPool(size) TrackedAllocateZeroPool(size, (const CHAR8 *)__FILE__, __LINE__)
+#define FreePool(buffer) TrackedFreePool(buffer)
+#endif
+
+BOOLEAN MemoryTrackingEnabled(VOID);
+VOID GetMemoryStatistics(MemoryStatistics *);
+VOID StoreMemoryStatistics(VOID);
+
+#endif
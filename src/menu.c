@@ -24,8 +24,24 @@
 #include "utils.h"
 #include "distribution.h"
 #include "hardware.h"
+#include "verify.h"
+#include "graphics.h"
+#include "memtrack.h"
+#include "varstore.h"
+#include "config.h"
+#include "smbios.h"
+#include "listview.h"
+#include "iotune.h"
+#include "uki.h"
+#include "isodev.h"
+#include "profile.h"
+
+// How much of each packed ISO the storage benchmark reads.
+#define PACKED_ISO_BENCHMARK_SIZE (64 * 1024 * 1024)
 
 static void ShowAboutPage(VOID);
+static VOID ShowStorageBenchmark(VOID);
+static VOID ShowPackedIsoBenchmark(VOID);
 static CHAR16 *boot_options;
 static UINT8 distribution_id = -1;
 
@@ -40,30 +56,53 @@ EFI_STATUS DisplayDistributionSelector(struct BootableLinuxDistro *root, CHAR16
 	Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 	DisplayColoredText(L"\n    Boot Selector:\n");
 	Print(L"    The following distributions have been detected on this USB.\n");
-	Print(L"    Press the key corresponding to the number of the option that you want.\n\n");
+	Print(L"    Select the one you want, or type part of its name to find it.\n\n");
 	uefi_call_wrapper(ST->ConIn->Reset, 2, ST->ConIn, FALSE);
 	uefi_call_wrapper(ST->ConOut->EnableCursor, 2, ST->ConOut, FALSE);
 	
-	// Print out the available Linux distributions on this USB.
+	// Gather the names of the available Linux distributions on this USB.
 	// The first item is blank. I'll fix this later.
-	BootableLinuxDistro *conductor = root->next;
-	UINTN iteratorIndex = 0;
-	while (conductor != NULL) {
-		if (conductor->bootOption->name) {
-			Print(L"    %d) %a\n", iteratorIndex, conductor->bootOption->name);
-		} else ++iteratorIndex;
-
-		conductor = conductor->next;
+	BootableLinuxDistro *conductor;
+	UINTN count = 0;
+	for (conductor = root->next; conductor != NULL; conductor = conductor->next) {
+		count++;
 	}
-	Print(L"\n    Press any other key to reboot the system.\n");
 	
-	// Get the key press.
-	UINT64 key;
-	err = key_read(&key, TRUE);
-	INTN index = key - '0';
+	// The filter's masks were worked out along with the configuration.
+	CHAR8 **names = AllocateZeroPool(sizeof(CHAR8 *) * (count + 1));
+	UINT64 *masks = AllocateZeroPool(sizeof(UINT64) * 2 * (count + 1));
+	ListView *list = NULL;
+	if (names && masks) {
+		UINTN i = 0;
+		for (conductor = root->next; conductor != NULL; conductor = conductor->next, i++) {
+			LinuxBootOption *option = conductor->bootOption;
+			if (option) {
+				UkiResolveName(option);
+				names[i] = option->name;
+				masks[i] = option->name_chars;
+				masks[count + 1 + i] = option->name_pairs;
+			}
+		}
+		list = ListViewCreate(names, masks, masks + count + 1, count);
+	}
+	
+	INTN index = -1;
+	if (list) {
+		index = ListViewRun(list, ST->ConOut->Mode->CursorRow);
+		ListViewFree(list);
+	} else {
+		DisplayErrorText(L"Failed to allocate memory for the boot selector.");
+	}
+	if (names) {
+		FreePool(names);
+	}
+	if (masks) {
+		FreePool(masks);
+	}
 
-	if (index < 0 || (UINTN)index > iteratorIndex) {
+	if (index < 0) {
 		// Reboot the system.
+		VarStoreCommit();
 		err = uefi_call_wrapper(RT->ResetSystem, 4, EfiResetCold, EFI_SUCCESS, 0, NULL);
 		
 		// Should never get here unless there's an error.
@@ -82,10 +121,58 @@ EFI_STATUS DisplayDistributionSelector(struct BootableLinuxDistro *root, CHAR16
 	return err; // Shouldn't get here.
 }
 
+/*
+ * Picks up an edited configuration file or newly inserted media without rebooting. The
+ * file is only parsed again if its size or modification time changed.
+ */
+static VOID ReloadConfiguration(VOID) {
+	Print(L"\n    Looking for new drives...\n");
+	ConnectAllControllers();
+
+	// If our own drive was pulled out and put back, the old root directory is stale.
+	EFI_FILE_INFO *info = LibFileInfo(root_dir);
+	if (info) {
+		FreePool(info);
+	} else {
+		EFI_FILE *new_root = LibOpenRoot(this_image->DeviceHandle);
+		if (!new_root) {
+			DisplayErrorText(L"    Error: can't open the drive Enterprise was started from.\n");
+			uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+			return;
+		}
+
+		uefi_call_wrapper(root_dir->Close, 1, root_dir);
+		root_dir = new_root;
+	}
+
+	if (!ConfigurationFileChanged(CONFIGURATION_FILE_PATH)) {
+		Print(L"    The configuration file has not changed.\n");
+		uefi_call_wrapper(BS->Stall, 1, 1000 * 1000);
+		return;
+	}
+
+	// The background check walks the distribution list that may be about to go away.
+	VerifyStopBackground();
+	if (ReloadConfigurationFile(CONFIGURATION_FILE_PATH)) {
+		Print(L"    Read %d distributions.\n", distroCount + 1);
+		uefi_call_wrapper(BS->Stall, 1, 1000 * 1000);
+	} else {
+		DisplayErrorText(L"    Error: configuration file parsing error; keeping the old one.\n");
+		uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+	}
+
+	if (verifyBeforeBoot) {
+		VerifyInBackground();
+	}
+}
+
 EFI_STATUS DisplayMenu(VOID) {
 	EFI_STATUS err;
 	UINT64 key;
-	boot_options = AllocateZeroPool(sizeof(CHAR16) * 150);
+	// Kept from one visit to the menu to the next.
+	if (!boot_options) {
+		boot_options = AllocateZeroPool(sizeof(CHAR16) * 150);
+	}
 	if (!boot_options) {
 		DisplayErrorText(L"Failed to allocate memory for boot options string.");
 		return EFI_OUT_OF_RESOURCES;
@@ -100,7 +187,9 @@ EFI_STATUS DisplayMenu(VOID) {
 	Print(L"    Press the key corresponding to the number of the option that you want.\n");
 	Print(L"\n    1) Boot Linux from ISO file\n");
 	Print(L"    2) Modify Linux kernel boot options (advanced!)\n");
-	Print(L"\n    Press any other key to reboot the system.\n");
+	Print(L"    3) Verify ISO file integrity\n");
+	Print(L"\n    Press F5 to reload the configuration file.\n");
+	Print(L"    Press any other key to reboot the system.\n");
 	
 	err = key_read(&key, TRUE);
 	//Print(L"%d", key);
@@ -109,11 +198,21 @@ EFI_STATUS DisplayMenu(VOID) {
 		DisplayDistributionSelector(distributionListRoot, L"", FALSE);
 	} else if (key == '2') {
 		DisplayDistributionSelector(distributionListRoot, L"", TRUE);
+	} else if (key == '3') {
+		VerifyAllDistributions();
+		uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+		Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+		goto start;
 	} else if (key == 27 || key == 1507328) { // Escape key
 		ShowAboutPage();
 		uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
 		Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 		goto start;
+	} else if (key == 983040) { // F5 key
+		ReloadConfiguration();
+		uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+		Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+		goto start;
 	} else if (key == 720896) { // F1 key
 		// Reset to use the default screen resolution. This is provided as a
 		// counter-annoyance measure for screens which are incredibly large.
@@ -124,6 +223,7 @@ EFI_STATUS DisplayMenu(VOID) {
 		goto start;
 	} else {
 		// Reboot the system.
+		VarStoreCommit();
 		err = uefi_call_wrapper(RT->ResetSystem, 4, EfiResetCold, EFI_SUCCESS, 0, NULL);
 		
 		// Should never get here unless there's an error.
@@ -149,13 +249,136 @@ static void ShowAboutPage(VOID) {
 		DisplayErrorText(L"    UEFI 2.0 not supported!\n\n");
 	}
 	
+	// What "machine" sections in the configuration file can match this machine by.
+	const SmbiosIdentity *identity = GetSmbiosIdentity();
+	Print(L"    Machine: %a, board %a\n    System UUID: %a\n\n", identity->product, identity->board, identity->uuid);
+	
 	Print(L"    Using a screen resolution of %d x %d, mode %d.\n",
 		numberOfDisplayRows, numberOfDisplayColumns, highestModeNumberAvailable);
-	Print(L"    Press any key to go back.");
+	if (GraphicsConsoleActive()) {
+		Print(L"    Graphical renderer: last frame %d us, slowest frame %d us.\n\n",
+			graphicsLastFrameTime, graphicsWorstFrameTime);
+	}
+	if (MemoryTrackingEnabled()) {
+		MemoryStatistics stats;
+		GetMemoryStatistics(&stats);
+		Print(L"    Memory: %d bytes in %d allocations, peak %d bytes (%d allocated, %d freed).\n\n",
+			stats.live_bytes, stats.live_allocations, stats.peak_bytes, stats.allocations, stats.frees);
+	}
+	if (FunctionProfilingEnabled()) {
+		Print(L"    Function profiling build: timings are written to %s at boot.\n\n", PROFILE_FILE);
+	}
+	if (ioChunkSize) {
+		Print(L"    Reading %d KB at a time, up to %d reads at once.\n\n", ioChunkSize / 1024, ioQueueDepth);
+	}
+	Print(L"    Press B to measure how fast this drive reads, or any other key to go back.");
+	UINT64 key;
+	key_read(&key, TRUE);
+	if ((key & 0xFFFF) == 'b' || (key & 0xFFFF) == 'B') {
+		ShowStorageBenchmark();
+	}
+}
+
+/*
+ * Times reads of our own drive at each setting we try, and shows what was picked. The
+ * result replaces what was measured at startup.
+ */
+static VOID ShowStorageBenchmark(VOID) {
+	IoMeasurement measurements[IO_TUNE_MAX_MEASUREMENTS];
+	IoTuning result;
+	UINTN count, i;
+
+	uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+	DisplayColoredText(L"\n\n    Storage Benchmark:\n");
+	Print(L"    Measuring how fast this drive reads. This takes a few seconds.\n\n");
+
+	EFI_STATUS err = IoTuneBenchmark(measurements, &count, &result);
+	for (i = 0; i < count; i++) {
+		Print(L"    %4d KB reads, %2d at once%s: ", measurements[i].chunk_size / 1024, measurements[i].depth,
+			measurements[i].misalignment ? L", not 4 KB aligned" : L"");
+		if (measurements[i].rate) {
+			Print(L"%d KB/s\n", measurements[i].rate);
+		} else {
+			DisplayErrorText(L"failed\n");
+		}
+	}
+
+	if (EFI_ERROR(err)) {
+		DisplayErrorText(L"\n    The drive could not be measured: ");
+		Print(L"%r\n", err);
+	} else {
+		if (result.usb_version) {
+			Print(L"\n    The drive is connected over USB %x.%x.", result.usb_version >> 8, (result.usb_version >> 4) & 0xF);
+		}
+		Print(L"\n    Using %d KB reads, %d at once (%d KB/s).\n", result.chunk_size / 1024, result.depth, result.rate);
+		if (ioChunkSize != result.chunk_size || ioQueueDepth != result.depth) {
+			Print(L"    The configuration file overrides some of this.\n");
+		}
+	}
+
+	ShowPackedIsoBenchmark();
+
+	Print(L"\n    Press any key to go back.");
 	UINT64 key;
 	key_read(&key, TRUE);
 }
 
+/*
+ * Times reading the start of each packed ISO through a virtual disc's cache, and of the
+ * ISO it was made from if that's on the drive too, to show what packing gains.
+ */
+static VOID ShowPackedIsoBenchmark(VOID) {
+	BootableLinuxDistro *conductor;
+	BOOLEAN shown = FALSE;
+	UINTN rate;
+
+	for (conductor = distributionListRoot->next; conductor != NULL; conductor = conductor->next) {
+		LinuxBootOption *option = conductor->bootOption;
+		if (!option || !option->iso_path || !IsPackedIsoPath(option->iso_path)) {
+			continue;
+		}
+
+		EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+		CHAR16 *path = volume ? IsoPathForBootOption(option) : NULL;
+		if (!path) {
+			if (volume) {
+				CloseVolume(volume);
+			}
+			continue;
+		}
+
+		if (!shown) {
+			DisplayColoredText(L"\n    Packed ISOs:\n");
+			shown = TRUE;
+		}
+		Print(L"    %a\n", option->name ? option->name : option->iso_path);
+
+		EFI_STATUS err = IsoDeviceBenchmark(volume, path, PACKED_ISO_BENCHMARK_SIZE, &rate);
+		if (EFI_ERROR(err)) {
+			Print(L"      packed: ");
+			DisplayErrorText(L"failed");
+			Print(L" (%r)\n", err);
+		} else {
+			Print(L"      packed: %d KB/s\n", rate);
+		}
+
+		// The plain ISO is the same path without the suffix.
+		path[StrLen(path) - strlena((CHAR8 *)PACKED_ISO_SUFFIX)] = '\0';
+		if (FileExists(volume, path)) {
+			err = IsoDeviceBenchmark(volume, path, PACKED_ISO_BENCHMARK_SIZE, &rate);
+			if (EFI_ERROR(err)) {
+				Print(L"      plain:  ");
+				DisplayErrorText(L"failed");
+				Print(L" (%r)\n", err);
+			} else {
+				Print(L"      plain:  %d KB/s\n", rate);
+			}
+		}
+		FreePool(path);
+		CloseVolume(volume);
+	}
+}
+
 static int options_array[20];
 
 #define OPTION(string, id) \
@@ -224,15 +447,19 @@ EFI_STATUS ConfigureKernel(CHAR16 *options, BOOLEAN preset_options[], int preset
 
 			CHAR16 *input = NULL;
 			EFI_STATUS err = ReadStringFromKeyboard(&input);
-			if (!EFI_ERROR(err)) StrCat(options, input);
-			FreePool(input);
+			if (!EFI_ERROR(err)) {
+				StrCat(options, input);
 
-			uefi_call_wrapper(ST->ConOut->EnableCursor, 2, ST->ConOut, FALSE);
-
-			// Highlight the ninth option if the user has entered an option.
-			if (StrLen(input) > 0) {
-				options_array[8] = TRUE;
+				// Highlight the ninth option if the user has entered an option.
+				if (StrLen(input) > 0) {
+					options_array[8] = TRUE;
+				}
+			}
+			if (input) {
+				FreePool(input);
 			}
+
+			uefi_call_wrapper(ST->ConOut->EnableCursor, 2, ST->ConOut, FALSE);
 		} else {
 			options_array[index - 1] = !options_array[index - 1];
 		}
@@ -276,6 +503,7 @@ EFI_STATUS ConfigureKernel(CHAR16 *options, BOOLEAN preset_options[], int preset
 	
 	// Shouldn't get here unless something went wrong with the boot process.
 	uefi_call_wrapper(BS->Stall, 1, 3 * 1000);
+	VarStoreCommit();
 	uefi_call_wrapper(RT->ResetSystem, 4, EfiResetCold, EFI_SUCCESS, 0, NULL);
 	return EFI_LOAD_ERROR;
 }
@@ -0,0 +1,296 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * ISOs split into several files, for FAT32 volumes, which can't hold a file of 4 GB or
+ * more. The parts are either named after the ISO with a three-digit number on the end, as
+ * split(1) -d -a 3 makes them ("fedora.iso.000", "fedora.iso.001", ...), or listed by the
+ * configuration ("parts fedora-1.iso fedora-2.iso"), in which case they are in the same
+ * directory as the ISO. Either way they are read back as one ISO, through one virtual disc.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "multipart.h"
+#include "config.h"
+#include "fatmap.h"
+#include "utils.h"
+
+#ifdef __APPLE__
+	#pragma mark - Finding the parts
+#endif
+static CHAR16* PartPathFromList(CHAR16 *iso_path, CHAR8 *name, UINTN length) {
+	UINTN directory = StrLen(iso_path);
+	while (directory > 0 && iso_path[directory - 1] != '\\') {
+		directory--;
+	}
+
+	CHAR16 *relative = ASCIItoUTF16(name, length);
+	if (!relative) {
+		return NULL;
+	}
+	for (UINTN i = 0; relative[i] != '\0'; i++) {
+		if (relative[i] == '/') {
+			relative[i] = '\\';
+		}
+	}
+
+	CHAR16 *path = AllocatePool((directory + StrLen(relative) + 1) * sizeof(CHAR16));
+	if (path) {
+		CopyMem(path, iso_path, directory * sizeof(CHAR16));
+		StrCpy(path + directory, relative);
+	}
+	FreePool(relative);
+	return path;
+}
+
+/*
+ * Returns the paths of the files that make up the ISO of the given boot option on its
+ * volume, in order, and sets count to how many there are. An ISO that isn't split is the
+ * only part of itself, whether or not it's there. Free the result with FreeIsoPartPaths.
+ */
+CHAR16** IsoPartPathsForBootOption(LinuxBootOption *option, EFI_FILE_HANDLE volume, UINTN *count) {
+	CHAR16 **paths = AllocateZeroPool(MAX_ISO_PARTS * sizeof(CHAR16 *));
+	CHAR16 *iso_path = IsoPathForBootOption(option);
+
+	*count = 0;
+	if (!paths || !iso_path) {
+		goto fail;
+	}
+
+	if (option->iso_parts) {
+		CHAR8 *p = option->iso_parts;
+		while (*p && *count < MAX_ISO_PARTS) {
+			while (*p == ' ' || *p == ',') {
+				p++;
+			}
+			CHAR8 *end = p;
+			while (*end && *end != ' ' && *end != ',') {
+				end++;
+			}
+			if (end == p) {
+				break;
+			}
+
+			paths[*count] = PartPathFromList(iso_path, p, end - p);
+			if (!paths[*count]) {
+				goto fail;
+			}
+			(*count)++;
+			p = end;
+		}
+	} else if (!FileExists(volume, iso_path)) {
+		while (*count < MAX_ISO_PARTS) {
+			CHAR16 *path = PoolPrint(L"%s.%03d", iso_path, *count);
+			if (!path) {
+				goto fail;
+			}
+			if (!FileExists(volume, path)) {
+				FreePool(path);
+				break;
+			}
+			paths[(*count)++] = path;
+		}
+	}
+
+	if (*count == 0) {
+		paths[0] = iso_path;
+		*count = 1;
+		return paths;
+	}
+
+	FreePool(iso_path);
+	return paths;
+
+fail:
+	if (paths) {
+		FreeIsoPartPaths(paths, *count);
+	}
+	if (iso_path) {
+		FreePool(iso_path);
+	}
+	*count = 0;
+	return NULL;
+}
+
+VOID FreeIsoPartPaths(CHAR16 **paths, UINTN count) {
+	UINTN i;
+	for (i = 0; i < count; i++) {
+		if (paths[i]) {
+			FreePool(paths[i]);
+		}
+	}
+	FreePool(paths);
+}
+
+BOOLEAN IsSplitIso(LinuxBootOption *option) {
+	UINTN count = 0;
+
+	if (!option->iso_path) {
+		return FALSE;
+	}
+	if (option->iso_parts) {
+		return TRUE;
+	}
+
+	EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+	if (!volume) {
+		return FALSE;
+	}
+
+	CHAR16 **paths = IsoPartPathsForBootOption(option, volume, &count);
+	CloseVolume(volume);
+	if (paths) {
+		FreeIsoPartPaths(paths, count);
+	}
+	return count > 1;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Reading
+#endif
+/*
+ * Opens the given parts on a volume, reading them straight from the drive if direct is
+ * set (which it may only be for our own volume).
+ */
+MultipartIso* MultipartIsoOpen(EFI_FILE_HANDLE volume, CHAR16 **paths, UINTN count, BOOLEAN direct) {
+	MultipartIso *iso = AllocateZeroPool(sizeof(MultipartIso));
+	if (!iso) {
+		return NULL;
+	}
+
+	iso->parts = AllocateZeroPool(count * sizeof(IsoPart));
+	if (!iso->parts) {
+		FreePool(iso);
+		return NULL;
+	}
+
+	for (iso->count = 0; iso->count < count; iso->count++) {
+		IsoPart *part = &iso->parts[iso->count];
+		EFI_STATUS err = uefi_call_wrapper(volume->Open, 5, volume, &part->file, paths[iso->count],
+			EFI_FILE_MODE_READ, 0);
+		if (EFI_ERROR(err)) {
+			goto fail;
+		}
+
+		EFI_FILE_INFO *info = LibFileInfo(part->file);
+		if (!info || info->FileSize == 0) {
+			if (info) {
+				FreePool(info);
+			}
+			uefi_call_wrapper(part->file->Close, 1, part->file);
+			goto fail;
+		}
+		part->offset = iso->size;
+		part->size = info->FileSize;
+		iso->size += part->size;
+		FreePool(info);
+
+		part->queue = direct ? FatOpenDirect(part->file, paths[iso->count], ioQueueDepth, FALSE) :
+			AioOpenFile(part->file, ioQueueDepth);
+		if (!part->queue) {
+			uefi_call_wrapper(part->file->Close, 1, part->file);
+			goto fail;
+		}
+	}
+
+	return iso;
+
+fail:
+	MultipartIsoClose(iso);
+	return NULL;
+}
+
+/*
+ * A BLOCK_CACHE_FILL for a split ISO; anything past its end reads as zeroes. The range is
+ * read in chunks from whichever parts it covers, and the chunks of the next part are
+ * submitted alongside those of the one before, so a read across a boundary keeps both
+ * drives' queues busy rather than waiting for the first part to finish.
+ */
+EFI_STATUS MultipartIsoRead(VOID *context, UINT64 offset, UINTN length, VOID *buffer) {
+	MultipartIso *iso = context;
+	AioRequest requests[AIO_MAX_DEPTH];
+	AioQueue *queues[AIO_MAX_DEPTH];
+	EFI_STATUS result = EFI_SUCCESS;
+	UINTN submitted = 0, completed = 0, position = 0, part = 0;
+
+	if (offset >= iso->size) {
+		SetMem(buffer, length, 0);
+		return EFI_SUCCESS;
+	}
+	if (length > iso->size - offset) {
+		SetMem((UINT8 *)buffer + (iso->size - offset), length - (iso->size - offset), 0);
+		length = iso->size - offset;
+	}
+
+	while (part + 1 < iso->count && iso->parts[part + 1].offset <= offset) {
+		part++;
+	}
+
+	while (completed < submitted || position < length) {
+		while (position < length && submitted - completed < AIO_MAX_DEPTH && !EFI_ERROR(result)) {
+			IsoPart *current = &iso->parts[part];
+			UINT64 within = offset + position - current->offset;
+			UINTN size = length - position;
+			if (size > current->queue->chunk_size) {
+				size = current->queue->chunk_size;
+			}
+			if (size > current->size - within) {
+				size = current->size - within;
+			}
+
+			UINTN slot = submitted % AIO_MAX_DEPTH;
+			queues[slot] = current->queue;
+			AioSubmit(current->queue, &requests[slot], within, size, (UINT8 *)buffer + position);
+			submitted++;
+
+			position += size;
+			if (within + size == current->size && part + 1 < iso->count) {
+				part++;
+			}
+		}
+
+		if (completed == submitted) {
+			break;
+		}
+
+		UINTN slot = completed % AIO_MAX_DEPTH;
+		EFI_STATUS err = AioWait(queues[slot], &requests[slot]);
+		if (!EFI_ERROR(err) && requests[slot].transferred != requests[slot].length) {
+			err = EFI_END_OF_FILE; // a part got shorter since we opened it
+		}
+		if (EFI_ERROR(err) && !EFI_ERROR(result)) {
+			result = err;
+		}
+		completed++;
+	}
+
+	return result;
+}
+
+VOID MultipartIsoClose(MultipartIso *iso) {
+	UINTN i;
+
+	for (i = 0; i < iso->count; i++) {
+		AioClose(iso->parts[i].queue);
+		uefi_call_wrapper(iso->parts[i].file->Close, 1, iso->parts[i].file);
+	}
+
+	FreePool(iso->parts);
+	FreePool(iso);
+}
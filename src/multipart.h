@@ -0,0 +1,46 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _multipart_h
+#define _multipart_h
+#include "main.h"
+#include "aio.h"
+
+#define MAX_ISO_PARTS 1000 // .000 to .999
+
+typedef struct {
+	EFI_FILE_HANDLE file;
+	AioQueue *queue;
+	UINT64 offset; // where the part starts in the ISO
+	UINT64 size;
+} IsoPart;
+
+typedef struct {
+	IsoPart *parts;
+	UINTN count;
+	UINT64 size;
+} MultipartIso;
+
+CHAR16** IsoPartPathsForBootOption(LinuxBootOption *, EFI_FILE_HANDLE, UINTN *);
+VOID FreeIsoPartPaths(CHAR16 **, UINTN);
+BOOLEAN IsSplitIso(LinuxBootOption *);
+MultipartIso* MultipartIsoOpen(EFI_FILE_HANDLE, CHAR16 **, UINTN, BOOLEAN);
+EFI_STATUS MultipartIsoRead(VOID *, UINT64, UINTN, VOID *);
+VOID MultipartIsoClose(MultipartIso *);
+
+#endif
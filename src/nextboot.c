@@ -0,0 +1,141 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * One-shot boot selection from the running system. tools/enterprise-ctl leaves the entry to
+ * start next time, and optionally extra kernel options, in variables; we boot that entry
+ * without showing the menu and delete them first, so that it only happens once. We also
+ * leave behind what was booted and how, for the tool to read back.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "nextboot.h"
+#include "utils.h"
+#include "config.h"
+#include "varstore.h"
+#include "uki.h"
+
+#define NEXT_BOOT_VARIABLE L"Enterprise_BootNext"
+#define NEXT_BOOT_OPTIONS_VARIABLE L"Enterprise_BootNextOptions"
+
+// Reads one of the tool's variables as a NUL-terminated string, which it needn't be.
+static CHAR8* ReadString(CHAR16 *name) {
+	CHAR8 *buffer, *string;
+	UINTN size;
+
+	if (EFI_ERROR(efi_get_variable(&enterprise_variable_guid, name, &buffer, &size))) {
+		return NULL;
+	}
+
+	string = AllocatePool(size + 1);
+	if (string) {
+		CopyMem(string, buffer, size);
+		string[size] = '\0';
+		while (size > 0 && (string[size - 1] == '\n' || string[size - 1] == '\0')) {
+			string[--size] = '\0';
+		}
+	}
+	FreePool(buffer);
+	return string;
+}
+
+// Finds an entry by its name, or by its number as the menu shows it (counting from 0).
+static INTN FindEntry(CHAR8 *wanted) {
+	BootableLinuxDistro *conductor;
+	INTN index = 0, number = 0;
+	CHAR8 *c;
+
+	for (c = wanted; *c >= '0' && *c <= '9'; c++) {
+		number = number * 10 + (*c - '0');
+	}
+	if (c != wanted && *c == '\0') {
+		return number <= distroCount ? number : -1;
+	}
+
+	for (conductor = distributionListRoot->next; conductor != NULL; conductor = conductor->next, index++) {
+		LinuxBootOption *option = conductor->bootOption;
+		if (!option) {
+			continue;
+		}
+		UkiResolveName(option);
+		if (option->name && strcmpa(option->name, wanted) == 0) {
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the entry the running system asked to boot this once, or -1 if there isn't one
+ * (or it names no entry). Sets options to the extra kernel options asked for, or NULL.
+ * Either way the request is gone afterwards.
+ */
+INTN NextBootTake(CHAR16 **options) {
+	*options = NULL;
+
+	CHAR8 *wanted = ReadString(NEXT_BOOT_VARIABLE);
+	CHAR8 *extra = ReadString(NEXT_BOOT_OPTIONS_VARIABLE);
+	if (!wanted && !extra) {
+		return -1;
+	}
+
+	// Should this boot hang, the next one mustn't try it again.
+	efi_delete_variable(&enterprise_variable_guid, NEXT_BOOT_VARIABLE);
+	efi_delete_variable(&enterprise_variable_guid, NEXT_BOOT_OPTIONS_VARIABLE);
+	VarStoreCommit();
+
+	INTN index = wanted && distributionListRoot ? FindEntry(wanted) : -1;
+	if (wanted && index < 0) {
+		DisplayErrorText(L"The entry asked for by the running system wasn't found: ");
+		Print(L"%a\n", wanted);
+		uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+	}
+	if (index >= 0 && extra) {
+		*options = ASCIItoUTF16(extra, strlena(extra));
+	}
+
+	if (wanted) {
+		FreePool(wanted);
+	}
+	if (extra) {
+		FreePool(extra);
+	}
+	return index;
+}
+
+/*
+ * Leaves a note of the entry being booted in the volatile Enterprise_BootEntry variable:
+ * its name, what chose it ("menu", "autoboot" or "next") and whether it's in safe mode.
+ */
+VOID StoreBootEntry(LinuxBootOption *option, const CHAR8 *chosen_by, BOOLEAN safe) {
+	CHAR8 *name = option->name ? option->name : option->iso_path;
+	CHAR16 *text = PoolPrint(L"entry=%a\nchosen=%a\nsafe=%d\n", name ? name : (CHAR8 *)"", chosen_by, safe ? 1 : 0);
+	if (!text) {
+		return;
+	}
+
+	UINTN length = StrLen(text);
+	CHAR8 *ascii = UTF16toASCII(text, length + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, L"Enterprise_BootEntry", ascii, length + 1, FALSE);
+		FreePool(ascii);
+	}
+	FreePool(text);
+}
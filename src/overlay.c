@@ -0,0 +1,466 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Overlays: files to add to a live system without remastering its ISO. Whatever is in
+ * \efi\overlay\<entry name>\ is packed into a newc cpio archive in memory, which GRUB loads
+ * after the distribution's own initrd, so that the kernel unpacks it on top. For example,
+ * \efi\overlay\Ubuntu\etc\ssh\sshd_config turns up as /etc/ssh/sshd_config.
+ *
+ * FAT has no permissions, so they are guessed: anything in a bin or sbin directory or
+ * ending in .sh is executable, anything in a .ssh directory or ending in _key is private,
+ * and everything else is readable by all.
+ *
+ * GRUB can only load files from a file system, so the archive is the one file on a small
+ * ISO 9660 disc in memory, /enterprise_overlay.cpio, which grub.cfg searches for.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "overlay.h"
+#include "config.h"
+#include "isodev.h"
+#include "utils.h"
+
+#define OVERLAY_MAX_SIZE (64 * 1024 * 1024)
+#define OVERLAY_MAX_DEPTH 16
+#define OVERLAY_MAX_ENTRIES 4096
+#define OVERLAY_FILE_NAME "ENTERPRISE_OVERLAY.CPIO;1"
+#define OVERLAY_ROCK_RIDGE_NAME "enterprise_overlay.cpio"
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_MODE_DIRECTORY 0040000
+#define CPIO_MODE_FILE 0100000
+
+// Where things are on the disc, in sectors. The archive follows the root directory.
+#define DISC_DESCRIPTOR_SECTOR 16
+#define DISC_TERMINATOR_SECTOR 17
+#define DISC_L_PATH_TABLE_SECTOR 18
+#define DISC_M_PATH_TABLE_SECTOR 19
+#define DISC_ROOT_SECTOR 20
+#define DISC_DATA_SECTOR 21
+
+typedef struct {
+	CHAR16 *path; // relative to the overlay directory, for opening it again
+	CHAR8 *name; // as it goes in the archive
+	UINT64 size;
+	UINT32 mode;
+	UINT32 mtime;
+	UINTN offset; // of its data in the archive
+} OverlayEntry;
+
+typedef struct {
+	OverlayEntry *entries;
+	UINTN count;
+	UINTN archive_size;
+} Overlay;
+
+static UINTN Align4(UINTN n) {
+	return (n + 3) & ~(UINTN)3;
+}
+
+// Seconds since 1970 for a time on the FAT volume, taking its local time for UTC.
+static UINT32 UnixTime(EFI_TIME *time) {
+	if (time->Year < 1970 || time->Month < 1 || time->Month > 12) {
+		return 0;
+	}
+
+	// Days from the civil calendar, counting years from March so that leap days come last.
+	INTN year = time->Year - (time->Month <= 2 ? 1 : 0);
+	UINTN month = time->Month > 2 ? time->Month - 3 : time->Month + 9;
+	INTN era_year = year - 1600;
+	INTN days = era_year * 365 + era_year / 4 - era_year / 100 + era_year / 400 + (153 * month + 2) / 5 +
+		time->Day - 1 - 135080; // 135080 days from 1600-03-01 to 1970-01-01
+	return (UINT32)(days * 86400 + time->Hour * 3600 + time->Minute * 60 + time->Second);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Gathering the files
+#endif
+static BOOLEAN NameEndsWith(CHAR16 *name, CHAR16 *suffix) {
+	UINTN length = StrLen(name), suffix_length = StrLen(suffix);
+	return length >= suffix_length && StriCmp(name + length - suffix_length, suffix) == 0;
+}
+
+static UINT32 GuessMode(CHAR16 *name, CHAR16 *parent, BOOLEAN directory) {
+	BOOLEAN private = StriCmp(parent, L".ssh") == 0 || (directory && StriCmp(name, L".ssh") == 0);
+	if (directory) {
+		return CPIO_MODE_DIRECTORY | (private ? 0700 : 0755);
+	}
+	if (private || NameEndsWith(name, L"_key")) {
+		return CPIO_MODE_FILE | 0600;
+	}
+	if (StriCmp(parent, L"bin") == 0 || StriCmp(parent, L"sbin") == 0 || NameEndsWith(name, L".sh")) {
+		return CPIO_MODE_FILE | 0755;
+	}
+	return CPIO_MODE_FILE | 0644;
+}
+
+/*
+ * Adds a file or directory to the overlay, which takes over path if this succeeds.
+ */
+static EFI_STATUS AddEntry(Overlay *overlay, CHAR16 *path, UINT64 size, UINT32 mode, EFI_TIME *time) {
+	if (overlay->count == OVERLAY_MAX_ENTRIES || size > OVERLAY_MAX_SIZE) {
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	CHAR8 *name = UTF16toASCII(path, StrLen(path) + 1);
+	if (!name) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	UINTN i;
+	for (i = 0; name[i]; i++) {
+		if (name[i] == '\\') {
+			name[i] = '/';
+		}
+	}
+
+	// The header and name are padded to four bytes, and so is the data.
+	UINTN offset = overlay->archive_size + Align4(CPIO_HEADER_SIZE + strlena(name) + 1);
+	if (offset + Align4(size) > OVERLAY_MAX_SIZE) {
+		FreePool(name);
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	OverlayEntry *entry = &overlay->entries[overlay->count++];
+	entry->path = path;
+	entry->name = name;
+	entry->size = size;
+	entry->mode = mode;
+	entry->mtime = UnixTime(time);
+	entry->offset = offset;
+	overlay->archive_size = offset + Align4(size);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Adds everything in a directory to the overlay, each directory before what's in it, as the
+ * kernel only creates a file if its directory is already there.
+ */
+static EFI_STATUS GatherDirectory(Overlay *overlay, EFI_FILE_HANDLE directory, CHAR16 *path, CHAR16 *name,
+	UINTN depth) {
+	UINTN buffer_size = SIZE_OF_EFI_FILE_INFO + 256 * sizeof(CHAR16);
+	EFI_FILE_INFO *info = AllocatePool(buffer_size);
+	EFI_STATUS err = EFI_SUCCESS;
+
+	if (!info) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (;;) {
+		UINTN size = buffer_size;
+		err = uefi_call_wrapper(directory->Read, 3, directory, &size, info);
+		if (err == EFI_BUFFER_TOO_SMALL) {
+			FreePool(info);
+			buffer_size = size;
+			info = AllocatePool(buffer_size);
+			if (!info) {
+				return EFI_OUT_OF_RESOURCES;
+			}
+			continue;
+		}
+		if (EFI_ERROR(err) || size == 0) {
+			break;
+		}
+
+		if (StrCmp(info->FileName, L".") == 0 || StrCmp(info->FileName, L"..") == 0) {
+			continue;
+		}
+
+		BOOLEAN is_directory = (info->Attribute & EFI_FILE_DIRECTORY) != 0;
+		CHAR16 *child = path ? PoolPrint(L"%s\\%s", path, info->FileName) : StrDuplicate(info->FileName);
+		if (!child) {
+			err = EFI_OUT_OF_RESOURCES;
+			break;
+		}
+		err = AddEntry(overlay, child, is_directory ? 0 : info->FileSize, GuessMode(info->FileName, name, is_directory),
+			&info->ModificationTime);
+		if (EFI_ERROR(err)) {
+			FreePool(child);
+			break;
+		}
+
+		if (is_directory && depth < OVERLAY_MAX_DEPTH) {
+			EFI_FILE_HANDLE subdirectory;
+			err = uefi_call_wrapper(directory->Open, 5, directory, &subdirectory, info->FileName,
+				EFI_FILE_MODE_READ, 0);
+			if (EFI_ERROR(err)) {
+				break;
+			}
+			err = GatherDirectory(overlay, subdirectory, child, info->FileName, depth + 1);
+			uefi_call_wrapper(subdirectory->Close, 1, subdirectory);
+			if (EFI_ERROR(err)) {
+				break;
+			}
+		}
+	}
+
+	FreePool(info);
+	return err;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Writing the archive
+#endif
+static CHAR8* WriteHex(CHAR8 *out, UINT32 value) {
+	static const CHAR8 digits[] = "0123456789abcdef";
+	INTN i;
+	for (i = 7; i >= 0; i--) {
+		*out++ = digits[(value >> (i * 4)) & 0xF];
+	}
+	return out;
+}
+
+static UINTN WriteHeader(CHAR8 *out, UINT32 inode, UINT32 mode, UINT32 mtime, UINT32 size, const CHAR8 *name) {
+	UINT32 name_size = strlena((CHAR8 *)name) + 1;
+	UINT32 fields[] = {
+		inode, mode, 0, 0, (mode & CPIO_MODE_DIRECTORY) ? 2 : 1, mtime, size, 0, 0, 0, 0, name_size, 0
+	};
+	CHAR8 *p = out;
+	UINTN i;
+
+	CopyMem(p, "070701", 6);
+	p += 6;
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		p = WriteHex(p, fields[i]);
+	}
+	CopyMem(p, name, name_size);
+
+	// The caller's buffer is zeroed, so the padding already is.
+	return Align4(CPIO_HEADER_SIZE + name_size);
+}
+
+/*
+ * Writes the archive's headers into archive and reads every file's contents into its place
+ * after its header, one after another in the order they were found, so that there is no
+ * copying and the reads run through each directory in the order it's stored.
+ */
+static EFI_STATUS WriteArchive(Overlay *overlay, EFI_FILE_HANDLE directory, CHAR8 *archive) {
+	UINTN position = 0, i;
+
+	for (i = 0; i < overlay->count; i++) {
+		OverlayEntry *entry = &overlay->entries[i];
+		position += WriteHeader(archive + position, i + 1, entry->mode, entry->mtime, entry->size, entry->name);
+		if (entry->size > 0) {
+			EFI_FILE_HANDLE file;
+			EFI_STATUS err = uefi_call_wrapper(directory->Open, 5, directory, &file, entry->path, EFI_FILE_MODE_READ, 0);
+			if (EFI_ERROR(err)) {
+				return err;
+			}
+
+			UINTN read = entry->size;
+			err = uefi_call_wrapper(file->Read, 3, file, &read, archive + position);
+			uefi_call_wrapper(file->Close, 1, file);
+			if (EFI_ERROR(err)) {
+				return err;
+			}
+			if (read != entry->size) {
+				return EFI_END_OF_FILE;
+			}
+		}
+		position += Align4(entry->size);
+	}
+
+	WriteHeader(archive + position, 0, 0, 0, 0, (const CHAR8 *)CPIO_TRAILER);
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - The disc
+#endif
+static VOID WriteBoth16(UINT8 *p, UINT16 value) {
+	p[0] = p[3] = value & 0xFF;
+	p[1] = p[2] = value >> 8;
+}
+
+static VOID WriteBoth32(UINT8 *p, UINT32 value) {
+	UINTN i;
+	for (i = 0; i < 4; i++) {
+		p[i] = p[7 - i] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+/*
+ * Writes a directory record and returns its length. system_use is appended after the name
+ * for Rock Ridge.
+ */
+static UINTN WriteRecord(UINT8 *p, UINT32 extent, UINT32 size, BOOLEAN directory, const CHAR8 *name,
+	UINTN name_length, const UINT8 *system_use, UINTN system_use_length) {
+	static const UINT8 date[7] = {119, 1, 1, 0, 0, 0, 0}; // 2019-01-01
+	UINTN length = 33 + name_length + ((name_length & 1) ? 0 : 1) + system_use_length;
+
+	length += length & 1;
+	p[0] = length;
+	WriteBoth32(p + 2, extent);
+	WriteBoth32(p + 10, size);
+	CopyMem(p + 18, date, sizeof(date));
+	p[25] = directory ? 2 : 0;
+	WriteBoth16(p + 28, 1);
+	p[32] = name_length;
+	CopyMem(p + 33, name, name_length);
+	if (system_use_length) {
+		CopyMem(p + 33 + name_length + ((name_length & 1) ? 0 : 1), system_use, system_use_length);
+	}
+	return length;
+}
+
+static VOID Pad(UINT8 *p, const CHAR8 *text, UINTN length) {
+	UINTN text_length = strlena((CHAR8 *)text);
+	SetMem(p, length, ' ');
+	CopyMem(p, text, text_length < length ? text_length : length);
+}
+
+/*
+ * Writes the descriptors, path tables and root directory of a disc holding just the
+ * archive, which is archive_size bytes long and starts at DISC_DATA_SECTOR.
+ */
+static VOID WriteDisc(UINT8 *disc, UINTN archive_size) {
+	UINT32 sectors = DISC_DATA_SECTOR + (archive_size + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+	UINT8 *descriptor = disc + DISC_DESCRIPTOR_SECTOR * ISO_SECTOR_SIZE;
+	UINT8 *root = disc + DISC_ROOT_SECTOR * ISO_SECTOR_SIZE;
+
+	// The root directory: ".", with the Rock Ridge "SP" entry that announces the extension,
+	// "..", and the archive, with its name in lower case in an "NM" entry.
+	static const UINT8 sharing_protocol[] = {'S', 'P', 7, 1, 0xBE, 0xEF, 0};
+	UINT8 alternate_name[5 + sizeof(OVERLAY_ROCK_RIDGE_NAME) - 1] = {'N', 'M', sizeof(alternate_name), 1, 0};
+	CopyMem(alternate_name + 5, OVERLAY_ROCK_RIDGE_NAME, sizeof(OVERLAY_ROCK_RIDGE_NAME) - 1);
+
+	UINTN position = WriteRecord(root, DISC_ROOT_SECTOR, ISO_SECTOR_SIZE, TRUE, (const CHAR8 *)"\0", 1,
+		sharing_protocol, sizeof(sharing_protocol));
+	position += WriteRecord(root + position, DISC_ROOT_SECTOR, ISO_SECTOR_SIZE, TRUE, (const CHAR8 *)"\1", 1, NULL, 0);
+	WriteRecord(root + position, DISC_DATA_SECTOR, archive_size, FALSE, (const CHAR8 *)OVERLAY_FILE_NAME,
+		sizeof(OVERLAY_FILE_NAME) - 1, alternate_name, sizeof(alternate_name));
+
+	// The path tables, little and big endian, each listing just the root.
+	UINT8 *table = disc + DISC_L_PATH_TABLE_SECTOR * ISO_SECTOR_SIZE;
+	table[0] = 1;
+	table[2] = DISC_ROOT_SECTOR;
+	table[6] = 1;
+	table = disc + DISC_M_PATH_TABLE_SECTOR * ISO_SECTOR_SIZE;
+	table[0] = 1;
+	table[5] = DISC_ROOT_SECTOR;
+	table[7] = 1;
+
+	descriptor[0] = 1;
+	CopyMem(descriptor + 1, "CD001", 5);
+	descriptor[6] = 1;
+	Pad(descriptor + 8, (const CHAR8 *)"", 32);
+	Pad(descriptor + 40, (const CHAR8 *)"ENTERPRISE_OVERLAY", 32);
+	WriteBoth32(descriptor + 80, sectors);
+	WriteBoth16(descriptor + 120, 1);
+	WriteBoth16(descriptor + 124, 1);
+	WriteBoth16(descriptor + 128, ISO_SECTOR_SIZE);
+	WriteBoth32(descriptor + 132, 10);
+	descriptor[140] = DISC_L_PATH_TABLE_SECTOR;
+	descriptor[151] = DISC_M_PATH_TABLE_SECTOR;
+	WriteRecord(descriptor + 156, DISC_ROOT_SECTOR, ISO_SECTOR_SIZE, TRUE, (const CHAR8 *)"\0", 1, NULL, 0);
+	Pad(descriptor + 190, (const CHAR8 *)"", 813 - 190); // the identifiers, all empty
+	UINTN date;
+	for (date = 813; date < 881; date += 17) {
+		SetMem(descriptor + date, 16, '0');
+	}
+	descriptor[881] = 1;
+
+	UINT8 *terminator = disc + DISC_TERMINATOR_SECTOR * ISO_SECTOR_SIZE;
+	terminator[0] = 255;
+	CopyMem(terminator + 1, "CD001", 5);
+	terminator[6] = 1;
+}
+
+/*
+ * Packs the entry's overlay directory, if it has one, and exposes it as a disc for GRUB.
+ * Returns EFI_NOT_FOUND if there is nothing to add.
+ */
+EFI_STATUS OverlayInstallForBootOption(LinuxBootOption *option) {
+	EFI_FILE_HANDLE directory;
+	Overlay overlay = {0};
+	UINT8 *disc = NULL;
+	UINTN i;
+
+	if (!option->name) {
+		return EFI_NOT_FOUND;
+	}
+
+	CHAR16 *name = ASCIItoUTF16(option->name, strlena(option->name));
+	CHAR16 *path = name ? PoolPrint(L"%s\\%s", OVERLAY_DIRECTORY, name) : NULL;
+	if (name) {
+		FreePool(name);
+	}
+	if (!path) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	EFI_STATUS err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &directory, path, EFI_FILE_MODE_READ, 0);
+	FreePool(path);
+	if (EFI_ERROR(err)) {
+		return EFI_NOT_FOUND;
+	}
+
+	overlay.entries = AllocateZeroPool(sizeof(OverlayEntry) * OVERLAY_MAX_ENTRIES);
+	if (!overlay.entries) {
+		err = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	err = GatherDirectory(&overlay, directory, NULL, L"", 0);
+	if (EFI_ERROR(err)) {
+		goto out;
+	}
+	if (overlay.count == 0) {
+		err = EFI_NOT_FOUND;
+		goto out;
+	}
+
+	// Lay the whole disc out first, so that it takes a single allocation and the files can be
+	// read straight into it.
+	UINTN archive_size = overlay.archive_size + Align4(CPIO_HEADER_SIZE + sizeof(CPIO_TRAILER));
+	UINTN disc_size = DISC_DATA_SECTOR * ISO_SECTOR_SIZE +
+		((archive_size + ISO_SECTOR_SIZE - 1) & ~(UINTN)(ISO_SECTOR_SIZE - 1));
+	disc = AllocateZeroPool(disc_size);
+	if (!disc) {
+		err = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	err = WriteArchive(&overlay, directory, (CHAR8 *)disc + DISC_DATA_SECTOR * ISO_SECTOR_SIZE);
+	if (EFI_ERROR(err)) {
+		goto out;
+	}
+	WriteDisc(disc, archive_size);
+
+	if (!IsoDeviceCreateInMemory(disc, disc_size)) {
+		err = EFI_OUT_OF_RESOURCES;
+	}
+
+out:
+	// The disc stays behind for GRUB; everything else goes.
+	if (EFI_ERROR(err) && disc) {
+		FreePool(disc);
+	}
+	if (overlay.entries) {
+		for (i = 0; i < overlay.count; i++) {
+			FreePool(overlay.entries[i].path);
+			FreePool(overlay.entries[i].name);
+		}
+		FreePool(overlay.entries);
+	}
+	uefi_call_wrapper(directory->Close, 1, directory);
+	return err;
+}
@@ -0,0 +1,367 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Packed ISOs: an ISO compressed in independent frames, with an index of where each frame
+ * is, so that any part of it can be read without decompressing what comes before. Reading
+ * less from the drive more than makes up for decompressing, as USB sticks are slow and
+ * much of an ISO compresses well. The frames of each read are decompressed in parallel on
+ * the application processors, while the compressed data for the next read is on its way.
+ * tools/isopack.c makes these files.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "packediso.h"
+#include "hardware.h"
+#include "lz4.h"
+
+#define MIN_FRAME_SIZE (4 * 1024)
+#define MAX_FRAME_SIZE (4 * 1024 * 1024)
+
+BOOLEAN IsPackedIsoPath(CHAR8 *path) {
+	UINTN length = strlena(path), suffix_length = strlena((CHAR8 *)PACKED_ISO_SUFFIX);
+	return length > suffix_length && strcmpa(path + length - suffix_length, (CHAR8 *)PACKED_ISO_SUFFIX) == 0;
+}
+
+/*
+ * Reads the header and index of a packed ISO through the queue, which holds a file of the
+ * given size. Returns NULL if it isn't a packed ISO. The queue stays the caller's.
+ */
+PackedIso* PackedIsoOpen(AioQueue *queue, UINT64 file_size) {
+	PackedIsoHeader header;
+	UINTN read, i;
+
+	if (EFI_ERROR(AioRead(queue, 0, sizeof(header), &header, &read)) || read != sizeof(header) ||
+		header.magic != PACKED_ISO_MAGIC || header.version != PACKED_ISO_VERSION ||
+		header.header_size < sizeof(header) || header.frame_size < MIN_FRAME_SIZE ||
+		header.frame_size > MAX_FRAME_SIZE || (header.frame_size & (header.frame_size - 1)) ||
+		header.frame_count == 0 || header.image_size == 0 ||
+		(header.image_size - 1) / header.frame_size + 1 != header.frame_count) {
+		return NULL;
+	}
+
+	// The index has to fit in the file, and its size in a UINTN.
+	if (header.header_size > file_size ||
+		(UINT64)header.frame_count + 1 > (file_size - header.header_size) / sizeof(UINT64) ||
+		(UINT64)header.frame_count + 1 > (UINTN)-1 / sizeof(UINT64)) {
+		return NULL;
+	}
+
+	PackedIso *iso = AllocateZeroPool(sizeof(PackedIso));
+	UINTN index_size = ((UINTN)header.frame_count + 1) * sizeof(UINT64);
+	if (!iso || !(iso->index = AllocatePool(index_size))) {
+		if (iso) {
+			FreePool(iso);
+		}
+		return NULL;
+	}
+
+	iso->queue = queue;
+	iso->frame_size = header.frame_size;
+	iso->frame_count = header.frame_count;
+	iso->image_size = header.image_size;
+	if (EFI_ERROR(AioRead(queue, header.header_size, index_size, iso->index, &read)) || read != index_size) {
+		goto fail;
+	}
+
+	// Frames must follow one another, and can be stored as is but no larger.
+	UINT64 data_start = header.header_size + index_size;
+	if (iso->index[0] < data_start || iso->index[header.frame_count] > file_size) {
+		goto fail;
+	}
+	for (i = 0; i < header.frame_count; i++) {
+		if (iso->index[i + 1] <= iso->index[i] || iso->index[i + 1] - iso->index[i] > header.frame_size) {
+			goto fail;
+		}
+	}
+
+	iso->partial[0] = AllocatePool(iso->frame_size);
+	iso->partial[1] = AllocatePool(iso->frame_size);
+	if (!iso->partial[0] || !iso->partial[1]) {
+		goto fail;
+	}
+
+	iso->ap_count = GetApplicationProcessors(&iso->mp, iso->aps, PACKED_ISO_MAX_WORKERS);
+	for (i = 0; i < iso->ap_count; i++) {
+		if (EFI_ERROR(uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &iso->ap_done[i]))) {
+			break;
+		}
+	}
+	iso->ap_count = i;
+	return iso;
+
+fail:
+	PackedIsoClose(iso);
+	return NULL;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Decompression
+#endif
+static VOID DecompressFrame(PackedIsoFrameJob *job) {
+	UINTN written;
+
+	if (job->input_size == job->output_size) {
+		CopyMem(job->output, job->input, job->output_size);
+		job->status = EFI_SUCCESS;
+		return;
+	}
+
+	job->status = Lz4DecompressBlock(job->input, job->input_size, job->output, 0, job->output_size, &written);
+	if (!EFI_ERROR(job->status) && written != job->output_size) {
+		job->status = EFI_COMPROMISED_DATA;
+	}
+}
+
+static EFI_CALLBACK VOID WorkerProcedure(VOID *argument) {
+	PackedIsoWorker *worker = argument;
+	UINTN i;
+	for (i = worker->first; i < worker->count; i += worker->stride) {
+		DecompressFrame(&worker->jobs[i]);
+	}
+}
+
+/*
+ * Shares the jobs out between the application processors and ourselves, and waits for all
+ * of them. Any processor that can't be started leaves its share to us.
+ */
+static VOID RunJobs(PackedIso *iso, UINTN count) {
+	UINTN workers = count < iso->ap_count + 1 ? count : iso->ap_count + 1;
+	BOOLEAN started[PACKED_ISO_MAX_WORKERS];
+	UINTN i;
+
+	for (i = 0; i < workers; i++) {
+		iso->workers[i].jobs = iso->jobs;
+		iso->workers[i].first = i;
+		iso->workers[i].count = count;
+		iso->workers[i].stride = workers;
+	}
+
+	for (i = 1; i < workers; i++) {
+		started[i - 1] = !EFI_ERROR(uefi_call_wrapper(iso->mp->StartupThisAP, 7, iso->mp, WorkerProcedure,
+			iso->aps[i - 1], iso->ap_done[i - 1], 0, &iso->workers[i], NULL));
+	}
+
+	WorkerProcedure(&iso->workers[0]);
+
+	// Block I/O may be called above TPL_APPLICATION, where we can't wait for events.
+	for (i = 1; i < workers; i++) {
+		if (!started[i - 1]) {
+			WorkerProcedure(&iso->workers[i]);
+			continue;
+		}
+		while (uefi_call_wrapper(BS->CheckEvent, 1, iso->ap_done[i - 1]) == EFI_NOT_READY) {
+			AioPoll(iso->queue);
+		}
+	}
+}
+
+#ifdef __APPLE__
+	#pragma mark - Reading
+#endif
+static BOOLEAN EnsureCapacity(PackedIso *iso, UINTN compressed, UINTN jobs) {
+	UINTN i;
+
+	if (compressed > iso->compressed_capacity) {
+		for (i = 0; i < 2; i++) {
+			if (iso->compressed[i]) {
+				FreePool(iso->compressed[i]);
+			}
+			iso->compressed[i] = AllocatePool(compressed);
+		}
+		iso->compressed_capacity = iso->compressed[0] && iso->compressed[1] ? compressed : 0;
+		if (!iso->compressed_capacity) {
+			return FALSE;
+		}
+	}
+
+	if (jobs > iso->job_capacity) {
+		if (iso->jobs) {
+			FreePool(iso->jobs);
+		}
+		iso->jobs = AllocatePool(sizeof(PackedIsoFrameJob) * jobs);
+		iso->job_capacity = iso->jobs ? jobs : 0;
+		if (!iso->jobs) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Makes sure the compressed data for count frames from first is in iso->compressed[0],
+ * using what was read ahead if it covers them.
+ */
+static EFI_STATUS FetchFrames(PackedIso *iso, UINT64 first, UINT64 count) {
+	UINTN length = iso->index[first + count] - iso->index[first];
+	BOOLEAN prefetched = FALSE;
+	UINTN read;
+
+	if (iso->prefetching) {
+		EFI_STATUS err = AioWait(iso->queue, &iso->prefetch);
+		iso->prefetching = FALSE;
+		prefetched = !EFI_ERROR(err) && iso->prefetch_first == first && iso->prefetch_count >= count &&
+			iso->prefetch.transferred == iso->prefetch.length;
+	}
+
+	if (prefetched) {
+		UINT8 *swap = iso->compressed[0];
+		iso->compressed[0] = iso->compressed[1];
+		iso->compressed[1] = swap;
+		return EFI_SUCCESS;
+	}
+
+	if (!EnsureCapacity(iso, length, count)) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	EFI_STATUS err = AioRead(iso->queue, iso->index[first], length, iso->compressed[0], &read);
+	if (!EFI_ERROR(err) && read != length) {
+		err = EFI_END_OF_FILE;
+	}
+	return err;
+}
+
+/*
+ * Starts reading the frames after the ones just fetched, as many again, if the reads so far
+ * have been going through the image in order.
+ */
+static VOID PrefetchAfter(PackedIso *iso, UINT64 first, UINT64 count) {
+	UINT64 next = first + count;
+
+	if (first != iso->next_frame || next >= iso->frame_count) {
+		return;
+	}
+	if (count > iso->frame_count - next) {
+		count = iso->frame_count - next;
+	}
+
+	UINTN length = iso->index[next + count] - iso->index[next];
+	if (length > iso->compressed_capacity) {
+		return;
+	}
+
+	if (!EFI_ERROR(AioSubmit(iso->queue, &iso->prefetch, iso->index[next], length, iso->compressed[1]))) {
+		iso->prefetching = TRUE;
+		iso->prefetch_first = next;
+		iso->prefetch_count = count;
+	}
+}
+
+/*
+ * Fills buffer with length bytes of the ISO from offset; a BLOCK_CACHE_FILL for the packed
+ * ISO given as context. Anything past the end of the ISO reads as zeroes.
+ */
+EFI_STATUS PackedIsoRead(VOID *context, UINT64 offset, UINTN length, VOID *buffer) {
+	PackedIso *iso = context;
+	UINT8 *out = buffer;
+	UINTN i;
+
+	if (offset >= iso->image_size) {
+		SetMem(buffer, length, 0);
+		return EFI_SUCCESS;
+	}
+	if (length > iso->image_size - offset) {
+		SetMem(out + (iso->image_size - offset), length - (iso->image_size - offset), 0);
+		length = iso->image_size - offset;
+	}
+	if (length == 0) {
+		return EFI_SUCCESS;
+	}
+
+	UINT64 first = offset / iso->frame_size;
+	UINT64 last = (offset + length - 1) / iso->frame_size;
+	UINTN count = last - first + 1;
+
+	EFI_STATUS err = FetchFrames(iso, first, count);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+	PrefetchAfter(iso, first, count);
+	iso->next_frame = last + 1;
+
+	// Whole frames go straight into the buffer; the ends, if they are cut off, go through
+	// the partial buffers.
+	for (i = 0; i < count; i++) {
+		UINT64 frame = first + i;
+		UINT64 frame_start = frame * iso->frame_size;
+		PackedIsoFrameJob *job = &iso->jobs[i];
+
+		job->input = iso->compressed[0] + (iso->index[frame] - iso->index[first]);
+		job->input_size = iso->index[frame + 1] - iso->index[frame];
+		job->output_size = frame == iso->frame_count - 1 ? iso->image_size - frame_start : iso->frame_size;
+		if (frame_start >= offset && frame_start + job->output_size <= offset + length) {
+			job->output = out + (frame_start - offset);
+		} else {
+			job->output = iso->partial[i == 0 ? 0 : 1];
+		}
+	}
+
+	RunJobs(iso, count);
+
+	for (i = 0; i < count; i++) {
+		if (EFI_ERROR(iso->jobs[i].status)) {
+			return iso->jobs[i].status;
+		}
+	}
+
+	// Copy out the wanted parts of the frames at either end.
+	for (i = 0; i < count; i += count - 1) {
+		PackedIsoFrameJob *job = &iso->jobs[i];
+		UINT64 frame_start = (first + i) * iso->frame_size;
+		if (job->output == iso->partial[0] || job->output == iso->partial[1]) {
+			UINT64 from = offset > frame_start ? offset : frame_start;
+			UINT64 to = frame_start + job->output_size < offset + length ? frame_start + job->output_size :
+				offset + length;
+			CopyMem(out + (from - offset), job->output + (from - frame_start), to - from);
+		}
+		if (count == 1) {
+			break;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+VOID PackedIsoClose(PackedIso *iso) {
+	UINTN i;
+
+	if (iso->prefetching) {
+		AioWait(iso->queue, &iso->prefetch);
+	}
+	for (i = 0; i < iso->ap_count; i++) {
+		uefi_call_wrapper(BS->CloseEvent, 1, iso->ap_done[i]);
+	}
+	for (i = 0; i < 2; i++) {
+		if (iso->compressed[i]) {
+			FreePool(iso->compressed[i]);
+		}
+		if (iso->partial[i]) {
+			FreePool(iso->partial[i]);
+		}
+	}
+	if (iso->jobs) {
+		FreePool(iso->jobs);
+	}
+	if (iso->index) {
+		FreePool(iso->index);
+	}
+	FreePool(iso);
+}
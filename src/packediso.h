@@ -0,0 +1,91 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _packediso_h
+#define _packediso_h
+#include "aio.h"
+#include "protocols.h"
+
+#define PACKED_ISO_MAGIC 0x4B505349 // "ISPK"
+#define PACKED_ISO_VERSION 1
+#define PACKED_ISO_SUFFIX ".lz4s"
+#define PACKED_ISO_MAX_WORKERS 8
+
+/*
+ * The file starts with this header, followed by frame_count + 1 file offsets (UINT64) of
+ * the frames and of the end of the last one. Each frame holds frame_size bytes of the ISO
+ * (the last one possibly fewer) as one LZ4 block, or as is if that's no smaller.
+ */
+typedef struct {
+	UINT32 magic;
+	UINT16 version;
+	UINT16 header_size;
+	UINT32 frame_size;
+	UINT32 frame_count;
+	UINT64 image_size;
+	UINT64 reserved;
+} PackedIsoHeader;
+
+typedef struct {
+	const UINT8 *input;
+	UINTN input_size;
+	UINT8 *output;
+	UINTN output_size;
+	EFI_STATUS status;
+} PackedIsoFrameJob;
+
+typedef struct {
+	PackedIsoFrameJob *jobs;
+	UINTN first;
+	UINTN count;
+	UINTN stride;
+} PackedIsoWorker;
+
+typedef struct {
+	AioQueue *queue;
+	UINT32 frame_size;
+	UINT32 frame_count;
+	UINT64 image_size;
+	UINT64 *index;
+
+	// Compressed data for the frames being decompressed, and for the ones after them, which
+	// are read while the others are decompressed.
+	UINT8 *compressed[2];
+	UINTN compressed_capacity;
+	AioRequest prefetch;
+	BOOLEAN prefetching;
+	UINT64 prefetch_first, prefetch_count;
+	UINT64 next_frame;
+
+	UINT8 *partial[2]; // for the frames at either end of a read, which are only partly wanted
+	PackedIsoFrameJob *jobs;
+	UINTN job_capacity;
+
+	EFI_MP_SERVICES_PROTOCOL *mp;
+	UINTN aps[PACKED_ISO_MAX_WORKERS];
+	UINTN ap_count;
+	EFI_EVENT ap_done[PACKED_ISO_MAX_WORKERS];
+	PackedIsoWorker workers[PACKED_ISO_MAX_WORKERS + 1];
+} PackedIso;
+
+BOOLEAN IsPackedIsoPath(CHAR8 *);
+PackedIso* PackedIsoOpen(AioQueue *, UINT64);
+EFI_STATUS PackedIsoRead(VOID *, UINT64, UINTN, VOID *);
+VOID PackedIsoClose(PackedIso *);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "main.h"
+#include "profile.h"
+#include "config.h"
+#include "timing.h"
+
+#ifdef PROFILE_FUNCTIONS
+/*
+ * Every call path is a node in a tree, found by its parent and function through a hash
+ * table. All of it is allocated up front, as the hooks run before anything else and mustn't
+ * call anything that is itself instrumented. Only the boot processor may run instrumented
+ * code; the Makefile leaves out what runs on the others.
+ */
+#define PROFILE_MAX_NODES 4096
+#define PROFILE_HASH_SIZE 8192 // a power of two
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_NO_NODE 0xFFFFFFFF
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+typedef struct {
+	UINTN function;
+	UINT32 parent;
+	UINT32 hash_next;
+	UINT64 calls;
+	UINT64 inclusive;
+	UINT64 children; // the part of inclusive spent in callees
+} ProfileNode;
+
+typedef struct {
+	UINT32 node;
+	UINT64 start;
+} ProfileFrame;
+
+// Node 0 is the root, which stands for whatever called efi_main.
+static ProfileNode nodes[PROFILE_MAX_NODES];
+static UINT32 node_count = 1;
+static UINT32 buckets[PROFILE_HASH_SIZE];
+static ProfileFrame stack[PROFILE_MAX_DEPTH];
+static UINTN depth = 0;
+static UINT64 dropped = 0;
+static BOOLEAN stopped = FALSE;
+
+VOID __cyg_profile_func_enter(VOID *, VOID *) NO_INSTRUMENT;
+VOID __cyg_profile_func_exit(VOID *, VOID *) NO_INSTRUMENT;
+
+static inline NO_INSTRUMENT UINT64 ReadCycleCounter(VOID) {
+#if defined(__x86_64__) || defined(__i386__)
+	UINT32 low, high;
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((UINT64)high << 32) | low;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Finds the node for a call to function from parent, adding it if it's new. Calls that don't
+ * fit any more aren't counted, and neither is anything under them.
+ */
+static NO_INSTRUMENT UINT32 FindNode(UINT32 parent, UINTN function) {
+	UINT32 bucket = (UINT32)((function >> 4) ^ (parent * 0x9E3779B1)) & (PROFILE_HASH_SIZE - 1);
+	UINT32 index;
+
+	for (index = buckets[bucket]; index != 0; index = nodes[index].hash_next) {
+		if (nodes[index].function == function && nodes[index].parent == parent) {
+			return index;
+		}
+	}
+
+	if (node_count == PROFILE_MAX_NODES) {
+		dropped++;
+		return PROFILE_NO_NODE;
+	}
+
+	index = node_count++;
+	nodes[index].function = function;
+	nodes[index].parent = parent;
+	nodes[index].hash_next = buckets[bucket];
+	buckets[bucket] = index;
+	return index;
+}
+
+VOID __cyg_profile_func_enter(VOID *function, VOID *call_site) {
+	UINT64 now = ReadCycleCounter();
+	(VOID)call_site;
+
+	if (stopped) {
+		return;
+	}
+	if (depth >= PROFILE_MAX_DEPTH) {
+		depth++;
+		dropped++;
+		return;
+	}
+
+	UINT32 parent = depth > 0 ? stack[depth - 1].node : 0;
+	stack[depth].node = parent == PROFILE_NO_NODE ? PROFILE_NO_NODE : FindNode(parent, (UINTN)function);
+	stack[depth].start = now;
+	depth++;
+}
+
+static NO_INSTRUMENT VOID EndFrame(UINT64 now) {
+	depth--;
+	if (depth >= PROFILE_MAX_DEPTH || stack[depth].node == PROFILE_NO_NODE) {
+		return;
+	}
+
+	ProfileNode *node = &nodes[stack[depth].node];
+	UINT64 elapsed = now - stack[depth].start;
+	node->calls++;
+	node->inclusive += elapsed;
+	if (depth > 0 && stack[depth - 1].node != PROFILE_NO_NODE) {
+		nodes[stack[depth - 1].node].children += elapsed;
+	}
+}
+
+VOID __cyg_profile_func_exit(VOID *function, VOID *call_site) {
+	UINT64 now = ReadCycleCounter();
+	(VOID)function;
+	(VOID)call_site;
+
+	if (!stopped && depth > 0) {
+		EndFrame(now);
+	}
+}
+#endif
+
+BOOLEAN FunctionProfilingEnabled(VOID) {
+#ifdef PROFILE_FUNCTIONS
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+#ifdef PROFILE_FUNCTIONS
+static VOID AppendLine(CHAR8 *report, UINTN *length, UINTN capacity, CHAR16 *line) {
+	UINTN i;
+	for (i = 0; line[i] != '\0' && *length < capacity; i++) {
+		report[(*length)++] = (CHAR8)line[i];
+	}
+}
+#endif
+
+/*
+ * Stops profiling and writes what it found to PROFILE_FILE: a line for each call path with
+ * its node, the node it was called from, the function's address in enterprise.so, and how
+ * many calls there were and cycles they took, with and without their callees. Functions
+ * that are still running, like efi_main, count as having returned now. Called just before
+ * GRUB starts.
+ */
+VOID StoreFunctionProfile(VOID) {
+#ifdef PROFILE_FUNCTIONS
+	EFI_FILE_HANDLE file;
+	CHAR16 line[128];
+	UINTN length = 0;
+	UINT32 i;
+
+	UINT64 now = ReadCycleCounter();
+	while (depth > 0) {
+		EndFrame(now);
+	}
+	stopped = TRUE;
+
+	UINTN capacity = (node_count + 2) * sizeof(line) / sizeof(line[0]);
+	CHAR8 *report = AllocatePool(capacity);
+	if (!report) {
+		return;
+	}
+
+	UINT64 microseconds = TimestampToMicroseconds(1000 * 1000 * 1000);
+	SPrint(line, sizeof(line), L"# cycles_per_us=%ld dropped=%ld\n",
+		microseconds ? 1000 * 1000 * 1000 / microseconds : 0, dropped);
+	AppendLine(report, &length, capacity, line);
+	AppendLine(report, &length, capacity, L"# node parent address calls inclusive exclusive\n");
+
+	for (i = 1; i < node_count; i++) {
+		ProfileNode *node = &nodes[i];
+		SPrint(line, sizeof(line), L"%d %d %lx %ld %ld %ld\n", i, node->parent,
+			(UINT64)(node->function - (UINTN)this_image->ImageBase), node->calls, node->inclusive,
+			node->inclusive - node->children);
+		AppendLine(report, &length, capacity, line);
+	}
+
+	// Start from an empty file, so a shorter profile doesn't leave the end of an older one.
+	EFI_STATUS err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &file, PROFILE_FILE,
+		EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE, 0);
+	if (!EFI_ERROR(err)) {
+		uefi_call_wrapper(file->Delete, 1, file);
+	}
+
+	err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &file, PROFILE_FILE,
+		EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE|EFI_FILE_MODE_CREATE, 0);
+	if (!EFI_ERROR(err)) {
+		uefi_call_wrapper(file->Write, 3, file, &length, report);
+		uefi_call_wrapper(file->Close, 1, file);
+	}
+
+	FreePool(report);
+#endif
+}
@@ -0,0 +1,35 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _profile_h
+#define _profile_h
+#include <efi.h>
+
+/*
+ * Function profiling for debug builds. Build with "make PROFILE_FUNCTIONS=1" and the
+ * compiler calls into profile.c on the way in and out of every function, which adds up the
+ * cycles spent in each one by call path. tools/enterprise-profile turns the result into
+ * something readable.
+ */
+
+#define PROFILE_FILE L"\\efi\\boot\\profile.txt"
+
+BOOLEAN FunctionProfilingEnabled(VOID);
+VOID StoreFunctionProfile(VOID);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Definitions for firmware protocols that GNU-EFI does not ship headers for.
+ */
+
+#pragma once
+#ifndef _protocols_h
+#define _protocols_h
+
+/*
+ * Functions that the firmware calls back into (protocol members we implement,
+ * event notification functions, AP procedures) must use the Microsoft calling
+ * convention. uefi_call_wrapper only takes care of calls in the other direction.
+ */
+#if defined(__x86_64__) && defined(EFI_FUNCTION_WRAPPER)
+	#define EFI_CALLBACK __attribute__((ms_abi))
+#else
+	#define EFI_CALLBACK EFIAPI
+#endif
+
+#ifdef __APPLE__
+	#pragma mark - MP Services protocol (UEFI PI specification, volume 2)
+#endif
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+	{ 0x3fdda605, 0xa76e, 0x4f46, { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+#define PROCESSOR_AS_BSP_BIT        0x00000001
+#define PROCESSOR_ENABLED_BIT       0x00000002
+#define PROCESSOR_HEALTH_STATUS_BIT 0x00000004
+
+typedef struct {
+	UINT32 Package;
+	UINT32 Core;
+	UINT32 Thread;
+} EFI_CPU_PHYSICAL_LOCATION;
+
+typedef struct {
+	UINT64 ProcessorId;
+	UINT32 StatusFlag;
+	EFI_CPU_PHYSICAL_LOCATION Location;
+} EFI_PROCESSOR_INFORMATION;
+
+typedef VOID (EFI_CALLBACK *EFI_AP_PROCEDURE)(VOID *ProcedureArgument);
+
+struct _EFI_MP_SERVICES_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	UINTN *NumberOfProcessors,
+	UINTN *NumberOfEnabledProcessors
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_GET_PROCESSOR_INFO)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	UINTN ProcessorNumber,
+	EFI_PROCESSOR_INFORMATION *ProcessorInfoBuffer
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_STARTUP_ALL_APS)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	EFI_AP_PROCEDURE Procedure,
+	BOOLEAN SingleThread,
+	EFI_EVENT WaitEvent,
+	UINTN TimeoutInMicroSeconds,
+	VOID *ProcedureArgument,
+	UINTN **FailedCpuList
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_STARTUP_THIS_AP)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	EFI_AP_PROCEDURE Procedure,
+	UINTN ProcessorNumber,
+	EFI_EVENT WaitEvent,
+	UINTN TimeoutInMicroseconds,
+	VOID *ProcedureArgument,
+	BOOLEAN *Finished
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_SWITCH_BSP)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	UINTN ProcessorNumber,
+	BOOLEAN EnableOldBSP
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_ENABLEDISABLEAP)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	UINTN ProcessorNumber,
+	BOOLEAN EnableAP,
+	UINT32 *HealthFlag
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_WHOAMI)(
+	struct _EFI_MP_SERVICES_PROTOCOL *This,
+	UINTN *ProcessorNumber
+);
+
+typedef struct _EFI_MP_SERVICES_PROTOCOL {
+	EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS GetNumberOfProcessors;
+	EFI_MP_SERVICES_GET_PROCESSOR_INFO GetProcessorInfo;
+	EFI_MP_SERVICES_STARTUP_ALL_APS StartupAllAPs;
+	EFI_MP_SERVICES_STARTUP_THIS_AP StartupThisAP;
+	EFI_MP_SERVICES_SWITCH_BSP SwitchBSP;
+	EFI_MP_SERVICES_ENABLEDISABLEAP EnableDisableAP;
+	EFI_MP_SERVICES_WHOAMI WhoAmI;
+} EFI_MP_SERVICES_PROTOCOL;
+
+#ifdef __APPLE__
+	#pragma mark - Disk I/O 2 protocol (UEFI 2.4)
+#endif
+#ifndef EFI_DISK_IO2_PROTOCOL_GUID
+#define EFI_DISK_IO2_PROTOCOL_GUID \
+	{ 0x151c8eae, 0x7f2c, 0x472c, { 0x9e, 0x54, 0x98, 0x28, 0x19, 0x4f, 0x6a, 0x88 } }
+
+typedef struct {
+	EFI_EVENT Event;
+	EFI_STATUS TransactionStatus;
+} EFI_DISK_IO2_TOKEN;
+
+struct _EFI_DISK_IO2_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_DISK_CANCEL_EX)(
+	struct _EFI_DISK_IO2_PROTOCOL *This
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_DISK_READ_EX)(
+	struct _EFI_DISK_IO2_PROTOCOL *This,
+	UINT32 MediaId,
+	UINT64 Offset,
+	EFI_DISK_IO2_TOKEN *Token,
+	UINTN BufferSize,
+	VOID *Buffer
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_DISK_WRITE_EX)(
+	struct _EFI_DISK_IO2_PROTOCOL *This,
+	UINT32 MediaId,
+	UINT64 Offset,
+	EFI_DISK_IO2_TOKEN *Token,
+	UINTN BufferSize,
+	VOID *Buffer
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_DISK_FLUSH_EX)(
+	struct _EFI_DISK_IO2_PROTOCOL *This,
+	EFI_DISK_IO2_TOKEN *Token
+);
+
+typedef struct _EFI_DISK_IO2_PROTOCOL {
+	UINT64 Revision;
+	EFI_DISK_CANCEL_EX Cancel;
+	EFI_DISK_READ_EX ReadDiskEx;
+	EFI_DISK_WRITE_EX WriteDiskEx;
+	EFI_DISK_FLUSH_EX FlushDiskEx;
+} EFI_DISK_IO2_PROTOCOL;
+#endif
+
+#ifdef __APPLE__
+	#pragma mark - Block I/O 2 protocol (UEFI 2.3.1)
+#endif
+#ifndef EFI_BLOCK_IO2_PROTOCOL_GUID
+#define EFI_BLOCK_IO2_PROTOCOL_GUID \
+	{ 0xa77b2472, 0xe282, 0x4e9f, { 0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1 } }
+
+typedef struct {
+	EFI_EVENT Event;
+	EFI_STATUS TransactionStatus;
+} EFI_BLOCK_IO2_TOKEN;
+
+struct _EFI_BLOCK_IO2_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_RESET_EX)(
+	struct _EFI_BLOCK_IO2_PROTOCOL *This,
+	BOOLEAN ExtendedVerification
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_READ_EX)(
+	struct _EFI_BLOCK_IO2_PROTOCOL *This,
+	UINT32 MediaId,
+	EFI_LBA LBA,
+	EFI_BLOCK_IO2_TOKEN *Token,
+	UINTN BufferSize,
+	VOID *Buffer
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_WRITE_EX)(
+	struct _EFI_BLOCK_IO2_PROTOCOL *This,
+	UINT32 MediaId,
+	EFI_LBA LBA,
+	EFI_BLOCK_IO2_TOKEN *Token,
+	UINTN BufferSize,
+	VOID *Buffer
+);
+
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_FLUSH_EX)(
+	struct _EFI_BLOCK_IO2_PROTOCOL *This,
+	EFI_BLOCK_IO2_TOKEN *Token
+);
+
+typedef struct _EFI_BLOCK_IO2_PROTOCOL {
+	EFI_BLOCK_IO_MEDIA *Media;
+	EFI_BLOCK_RESET_EX Reset;
+	EFI_BLOCK_READ_EX ReadBlocksEx;
+	EFI_BLOCK_WRITE_EX WriteBlocksEx;
+	EFI_BLOCK_FLUSH_EX FlushBlocksEx;
+} EFI_BLOCK_IO2_PROTOCOL;
+#endif
+
+#ifdef __APPLE__
+	#pragma mark - SMBIOS 3.0 entry point
+#endif
+#ifndef SMBIOS3_TABLE_GUID
+#define SMBIOS3_TABLE_GUID \
+	{ 0xf2fd1544, 0x9794, 0x4a2c, { 0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94 } }
+#endif
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A small cooperative scheduler. Enterprise spends most of its life waiting for the user to
+ * press a key; while it waits, registered background tasks are run a slice at a time, and
+ * the events being waited on are checked between slices so the menus stay responsive.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "sched.h"
+#include "timing.h"
+
+// How long to keep running tasks before checking the events again.
+#define SCHEDULER_SLICE_TIME 10000
+// How often (in 100ns units) to wake up for the next slice while there are tasks. Shorter
+// than a slice, so the tick has always gone off by the time a slice is over.
+#define SCHEDULER_TICK (1000 * 10)
+#define SCHEDULER_MAX_EVENTS 8
+
+static BackgroundTask *tasks = NULL;
+static BackgroundTask *next_task = NULL;
+
+BackgroundTask* SchedulerAddTask(BACKGROUND_TASK_STEP step, BACKGROUND_TASK_CANCEL cancel, VOID *context,
+	BOOLEAN must_finish) {
+	BackgroundTask *task = AllocateZeroPool(sizeof(BackgroundTask));
+	if (!task) {
+		return NULL;
+	}
+
+	task->step = step;
+	task->cancel = cancel;
+	task->context = context;
+	task->must_finish = must_finish;
+
+	// Append, so tasks get their first slice in the order they were added.
+	BackgroundTask **link = &tasks;
+	while (*link) {
+		link = &(*link)->next;
+	}
+	*link = task;
+
+	return task;
+}
+
+static VOID RemoveTask(BackgroundTask *task) {
+	BackgroundTask **link = &tasks;
+	while (*link && *link != task) {
+		link = &(*link)->next;
+	}
+
+	if (*link) {
+		*link = task->next;
+	}
+
+	if (next_task == task) {
+		next_task = task->next;
+	}
+
+	FreePool(task);
+}
+
+VOID SchedulerCancelTask(BackgroundTask *task) {
+	if (task->cancel) {
+		task->cancel(task->context);
+	}
+
+	RemoveTask(task);
+}
+
+/*
+ * Runs a single task to completion right now, for when its result is needed.
+ */
+VOID SchedulerRunTask(BackgroundTask *task) {
+	BOOLEAN finished = FALSE;
+	while (!finished) {
+		finished = task->step(task->context);
+	}
+	RemoveTask(task);
+}
+
+/*
+ * Steps the tasks round-robin until the slice is used up. Every runnable task gets at least
+ * one step. Returns TRUE if there is still work left to do.
+ */
+BOOLEAN SchedulerRunSlice(VOID) {
+	UINT64 start = TimestampNow();
+
+	while (tasks) {
+		BackgroundTask *task = next_task ? next_task : tasks;
+		next_task = task->next;
+
+		if (task->step(task->context)) {
+			RemoveTask(task);
+		}
+
+		if (TimestampToMicroseconds(TimestampNow() - start) >= SCHEDULER_SLICE_TIME) {
+			break;
+		}
+	}
+
+	return tasks != NULL;
+}
+
+/*
+ * Waits for one of the given events to be signalled, running background tasks while nothing
+ * is happening. A timeout (in microseconds) of zero waits forever; otherwise EFI_TIMEOUT is
+ * returned when it expires. The events must be waitable, i.e. not notify-signal events.
+ */
+EFI_STATUS SchedulerWaitForEvents(UINTN count, EFI_EVENT *events, UINT64 timeout, UINTN *index) {
+	EFI_EVENT wait_list[SCHEDULER_MAX_EVENTS + 2];
+	EFI_EVENT timer = NULL, tick = NULL;
+	UINTN total = count;
+	EFI_STATUS err;
+	UINTN i;
+
+	if (count > SCHEDULER_MAX_EVENTS) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < count; i++) {
+		wait_list[i] = events[i];
+	}
+
+	if (timeout) {
+		err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL, &timer);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+
+		uefi_call_wrapper(BS->SetTimer, 3, timer, TimerRelative, timeout * 10);
+		wait_list[total++] = timer;
+	}
+
+	// While there are tasks, the tick is waited on as well, so the firmware can idle the CPU
+	// between slices instead of us checking the events over and over. Without one, the tasks
+	// wait until we're done.
+	err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL, &tick);
+	if (!EFI_ERROR(err)) {
+		uefi_call_wrapper(BS->SetTimer, 3, tick, TimerPeriodic, SCHEDULER_TICK);
+		wait_list[total] = tick;
+	} else {
+		tick = NULL;
+	}
+
+	for (;;) {
+		err = uefi_call_wrapper(BS->WaitForEvent, 3, tasks && tick ? total + 1 : total, wait_list, index);
+		if (EFI_ERROR(err) || *index < total) {
+			break;
+		}
+
+		SchedulerRunSlice();
+	}
+
+	if (tick) {
+		uefi_call_wrapper(BS->CloseEvent, 1, tick);
+	}
+	if (timer) {
+		uefi_call_wrapper(BS->CloseEvent, 1, timer);
+		if (!EFI_ERROR(err) && *index == count) {
+			err = EFI_TIMEOUT;
+		}
+	}
+
+	return err;
+}
+
+/*
+ * Brings background work to a deterministic end before another image is started: tasks
+ * whose results are needed are run to completion, and everything else is cancelled.
+ */
+VOID SchedulerShutdown(VOID) {
+	while (tasks) {
+		BackgroundTask *task = tasks;
+		if (task->must_finish) {
+			SchedulerRunTask(task);
+		} else {
+			SchedulerCancelTask(task);
+		}
+	}
+}
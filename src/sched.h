@@ -0,0 +1,45 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _sched_h
+#define _sched_h
+
+/*
+ * A background task does a small, bounded piece of work each time its step function is
+ * called and returns TRUE once it has nothing left to do. The cancel function, if any, is
+ * called instead when the task is abandoned, and must release whatever the task holds.
+ */
+typedef BOOLEAN (*BACKGROUND_TASK_STEP)(VOID *);
+typedef VOID (*BACKGROUND_TASK_CANCEL)(VOID *);
+
+typedef struct BackgroundTask {
+	BACKGROUND_TASK_STEP step;
+	BACKGROUND_TASK_CANCEL cancel;
+	VOID *context;
+	BOOLEAN must_finish;
+	struct BackgroundTask *next;
+} BackgroundTask;
+
+BackgroundTask* SchedulerAddTask(BACKGROUND_TASK_STEP, BACKGROUND_TASK_CANCEL, VOID *, BOOLEAN);
+VOID SchedulerCancelTask(BackgroundTask *);
+VOID SchedulerRunTask(BackgroundTask *);
+BOOLEAN SchedulerRunSlice(VOID);
+EFI_STATUS SchedulerWaitForEvents(UINTN, EFI_EVENT *, UINT64, UINTN *);
+VOID SchedulerShutdown(VOID);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "sha256.h"
+
+#if defined(__x86_64__)
+	#include <cpuid.h>
+	#include <immintrin.h>
+	#define SHA256_HAVE_SHANI
+#endif
+
+static const UINT32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+typedef VOID (*SHA256_TRANSFORM)(UINT32 *, const UINT8 *, UINTN);
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Portable implementation; processes the given number of 64-byte blocks. */
+static VOID Sha256TransformGeneric(UINT32 *state, const UINT8 *data, UINTN blocks) {
+	UINT32 w[64];
+	UINT32 a, b, c, d, e, f, g, h, t1, t2;
+	UINTN i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++) {
+			w[i] = ((UINT32)data[i * 4] << 24) | ((UINT32)data[i * 4 + 1] << 16) |
+				((UINT32)data[i * 4 + 2] << 8) | (UINT32)data[i * 4 + 3];
+		}
+
+		for (i = 16; i < 64; i++) {
+			UINT32 s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			UINT32 s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256_BLOCK_SIZE;
+	}
+}
+
+#ifdef SHA256_HAVE_SHANI
+/*
+ * Implementation using the Intel SHA extensions, which most CPUs from the last
+ * few years have. Each iteration of the inner loop performs four rounds; the
+ * message schedule for later rounds is computed in between.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static VOID Sha256TransformShaNi(UINT32 *state, const UINT8 *data, UINTN blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+	__m128i w[4];
+	UINTN g;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);            // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);      // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);      // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);   // CDGH
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		for (g = 0; g < 16; g++) {
+			if (g < 4) {
+				w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + g * 16)), mask);
+			}
+
+			msg = _mm_add_epi32(w[g % 4], _mm_loadu_si128((const __m128i *)&sha256_k[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+			if (g >= 3 && g <= 14) {
+				tmp = _mm_alignr_epi8(w[g % 4], w[(g + 3) % 4], 4);
+				w[(g + 1) % 4] = _mm_add_epi32(w[(g + 1) % 4], tmp);
+				w[(g + 1) % 4] = _mm_sha256msg2_epu32(w[(g + 1) % 4], w[g % 4]);
+			}
+
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			if (g >= 1 && g <= 12) {
+				w[(g + 3) % 4] = _mm_sha256msg1_epu32(w[(g + 3) % 4], w[g % 4]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);         // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);      // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);   // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);      // ABEF
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static SHA256_TRANSFORM Sha256SelectTransform(VOID) {
+	static SHA256_TRANSFORM transform = NULL;
+
+	if (transform) {
+		return transform;
+	}
+
+	transform = Sha256TransformGeneric;
+#ifdef SHA256_HAVE_SHANI
+	// SHA-NI is reported in CPUID leaf 7, EBX bit 29. SSE4.1 and SSSE3 are
+	// needed for the shuffles around it.
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+		__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29))) {
+		transform = Sha256TransformShaNi;
+	}
+#endif
+
+	return transform;
+}
+
+BOOLEAN Sha256HardwareAccelerated(VOID) {
+	return Sha256SelectTransform() != Sha256TransformGeneric;
+}
+
+VOID Sha256Init(SHA256_CONTEXT *ctx) {
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->length = 0;
+	ctx->buffered = 0;
+
+	// Pick the transform here, on the calling processor, so that the CPUID
+	// probe never has to run on an application processor mid-hash.
+	Sha256SelectTransform();
+}
+
+VOID Sha256Update(SHA256_CONTEXT *ctx, const VOID *data, UINTN length) {
+	SHA256_TRANSFORM transform = Sha256SelectTransform();
+	const UINT8 *bytes = data;
+
+	ctx->length += length;
+
+	// Top up a partially filled block first.
+	if (ctx->buffered) {
+		UINTN take = SHA256_BLOCK_SIZE - ctx->buffered;
+		if (take > length) {
+			take = length;
+		}
+
+		CopyMem(ctx->buffer + ctx->buffered, bytes, take);
+		ctx->buffered += take;
+		bytes += take;
+		length -= take;
+
+		if (ctx->buffered < SHA256_BLOCK_SIZE) {
+			return;
+		}
+
+		transform(ctx->state, ctx->buffer, 1);
+		ctx->buffered = 0;
+	}
+
+	// Hash whole blocks straight out of the caller's buffer.
+	if (length >= SHA256_BLOCK_SIZE) {
+		UINTN blocks = length / SHA256_BLOCK_SIZE;
+		transform(ctx->state, bytes, blocks);
+		bytes += blocks * SHA256_BLOCK_SIZE;
+		length -= blocks * SHA256_BLOCK_SIZE;
+	}
+
+	if (length) {
+		CopyMem(ctx->buffer, bytes, length);
+		ctx->buffered = length;
+	}
+}
+
+VOID Sha256Final(SHA256_CONTEXT *ctx, UINT8 *digest) {
+	SHA256_TRANSFORM transform = Sha256SelectTransform();
+	UINT64 bits = ctx->length * 8;
+	UINTN i;
+
+	ctx->buffer[ctx->buffered++] = 0x80;
+	if (ctx->buffered > SHA256_BLOCK_SIZE - 8) {
+		SetMem(ctx->buffer + ctx->buffered, SHA256_BLOCK_SIZE - ctx->buffered, 0);
+		transform(ctx->state, ctx->buffer, 1);
+		ctx->buffered = 0;
+	}
+
+	SetMem(ctx->buffer + ctx->buffered, SHA256_BLOCK_SIZE - 8 - ctx->buffered, 0);
+	for (i = 0; i < 8; i++) {
+		ctx->buffer[SHA256_BLOCK_SIZE - 1 - i] = (UINT8)(bits >> (i * 8));
+	}
+	transform(ctx->state, ctx->buffer, 1);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = (UINT8)(ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (UINT8)(ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (UINT8)(ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (UINT8)ctx->state[i];
+	}
+}
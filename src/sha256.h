@@ -0,0 +1,37 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#pragma once
+#ifndef _sha256_h
+#define _sha256_h
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+	UINT32 state[8];
+	UINT64 length;
+	UINT8 buffer[SHA256_BLOCK_SIZE];
+	UINTN buffered;
+} SHA256_CONTEXT;
+
+VOID Sha256Init(SHA256_CONTEXT *);
+VOID Sha256Update(SHA256_CONTEXT *, const VOID *, UINTN);
+VOID Sha256Final(SHA256_CONTEXT *, UINT8 *);
+BOOLEAN Sha256HardwareAccelerated(VOID);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Reads the few SMBIOS fields that tell machines apart: the system UUID and product name
+ * (type 1) and the baseboard product (type 2), which on a Mac is its board ID. The tables
+ * don't change while we run, so they're only walked once.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "smbios.h"
+#include "protocols.h"
+
+#define SMBIOS_TYPE_SYSTEM 1
+#define SMBIOS_TYPE_BASEBOARD 2
+#define SMBIOS_TYPE_END 127
+
+static SmbiosIdentity identity;
+static BOOLEAN identity_read = FALSE;
+
+static UINT16 ReadLittleEndian16(const UINT8 *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static UINT32 ReadLittleEndian32(const UINT8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+/*
+ * Finds the structure table through the SMBIOS 3.0 entry point if the firmware has one, and
+ * the older 32-bit one otherwise.
+ */
+static BOOLEAN FindStructureTable(const UINT8 **table, UINTN *length) {
+	EFI_GUID smbios3_guid = SMBIOS3_TABLE_GUID;
+	UINT8 *entry;
+
+	if (!EFI_ERROR(LibGetSystemConfigurationTable(&smbios3_guid, (VOID **)&entry)) &&
+		CompareMem(entry, "_SM3_", 5) == 0) {
+		*length = ReadLittleEndian32(entry + 0x0C);
+		*table = (const UINT8 *)(UINTN)(ReadLittleEndian32(entry + 0x10) |
+			((UINT64)ReadLittleEndian32(entry + 0x14) << 32));
+		return TRUE;
+	}
+
+	if (!EFI_ERROR(LibGetSystemConfigurationTable(&SMBIOSTableGuid, (VOID **)&entry)) &&
+		CompareMem(entry, "_SM_", 4) == 0) {
+		*length = ReadLittleEndian16(entry + 0x16);
+		*table = (const UINT8 *)(UINTN)ReadLittleEndian32(entry + 0x18);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Copies string number index from the string set that follows a structure's formatted
+ * area. Strings are numbered from one; zero means the field isn't set.
+ */
+static VOID CopyStructureString(const UINT8 *strings, const UINT8 *end, UINT8 index, CHAR8 *output) {
+	UINTN length = 0;
+
+	output[0] = '\0';
+	if (index == 0) {
+		return;
+	}
+
+	while (--index > 0 && strings < end) {
+		while (strings < end && *strings) {
+			strings++;
+		}
+		strings++;
+	}
+
+	while (strings < end && *strings && length < SMBIOS_STRING_LENGTH) {
+		output[length++] = *strings++;
+	}
+
+	// Vendors pad these with spaces.
+	while (length > 0 && output[length - 1] == ' ') {
+		length--;
+	}
+	output[length] = '\0';
+}
+
+// Formats the UUID the way dmidecode and Linux's product_uuid show it.
+static VOID FormatUuid(const UINT8 *uuid, CHAR8 *output) {
+	static const char hex[] = "0123456789ABCDEF";
+	// Since SMBIOS 2.6, the first three fields are little endian.
+	static const UINT8 order[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+	UINTN i, length = 0;
+
+	BOOLEAN all_zero = TRUE, all_ones = TRUE;
+	for (i = 0; i < 16; i++) {
+		all_zero = all_zero && uuid[i] == 0x00;
+		all_ones = all_ones && uuid[i] == 0xFF;
+	}
+
+	// Neither of these identifies anything.
+	if (all_zero || all_ones) {
+		output[0] = '\0';
+		return;
+	}
+
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			output[length++] = '-';
+		}
+		output[length++] = hex[uuid[order[i]] >> 4];
+		output[length++] = hex[uuid[order[i]] & 0xF];
+	}
+	output[length] = '\0';
+}
+
+static VOID ReadIdentity(VOID) {
+	const UINT8 *table, *p, *end;
+	UINTN length;
+
+	if (!FindStructureTable(&table, &length) || !table) {
+		return;
+	}
+
+	p = table;
+	end = table + length;
+	while (p + 4 <= end) {
+		UINT8 type = p[0];
+		UINT8 formatted_length = p[1];
+		if (formatted_length < 4 || p + formatted_length > end) {
+			break;
+		}
+
+		// The string set ends with two NUL bytes.
+		const UINT8 *strings = p + formatted_length;
+		const UINT8 *next = strings;
+		while (next + 1 < end && (next[0] || next[1])) {
+			next++;
+		}
+		next += 2;
+
+		if (type == SMBIOS_TYPE_SYSTEM && formatted_length >= 0x08) {
+			CopyStructureString(strings, end, p[0x05], identity.product);
+			if (formatted_length >= 0x18) {
+				FormatUuid(p + 0x08, identity.uuid);
+			}
+		} else if (type == SMBIOS_TYPE_BASEBOARD && formatted_length >= 0x06 && !identity.board[0]) {
+			CopyStructureString(strings, end, p[0x05], identity.board);
+		} else if (type == SMBIOS_TYPE_END) {
+			break;
+		}
+
+		p = next;
+	}
+}
+
+/*
+ * Returns this machine's identity. Fields the firmware doesn't report are empty strings.
+ */
+const SmbiosIdentity* GetSmbiosIdentity(VOID) {
+	if (!identity_read) {
+		SetMem(&identity, sizeof(identity), 0);
+		ReadIdentity();
+		identity_read = TRUE;
+	}
+
+	return &identity;
+}
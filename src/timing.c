@@ -0,0 +1,122 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "main.h"
+#include "timing.h"
+#include "utils.h"
+
+#define MAX_TIMING_MARKS 16
+
+typedef struct {
+	const CHAR8 *name;
+	UINT64 time;
+} TimingMarkRecord;
+
+static UINT64 ticks_per_microsecond = 0;
+static UINT64 start_time = 0;
+static TimingMarkRecord marks[MAX_TIMING_MARKS];
+static UINTN mark_count = 0;
+
+/*
+ * Reads the processor's time stamp counter. This is far cheaper and finer grained than
+ * anything the firmware offers, which is what we want for timing screen updates and I/O.
+ */
+UINT64 TimestampNow(VOID) {
+#if defined(__x86_64__) || defined(__i386__)
+	UINT32 low, high;
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((UINT64)high << 32) | low;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Works out how fast the time stamp counter runs by timing a short stall. This must be
+ * called once from the boot processor before any timestamps are converted.
+ */
+VOID TimingInit(VOID) {
+	UINT64 start = start_time = TimestampNow();
+	uefi_call_wrapper(BS->Stall, 1, 10 * 1000);
+	UINT64 elapsed = TimestampNow() - start;
+
+	ticks_per_microsecond = elapsed / (10 * 1000);
+	if (ticks_per_microsecond == 0) {
+		ticks_per_microsecond = 1;
+	}
+}
+
+UINT64 TimestampToMicroseconds(UINT64 ticks) {
+	if (ticks_per_microsecond == 0) {
+		return 0;
+	}
+
+	return ticks / ticks_per_microsecond;
+}
+
+/*
+ * Notes that the boot got as far as name, which must be a string constant. A mark that's
+ * already there is moved to now, so that only the last time round the menu counts.
+ */
+VOID TimingMark(const CHAR8 *name) {
+	UINTN i;
+	for (i = 0; i < mark_count && marks[i].name != name; i++);
+	if (i == MAX_TIMING_MARKS) {
+		return;
+	}
+
+	marks[i].name = name;
+	marks[i].time = TimestampNow();
+	if (i == mark_count) {
+		mark_count++;
+	}
+}
+
+/*
+ * Leaves the marks, in microseconds since we started, in the volatile Enterprise_BootTiming
+ * variable as "name=time" lines, where the running system can read them.
+ */
+VOID StoreBootTiming(VOID) {
+	CHAR16 *report = NULL;
+	UINTN i;
+
+	for (i = 0; i < mark_count; i++) {
+		CHAR16 *line = PoolPrint(L"%s%a=%ld\n", report ? report : L"", marks[i].name,
+			TimestampToMicroseconds(marks[i].time - start_time));
+		if (report) {
+			FreePool(report);
+		}
+		if (!line) {
+			return;
+		}
+		report = line;
+	}
+	if (!report) {
+		return;
+	}
+
+	UINTN length = StrLen(report);
+	CHAR8 *ascii = UTF16toASCII(report, length + 1);
+	if (ascii) {
+		efi_set_variable(&enterprise_variable_guid, L"Enterprise_BootTiming", ascii, length + 1, FALSE);
+		FreePool(ascii);
+	}
+	FreePool(report);
+}
@@ -0,0 +1,311 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Unified kernel images: a kernel together with its initrd, command line and os-release
+ * file in one PE image. We start them directly with LoadImage and StartImage, so there is
+ * no GRUB, no loopback mount and no separate initrd to read, and the firmware checks the
+ * signature if Secure Boot is on. An image is on our own drive unless its path starts with
+ * the label of another volume and a colon, as in "DATA:\EFI\Linux\image.efi".
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "uki.h"
+#include "config.h"
+#include "utils.h"
+#include "listview.h"
+
+#define PE_HEADER_READ_SIZE 4096
+#define PE_SECTION_HEADER_SIZE 40
+#define PE_MAX_SECTIONS 96
+#define MAX_OSREL_SIZE (16 * 1024)
+
+#ifdef __APPLE__
+	#pragma mark - Finding the image
+#endif
+/*
+ * Finds the volume an image is on. The caller closes the returned directory, which is only
+ * different from root_dir for another volume, and frees path.
+ */
+static EFI_STATUS LocateUki(CHAR8 *uki_path, EFI_HANDLE *device, EFI_FILE_HANDLE *volume, CHAR16 **path) {
+	INTN colon = strposa(uki_path, ':');
+
+	*path = NULL;
+	if (colon <= 0) {
+		*device = this_image->DeviceHandle;
+		*volume = root_dir;
+		*path = ASCIItoUTF16(uki_path, strlena(uki_path) + 1);
+		return *path ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+	}
+
+	CHAR16 *label = ASCIItoUTF16(uki_path, colon);
+	if (!label) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	*volume = OpenVolumeByLabel(label, device);
+	FreePool(label);
+	if (!*volume) {
+		return EFI_NOT_FOUND;
+	}
+
+	*path = ASCIItoUTF16(uki_path + colon + 1, strlena(uki_path + colon + 1) + 1);
+	if (!*path) {
+		uefi_call_wrapper((*volume)->Close, 1, *volume);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Reading the name
+#endif
+static EFI_STATUS ReadAt(EFI_FILE_HANDLE file, UINT64 offset, UINTN length, VOID *buffer) {
+	UINTN read = length;
+	EFI_STATUS err = uefi_call_wrapper(file->SetPosition, 2, file, offset);
+	if (!EFI_ERROR(err)) {
+		err = uefi_call_wrapper(file->Read, 3, file, &read, buffer);
+	}
+	if (!EFI_ERROR(err) && read != length) {
+		err = EFI_END_OF_FILE;
+	}
+	return err;
+}
+
+static UINT32 ReadLittleEndian32(const UINT8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+/*
+ * Reads the .osrel section of the image by way of the PE section table, without reading
+ * the rest of the image. The returned text is NUL-terminated.
+ */
+static CHAR8* ReadOsRelease(EFI_FILE_HANDLE file) {
+	UINT8 *headers = AllocatePool(PE_HEADER_READ_SIZE);
+	CHAR8 *text = NULL;
+
+	if (!headers || EFI_ERROR(ReadAt(file, 0, PE_HEADER_READ_SIZE, headers)) || headers[0] != 'M' ||
+		headers[1] != 'Z') {
+		goto out;
+	}
+
+	UINT32 pe = ReadLittleEndian32(headers + 0x3C);
+	if (pe > PE_HEADER_READ_SIZE - 24 || CompareMem(headers + pe, "PE\0\0", 4) != 0) {
+		goto out;
+	}
+
+	UINTN sections = headers[pe + 6] | (headers[pe + 7] << 8);
+	UINTN table = pe + 24 + (headers[pe + 20] | (headers[pe + 21] << 8));
+	if (sections > PE_MAX_SECTIONS) {
+		goto out;
+	}
+
+	// The section table normally fits in the first page, but needn't.
+	UINTN table_end = table + sections * PE_SECTION_HEADER_SIZE;
+	if (table_end > PE_HEADER_READ_SIZE) {
+		FreePool(headers);
+		headers = AllocatePool(table_end);
+		if (!headers || EFI_ERROR(ReadAt(file, 0, table_end, headers))) {
+			goto out;
+		}
+	}
+
+	UINTN i;
+	for (i = 0; i < sections; i++) {
+		const UINT8 *section = headers + table + i * PE_SECTION_HEADER_SIZE;
+		if (CompareMem(section, ".osrel\0\0", 8) != 0) {
+			continue;
+		}
+
+		UINT32 virtual_size = ReadLittleEndian32(section + 8);
+		UINT32 raw_size = ReadLittleEndian32(section + 16);
+		UINTN size = virtual_size && virtual_size < raw_size ? virtual_size : raw_size;
+		if (size == 0 || size > MAX_OSREL_SIZE) {
+			break;
+		}
+
+		text = AllocatePool(size + 1);
+		if (text && EFI_ERROR(ReadAt(file, ReadLittleEndian32(section + 20), size, text))) {
+			FreePool(text);
+			text = NULL;
+		} else if (text) {
+			text[size] = '\0';
+		}
+		break;
+	}
+
+out:
+	if (headers) {
+		FreePool(headers);
+	}
+	return text;
+}
+
+/*
+ * Finds a key in os-release text and returns its value, without any quotes around it.
+ */
+static CHAR8* OsReleaseValue(CHAR8 *text, CHAR8 *key) {
+	UINTN key_length = strlena(key);
+	CHAR8 *line = text;
+
+	while (*line) {
+		CHAR8 *end = line;
+		while (*end && *end != '\n') {
+			end++;
+		}
+
+		if ((UINTN)(end - line) > key_length && strncmpa(line, key, key_length) == 0 &&
+			line[key_length] == '=') {
+			CHAR8 *value = line + key_length + 1;
+			CHAR8 *value_end = end;
+			if (value_end > value && value_end[-1] == '\r') {
+				value_end--;
+			}
+			if (value_end - value >= 2 && (*value == '"' || *value == '\'') && value_end[-1] == *value) {
+				value++;
+				value_end--;
+			}
+			if (value_end == value) {
+				return NULL;
+			}
+
+			CHAR8 *result = AllocatePool(value_end - value + 1);
+			if (result) {
+				CopyMem(result, value, value_end - value);
+				result[value_end - value] = '\0';
+			}
+			return result;
+		}
+
+		line = *end ? end + 1 : end;
+	}
+
+	return NULL;
+}
+
+static CHAR8* FileNameOf(CHAR8 *path) {
+	CHAR8 *name = path, *p;
+	for (p = path; *p; p++) {
+		if (*p == '\\' || *p == '/' || *p == ':') {
+			name = p + 1;
+		}
+	}
+
+	CHAR8 *copy = AllocatePool(strlena(name) + 1);
+	if (copy) {
+		strcpya(copy, name);
+	}
+	return copy;
+}
+
+/*
+ * Names an image's entry after the distribution in it, the first time the name is needed.
+ * Images without a readable .osrel section are named after their file.
+ */
+VOID UkiResolveName(LinuxBootOption *option) {
+	EFI_HANDLE device;
+	EFI_FILE_HANDLE volume, file;
+	CHAR16 *path;
+
+	if (!option->uki_path || option->name) {
+		return;
+	}
+
+	if (!EFI_ERROR(LocateUki(option->uki_path, &device, &volume, &path))) {
+		if (!EFI_ERROR(uefi_call_wrapper(volume->Open, 5, volume, &file, path, EFI_FILE_MODE_READ, 0))) {
+			CHAR8 *os_release = ReadOsRelease(file);
+			if (os_release) {
+				option->name = OsReleaseValue(os_release, (CHAR8 *)"PRETTY_NAME");
+				if (!option->name) {
+					option->name = OsReleaseValue(os_release, (CHAR8 *)"NAME");
+				}
+				FreePool(os_release);
+			}
+			uefi_call_wrapper(file->Close, 1, file);
+		}
+		FreePool(path);
+		CloseVolume(volume);
+	}
+
+	if (!option->name) {
+		option->name = FileNameOf(option->uki_path);
+	}
+	ListViewNameMasks(option->name, &option->name_chars, &option->name_pairs);
+}
+
+#ifdef __APPLE__
+	#pragma mark - Booting
+#endif
+/*
+ * Loads the image for an entry, ready for StartImage. The kernel parameters are passed as
+ * its load options, which the stub uses unless the image has its own command line and
+ * Secure Boot is on.
+ */
+EFI_STATUS LoadUkiImage(EFI_HANDLE parent, LinuxBootOption *option, CHAR8 *kernel_parameters, EFI_HANDLE *image) {
+	EFI_LOADED_IMAGE *loaded_image;
+	EFI_HANDLE device;
+	EFI_FILE_HANDLE volume;
+	CHAR16 *path;
+	CHAR8 *contents = NULL;
+
+	EFI_STATUS err = LocateUki(option->uki_path, &device, &volume, &path);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	// One read of the whole image, rather than leaving the firmware to read it in pieces.
+	UINTN size = FileRead(volume, path, &contents);
+	EFI_DEVICE_PATH *device_path = FileDevicePath(device, path);
+	FreePool(path);
+	CloseVolume(volume);
+	if (size == 0 || !device_path) {
+		if (contents) {
+			FreePool(contents);
+		}
+		if (device_path) {
+			FreePool(device_path);
+		}
+		return size == 0 ? EFI_NOT_FOUND : EFI_OUT_OF_RESOURCES;
+	}
+
+	err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent, device_path, contents, size, image);
+	FreePool(contents);
+	FreePool(device_path);
+	if (EFI_ERROR(err)) {
+		return err;
+	}
+
+	UINTN length = kernel_parameters ? strlena(kernel_parameters) : 0;
+	while (length > 0 && kernel_parameters[length - 1] == ' ') {
+		length--;
+	}
+	if (length > 0) {
+		// These stay allocated for as long as the image runs.
+		CHAR16 *options = ASCIItoUTF16(kernel_parameters, length);
+		err = uefi_call_wrapper(BS->HandleProtocol, 3, *image, &LoadedImageProtocol, (VOID **)&loaded_image);
+		if (options && !EFI_ERROR(err)) {
+			loaded_image->LoadOptions = options;
+			loaded_image->LoadOptionsSize = StrSize(options);
+		} else if (options) {
+			FreePool(options);
+		}
+	}
+
+	return EFI_SUCCESS;
+}
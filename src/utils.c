@@ -19,6 +19,9 @@
 #include <efilib.h>
 
 #include "utils.h"
+#include "config.h"
+#include "hardware.h"
+#include "varstore.h"
 
 #ifdef __APPLE__
 	#pragma mark - Get/Set/Delete EFI variables
@@ -31,6 +34,12 @@ EFI_STATUS efi_set_variable(const EFI_GUID * const vendor, CHAR16 *name, CHAR8 *
 		flags |= EFI_VARIABLE_NON_VOLATILE;
 	}
 	
+	// Our own variables are written back in one go when we hand off to GRUB.
+	EFI_STATUS err = VarStoreSet(vendor, name, buf, size, flags);
+	if (err != EFI_UNSUPPORTED) {
+		return err;
+	}
+	
 	return uefi_call_wrapper(RT->SetVariable, 5, name, (EFI_GUID *)vendor, flags, size, buf);
 }
 
@@ -39,6 +48,11 @@ EFI_STATUS efi_delete_variable(const EFI_GUID * const vendor, CHAR16 *name) {
 	UINTN size = 0;
 	
 	flags = EFI_VARIABLE_BOOTSERVICE_ACCESS|EFI_VARIABLE_RUNTIME_ACCESS;
+	EFI_STATUS err = VarStoreSet(vendor, name, NULL, 0, flags);
+	if (err != EFI_UNSUPPORTED) {
+		return err;
+	}
+	
 	return uefi_call_wrapper(RT->SetVariable, 5, name, (EFI_GUID *)vendor, flags, size, NULL);
 }
 
@@ -47,7 +61,18 @@ EFI_STATUS efi_get_variable(const EFI_GUID *const vendor, CHAR16 *name, CHAR8 **
 	UINTN length;
 	EFI_STATUS err;
 
-	length = sizeof(CHAR16 *) * EFI_MAXIMUM_VARIABLE_SIZE;
+	err = VarStoreGet(vendor, name, buffer, size);
+	if (err != EFI_UNSUPPORTED) {
+		return err;
+	}
+
+	// Ask for the size first so that we only allocate as much as the variable needs.
+	length = 0;
+	err = uefi_call_wrapper(RT->GetVariable, 5, name, (EFI_GUID *)vendor, NULL, &length, NULL);
+	if (err != EFI_BUFFER_TOO_SMALL) {
+		return EFI_ERROR(err) ? err : EFI_NOT_FOUND;
+	}
+
 	buf = AllocatePool(length);
 	if (!buf) {
 		return EFI_OUT_OF_RESOURCES;
@@ -93,18 +118,19 @@ EFI_STATUS ReadStringFromKeyboard(OUT CHAR16 **outString) {
 	*outString = AllocateZeroPool(sizeof(CHAR16) * (maxInputLength + 1));
 	
 	// Check to make sure we have the memory.
-	if (!outString) {
+	if (!*outString) {
 		DisplayErrorText(L"Error: can't allocate memory for keyboard input.\n");
 		return EFI_OUT_OF_RESOURCES;
 	}
 	
-	// Read (and echo back to) the keyboard
+	// Read (and echo back to) the keyboard. key_read lets background work run while
+	// nothing is typed, and takes keys from a test script when there is one.
 	CHAR16 key = 0;
 	while (key != 13) {
-		EFI_INPUT_KEY inputKey;
-		err = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &inputKey);
-		if (err != EFI_NOT_READY) {
-			key = inputKey.UnicodeChar;
+		UINT64 keypress;
+		err = key_read(&keypress, TRUE);
+		if (!EFI_ERROR(err)) {
+			key = keypress & 0xffff;
 			
 			if (!(key < 0x20 || key > 127)) {
 				CHAR16 tempStr[2] = {key, '\0'};
@@ -276,6 +302,151 @@ CHAR8* PathConvert(CHAR8 needle, CHAR8 *path) {
 	return path;
 }
 
+/**
+ * 32-bit FNV-1a hash, used wherever we need a compact key for a path or name.
+ */
+UINT32 Fnv1aHash(const VOID *data, UINTN length) {
+	const UINT8 *bytes = data;
+	UINT32 hash = 0x811c9dc5;
+
+	while (length--) {
+		hash ^= *bytes++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+/**
+ * Opens the root of the volume with the given label, and sets device to its handle. Any
+ * volume a firmware driver understands will do, not only FAT ones. Returns NULL if there
+ * is no such volume.
+ */
+EFI_FILE_HANDLE OpenVolumeByLabel(CHAR16 *label, EFI_HANDLE *device) {
+	EFI_HANDLE *handles;
+	UINTN count, i;
+	EFI_FILE_HANDLE found = NULL;
+
+	if (EFI_ERROR(LibLocateHandle(ByProtocol, &FileSystemProtocol, NULL, &count, &handles))) {
+		return NULL;
+	}
+
+	for (i = 0; i < count && !found; i++) {
+		EFI_FILE_HANDLE root = LibOpenRoot(handles[i]);
+		if (!root) {
+			continue;
+		}
+
+		EFI_FILE_SYSTEM_VOLUME_LABEL_INFO *info = LibFileSystemVolumeLabelInfo(root);
+		if (info && StriCmp(info->VolumeLabel, label) == 0) {
+			found = root;
+			*device = handles[i];
+		} else {
+			uefi_call_wrapper(root->Close, 1, root);
+		}
+		if (info) {
+			FreePool(info);
+		}
+	}
+
+	FreePool(handles);
+	return found;
+}
+
+/**
+ * Closes a volume from OpenVolumeByLabel or IsoVolumeForBootOption, unless it's ours.
+ */
+VOID CloseVolume(EFI_FILE_HANDLE volume) {
+	if (volume != root_dir) {
+		uefi_call_wrapper(volume->Close, 1, volume);
+	}
+}
+
+/**
+ * Opens the volume the ISO of the given boot option is on: ours, unless its path starts
+ * with the label of another volume, as in "BIGDATA:\isos\fedora.iso". Returns NULL if
+ * that volume isn't there. Close it with CloseVolume.
+ */
+EFI_FILE_HANDLE IsoVolumeForBootOption(LinuxBootOption *option) {
+	INTN colon = strposa(option->iso_path, ':');
+	EFI_HANDLE device;
+
+	if (colon <= 0) {
+		return root_dir;
+	}
+
+	CHAR16 *label = ASCIItoUTF16(option->iso_path, colon);
+	if (!label) {
+		return NULL;
+	}
+
+	EFI_FILE_HANDLE volume = OpenVolumeByLabel(label, &device);
+	FreePool(label);
+	return volume;
+}
+
+BOOLEAN IsoIsOnBootVolume(LinuxBootOption *option) {
+	return strposa(option->iso_path, ':') <= 0;
+}
+
+/**
+ * Returns the full path of the ISO file used by the given boot option on its volume. GRUB
+ * resolves iso_path relative to its own directory, so we do the same for ours; on another
+ * volume it's from the root. The caller must free the returned string.
+ */
+CHAR16* IsoPathForBootOption(LinuxBootOption *option) {
+	INTN colon = strposa(option->iso_path, ':');
+	CHAR8 *iso_path = colon > 0 ? option->iso_path + colon + 1 : option->iso_path;
+
+	CHAR16 *relative = ASCIItoUTF16(iso_path, strlena(iso_path));
+	if (!relative) {
+		return NULL;
+	}
+
+	// Flip any Unix-style separators GRUB would accept into ones the firmware accepts.
+	for (UINTN i = 0; relative[i] != '\0'; i++) {
+		if (relative[i] == '/') {
+			relative[i] = '\\';
+		}
+	}
+
+	if (colon > 0) {
+		return relative;
+	}
+
+	CHAR16 *path = PoolPrint(L"\\efi\\boot\\%s", relative);
+	FreePool(relative);
+	return path;
+}
+
+/**
+ * Returns the path of the ISO file used by the given boot option as Linux will see it on
+ * its volume, for the kernel parameters that tell the live system where to find it. The
+ * caller must free the returned string.
+ */
+CHAR8* IsoPathForLinux(LinuxBootOption *option) {
+	INTN colon = strposa(option->iso_path, ':');
+	CHAR8 *iso_path = colon > 0 ? option->iso_path + colon + 1 : option->iso_path;
+	CHAR8 *prefix = colon > 0 ? (CHAR8 *)"" : (CHAR8 *)"/efi/boot/";
+
+	CHAR8 *path = AllocatePool(strlena(prefix) + strlena(iso_path) + 2);
+	if (!path) {
+		return NULL;
+	}
+
+	strcpya(path, prefix);
+	if (colon > 0 && iso_path[0] != '\\' && iso_path[0] != '/') {
+		strcata(path, (CHAR8 *)"/");
+	}
+	strcata(path, iso_path);
+	for (UINTN i = 0; path[i] != '\0'; i++) {
+		if (path[i] == '\\') {
+			path[i] = '/';
+		}
+	}
+	return path;
+}
+
 BOOLEAN FileExists(EFI_FILE_HANDLE dir, CHAR16 *name) {
 	EFI_FILE_HANDLE handle;
 	EFI_STATUS err;
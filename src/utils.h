@@ -35,6 +35,14 @@ CHAR8* PathConvert(CHAR8, CHAR8 *);
 CHAR16* ASCIItoUTF16(CHAR8 *, UINTN);
 CHAR8* UTF16toASCII(CHAR16 *, UINTN);
 
+UINT32 Fnv1aHash(const VOID *, UINTN);
+EFI_FILE_HANDLE OpenVolumeByLabel(CHAR16 *, EFI_HANDLE *);
+VOID CloseVolume(EFI_FILE_HANDLE);
+EFI_FILE_HANDLE IsoVolumeForBootOption(LinuxBootOption *);
+BOOLEAN IsoIsOnBootVolume(LinuxBootOption *);
+CHAR16* IsoPathForBootOption(LinuxBootOption *);
+CHAR8* IsoPathForLinux(LinuxBootOption *);
+
 BOOLEAN FileExists(EFI_FILE_HANDLE, CHAR16 *);
 UINTN FileRead(EFI_FILE_HANDLE, const CHAR16 const *, CHAR8 **);
 CHAR8* GetConfigurationKeyAndValue(CHAR8 *, UINTN *, CHAR8 **, CHAR8 **);
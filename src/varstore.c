@@ -0,0 +1,340 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * A write-behind cache of our own EFI variables. Every "Enterprise_" variable is read from
+ * the firmware once when we start; reads are then served from memory and writes only mark
+ * the cached copy as dirty. VarStoreCommit writes the variables whose value actually
+ * changed in one pass, which spares both slow NVRAM services (Apple's especially) and the
+ * flash they live in. Variables without our prefix always go straight to the firmware.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "main.h"
+#include "varstore.h"
+
+#define VARIABLE_PREFIX L"Enterprise_"
+#define VARIABLE_PREFIX_LENGTH 11
+#define VARIABLE_NAME_SIZE 256
+
+typedef struct CachedVariable {
+	EFI_GUID vendor;
+	CHAR16 *name;
+	CHAR8 *data; // NULL once the variable has been deleted.
+	UINTN size;
+	UINT32 attributes;
+	BOOLEAN dirty;
+	BOOLEAN in_firmware;
+	UINT32 firmware_attributes;
+	struct CachedVariable *next;
+} CachedVariable;
+
+static CachedVariable *variables = NULL;
+static BOOLEAN loaded = FALSE;
+
+static BOOLEAN IsManagedVariable(const EFI_GUID *vendor, CHAR16 *name) {
+	if (CompareGuid((EFI_GUID *)vendor, (EFI_GUID *)&enterprise_variable_guid) != 0 &&
+		CompareGuid((EFI_GUID *)vendor, (EFI_GUID *)&grub_variable_guid) != 0) {
+		return FALSE;
+	}
+
+	return StrnCmp(name, VARIABLE_PREFIX, VARIABLE_PREFIX_LENGTH) == 0;
+}
+
+static CachedVariable* FindVariable(const EFI_GUID *vendor, CHAR16 *name) {
+	CachedVariable *variable;
+	for (variable = variables; variable; variable = variable->next) {
+		if (CompareGuid(&variable->vendor, (EFI_GUID *)vendor) == 0 && StrCmp(variable->name, name) == 0) {
+			return variable;
+		}
+	}
+
+	return NULL;
+}
+
+static CachedVariable* AddVariable(const EFI_GUID *vendor, CHAR16 *name) {
+	CachedVariable *variable = AllocateZeroPool(sizeof(CachedVariable));
+	if (!variable) {
+		return NULL;
+	}
+
+	UINTN name_size = (StrLen(name) + 1) * sizeof(CHAR16);
+	variable->name = AllocatePool(name_size);
+	if (!variable->name) {
+		FreePool(variable);
+		return NULL;
+	}
+
+	CopyMem(variable->name, name, name_size);
+	CopyMem(&variable->vendor, vendor, sizeof(EFI_GUID));
+	variable->next = variables;
+	variables = variable;
+	return variable;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Loading
+#endif
+static EFI_STATUS LoadVariable(EFI_GUID *vendor, CHAR16 *name) {
+	EFI_STATUS err;
+	UINT32 attributes;
+	UINTN size = 0;
+
+	err = uefi_call_wrapper(RT->GetVariable, 5, name, vendor, &attributes, &size, NULL);
+	if (err != EFI_BUFFER_TOO_SMALL) {
+		return err;
+	}
+
+	CHAR8 *data = AllocatePool(size);
+	if (!data) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	err = uefi_call_wrapper(RT->GetVariable, 5, name, vendor, &attributes, &size, data);
+	if (EFI_ERROR(err)) {
+		FreePool(data);
+		return err;
+	}
+
+	CachedVariable *variable = AddVariable(vendor, name);
+	if (!variable) {
+		FreePool(data);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	variable->data = data;
+	variable->size = size;
+	variable->attributes = attributes;
+	variable->in_firmware = TRUE;
+	variable->firmware_attributes = attributes;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Walks the firmware's variables once and caches all of ours. Until this has succeeded,
+ * every access goes to the firmware.
+ */
+EFI_STATUS VarStoreLoad(VOID) {
+	EFI_STATUS err;
+	EFI_GUID vendor;
+	UINTN buffer_size = VARIABLE_NAME_SIZE;
+
+	if (loaded) {
+		return EFI_SUCCESS;
+	}
+
+	CHAR16 *name = AllocateZeroPool(buffer_size);
+	if (!name) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (;;) {
+		UINTN size = buffer_size;
+		err = uefi_call_wrapper(RT->GetNextVariableName, 3, &size, name, &vendor);
+		if (err == EFI_BUFFER_TOO_SMALL) {
+			CHAR16 *larger = AllocateZeroPool(size);
+			if (!larger) {
+				err = EFI_OUT_OF_RESOURCES;
+				break;
+			}
+
+			CopyMem(larger, name, buffer_size);
+			FreePool(name);
+			name = larger;
+			buffer_size = size;
+			continue;
+		} else if (EFI_ERROR(err)) {
+			break;
+		}
+
+		if (IsManagedVariable(&vendor, name)) {
+			LoadVariable(&vendor, name);
+		}
+	}
+
+	FreePool(name);
+	if (err != EFI_NOT_FOUND) {
+		VarStoreShutdown();
+		return err;
+	}
+
+	loaded = TRUE;
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Access
+#endif
+/*
+ * Returns a copy of the variable's contents, which the caller frees. Returns
+ * EFI_UNSUPPORTED for variables we don't cache, which the caller must read itself.
+ */
+EFI_STATUS VarStoreGet(const EFI_GUID *vendor, CHAR16 *name, CHAR8 **buffer, UINTN *size) {
+	if (!loaded || !IsManagedVariable(vendor, name)) {
+		return EFI_UNSUPPORTED;
+	}
+
+	CachedVariable *variable = FindVariable(vendor, name);
+	if (!variable || !variable->data) {
+		return EFI_NOT_FOUND;
+	}
+
+	CHAR8 *copy = AllocatePool(variable->size);
+	if (!copy) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	CopyMem(copy, variable->data, variable->size);
+	*buffer = copy;
+	if (size) {
+		*size = variable->size;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Changes the cached value of a variable; a size of zero deletes it. Nothing reaches the
+ * firmware until the next commit, and writing the value a variable already has costs
+ * nothing. Returns EFI_UNSUPPORTED for variables we don't cache.
+ */
+EFI_STATUS VarStoreSet(const EFI_GUID *vendor, CHAR16 *name, CHAR8 *buffer, UINTN size, UINT32 attributes) {
+	if (!loaded || !IsManagedVariable(vendor, name)) {
+		return EFI_UNSUPPORTED;
+	}
+
+	CachedVariable *variable = FindVariable(vendor, name);
+	if (size == 0) {
+		if (variable && variable->data) {
+			FreePool(variable->data);
+			variable->data = NULL;
+			variable->size = 0;
+			variable->dirty = variable->in_firmware;
+		}
+
+		return variable ? EFI_SUCCESS : EFI_NOT_FOUND;
+	}
+
+	if (variable && variable->data && variable->attributes == attributes && variable->size == size &&
+		CompareMem(variable->data, buffer, size) == 0) {
+		return EFI_SUCCESS;
+	}
+
+	CHAR8 *data = AllocatePool(size);
+	if (!data) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (!variable) {
+		variable = AddVariable(vendor, name);
+		if (!variable) {
+			FreePool(data);
+			return EFI_OUT_OF_RESOURCES;
+		}
+	}
+
+	CopyMem(data, buffer, size);
+	if (variable->data) {
+		FreePool(variable->data);
+	}
+	variable->data = data;
+	variable->size = size;
+	variable->attributes = attributes;
+	variable->dirty = TRUE;
+	return EFI_SUCCESS;
+}
+
+#ifdef __APPLE__
+	#pragma mark - Committing
+#endif
+static EFI_STATUS CommitVariable(CachedVariable *variable) {
+	EFI_STATUS err;
+
+	// The firmware won't change a variable's attributes in place, so an existing copy
+	// with different ones has to go first.
+	if (variable->in_firmware && (!variable->data || variable->firmware_attributes != variable->attributes)) {
+		err = uefi_call_wrapper(RT->SetVariable, 5, variable->name, &variable->vendor,
+			variable->firmware_attributes, 0, NULL);
+		if (EFI_ERROR(err) && err != EFI_NOT_FOUND) {
+			return err;
+		}
+		variable->in_firmware = FALSE;
+	}
+
+	if (variable->data) {
+		err = uefi_call_wrapper(RT->SetVariable, 5, variable->name, &variable->vendor,
+			variable->attributes, variable->size, variable->data);
+		if (EFI_ERROR(err)) {
+			return err;
+		}
+		variable->in_firmware = TRUE;
+		variable->firmware_attributes = variable->attributes;
+	}
+
+	variable->dirty = FALSE;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Writes every changed variable to the firmware. Volatile variables only live in RAM and
+ * go first; the non-volatile ones, which cost a flash write each, follow in a single batch.
+ */
+EFI_STATUS VarStoreCommit(VOID) {
+	EFI_STATUS result = EFI_SUCCESS;
+	CachedVariable *variable;
+	UINTN pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		UINT32 non_volatile = pass == 0 ? 0 : EFI_VARIABLE_NON_VOLATILE;
+		for (variable = variables; variable; variable = variable->next) {
+			if (!variable->dirty || (variable->attributes & EFI_VARIABLE_NON_VOLATILE) != non_volatile) {
+				continue;
+			}
+
+			EFI_STATUS err = CommitVariable(variable);
+			if (EFI_ERROR(err) && !EFI_ERROR(result)) {
+				result = err;
+			}
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Commits any changes and drops the cache; later accesses go to the firmware until it is
+ * loaded again.
+ */
+VOID VarStoreShutdown(VOID) {
+	if (loaded) {
+		VarStoreCommit();
+	}
+
+	while (variables) {
+		CachedVariable *next = variables->next;
+		if (variables->data) {
+			FreePool(variables->data);
+		}
+		FreePool(variables->name);
+		FreePool(variables);
+		variables = next;
+	}
+
+	loaded = FALSE;
+}
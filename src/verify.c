@@ -0,0 +1,587 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "verify.h"
+#include "aio.h"
+#include "config.h"
+#include "hardware.h"
+#include "sched.h"
+#include "sha256.h"
+#include "utils.h"
+#include "fatmap.h"
+#include "uki.h"
+#include "multipart.h"
+
+// Small enough that reading one chunk from a slow stick doesn't make the menu feel sluggish
+// when this runs in the background.
+#define VERIFY_CHUNK_SIZE (1024 * 1024)
+#define VERIFY_MAX_DEPTH 8
+#define VERIFY_CACHE_ENTRIES 16
+
+/*
+ * Each ISO we have hashed is remembered in a non-volatile variable, keyed by its path,
+ * size and modification time, so that a given file only ever gets hashed once.
+ */
+typedef struct {
+	UINT32 path_hash;
+	UINT32 reserved;
+	UINT64 size;
+	EFI_TIME modification_time;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+} VerifiedIsoRecord;
+
+typedef struct {
+	SHA256_CONTEXT *context;
+	UINT8 *data;
+	UINTN length;
+} HashJob;
+
+/*
+ * The state of checking one ISO. This is driven one chunk at a time, either in a loop when
+ * the answer is needed right away or as a background task while the menu is up.
+ */
+typedef struct {
+	LinuxBootOption *option;
+	CHAR16 *path;
+	EFI_FILE_HANDLE handle;
+	EFI_FILE_INFO *info;
+	UINT32 path_hash;
+	UINT8 expected[SHA256_DIGEST_SIZE];
+	UINT8 actual[SHA256_DIGEST_SIZE];
+	SHA256_CONTEXT context;
+	EFI_MP_SERVICES_PROTOCOL *mp;
+	UINTN ap;
+	EFI_EVENT ap_done;
+	BOOLEAN ap_busy;
+	HashJob job;
+	AioQueue *queue;
+	AioRequest requests[VERIFY_MAX_DEPTH];
+	UINT8 *buffers[VERIFY_MAX_DEPTH];
+	UINTN depth;
+	UINTN current;
+	UINT64 next_offset;
+	UINT64 done;
+	EFI_STATUS status;
+} IsoVerification;
+
+/*
+ * Background verification walks the configured distributions in order.
+ */
+typedef struct {
+	BootableLinuxDistro *conductor;
+	IsoVerification *verification;
+} BackgroundVerification;
+
+static BackgroundVerification *background = NULL;
+static BackgroundTask *background_task = NULL;
+
+static EFI_CALLBACK VOID HashJobProcedure(VOID *argument) {
+	HashJob *job = argument;
+	Sha256Update(job->context, job->data, job->length);
+}
+
+static INTN HexDigitValue(CHAR8 c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static BOOLEAN ParseDigest(CHAR8 *hex, UINT8 *digest) {
+	for (UINTN i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		INTN high = HexDigitValue(hex[i * 2]);
+		INTN low = high < 0 ? -1 : HexDigitValue(hex[i * 2 + 1]);
+		if (low < 0) {
+			return FALSE;
+		}
+
+		digest[i] = (UINT8)((high << 4) | low);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Works out what the checksum of the ISO should be: either the checksum key given in the
+ * configuration file, or failing that a sha256sum-style sidecar file next to the ISO.
+ */
+static BOOLEAN GetExpectedDigest(LinuxBootOption *option, EFI_FILE_HANDLE volume, CHAR16 *iso_path, UINT8 *digest) {
+	if (option->checksum) {
+		return strlena(option->checksum) >= SHA256_DIGEST_SIZE * 2 && ParseDigest(option->checksum, digest);
+	}
+
+	CHAR16 *sidecar_path = PoolPrint(L"%s.sha256", iso_path);
+	CHAR8 *contents = NULL;
+	BOOLEAN found = FALSE;
+	if (!sidecar_path) {
+		return FALSE;
+	}
+
+	if (FileRead(volume, sidecar_path, &contents) >= SHA256_DIGEST_SIZE * 2) {
+		found = ParseDigest(contents, digest);
+	}
+
+	if (contents) {
+		FreePool(contents);
+	}
+	FreePool(sidecar_path);
+	return found;
+}
+
+static VerifiedIsoRecord* FindCachedRecord(VerifiedIsoRecord *records, UINTN count, UINT32 path_hash,
+	EFI_FILE_INFO *info) {
+	for (UINTN i = 0; i < count; i++) {
+		if (records[i].path_hash == path_hash && records[i].size == info->FileSize &&
+			CompareMem(&records[i].modification_time, &info->ModificationTime, sizeof(EFI_TIME)) == 0) {
+			return &records[i];
+		}
+	}
+
+	return NULL;
+}
+
+static VOID StoreCachedRecord(UINT32 path_hash, EFI_FILE_INFO *info, UINT8 *digest) {
+	VerifiedIsoRecord *records = NULL;
+	UINTN records_size = 0;
+
+	if (EFI_ERROR(efi_get_variable(&enterprise_variable_guid, L"Enterprise_VerifiedISOs",
+		(CHAR8 **)&records, &records_size))) {
+		records = NULL;
+		records_size = 0;
+	}
+
+	VerifiedIsoRecord *updated = AllocateZeroPool(sizeof(VerifiedIsoRecord) * VERIFY_CACHE_ENTRIES);
+	UINTN count = records_size / sizeof(VerifiedIsoRecord);
+	UINTN kept = 1;
+	if (!updated) {
+		if (records) {
+			FreePool(records);
+		}
+		return;
+	}
+
+	// The newest record goes first; anything else for the same path is stale, and the
+	// oldest records fall off the end once the cache is full.
+	updated[0].path_hash = path_hash;
+	updated[0].size = info->FileSize;
+	CopyMem(&updated[0].modification_time, &info->ModificationTime, sizeof(EFI_TIME));
+	CopyMem(updated[0].digest, digest, SHA256_DIGEST_SIZE);
+	for (UINTN i = 0; i < count && kept < VERIFY_CACHE_ENTRIES; i++) {
+		if (records[i].path_hash != path_hash) {
+			CopyMem(&updated[kept++], &records[i], sizeof(VerifiedIsoRecord));
+		}
+	}
+
+	efi_set_variable(&enterprise_variable_guid, L"Enterprise_VerifiedISOs", (CHAR8 *)updated,
+		sizeof(VerifiedIsoRecord) * kept, TRUE);
+	if (records) {
+		FreePool(records);
+	}
+	FreePool(updated);
+}
+
+static VOID FreeVerification(IsoVerification *v) {
+	if (v->ap_busy) {
+		UINTN index;
+		uefi_call_wrapper(BS->WaitForEvent, 3, 1, &v->ap_done, &index);
+	}
+
+	if (v->ap_done) {
+		uefi_call_wrapper(BS->CloseEvent, 1, v->ap_done);
+	}
+
+	// Reads still in flight must land before their buffers go.
+	if (v->queue) {
+		AioClose(v->queue);
+	}
+	UINTN i;
+	for (i = 0; i < VERIFY_MAX_DEPTH; i++) {
+		if (v->buffers[i]) {
+			FreePool(v->buffers[i]);
+		}
+	}
+	if (v->info) {
+		FreePool(v->info);
+	}
+	if (v->handle) {
+		uefi_call_wrapper(v->handle->Close, 1, v->handle);
+	}
+	if (v->path) {
+		FreePool(v->path);
+	}
+	FreePool(v);
+}
+
+/*
+ * Starts reading the next chunk of the file into the given buffer, if there is one.
+ */
+static VOID SubmitChunk(IsoVerification *v, UINTN slot) {
+	if (v->next_offset >= v->info->FileSize) {
+		return;
+	}
+
+	AioSubmit(v->queue, &v->requests[slot], v->next_offset, VERIFY_CHUNK_SIZE, v->buffers[slot]);
+	v->next_offset += VERIFY_CHUNK_SIZE;
+}
+
+static VOID CompleteVerification(IsoVerification *v, EFI_STATUS status) {
+	if (!EFI_ERROR(status)) {
+		status = CompareMem(v->expected, v->actual, SHA256_DIGEST_SIZE) == 0 ? EFI_SUCCESS : EFI_CRC_ERROR;
+	}
+
+	v->status = status;
+}
+
+/*
+ * Sets up the check of one ISO. If there is nothing to check against, or an earlier result
+ * can be reused (unless force is set), the verification is already complete on return;
+ * otherwise its status is EFI_NOT_READY until StepVerification finishes it.
+ */
+static IsoVerification* StartVerification(LinuxBootOption *option, BOOLEAN force) {
+	VerifiedIsoRecord *records = NULL;
+	UINTN records_size = 0;
+	EFI_STATUS err;
+
+	IsoVerification *v = AllocateZeroPool(sizeof(IsoVerification));
+	if (!v) {
+		return NULL;
+	}
+
+	v->option = option;
+	v->status = EFI_NOT_READY;
+	if (!option->iso_path) {
+		// Unified kernel images are checked by the firmware, if at all.
+		CompleteVerification(v, EFI_NOT_FOUND);
+		return v;
+	}
+	if (IsSplitIso(option)) {
+		// Only whole ISO files are checked for now.
+		CompleteVerification(v, EFI_UNSUPPORTED);
+		return v;
+	}
+
+	v->path = IsoPathForBootOption(option);
+	if (!v->path) {
+		CompleteVerification(v, EFI_OUT_OF_RESOURCES);
+		return v;
+	}
+
+	EFI_FILE_HANDLE volume = IsoVolumeForBootOption(option);
+	if (!volume) {
+		CompleteVerification(v, EFI_NO_MEDIA);
+		return v;
+	}
+
+	if (!GetExpectedDigest(option, volume, v->path, v->expected)) {
+		CloseVolume(volume);
+		CompleteVerification(v, EFI_NOT_FOUND);
+		return v;
+	}
+
+	err = uefi_call_wrapper(volume->Open, 5, volume, &v->handle, v->path, EFI_FILE_MODE_READ, 0);
+	CloseVolume(volume);
+	if (EFI_ERROR(err)) {
+		v->handle = NULL;
+		CompleteVerification(v, err);
+		return v;
+	}
+
+	v->info = LibFileInfo(v->handle);
+	if (!v->info) {
+		CompleteVerification(v, EFI_DEVICE_ERROR);
+		return v;
+	}
+
+	v->path_hash = Fnv1aHash(v->path, StrLen(v->path) * sizeof(CHAR16));
+	if (!force && !EFI_ERROR(efi_get_variable(&enterprise_variable_guid, L"Enterprise_VerifiedISOs",
+		(CHAR8 **)&records, &records_size))) {
+		VerifiedIsoRecord *cached = FindCachedRecord(records, records_size / sizeof(VerifiedIsoRecord),
+			v->path_hash, v->info);
+		if (cached) {
+			CopyMem(v->actual, cached->digest, SHA256_DIGEST_SIZE);
+			CompleteVerification(v, EFI_SUCCESS);
+		}
+	}
+
+	if (records) {
+		FreePool(records);
+	}
+	if (v->status != EFI_NOT_READY) {
+		return v;
+	}
+
+	v->depth = ioQueueDepth < 2 ? 2 : (ioQueueDepth > VERIFY_MAX_DEPTH ? VERIFY_MAX_DEPTH : ioQueueDepth);
+	// This may run while the menu is up, so it mustn't print anything.
+	v->queue = IsoIsOnBootVolume(option) ? FatOpenDirect(v->handle, v->path, v->depth, TRUE) :
+		AioOpenFile(v->handle, v->depth);
+	if (!v->queue) {
+		CompleteVerification(v, EFI_OUT_OF_RESOURCES);
+		return v;
+	}
+
+	UINTN i;
+	for (i = 0; i < v->depth; i++) {
+		v->buffers[i] = AllocatePool(VERIFY_CHUNK_SIZE);
+		if (!v->buffers[i]) {
+			CompleteVerification(v, EFI_OUT_OF_RESOURCES);
+			return v;
+		}
+	}
+
+	if (GetApplicationProcessors(&v->mp, &v->ap, 1) == 1) {
+		err = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &v->ap_done);
+		if (EFI_ERROR(err)) {
+			v->ap_done = NULL;
+		}
+	}
+
+	Sha256Init(&v->context);
+	for (i = 0; i < v->depth; i++) {
+		SubmitChunk(v, i);
+	}
+
+	return v;
+}
+
+/*
+ * Hashes the oldest outstanding chunk once it has arrived, then reuses its buffer for the
+ * next chunk that isn't being read yet. Up to the queue depth of chunks are being read at any
+ * time. If there is an application processor available it does the hashing, while we keep
+ * the reads going (which only the boot processor can do); otherwise we do both in turn.
+ */
+static VOID StepVerification(IsoVerification *v) {
+	UINTN current = v->current;
+	UINTN index;
+	EFI_STATUS err;
+
+	if (v->status != EFI_NOT_READY) {
+		return;
+	}
+
+	if (v->done >= v->info->FileSize) {
+		Sha256Final(&v->context, v->actual);
+		StoreCachedRecord(v->path_hash, v->info, v->actual);
+		CompleteVerification(v, EFI_SUCCESS);
+		return;
+	}
+
+	AioRequest *request = &v->requests[current];
+	err = AioWait(v->queue, request);
+	if (EFI_ERROR(err)) {
+		CompleteVerification(v, err);
+		return;
+	}
+
+	// Only the last chunk of the file may come up short.
+	if (request->transferred == 0 ||
+		(request->transferred != request->length && v->done + request->transferred != v->info->FileSize)) {
+		CompleteVerification(v, EFI_END_OF_FILE);
+		return;
+	}
+
+	v->job.context = &v->context;
+	v->job.data = v->buffers[current];
+	v->job.length = request->transferred;
+	if (v->ap_done) {
+		err = uefi_call_wrapper(v->mp->StartupThisAP, 7, v->mp, HashJobProcedure, v->ap, v->ap_done,
+			0, &v->job, NULL);
+		v->ap_busy = !EFI_ERROR(err);
+	}
+
+	if (!v->ap_busy) {
+		HashJobProcedure(&v->job);
+	} else {
+		// Keep the reads moving while the hash is being computed.
+		for (;;) {
+			if (uefi_call_wrapper(BS->CheckEvent, 1, v->ap_done) == EFI_SUCCESS) {
+				break;
+			}
+
+			if (!AioPoll(v->queue)) {
+				uefi_call_wrapper(BS->WaitForEvent, 3, 1, &v->ap_done, &index);
+				break;
+			}
+		}
+		v->ap_busy = FALSE;
+	}
+
+	v->done += request->transferred;
+	SubmitChunk(v, current);
+	v->current = (current + 1) % v->depth;
+}
+
+static BOOLEAN BackgroundVerificationStep(VOID *context) {
+	BackgroundVerification *state = context;
+
+	if (state->verification) {
+		StepVerification(state->verification);
+		if (state->verification->status == EFI_NOT_READY) {
+			return FALSE;
+		}
+
+		FreeVerification(state->verification);
+		state->verification = NULL;
+		state->conductor = state->conductor->next;
+	}
+
+	// Move on to the next ISO that actually needs reading.
+	while (state->conductor) {
+		state->verification = StartVerification(state->conductor->bootOption, FALSE);
+		if (state->verification && state->verification->status == EFI_NOT_READY) {
+			return FALSE;
+		}
+
+		if (state->verification) {
+			FreeVerification(state->verification);
+		}
+		state->verification = NULL;
+		state->conductor = state->conductor->next;
+	}
+
+	FreePool(state);
+	background = NULL;
+	background_task = NULL;
+	return TRUE;
+}
+
+static VOID BackgroundVerificationCancel(VOID *context) {
+	BackgroundVerification *state = context;
+
+	if (state->verification) {
+		FreeVerification(state->verification);
+	}
+	FreePool(state);
+	background = NULL;
+	background_task = NULL;
+}
+
+/*
+ * Starts checking all of the ISOs while the user is looking at the menu, so that by the time
+ * one is picked its result is usually already in the cache.
+ */
+VOID VerifyInBackground(VOID) {
+	if (background || !distributionListRoot) {
+		return;
+	}
+
+	background = AllocateZeroPool(sizeof(BackgroundVerification));
+	if (!background) {
+		return;
+	}
+
+	background->conductor = distributionListRoot->next;
+	background_task = SchedulerAddTask(BackgroundVerificationStep, BackgroundVerificationCancel, background, FALSE);
+	if (!background_task) {
+		FreePool(background);
+		background = NULL;
+	}
+}
+
+/*
+ * Abandons background verification, which must happen before the distribution list it
+ * walks is freed.
+ */
+VOID VerifyStopBackground(VOID) {
+	if (background_task) {
+		SchedulerCancelTask(background_task);
+	}
+}
+
+/*
+ * Checks the ISO used by the given boot option against its expected SHA-256 checksum.
+ * Returns EFI_NOT_FOUND if there is no checksum to compare against, EFI_UNSUPPORTED if the
+ * ISO can't be checked, and EFI_CRC_ERROR if the file does not match. Unless force is set, a previous result for an unchanged file
+ * is reused instead of reading the file again.
+ */
+EFI_STATUS VerifyIsoFile(LinuxBootOption *option, BOOLEAN force) {
+	IsoVerification *v = NULL;
+
+	// If the background task is part way through this very ISO, take over from it rather
+	// than starting from the beginning.
+	if (background && background->verification && background->verification->option == option && !force) {
+		v = background->verification;
+		background->verification = NULL;
+	}
+
+	if (background_task) {
+		SchedulerCancelTask(background_task);
+	}
+
+	if (!v) {
+		v = StartVerification(option, force);
+		if (!v) {
+			return EFI_OUT_OF_RESOURCES;
+		}
+	}
+
+	while (v->status == EFI_NOT_READY) {
+		StepVerification(v);
+		Print(L"\r    %d%% ", v->info->FileSize ? (v->done * 100) / v->info->FileSize : 100);
+	}
+	Print(L"\r");
+
+	EFI_STATUS err = v->status;
+	FreeVerification(v);
+	return err;
+}
+
+/*
+ * Verifies every configured ISO on demand, ignoring any cached results.
+ */
+VOID VerifyAllDistributions(VOID) {
+	uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+	Print(banner, VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+	DisplayColoredText(L"\n    Verify ISO Files:\n");
+	if (Sha256HardwareAccelerated()) {
+		Print(L"    Using the processor's SHA extensions.\n");
+	}
+	Print(L"\n");
+
+	BootableLinuxDistro *conductor = distributionListRoot->next;
+	while (conductor != NULL) {
+		LinuxBootOption *option = conductor->bootOption;
+		UkiResolveName(option);
+		Print(L"    %a (%a):\n", option->name, option->iso_path ? option->iso_path : option->uki_path);
+
+		EFI_STATUS err = VerifyIsoFile(option, TRUE);
+		if (err == EFI_SUCCESS) {
+			Print(L"    OK          \n");
+		} else if (err == EFI_NOT_FOUND) {
+			Print(L"    No checksum to verify against.\n");
+		} else if (err == EFI_CRC_ERROR) {
+			DisplayErrorText(L"    Checksum mismatch! The ISO file is damaged.\n");
+		} else {
+			DisplayErrorText(L"    Could not read the ISO file: ");
+			Print(L"%r\n", err);
+		}
+
+		conductor = conductor->next;
+	}
+
+	Print(L"\n    Press any key to go back.");
+	UINT64 key;
+	key_read(&key, TRUE);
+}
@@ -0,0 +1,243 @@
+/*
+ * Tool intended to help facilitate the process of booting Linux on Intel
+ * Macintosh computers made by Apple from a USB stick or similar.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * Copyright (C) 2019 SevenBits
+ *
+ */
+
+/*
+ * Packs an ISO into the format Enterprise reads in src/packediso.c: the image cut into
+ * frames, each compressed as an LZ4 block on its own, with an index of where each starts.
+ * Build it on the machine preparing the USB stick:
+ *
+ *     cc -O2 -o isopack isopack.c
+ *     ./isopack [-b frame_size] ubuntu.iso ubuntu.iso.lz4s
+ *
+ * and use the packed file as the entry's ISO in enterprise.cfg.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PACKED_ISO_MAGIC 0x4B505349
+#define PACKED_ISO_VERSION 1
+#define DEFAULT_FRAME_SIZE (64 * 1024)
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the format wants the last five bytes of a block to be literals
+#define MATCH_SEARCH_END 12 // and no match to start within the last twelve
+#define HASH_BITS 16
+
+struct header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t frame_size;
+	uint32_t frame_count;
+	uint64_t image_size;
+	uint64_t reserved;
+};
+
+static uint32_t Read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t Hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* WriteLength(uint8_t *out, size_t length) {
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+static uint8_t* WriteSequence(uint8_t *out, const uint8_t *literals, size_t literal_length, size_t offset,
+	size_t match_length) {
+	uint8_t *token = out++;
+	*token = (literal_length >= 15 ? 15 : literal_length) << 4;
+	if (literal_length >= 15) {
+		out = WriteLength(out, literal_length - 15);
+	}
+	memcpy(out, literals, literal_length);
+	out += literal_length;
+
+	if (match_length) {
+		*out++ = offset & 0xFF;
+		*out++ = offset >> 8;
+		match_length -= MIN_MATCH;
+		*token |= match_length >= 15 ? 15 : match_length;
+		if (match_length >= 15) {
+			out = WriteLength(out, match_length - 15);
+		}
+	}
+	return out;
+}
+
+/*
+ * Compresses one block greedily, finding matches through a table of where each hash of four
+ * bytes was last seen. Returns the compressed size, which may be more than length.
+ */
+static size_t CompressBlock(const uint8_t *in, size_t length, uint8_t *out, uint32_t *table) {
+	const uint8_t *anchor = in, *p = in, *end = in + length;
+	uint8_t *start = out;
+
+	memset(table, 0xFF, sizeof(uint32_t) << HASH_BITS);
+	if (length > MATCH_SEARCH_END) {
+		const uint8_t *limit = end - MATCH_SEARCH_END;
+		while (p < limit) {
+			uint32_t h = Hash(Read32(p));
+			uint32_t candidate = table[h];
+			table[h] = p - in;
+			if (candidate == UINT32_MAX || p - (in + candidate) > 0xFFFF || Read32(in + candidate) != Read32(p)) {
+				p++;
+				continue;
+			}
+
+			const uint8_t *match = in + candidate;
+			size_t match_length = MIN_MATCH;
+			while (p + match_length < end - LAST_LITERALS && match[match_length] == p[match_length]) {
+				match_length++;
+			}
+
+			out = WriteSequence(out, anchor, p - anchor, p - match, match_length);
+			p += match_length;
+			anchor = p;
+		}
+	}
+
+	out = WriteSequence(out, anchor, end - anchor, 0, 0);
+	return out - start;
+}
+
+static void Usage(void) {
+	fprintf(stderr, "usage: isopack [-b frame_size] input.iso output.iso.lz4s\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint32_t frame_size = DEFAULT_FRAME_SIZE;
+	int arg = 1;
+
+	if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+		char *end;
+		unsigned long size = strtoul(argv[2], &end, 0);
+		if (*end == 'k' || *end == 'K') {
+			size *= 1024;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			size *= 1024 * 1024;
+			end++;
+		}
+		if (*end || size < 4096 || size > 4 * 1024 * 1024 || (size & (size - 1))) {
+			fprintf(stderr, "isopack: the frame size must be a power of two from 4K to 4M\n");
+			return 2;
+		}
+		frame_size = size;
+		arg = 3;
+	}
+	if (argc - arg != 2) {
+		Usage();
+	}
+
+	FILE *in = fopen(argv[arg], "rb");
+	if (!in) {
+		fprintf(stderr, "isopack: %s: %s\n", argv[arg], strerror(errno));
+		return 1;
+	}
+	if (fseeko(in, 0, SEEK_END) != 0) {
+		fprintf(stderr, "isopack: %s: %s\n", argv[arg], strerror(errno));
+		return 1;
+	}
+	uint64_t image_size = ftello(in);
+	rewind(in);
+	if (image_size == 0) {
+		fprintf(stderr, "isopack: %s is empty\n", argv[arg]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[arg + 1], "wb");
+	if (!out) {
+		fprintf(stderr, "isopack: %s: %s\n", argv[arg + 1], strerror(errno));
+		return 1;
+	}
+
+	struct header header = {
+		.magic = PACKED_ISO_MAGIC,
+		.version = PACKED_ISO_VERSION,
+		.header_size = sizeof(struct header),
+		.frame_size = frame_size,
+		.frame_count = (image_size + frame_size - 1) / frame_size,
+		.image_size = image_size,
+	};
+	size_t index_size = (header.frame_count + 1) * sizeof(uint64_t);
+	uint64_t *index = calloc(header.frame_count + 1, sizeof(uint64_t));
+	uint8_t *frame = malloc(frame_size);
+	uint8_t *packed = malloc(frame_size + frame_size / 255 + 16);
+	uint32_t *table = malloc(sizeof(uint32_t) << HASH_BITS);
+	if (!index || !frame || !packed || !table) {
+		fprintf(stderr, "isopack: out of memory\n");
+		return 1;
+	}
+
+	// The index is written once the frames are, as only then are their offsets known.
+	if (fwrite(&header, sizeof(header), 1, out) != 1 || fseeko(out, sizeof(header) + index_size, SEEK_SET) != 0) {
+		goto write_error;
+	}
+
+	uint64_t position = sizeof(header) + index_size;
+	uint32_t i;
+	for (i = 0; i < header.frame_count; i++) {
+		size_t length = fread(frame, 1, frame_size, in);
+		if (length != frame_size && (i != header.frame_count - 1 || length != image_size % frame_size)) {
+			fprintf(stderr, "isopack: %s: short read\n", argv[arg]);
+			return 1;
+		}
+
+		size_t packed_length = CompressBlock(frame, length, packed, table);
+		const uint8_t *data = packed;
+		if (packed_length >= length) {
+			data = frame;
+			packed_length = length;
+		}
+
+		index[i] = position;
+		if (fwrite(data, 1, packed_length, out) != packed_length) {
+			goto write_error;
+		}
+		position += packed_length;
+	}
+	index[header.frame_count] = position;
+
+	if (fseeko(out, sizeof(header), SEEK_SET) != 0 || fwrite(index, sizeof(uint64_t), header.frame_count + 1, out) !=
+		header.frame_count + 1 || fclose(out) != 0) {
+		goto write_error;
+	}
+
+	fclose(in);
+	printf("%s: %llu bytes in %u frames, packed to %llu (%.1f%%)\n", argv[arg + 1], (unsigned long long)image_size,
+		header.frame_count, (unsigned long long)position, 100.0 * position / image_size);
+	return 0;
+
+write_error:
+	fprintf(stderr, "isopack: %s: %s\n", argv[arg + 1], strerror(errno));
+	return 1;
+}